@@ -9,7 +9,7 @@ layout(binding = 0) uniform UniformBufferObject {
 } ubo;
 
 layout(binding = 1) readonly buffer Material {
-    uvec4 textureIds[];
+    DeviceMaterial m[];
 } materials;
 
 // per vertex
@@ -35,6 +35,8 @@ layout(location = 2) out vec2 fragTexCoord;
 layout(location = 3) out uvec4 fragData;
 layout(location = 4) out vec4 worldPos;
 layout(location = 5) out vec4 worldPosPrev;
+layout(location = 6) flat out uvec2 fragLdrConstants;
+layout(location = 7) flat out vec4 fragHdrConstant;
 
 void main() 
 {   
@@ -45,5 +47,8 @@ void main()
     fragNormal = normalize((modelTransformIT * vec4(inNormal, 0)).xyz);
     fragTexCoord = inTexCoord;
     uint materialIndex = inData.x == 0xffffffff ? materialIdx : inData.x;
-    fragData = materials.textureIds[materialIndex];
+    DeviceMaterial material = materials.m[materialIndex];
+    fragData = uvec4(material.diffuseTexture, material.specularTexture, material.alphaIntExtIorTexture, material.materialType);
+    fragLdrConstants = uvec2(material.diffuseConstant, material.specularConstant);
+    fragHdrConstant = material.alphaIntExtIorConstant;
 }
\ No newline at end of file
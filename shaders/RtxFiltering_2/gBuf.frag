@@ -8,8 +8,11 @@ layout(binding = 0) uniform UniformBufferObject {
     VIEWPROJ_BLOCK
 } ubo;
 
-layout(binding = 2) uniform sampler2DArray ldrTexSampler;
-layout(binding = 3) uniform sampler2DArray hdrTexSampler;
+layout(binding = 2) uniform sampler2DArray ldrTexSamplers[TEXTURE_BUCKET_COUNT];
+layout(binding = 3) uniform sampler2DArray hdrTexSamplers[TEXTURE_BUCKET_COUNT];
+
+#define MATERIAL_HDR_TEXTURES
+#include "../materialTextures.h"
 
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec3 fragNormal;
@@ -17,6 +20,8 @@ layout(location = 2) in vec2 fragTexCoord;
 layout(location = 3) flat in uvec4 fragData; // there is no interpolation for flat type
 layout(location = 4) in vec4 worldPos;
 layout(location = 5) in vec4 worldPosPrev;
+layout(location = 6) flat in uvec2 fragLdrConstants;
+layout(location = 7) flat in vec4 fragHdrConstant;
 
 layout(location = 0) out vec4 outDiffuseColor;
 layout(location = 1) out vec4 outSpecularColor;
@@ -29,9 +34,11 @@ void main()
     uint specularTextureIdx = fragData.y;
     uint alphaIorIdx = fragData.z;
     uint bsdfType = fragData.w;
-    outDiffuseColor = texture(ldrTexSampler, vec3(fragTexCoord, diffuseTextureIdx)) * vec4(fragColor, 1.0f);
-    outSpecularColor = texture(ldrTexSampler, vec3(fragTexCoord, specularTextureIdx));
-    vec4 alphaIntExtIor = texture(hdrTexSampler, vec3(fragTexCoord, alphaIorIdx));
+    vec2 dx = dFdx(fragTexCoord);
+    vec2 dy = dFdy(fragTexCoord);
+    outDiffuseColor = sampleLdrTexture(diffuseTextureIdx, fragLdrConstants.x, fragTexCoord, dx, dy) * vec4(fragColor, 1.0f);
+    outSpecularColor = sampleLdrTexture(specularTextureIdx, fragLdrConstants.y, fragTexCoord, dx, dy);
+    vec4 alphaIntExtIor = sampleHdrTexture(alphaIorIdx, fragHdrConstant, fragTexCoord, dx, dy);
     // Depth is the distance of hit point from camera origin.
     // Does not work?? gl_FragCoord.z / gl_FragCoord.w
     outNormalDepth = vec4(normalize(fragNormal), length((worldPos - ubo.viewInv[3]).xyz));
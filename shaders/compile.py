@@ -6,6 +6,7 @@ glslangValidator = "C:/VulkanSDK/1.2.148.1/Bin32/glslangValidator.exe"
 forceFullCompilationList = []
 forceFullCompilationList.append(("./commonMath.h", "null"))
 forceFullCompilationList.append(("./hostDeviceShared.h", "null"))
+forceFullCompilationList.append(("./materialTextures.h", "null"))
 forceFullCompilationList.append(("./Filters/filterParams.h", "null"))
 forceFullCompilationList.append(("./RtxFiltering_2/hostDeviceShared.h", "null"))
 forceFullCompilationList.append(("./RtxFiltering_3/hostDeviceShared.h", "null"))
@@ -1,8 +1,13 @@
 #ifdef GL_core_profile
 #define MAT4 mat4
+#define VEC4 vec4
+#define UINT uint
 #else
 #pragma once
+#include <cstddef>
 #define MAT4 alignas(16) glm::mat4
+#define VEC4 alignas(16) glm::vec4
+#define UINT uint32_t
 #endif
 
 #define VIEWPROJ_BLOCK \
@@ -11,4 +16,51 @@
     MAT4 proj; \
     MAT4 viewInv; \
     MAT4 projInv; \
-    MAT4 projViewPrev;
\ No newline at end of file
+    MAT4 projViewPrev;
+
+// Location of a mesh in the global vertex and index buffers of the model, indexed by mesh index (w component of static instance data)
+struct MeshOffsets
+{
+    UINT vertexOffset;
+    UINT indexOffset;
+    UINT vertexCount;
+    UINT indexCount;
+};
+
+// Cluster of up to 64 vertices / 124 triangles of a mesh, a contiguous range of the global index buffer. See src/meshletBuilder.h
+struct Meshlet
+{
+    VEC4 boundingSphere; // center, radius
+    VEC4 aabbMin;
+    VEC4 aabbMax;
+    VEC4 cone; // axis, cutoff. Backfacing when dot(normalize(coneApex - cameraPos), axis) >= cutoff, a cutoff above 1 disables the test
+    VEC4 coneApex;
+    UINT firstIndex;
+    UINT indexCount;
+    UINT meshIdx;
+    UINT vertexCount;
+};
+// Textures of a texture set (LDR, HDR) are grouped into at most TEXTURE_BUCKET_COUNT arrays by size, see TextureGenerator in src/generator.h.
+// A texture handle is bucket << 24 | layer, textures of a single color have no handle and use the constants of DeviceMaterial instead.
+#define TEXTURE_BUCKET_COUNT 4
+#define CONSTANT_TEXTURE 0xffffffff
+
+// Material as read by the shaders, indexed by material index. Built by Model::createBuffers() from the materials and texture handles, equal
+// materials are merged. The parameters of textures with a single color are stored in the block, so that they need no texture fetch.
+// std430 layout, 48 bytes.
+struct DeviceMaterial
+{
+    UINT diffuseTexture;
+    UINT specularTexture;
+    UINT alphaIntExtIorTexture;
+    UINT materialType;
+    UINT diffuseConstant; // base color RGBA8, used when diffuseTexture is CONSTANT_TEXTURE
+    UINT specularConstant; // RGBA8
+    UINT emission; // RGB shared exponent E5B9G9R9, see materialEmission() in materialTextures.h
+    UINT pad;
+    VEC4 alphaIntExtIorConstant; // roughness alpha, interior IOR, exterior IOR
+};
+#ifndef GL_core_profile
+static_assert(sizeof(DeviceMaterial) == 48 && offsetof(DeviceMaterial, emission) == 24 && offsetof(DeviceMaterial, alphaIntExtIorConstant) == 32,
+    "DeviceMaterial must match its std430 layout");
+#endif
@@ -0,0 +1,54 @@
+// GLSL access to the material textures, see DeviceMaterial in hostDeviceShared.h and TextureGenerator in src/generator.h.
+// Shaders that include this file must declare before the include:
+//   uniform sampler2DArray ldrTexSamplers[TEXTURE_BUCKET_COUNT];   // Model::getLdrTextureDescriptorImageInfos()
+// and when MATERIAL_HDR_TEXTURES is defined:
+//   uniform sampler2DArray hdrTexSamplers[TEXTURE_BUCKET_COUNT];   // Model::getHdrTextureDescriptorImageInfos()
+// Gradients are explicit, hence the mip level does not depend on which invocations of a quad take a bucket branch. Ray tracing shaders pass
+// zero gradients to sample level 0.
+
+uint textureBucket(in uint handle)
+{
+	return handle >> 24;
+}
+
+float textureLayer(in uint handle)
+{
+	return float(handle & 0xffffff);
+}
+
+// One case per bucket, the arrays are indexed with constants only
+#define SAMPLE_TEXTURE_BUCKET(samplers, handle, uv, dx, dy, result) \
+	switch (textureBucket(handle)) { \
+	case 0: result = textureGrad(samplers[0], vec3(uv, textureLayer(handle)), dx, dy); break; \
+	case 1: result = textureGrad(samplers[1], vec3(uv, textureLayer(handle)), dx, dy); break; \
+	case 2: result = textureGrad(samplers[2], vec3(uv, textureLayer(handle)), dx, dy); break; \
+	default: result = textureGrad(samplers[3], vec3(uv, textureLayer(handle)), dx, dy); break; \
+	}
+
+vec4 sampleLdrTexture(in uint handle, in uint constant, in vec2 uv, in vec2 dx, in vec2 dy)
+{
+	if (handle == CONSTANT_TEXTURE)
+		return unpackUnorm4x8(constant);
+
+	vec4 result;
+	SAMPLE_TEXTURE_BUCKET(ldrTexSamplers, handle, uv, dx, dy, result)
+	return result;
+}
+
+// Unpacks DeviceMaterial.emission, packed by FloatPacker::packSharedExponent() in src/floatPacker.h
+vec3 materialEmission(in uint packed)
+{
+	return vec3(packed & 0x1ffu, (packed >> 9) & 0x1ffu, (packed >> 18) & 0x1ffu) * exp2(float(int(packed >> 27) - 24));
+}
+
+#ifdef MATERIAL_HDR_TEXTURES
+vec4 sampleHdrTexture(in uint handle, in vec4 constant, in vec2 uv, in vec2 dx, in vec2 dy)
+{
+	if (handle == CONSTANT_TEXTURE)
+		return constant;
+
+	vec4 result;
+	SAMPLE_TEXTURE_BUCKET(hdrTexSamplers, handle, uv, dx, dy, result)
+	return result;
+}
+#endif
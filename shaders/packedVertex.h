@@ -0,0 +1,53 @@
+// GLSL decoder for PackedVertex of src/vertexCompression.h (Model::setPackedVertices()).
+// Vertex shaders get the attributes already unpacked by the vertex input stage except for location 1 (color palette index | material index).
+// Closest hit shaders that include this file must declare before the include:
+//   readonly buffer PackedVertices { uint v[]; } packedVertices;   // Model::getVertexDescriptorBufferInfo()
+//   readonly buffer ColorPalette { vec4 c[]; } colorPalette;        // Model::getColorPaletteDescriptorBufferInfo()
+
+// Number of uint values used to represent a packed vertex i.e. packedVertexSize * sizeof(uint) == sizeof(PackedVertex)
+#define PACKED_VERTEX_SIZE 6
+
+vec3 octDecode(in vec2 e)
+{
+	vec3 n = vec3(e.x, e.y, 1.0f - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return normalize(n);
+}
+
+uint packedColorIdx(in uint colorMaterial)
+{
+	return colorMaterial & 0xffff;
+}
+
+uint packedMaterialIdx(in uint colorMaterial)
+{
+	return colorMaterial >> 16;
+}
+
+#ifndef PACKED_VERTEX_NO_BUFFERS
+struct Vertex
+{
+	vec3 pos;
+	vec3 color;
+	vec3 normal;
+	vec2 texCoord;
+	uint materialIdx;
+};
+
+Vertex unpackVertex(uint index)
+{
+	Vertex v;
+
+	uint base = PACKED_VERTEX_SIZE * index;
+	v.pos = uintBitsToFloat(uvec3(packedVertices.v[base + 0], packedVertices.v[base + 1], packedVertices.v[base + 2]));
+	v.normal = octDecode(unpackSnorm2x16(packedVertices.v[base + 3]));
+	v.texCoord = unpackHalf2x16(packedVertices.v[base + 4]);
+	uint colorMaterial = packedVertices.v[base + 5];
+	v.color = colorPalette.c[packedColorIdx(colorMaterial)].xyz;
+	v.materialIdx = packedMaterialIdx(colorMaterial);
+
+	return v;
+}
+#endif
@@ -1,25 +1,7 @@
 #include "accelerationStructure.h"
 
-void BottomLevelAccelerationStructure::create(const VkDevice& device, const VmaAllocator& allocator, const std::vector<VkGeometryNV>& geometries, bool allowUpdate)
+void AccelerationStructure::allocateMemory(const VkDevice& device, const VmaAllocator& allocator, bool queryScratch)
 {
-	initProcAddress(device);
-
-	VkAccelerationStructureInfoNV accelerationStructureInfo{};
-	accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
-	accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
-	accelerationStructureInfo.instanceCount = 0;
-	accelerationStructureInfo.geometryCount = static_cast<uint32_t>(geometries.size());
-	accelerationStructureInfo.pGeometries = geometries.data();
-	accelerationStructureInfo.flags = allowUpdate ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV : 0;
-
-	this->allowUpdate = allowUpdate;
-
-	VkAccelerationStructureCreateInfoNV accelerationStructureCreateInfo{};
-	accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
-	accelerationStructureCreateInfo.info = accelerationStructureInfo;
-	VK_CHECK_DBG_ONLY(vkCreateAccelerationStructureNV(device, &accelerationStructureCreateInfo, nullptr, &accelerationStructure),
-		"AccelarationStructure: failed to create bottom level accelaration structure!");
-
 	// Find memory requirements for accelaration structure object
 	VkAccelerationStructureMemoryRequirementsInfoNV memoryRequirementsInfo{};
 	memoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
@@ -37,7 +19,9 @@ void BottomLevelAccelerationStructure::create(const VkDevice& device, const VmaA
 
 	VmaAllocationInfo allocInfo = {};
 	VK_CHECK_DBG_ONLY(vmaAllocateMemory(allocator, &memoryRequirements2.memoryRequirements, &allocCreateInfo, &accelerationStructureAllocation, &allocInfo),
-		"AccelarationStructure: failed to allocate memory for bottom level accelaration structure!");
+		"AccelarationStructure: failed to allocate memory for accelaration structure!");
+	residentSize += allocInfo.size;
+	memoryStats().add(memoryStats().resident, allocInfo.size);
 
 	// Bind Accelaration structure with its memory
 	VkBindAccelerationStructureMemoryInfoNV accelerationStructureMemoryInfo{};
@@ -46,62 +30,126 @@ void BottomLevelAccelerationStructure::create(const VkDevice& device, const VmaA
 	accelerationStructureMemoryInfo.memory = allocInfo.deviceMemory;
 	accelerationStructureMemoryInfo.memoryOffset = allocInfo.offset;
 	VK_CHECK_DBG_ONLY(vkBindAccelerationStructureMemoryNV(device, 1, &accelerationStructureMemoryInfo),
-		"AccelarationStructure: failed to bind memory for bottom level accelaration structure!");
-		
-	// Get a handle for the acceleration structure
-	VK_CHECK_DBG_ONLY(vkGetAccelerationStructureHandleNV(device, accelerationStructure, sizeof(uint64_t), &handle),
-		"AccelarationStructur: failed to retrive handle for bottom level accelaration structure!");
+		"AccelarationStructure: failed to bind memory for accelaration structure!");
+
+	if (!queryScratch)
+		return;
 
 	// Find memory requirements for accelaration structure build scratch
 	memoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_BUILD_SCRATCH_NV;
 	memoryRequirements2 = {};
 	vkGetAccelerationStructureMemoryRequirementsNV(device, &memoryRequirementsInfo, &memoryRequirements2);
-	size_t scratchSize = memoryRequirements2.memoryRequirements.size;
+	buildScratchSize = memoryRequirements2.memoryRequirements.size;
+	scratchMemoryTypeBits = memoryRequirements2.memoryRequirements.memoryTypeBits;
 
 	// Find memory requirements for accelaration structure update scratch
+	updateScratchSize = 0;
 	if (allowUpdate) {
-		uint32_t buildScratchType = memoryRequirements2.memoryRequirements.memoryTypeBits;
 		memoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_UPDATE_SCRATCH_NV;
 		memoryRequirements2 = {};
 		vkGetAccelerationStructureMemoryRequirementsNV(device, &memoryRequirementsInfo, &memoryRequirements2);
-		scratchSize = scratchSize > memoryRequirements2.memoryRequirements.size ? scratchSize : memoryRequirements2.memoryRequirements.size;
+		updateScratchSize = memoryRequirements2.memoryRequirements.size;
 
-		VK_CHECK_DBG_ONLY(buildScratchType == memoryRequirements2.memoryRequirements.memoryTypeBits,
-			"AccelartionStructure: Build scratch and update scratch type do not match for bottom level AS!");
+		CHECK_DBG_ONLY(scratchMemoryTypeBits == memoryRequirements2.memoryRequirements.memoryTypeBits,
+			"AccelarationStructure: Build scratch and update scratch type do not match!");
 	}
+}
 
-	// Create scratch buffer
-	allocCreateInfo = {};
+void AccelerationStructure::createScratchBuffer(const VmaAllocator& allocator)
+{
+	VmaAllocationCreateInfo allocCreateInfo = {};
 	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-	allocCreateInfo.memoryTypeBits = memoryRequirements2.memoryRequirements.memoryTypeBits;
+	allocCreateInfo.memoryTypeBits = scratchMemoryTypeBits;
 
 	VkBufferCreateInfo bufferCreateInfo = {};
 	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferCreateInfo.size = scratchSize;
+	bufferCreateInfo.size = std::max(buildScratchSize, updateScratchSize);
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
 	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
 	// Allocate memory and bind it to the buffer
+	VmaAllocationInfo allocInfo = {};
 	VK_CHECK_DBG_ONLY(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &scratchBuffer, &scratchBufferAllocation, &allocInfo),
-		"AccelarationStructure: failed to allocate scratch buffer for bottom level accelaration structure!");
+		"AccelarationStructure: failed to allocate scratch buffer for accelaration structure!");
+	residentSize += allocInfo.size;
+	memoryStats().add(memoryStats().resident, allocInfo.size);
+}
+
+void AccelerationStructureScratch::create(const VmaAllocator& allocator)
+{
+	CHECK(buffer == VK_NULL_HANDLE, "AccelerationStructureScratch: Buffer already created.");
+	CHECK(memoryTypeBits != 0, "AccelerationStructureScratch: The reserved structures have no common scratch memory type.");
+	if (size == 0)
+		return;
+
+	VmaAllocationCreateInfo allocCreateInfo = {};
+	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	allocCreateInfo.memoryTypeBits = memoryTypeBits;
+
+	VkBufferCreateInfo bufferCreateInfo = {};
+	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferCreateInfo.size = size;
+	bufferCreateInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
+	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationInfo allocInfo = {};
+	VK_CHECK(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &buffer, &allocation, &allocInfo),
+		"AccelerationStructureScratch: failed to allocate scratch buffer!");
+	allocatedSize = allocInfo.size;
+	AccelerationStructure::memoryStats().add(AccelerationStructure::memoryStats().scratch, allocatedSize);
+}
+
+void BottomLevelAccelerationStructure::create(const VkDevice& device, const VmaAllocator& allocator, const std::vector<VkGeometryNV>& geometries, bool allowUpdate,
+	bool allowCompaction)
+{
+	initProcAddress(device);
+
+	VkAccelerationStructureInfoNV accelerationStructureInfo{};
+	accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+	accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
+	accelerationStructureInfo.instanceCount = 0;
+	accelerationStructureInfo.geometryCount = static_cast<uint32_t>(geometries.size());
+	accelerationStructureInfo.pGeometries = geometries.data();
+	accelerationStructureInfo.flags = (allowUpdate ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV : 0) |
+		(allowCompaction ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_NV : 0);
+
+	this->allowUpdate = allowUpdate;
+	this->allowCompaction = allowCompaction;
+	this->geometries = geometries;
+
+	VkAccelerationStructureCreateInfoNV accelerationStructureCreateInfo{};
+	accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
+	accelerationStructureCreateInfo.info = accelerationStructureInfo;
+	VK_CHECK_DBG_ONLY(vkCreateAccelerationStructureNV(device, &accelerationStructureCreateInfo, nullptr, &accelerationStructure),
+		"AccelarationStructure: failed to create bottom level accelaration structure!");
+
+	allocateMemory(device, allocator);
+		
+	// Get a handle for the acceleration structure
+	VK_CHECK_DBG_ONLY(vkGetAccelerationStructureHandleNV(device, accelerationStructure, sizeof(uint64_t), &handle),
+		"AccelarationStructur: failed to retrive handle for bottom level accelaration structure!");
 }
 
-void BottomLevelAccelerationStructure::cmdBuild(const VkCommandBuffer& cmdBuf, const std::vector<VkGeometryNV>& geometries, bool update)
+void BottomLevelAccelerationStructure::cmdBuild(const VkCommandBuffer& cmdBuf, const AccelerationStructureScratch& scratch, bool update)
 {
 	CHECK_DBG_ONLY(!update || allowUpdate == update,
 		"AccelartionStructure: Partial rebuild for bottom level accelaration structure is not allowed. First create the BLAS with appropriate flag!");
 
+	CHECK_DBG_ONLY(scratch.getBuffer() != VK_NULL_HANDLE && scratch.getSize() >= getScratchSize(update),
+		"AccelartionStructure: The scratch buffer is too small, reserve the BLAS before creating the scratch buffer!");
+
 	// Build the actual bottom-level acceleration structure
 	VkAccelerationStructureInfoNV buildInfo = {};
 	buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
 	buildInfo.pNext = nullptr;
-	buildInfo.flags = allowUpdate ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV : 0;
+	buildInfo.flags = (allowUpdate ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV : 0) |
+		(allowCompaction ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_NV : 0);
 	buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
 	buildInfo.geometryCount = static_cast<uint32_t>(geometries.size());
 	buildInfo.pGeometries = geometries.data();
 
 	vkCmdBuildAccelerationStructureNV(cmdBuf, &buildInfo, VK_NULL_HANDLE, 0, update,
-		accelerationStructure, update ? accelerationStructure : VK_NULL_HANDLE, scratchBuffer,
+		accelerationStructure, update ? accelerationStructure : VK_NULL_HANDLE, scratch.getBuffer(),
 		0);
 
 	// Wait for the builder to complete by setting a barrier on the resulting buffer. This is
@@ -120,6 +168,78 @@ void BottomLevelAccelerationStructure::cmdBuild(const VkCommandBuffer& cmdBuf, c
 		0, nullptr, 0, nullptr);
 }
 
+void BottomLevelAccelerationStructure::createCompacted(const VkDevice& device, const VmaAllocator& allocator, VkDeviceSize compactedSize)
+{
+	initProcAddress(device);
+
+	// A compacted structure only takes its size, the content comes from the copy
+	VkAccelerationStructureInfoNV accelerationStructureInfo{};
+	accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+	accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
+
+	VkAccelerationStructureCreateInfoNV accelerationStructureCreateInfo{};
+	accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
+	accelerationStructureCreateInfo.compactedSize = compactedSize;
+	accelerationStructureCreateInfo.info = accelerationStructureInfo;
+	VK_CHECK_DBG_ONLY(vkCreateAccelerationStructureNV(device, &accelerationStructureCreateInfo, nullptr, &accelerationStructure),
+		"AccelarationStructure: failed to create compacted bottom level accelaration structure!");
+
+	allocateMemory(device, allocator, false);
+
+	VK_CHECK_DBG_ONLY(vkGetAccelerationStructureHandleNV(device, accelerationStructure, sizeof(uint64_t), &handle),
+		"AccelarationStructur: failed to retrive handle for compacted bottom level accelaration structure!");
+}
+
+void BottomLevelAccelerationStructure::cmdCopyCompacted(const VkCommandBuffer& cmdBuf, const BottomLevelAccelerationStructure& source)
+{
+	CHECK_DBG_ONLY(source.allowCompaction,
+		"AccelartionStructure: Only structures created with allowCompaction can be compacted!");
+
+	vkCmdCopyAccelerationStructureNV(cmdBuf, accelerationStructure, source.accelerationStructure, VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_NV);
+
+	VkMemoryBarrier memoryBarrier = {};
+	memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
+
+	vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, 0, 1, &memoryBarrier,
+		0, nullptr, 0, nullptr);
+}
+
+void CompactedSizeQuery::create(const VkDevice& device, uint32_t count)
+{
+	CHECK(queryPool == VK_NULL_HANDLE, "CompactedSizeQuery: Query pool already created.");
+	vkCmdWriteAccelerationStructuresPropertiesNV = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesNV>(
+		vkGetDeviceProcAddr(device, "vkCmdWriteAccelerationStructuresPropertiesNV"));
+
+	VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+	queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_NV;
+	queryPoolCreateInfo.queryCount = count;
+	VK_CHECK(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool),
+		"CompactedSizeQuery: failed to create query pool!");
+
+	this->count = count;
+}
+
+void CompactedSizeQuery::cmdWrite(const VkCommandBuffer& cmdBuf, const std::vector<VkAccelerationStructureNV>& structures)
+{
+	CHECK_DBG_ONLY(structures.size() == count, "CompactedSizeQuery: One query per structure.");
+
+	vkCmdResetQueryPool(cmdBuf, queryPool, 0, count);
+	vkCmdWriteAccelerationStructuresPropertiesNV(cmdBuf, count, structures.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_NV, queryPool, 0);
+}
+
+std::vector<VkDeviceSize> CompactedSizeQuery::getSizes(const VkDevice& device) const
+{
+	std::vector<VkDeviceSize> sizes(count, 0);
+	VK_CHECK(vkGetQueryPoolResults(device, queryPool, 0, count, sizes.size() * sizeof(VkDeviceSize), sizes.data(), sizeof(VkDeviceSize),
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT), "CompactedSizeQuery: failed to read the compacted sizes!");
+
+	return sizes;
+}
+
 void TopLevelAccelerationStructure::create(const VkDevice& device, const VmaAllocator& allocator, const uint32_t instanceCount, bool allowUpdate)
 {
 	initProcAddress(device);
@@ -139,82 +259,25 @@ void TopLevelAccelerationStructure::create(const VkDevice& device, const VmaAllo
 	VK_CHECK_DBG_ONLY(vkCreateAccelerationStructureNV(device, &accelerationStructureCreateInfo, nullptr, &accelerationStructure),
 		"AccelerationStructure: failed to create top level accelaration structure!");
 
-	// Find memory requirements for accelaration structure object
-	VkAccelerationStructureMemoryRequirementsInfoNV memoryRequirementsInfo{};
-	memoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
-	memoryRequirementsInfo.accelerationStructure = accelerationStructure;
-	memoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_OBJECT_NV;
+	allocateMemory(device, allocator);
+	createScratchBuffer(allocator);
 
-	VkMemoryRequirements2 memoryRequirements2{};
-	vkGetAccelerationStructureMemoryRequirementsNV(device, &memoryRequirementsInfo, &memoryRequirements2);
-	
-	// Allocate memory for accelaration structure object
-	// https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator/issues/63
+	// Create instance buffer
 	VmaAllocationCreateInfo allocCreateInfo = {};
 	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-	allocCreateInfo.memoryTypeBits = memoryRequirements2.memoryRequirements.memoryTypeBits;
-	
-	VmaAllocationInfo allocInfo = {};
-	VK_CHECK_DBG_ONLY(vmaAllocateMemory(allocator, &memoryRequirements2.memoryRequirements, &allocCreateInfo, &accelerationStructureAllocation, &allocInfo),
-		"AccelarationStructure: failed to allocate memory for bottom level accelaration structure!");
-
-	// Bind Accelaration structure with its memory
-	VkBindAccelerationStructureMemoryInfoNV accelerationStructureMemoryInfo{};
-	accelerationStructureMemoryInfo.sType = VK_STRUCTURE_TYPE_BIND_ACCELERATION_STRUCTURE_MEMORY_INFO_NV;
-	accelerationStructureMemoryInfo.accelerationStructure = accelerationStructure;
-	accelerationStructureMemoryInfo.memory = allocInfo.deviceMemory;
-	accelerationStructureMemoryInfo.memoryOffset = allocInfo.offset;
-	
-	VK_CHECK_DBG_ONLY(vkBindAccelerationStructureMemoryNV(device, 1, &accelerationStructureMemoryInfo),
-		"AccelarationStructure: failed to bind memory for top level accelaration structure!");
-	
-	// Find memory requirements for accelaration structure build scratch
-	memoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_BUILD_SCRATCH_NV;
-	memoryRequirements2 = {};
-	vkGetAccelerationStructureMemoryRequirementsNV(device, &memoryRequirementsInfo, &memoryRequirements2);
-	VkDeviceSize scratchSize = memoryRequirements2.memoryRequirements.size;
-
-	// Find memory requirements for accelaration structure update scratch
-	if (allowUpdate) {
-		uint32_t buildScratchType = memoryRequirements2.memoryRequirements.memoryTypeBits;
-		memoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_UPDATE_SCRATCH_NV;
-		memoryRequirements2 = {};
-		vkGetAccelerationStructureMemoryRequirementsNV(device, &memoryRequirementsInfo, &memoryRequirements2);
-		scratchSize = scratchSize > memoryRequirements2.memoryRequirements.size ? scratchSize : memoryRequirements2.memoryRequirements.size;
-
-		CHECK_DBG_ONLY(buildScratchType == memoryRequirements2.memoryRequirements.memoryTypeBits,
-			"AccelarationStructure: Build scratch and update scratch type do not match for top level AS!");
-	}
-
-	// Create scratch buffer
-	allocCreateInfo = {};
-	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-	allocCreateInfo.memoryTypeBits = memoryRequirements2.memoryRequirements.memoryTypeBits;
 
 	VkBufferCreateInfo bufferCreateInfo = {};
 	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferCreateInfo.size = scratchSize;
-	bufferCreateInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
-	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-	allocInfo = {};
-	// Allocate memory and bind it to the buffer
-	VK_CHECK_DBG_ONLY(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &scratchBuffer, &scratchBufferAllocation, &allocInfo),
-		"AccelarationStructure: failed to allocate scratch buffer for top level accelaration structure!");
-
-	// Create instance buffer
-	allocCreateInfo = {};
-	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-
-	bufferCreateInfo = {};
-	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferCreateInfo.size = instanceCount * sizeof(TopLevelAccelerationStructureData);
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
 	// Allocate memory and bind it to the buffer
-	VK_CHECK_DBG_ONLY(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &instanceBuffer, &instanceBufferAllocation, nullptr),
+	VmaAllocationInfo allocInfo = {};
+	VK_CHECK_DBG_ONLY(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &instanceBuffer, &instanceBufferAllocation, &allocInfo),
 		"AccelarationStructure: failed to allocate instance buffer for top level accelaration structure!");
+	instanceBufferSize = allocInfo.size;
+	memoryStats().add(memoryStats().resident, instanceBufferSize);
 
 	// Create staging buffer for instances
 	allocCreateInfo = {};
@@ -2,6 +2,26 @@
 
 #include "helper.h"
 
+/*
+ * Acceleration structure memory - Scratch memory is only needed while a structure is built. Bottom level structures are built once at load,
+ * they share the buffer of an AccelerationStructureScratch that is freed after the batch. Top level structures are rebuilt or refitted every
+ * frame and keep their own scratch buffer. AccelerationStructure::memoryStats() follows the device memory of all of them.
+ */
+
+// Device memory in bytes
+struct AccelerationStructureMemory
+{
+	VkDeviceSize resident = 0; // structures, the scratch of top level structures and their instance buffers
+	VkDeviceSize scratch = 0; // scratch arenas
+	VkDeviceSize peak = 0; // of resident + scratch
+
+	void add(VkDeviceSize& counter, VkDeviceSize size)
+	{
+		counter += size;
+		peak = std::max(peak, resident + scratch);
+	}
+};
+
 class AccelerationStructure 
 {
 protected:
@@ -11,6 +31,17 @@ protected:
 	VkAccelerationStructureNV accelerationStructure = VK_NULL_HANDLE;
 
 	bool allowUpdate = false; // Allow for runtime update
+	bool allowCompaction = false; // Built to be copied into a compacted structure
+	VkDeviceSize buildScratchSize = 0;
+	VkDeviceSize updateScratchSize = 0;
+	uint32_t scratchMemoryTypeBits = 0;
+	VkDeviceSize residentSize = 0; // counted in memoryStats().resident
+
+	// Allocates and binds the memory of the structure and queries its scratch requirements, compacted structures are never built
+	void allocateMemory(const VkDevice& device, const VmaAllocator& allocator, bool queryScratch = true);
+
+	// Own scratch buffer, for structures that are built again later
+	void createScratchBuffer(const VmaAllocator& allocator);
 
 	void initProcAddress(const VkDevice& device) {
 		if (vkCreateAccelerationStructureNV != nullptr) return;
@@ -20,6 +51,7 @@ protected:
 		vkGetAccelerationStructureHandleNV = reinterpret_cast<PFN_vkGetAccelerationStructureHandleNV>(vkGetDeviceProcAddr(device, "vkGetAccelerationStructureHandleNV"));
 		vkCmdBuildAccelerationStructureNV = reinterpret_cast<PFN_vkCmdBuildAccelerationStructureNV>(vkGetDeviceProcAddr(device, "vkCmdBuildAccelerationStructureNV"));
 		vkDestroyAccelerationStructureNV = reinterpret_cast<PFN_vkDestroyAccelerationStructureNV>(vkGetDeviceProcAddr(device, "vkDestroyAccelerationStructureNV"));
+		vkCmdCopyAccelerationStructureNV = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureNV>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureNV"));
 	}
 
 	// also store function pointers
@@ -29,6 +61,7 @@ protected:
 	PFN_vkGetAccelerationStructureHandleNV vkGetAccelerationStructureHandleNV = nullptr;
 	PFN_vkCmdBuildAccelerationStructureNV vkCmdBuildAccelerationStructureNV = nullptr;
 	PFN_vkDestroyAccelerationStructureNV vkDestroyAccelerationStructureNV = nullptr;
+	PFN_vkCmdCopyAccelerationStructureNV vkCmdCopyAccelerationStructureNV = nullptr;
 
 public:
 	void cleanUp(const VkDevice& device, const VmaAllocator& allocator) 
@@ -37,19 +70,159 @@ public:
 			throw std::runtime_error("Accelaration structure is NOT initialized!");
 
 		vmaDestroyBuffer(allocator, scratchBuffer, scratchBufferAllocation);
+		scratchBuffer = VK_NULL_HANDLE;
 		vmaFreeMemory(allocator, accelerationStructureAllocation);
 		vkDestroyAccelerationStructureNV(device, accelerationStructure, nullptr);
+		memoryStats().resident -= residentSize;
+		residentSize = 0;
 
 		vkDestroyAccelerationStructureNV = nullptr;
 	}
+
+	VkAccelerationStructureNV getAccelerationStructure() const
+	{
+		return accelerationStructure;
+	}
+
+	// Device memory of the structure and its own buffers
+	VkDeviceSize getResidentSize() const
+	{
+		return residentSize;
+	}
+
+	// Scratch bytes a build, or a refit when update is set, needs
+	VkDeviceSize getScratchSize(bool update = false) const
+	{
+		return update ? updateScratchSize : buildScratchSize;
+	}
+
+	uint32_t getScratchMemoryTypeBits() const
+	{
+		return scratchMemoryTypeBits;
+	}
+
+	static AccelerationStructureMemory& memoryStats()
+	{
+		static AccelerationStructureMemory memory;
+		return memory;
+	}
+
+	static void printMemoryReport()
+	{
+		const double mb = 1.0 / (1024.0 * 1024.0);
+		std::cout << "Acceleration structure memory - resident: " << memoryStats().resident * mb << " MB, peak: " << memoryStats().peak * mb << " MB" << std::endl;
+	}
+};
+
+/*
+ * Scratch arena - One scratch buffer for a batch of builds. reserve() every structure of the batch, create() the buffer for the largest of
+ * them, record the builds and cleanUp() once the command buffer has completed. Every cmdBuild() ends with a barrier on acceleration structure
+ * accesses, which scratch accesses are, so the builds of a batch can all start at offset 0.
+ */
+class AccelerationStructureScratch
+{
+public:
+	void reserve(const AccelerationStructure& structure, bool update = false)
+	{
+		CHECK(buffer == VK_NULL_HANDLE, "AccelerationStructureScratch: Reserve before creating the buffer.");
+		size = std::max(size, structure.getScratchSize(update));
+		reservedTotal += structure.getScratchSize(update);
+		memoryTypeBits &= structure.getScratchMemoryTypeBits();
+		reservedCount++;
+	}
+
+	void create(const VmaAllocator& allocator);
+
+	void cleanUp(const VmaAllocator& allocator)
+	{
+		vmaDestroyBuffer(allocator, buffer, allocation);
+		AccelerationStructure::memoryStats().scratch -= allocatedSize;
+		buffer = VK_NULL_HANDLE;
+		allocation = VK_NULL_HANDLE;
+		allocatedSize = 0;
+		size = 0;
+		reservedTotal = 0;
+		reservedCount = 0;
+		memoryTypeBits = ~0u;
+	}
+
+	VkBuffer getBuffer() const
+	{
+		return buffer;
+	}
+
+	VkDeviceSize getSize() const
+	{
+		return size;
+	}
+
+	// What a scratch buffer per structure would have taken
+	VkDeviceSize getReservedTotal() const
+	{
+		return reservedTotal;
+	}
+
+	uint32_t getReservedCount() const
+	{
+		return reservedCount;
+	}
+
+private:
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VmaAllocation allocation = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	VkDeviceSize allocatedSize = 0;
+	VkDeviceSize reservedTotal = 0;
+	uint32_t reservedCount = 0;
+	uint32_t memoryTypeBits = ~0u;
 };
 
 class BottomLevelAccelerationStructure : public AccelerationStructure 
 {
 public:
 	uint64_t handle = 0;
-	void create(const VkDevice& device, const VmaAllocator& allocator, const std::vector<VkGeometryNV>& geometries, bool allowUpdate = false);
-	void cmdBuild(const VkCommandBuffer& cmdBuf, const std::vector<VkGeometryNV>& geometries, bool partialRebuild = false);
+	// The geometries are kept for cmdBuild(), reserve the structure in the scratch of its build batch afterwards
+	void create(const VkDevice& device, const VmaAllocator& allocator, const std::vector<VkGeometryNV>& geometries, bool allowUpdate = false,
+		bool allowCompaction = false);
+	void cmdBuild(const VkCommandBuffer& cmdBuf, const AccelerationStructureScratch& scratch, bool partialRebuild = false);
+
+	// Compaction - Build the source with allowCompaction, read its size with CompactedSizeQuery once the build completed, create the
+	// compacted structure with that size and record the copy. The source can be cleaned up after the copy completed.
+	void createCompacted(const VkDevice& device, const VmaAllocator& allocator, VkDeviceSize compactedSize);
+	void cmdCopyCompacted(const VkCommandBuffer& cmdBuf, const BottomLevelAccelerationStructure& source);
+
+	bool isCompactable() const
+	{
+		return allowCompaction;
+	}
+
+private:
+	std::vector<VkGeometryNV> geometries;
+};
+
+// Compacted sizes of a batch of bottom level structures, see BottomLevelAccelerationStructure::createCompacted()
+class CompactedSizeQuery
+{
+public:
+	void create(const VkDevice& device, uint32_t count);
+
+	// After the builds of the structures, in the same command buffer
+	void cmdWrite(const VkCommandBuffer& cmdBuf, const std::vector<VkAccelerationStructureNV>& structures);
+
+	// Waits for the command buffer of cmdWrite()
+	std::vector<VkDeviceSize> getSizes(const VkDevice& device) const;
+
+	void cleanUp(const VkDevice& device)
+	{
+		vkDestroyQueryPool(device, queryPool, nullptr);
+		queryPool = VK_NULL_HANDLE;
+		count = 0;
+	}
+
+private:
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	uint32_t count = 0;
+	PFN_vkCmdWriteAccelerationStructuresPropertiesNV vkCmdWriteAccelerationStructuresPropertiesNV = nullptr;
 };
 
 // Data layout expected by VK_NV_ray_tracing for top level acceleration structure 
@@ -73,6 +246,7 @@ private:
 	VkBuffer instanceStagingBuffer = VK_NULL_HANDLE;
 	VmaAllocation instanceStagingBufferAllocation = VK_NULL_HANDLE;
 	void* mappedInstanceBuffer = nullptr;
+	VkDeviceSize instanceBufferSize = 0; // counted in memoryStats().resident
 
 public:
 	void create(const VkDevice& device, const VmaAllocator& allocator, const uint32_t instanceCount, bool allowUpdate = true);
@@ -90,6 +264,8 @@ public:
 	void cleanUp(const VkDevice& device, const VmaAllocator& allocator) 
 	{
 		AccelerationStructure::cleanUp(device, allocator);
+		memoryStats().resident -= instanceBufferSize;
+		instanceBufferSize = 0;
 		vmaUnmapMemory(allocator, instanceStagingBufferAllocation);
 		mappedInstanceBuffer = nullptr;
 		vmaDestroyBuffer(allocator, instanceStagingBuffer, instanceStagingBufferAllocation);
@@ -191,6 +191,7 @@ public:
 		requiredDeviceFeatures.push_back("samplerAnisotropy");
 		requiredDeviceFeatures.push_back("multiDrawIndirect");
 		requiredDeviceFeatures.push_back("drawIndirectFirstInstance");
+		requiredDeviceFeatures.push_back("textureCompressionBC");
 	}
 
 	~Application() {
@@ -12,6 +12,9 @@
 #include "RtxFiltering_1.hpp"
 #include "RtxFiltering_2/RtxFiltering_2.hpp"
 #include "RtxFiltering_3/RtxFiltering_3.hpp"
+#include "../cpuBvh.h"
+#include "../virtualTextureStreamer.h"
+#include "../sceneCache.h"
 
 int main()
 {	
@@ -112,6 +115,40 @@ int main()
 			RtxFiltering_3::RtxFiltering_3 app(instanceExtensions, deviceExtensions, deviceFeatures);
 			app.run(1280, 720, false);
 		}
+		else if (select == 12) {
+			// Decode throughput of the model textures, serial vs. thread pool
+			ImageDecoder::benchmark(ROOT + "/models");
+		}
+		else if (select == 13) {
+			// Host side asset pipeline benchmarks, no GPU needed
+			benchmarkVertexWelding(ROOT + "/models");
+			Model::benchmarkAddInstances();
+			InstanceCuller::benchmark();
+			MipGenerator::benchmark();
+		}
+		else if (select == 14) {
+			// Host side checks of the asset pipeline, no GPU needed. Throw on the first failure.
+			VertexPacker::selfTest();
+			MeshletBuilder::selfTest();
+			BlockCompressor::selfTest();
+			FloatPacker::selfTest();
+			VirtualTextureStreamer::selfTest((std::filesystem::temp_directory_path() / "selfTest.vtex").string());
+			TlasUpdatePolicy::selfTest();
+			BlasPlanner::selfTest();
+			SceneCache::selfTest(std::filesystem::temp_directory_path().string());
+		}
+		else if (select == 15) {
+			// CPU BVH builds of the test scenes, no GPU needed
+			for (const std::string& name : { std::string("spaceship"), std::string("medievalHouse") }) {
+				Model model;
+				Camera cam;
+				loadScene(model, cam, name);
+				SceneBvh bvh;
+				bvh.build(model);
+				std::cout << name << ":" << std::endl;
+				bvh.printReport();
+			}
+		}
 		
 	}
 	catch (const std::exception& e) {
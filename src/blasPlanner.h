@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+#include <glm/glm.hpp>
+
+#include "culling.h"
+
+/*
+ * BLAS planner - Decides which meshes share a bottom level acceleration structure. Every BLAS is one more instance in the TLAS and one more
+ * root the traversal enters, so scenes made of many small meshes trace faster with fewer, larger BLAS. A grouped BLAS is a single triangle
+ * geometry over the index range of its meshes, which is why only meshes that follow each other in the model are grouped, and why all of
+ * them must be placed by one TLAS instance:
+ * - every mesh has exactly one instance, which is static and not an area light,
+ * - the instances share the transform and the material override, the hit shaders read them from the first instance of the group,
+ * - a mesh has at most maxMeshTriangles triangles and a group at most maxGroupTriangles,
+ * - the meshes overlap, i.e. the cube of the radius of the merged bounding sphere is at most maxSpread times the sum over the cubes of the
+ *   radii of the members. Far apart meshes would leave a mostly empty root box that every ray crossing it has to enter.
+ * Pure host code, plan() only looks at BlasCandidate.
+ */
+
+struct BlasPlannerSettings
+{
+	bool enable = true;
+	uint32_t maxMeshTriangles = 4096;
+	uint32_t maxGroupTriangles = 65536;
+	float maxSpread = 8.0f;
+};
+
+// One per mesh, in mesh order
+struct BlasCandidate
+{
+	uint32_t triangleCount = 0;
+	glm::vec4 boundingSphere = glm::vec4(0.0f); // object space
+	bool groupable = false; // a single static instance that is not an area light
+	glm::mat4 transform = glm::mat4(1.0f); // of the instance
+	uint32_t materialIndex = 0xffffffff; // material override of the instance
+};
+
+// Meshes [firstMesh, firstMesh + meshCount) in one BLAS
+struct BlasGroup
+{
+	uint32_t firstMesh = 0;
+	uint32_t meshCount = 0;
+	uint32_t triangleCount = 0;
+	glm::vec4 boundingSphere = glm::vec4(0.0f); // object space, of all members
+};
+
+class BlasPlanner
+{
+public:
+	// Groups of two or more meshes, meshes outside of them keep a BLAS of their own
+	static std::vector<BlasGroup> plan(const std::vector<BlasCandidate>& candidates, const BlasPlannerSettings& settings = BlasPlannerSettings())
+	{
+		std::vector<BlasGroup> groups;
+		if (!settings.enable)
+			return groups;
+
+		BlasGroup group;
+		float memberVolume = 0.0f; // sum of radius^3 of the members
+		for (uint32_t meshIdx = 0; meshIdx < candidates.size(); meshIdx++) {
+			const BlasCandidate& candidate = candidates[meshIdx];
+			const bool small = candidate.groupable && candidate.triangleCount <= settings.maxMeshTriangles;
+			const float volume = cube(candidate.boundingSphere.w);
+
+			if (small && group.meshCount > 0 && canJoin(candidates[group.firstMesh], group, memberVolume, candidate, volume, settings)) {
+				group.meshCount++;
+				group.triangleCount += candidate.triangleCount;
+				group.boundingSphere = mergeSpheres(group.boundingSphere, candidate.boundingSphere);
+				memberVolume += volume;
+				continue;
+			}
+
+			if (group.meshCount > 1)
+				groups.push_back(group);
+
+			group = BlasGroup();
+			memberVolume = 0.0f;
+			if (small) {
+				group = { meshIdx, 1, candidate.triangleCount, candidate.boundingSphere };
+				memberVolume = volume;
+			}
+		}
+
+		if (group.meshCount > 1)
+			groups.push_back(group);
+
+		return groups;
+	}
+
+	// Plans scripted mesh sequences and throws when the groups differ from the rules at the top of this file
+	static void selfTest()
+	{
+		auto expect = [](bool condition, const std::string& message) {
+			if (!condition)
+				throw std::runtime_error("BlasPlanner: " + message);
+		};
+		auto mesh = [](float x, float radius = 1.0f, uint32_t triangles = 100) {
+			BlasCandidate candidate;
+			candidate.triangleCount = triangles;
+			candidate.boundingSphere = glm::vec4(x, 0.0f, 0.0f, radius);
+			candidate.groupable = true;
+			return candidate;
+		};
+		auto sameGroups = [](const std::vector<BlasGroup>& groups, const std::vector<std::pair<uint32_t, uint32_t>>& expected) {
+			if (groups.size() != expected.size())
+				return false;
+			for (size_t i = 0; i < groups.size(); i++)
+				if (groups[i].firstMesh != expected[i].first || groups[i].meshCount != expected[i].second)
+					return false;
+			return true;
+		};
+
+		// Four overlapping unit spheres in a row
+		std::vector<BlasCandidate> row = { mesh(0.0f), mesh(1.0f), mesh(2.0f), mesh(3.0f) };
+		std::vector<BlasGroup> groups = plan(row);
+		expect(sameGroups(groups, { { 0, 4 } }), "Overlapping small meshes are not grouped.");
+		expect(groups[0].triangleCount == 400, "Group triangle count is not the sum of its meshes.");
+		for (const auto& candidate : row)
+			expect(glm::length(glm::vec3(candidate.boundingSphere) - glm::vec3(groups[0].boundingSphere)) + candidate.boundingSphere.w <= groups[0].boundingSphere.w * 1.0001f,
+				"Group bounding sphere does not contain its meshes.");
+
+		BlasPlannerSettings disabled;
+		disabled.enable = false;
+		expect(plan(row, disabled).empty(), "Disabled planner groups meshes.");
+
+		// Breaks of the sequence: an animated or multi instance mesh, a large mesh
+		std::vector<BlasCandidate> broken = { mesh(0.0f), mesh(0.5f), mesh(1.0f), mesh(1.5f), mesh(2.0f), mesh(2.5f), mesh(3.0f), mesh(3.5f) };
+		broken[2].groupable = false;
+		broken[5].triangleCount = BlasPlannerSettings().maxMeshTriangles + 1;
+		expect(sameGroups(plan(broken), { { 0, 2 }, { 3, 2 }, { 6, 2 } }), "Groups do not stop at a mesh that can not join.");
+
+		// Another transform or material override starts a new group
+		std::vector<BlasCandidate> moved = row;
+		moved[2].transform = moved[3].transform = glm::mat4(2.0f);
+		expect(sameGroups(plan(moved), { { 0, 2 }, { 2, 2 } }), "Meshes with different transforms are grouped.");
+		std::vector<BlasCandidate> recolored = row;
+		recolored[2].materialIndex = recolored[3].materialIndex = 3;
+		expect(sameGroups(plan(recolored), { { 0, 2 }, { 2, 2 } }), "Meshes with different material overrides are grouped.");
+
+		// Triangle budget of a group
+		BlasPlannerSettings budget;
+		budget.maxGroupTriangles = 250;
+		expect(sameGroups(plan(row, budget), { { 0, 2 }, { 2, 2 } }), "Groups exceed maxGroupTriangles.");
+
+		// Far apart meshes stay alone, as does a single mesh between them
+		std::vector<BlasCandidate> scattered = { mesh(0.0f), mesh(100.0f), mesh(100.5f), mesh(300.0f) };
+		expect(sameGroups(plan(scattered), { { 1, 2 } }), "Far apart meshes are grouped.");
+		BlasPlannerSettings loose;
+		loose.maxSpread = 1e9f;
+		expect(sameGroups(plan(scattered, loose), { { 0, 4 } }), "A loose maxSpread does not group far apart meshes.");
+
+		std::cout << "BLAS planner - grouping rules checked, " << plan(row).size() << " group of " << row.size() << " overlapping meshes" << std::endl;
+	}
+
+private:
+	static float cube(float x)
+	{
+		return x * x * x;
+	}
+
+	static bool canJoin(const BlasCandidate& first, const BlasGroup& group, float memberVolume, const BlasCandidate& candidate, float volume,
+		const BlasPlannerSettings& settings)
+	{
+		if (candidate.transform != first.transform || candidate.materialIndex != first.materialIndex)
+			return false;
+
+		if (group.triangleCount + candidate.triangleCount > settings.maxGroupTriangles)
+			return false;
+
+		const glm::vec4 merged = mergeSpheres(group.boundingSphere, candidate.boundingSphere);
+		return cube(merged.w) <= settings.maxSpread * (memberVolume + volume);
+	}
+};
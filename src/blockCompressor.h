@@ -0,0 +1,469 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+#include "vulkan/vulkan.h"
+#include "threadPool.h"
+#include "mipGenerator.h"
+
+/*
+ * Block compressor - Encodes RGBA8 mip chains of MipGenerator into BC1 (opaque textures) or BC3 (textures with alpha), 4x4 texels per block.
+ * Colors are fit along the principal axis of the block, quantized to RGB565 and refined once by least squares on the chosen indices. Alpha is
+ * stored as a BC4 block with the 8 value palette. Blocks on the right and bottom border repeat the last texel of the level.
+ * The decoder follows the palette of the encoder and is used to measure the PSNR of the encoded chains on the CPU. Block rows of all levels
+ * and layers are encoded in parallel on the ThreadPool.
+ */
+class BlockCompressor
+{
+public:
+	// RGBA8 textures without alpha are stored as BC1, the others as BC3
+	static bool isOpaque(const void* texels, size_t texelCount)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(texels);
+		for (size_t i = 0; i < texelCount; i++)
+			if (bytes[i * 4 + 3] != 255)
+				return false;
+
+		return true;
+	}
+
+	// src holds layerCount RGBA8 mip chains, dst receives the chains in format, see MipGenerator::chainSize()
+	static void compressChains(const uint8_t* src, uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t layerCount, VkFormat format, uint8_t* dst)
+	{
+		const std::vector<BlockRow> rows = blockRows(width, height, mipLevels, layerCount, format);
+		ThreadPool::getInstance().parallelFor(rows.size(), [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; i++) {
+				const BlockRow& row = rows[i];
+				for (uint32_t x = 0; x < row.width; x += 4) {
+					uint8_t texels[64];
+					gatherBlock(src + row.srcOffset, row.width, row.height, x, row.y, texels);
+
+					uint8_t* block = dst + row.dstOffset + (x / 4) * MipGenerator::blockSize(format);
+					if (format == VK_FORMAT_BC3_UNORM_BLOCK) {
+						encodeAlpha(texels, block);
+						block += 8;
+					}
+					encodeColor(texels, block);
+				}
+			}
+		}, 16);
+	}
+
+	// Inverse of compressChains(), dst receives RGBA8 chains
+	static void decompressChains(const uint8_t* src, uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t layerCount, VkFormat format, uint8_t* dst)
+	{
+		const std::vector<BlockRow> rows = blockRows(width, height, mipLevels, layerCount, format);
+		ThreadPool::getInstance().parallelFor(rows.size(), [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; i++) {
+				const BlockRow& row = rows[i];
+				for (uint32_t x = 0; x < row.width; x += 4) {
+					uint8_t texels[64];
+					const uint8_t* block = src + row.dstOffset + (x / 4) * MipGenerator::blockSize(format);
+					if (format == VK_FORMAT_BC3_UNORM_BLOCK) {
+						decodeColor(block + 8, texels);
+						decodeAlpha(block, texels);
+					}
+					else
+						decodeColor(block, texels);
+
+					scatterBlock(texels, row.width, row.height, x, row.y, dst + row.srcOffset);
+				}
+			}
+		}, 16);
+	}
+
+	// Peak signal to noise ratio in dB over all bytes, infinity when equal
+	static double psnr(const uint8_t* reference, const uint8_t* test, size_t sizeInBytes)
+	{
+		double squaredError = 0.0;
+		for (size_t i = 0; i < sizeInBytes; i++) {
+			double difference = static_cast<double>(reference[i]) - test[i];
+			squaredError += difference * difference;
+		}
+
+		if (squaredError == 0.0)
+			return std::numeric_limits<double>::infinity();
+
+		return 10.0 * std::log10(255.0 * 255.0 * sizeInBytes / squaredError);
+	}
+
+	// Compresses the mip chains of test textures and throws when the PSNR of the decoded chains is below the bound of the texture.
+	// Bounds are ~2 dB below the measured values, BC1 textures are opaque. Blocks of at most two RGB565 colors and two alpha values,
+	// and textures whose size is not a multiple of 4, must decode exactly.
+	static void selfTest()
+	{
+		auto fail = [](const std::string& message) { throw std::runtime_error("BlockCompressor: " + message); };
+
+		struct TestTexture
+		{
+			const char* name;
+			double minPsnr[2]; // BC1, BC3
+		};
+		const TestTexture textures[3] = { { "gradient", { 41.0, 41.0 } }, { "sines + noise", { 32.0, 32.0 } }, { "heavy noise", { 28.0, 28.0 } } };
+		const VkFormat formats[2] = { VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC3_UNORM_BLOCK };
+
+		const uint32_t size = 256;
+		const uint32_t mipLevels = 9;
+		const size_t chainBytes = MipGenerator::chainSize(size, size, mipLevels, VK_FORMAT_R8G8B8A8_UNORM);
+		std::vector<uint8_t> level0(static_cast<size_t>(size) * size * 4);
+		std::vector<uint8_t> chain(chainBytes);
+		std::vector<uint8_t> decoded(chainBytes);
+
+		std::cout << "Block compression - " << size << "x" << size << " textures, " << mipLevels << " levels" << std::endl;
+		for (uint32_t t = 0; t < 3; t++) {
+			std::cout << "\t" << textures[t].name << ":";
+			for (uint32_t f = 0; f < 2; f++) {
+				std::mt19937 rng(13);
+				std::uniform_int_distribution<int32_t> noise(-4, 4);
+				for (uint32_t y = 0; y < size; y++)
+					for (uint32_t x = 0; x < size; x++) {
+						uint8_t* texel = level0.data() + (static_cast<size_t>(y) * size + x) * 4;
+						const double u = static_cast<double>(x) / size;
+						const double v = static_cast<double>(y) / size;
+						const double gradient[4] = { static_cast<double>(x), static_cast<double>(y), 0.5 * (x + y), 255.0 - y };
+						for (uint32_t c = 0; c < 4; c++) {
+							const double sines = 128.0 + 60.0 * std::sin(2.0 * 3.14159265358979 * (3.0 * u + 2.0 * v + c)) +
+								40.0 * std::sin(2.0 * 3.14159265358979 * (17.0 * u - 11.0 * v));
+							const double value = t == 0 ? gradient[c] : sines + noise(rng) * (t == 2 ? 4 : 1);
+							texel[c] = static_cast<uint8_t>(std::min(std::max(value, 0.0), 255.0));
+						}
+						if (formats[f] == VK_FORMAT_BC1_RGB_UNORM_BLOCK)
+							texel[3] = 255;
+					}
+
+				MipGenerator::generate({ level0.data() }, size, size, VK_FORMAT_R8G8B8A8_UNORM, mipLevels, MipSettings(), chain.data());
+				const double value = roundTripPsnr(chain.data(), size, size, mipLevels, formats[f], decoded.data());
+				std::cout << (f == 0 ? " BC1 " : ", BC3 ") << value << " dB";
+				if (value < textures[t].minPsnr[f])
+					fail(std::string(f == 0 ? "BC1" : "BC3") + " PSNR of the " + textures[t].name + " texture below " + std::to_string(textures[t].minPsnr[f]) + " dB.");
+			}
+			std::cout << std::endl;
+		}
+
+		// Two RGB565 colors and two alpha values per 4x4 cell, repeated over a level that is not a multiple of the block size
+		const uint32_t width = 13;
+		const uint32_t height = 7;
+		std::vector<uint8_t> twoColors(static_cast<size_t>(width) * height * 4);
+		for (uint32_t y = 0; y < height; y++)
+			for (uint32_t x = 0; x < width; x++) {
+				const bool second = ((x + y) & 1) != 0;
+				const uint8_t texel[4] = { second ? uint8_t(255) : uint8_t(0), second ? uint8_t(130) : uint8_t(65), second ? uint8_t(74) : uint8_t(255), second ? uint8_t(0) : uint8_t(255) };
+				memcpy(twoColors.data() + (static_cast<size_t>(y) * width + x) * 4, texel, 4);
+			}
+		std::vector<uint8_t> twoColorsDecoded(twoColors.size());
+		if (roundTripPsnr(twoColors.data(), width, height, 1, VK_FORMAT_BC3_UNORM_BLOCK, twoColorsDecoded.data()) != std::numeric_limits<double>::infinity())
+			fail("Blocks of two RGB565 colors and two alpha values do not decode exactly.");
+	}
+
+private:
+	static double roundTripPsnr(const uint8_t* chains, uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, uint8_t* decoded)
+	{
+		const size_t chainBytes = MipGenerator::chainSize(width, height, mipLevels, VK_FORMAT_R8G8B8A8_UNORM);
+		std::vector<uint8_t> compressed(MipGenerator::chainSize(width, height, mipLevels, format));
+		compressChains(chains, width, height, mipLevels, 1, format, compressed.data());
+		decompressChains(compressed.data(), width, height, mipLevels, 1, format, decoded);
+
+		return psnr(chains, decoded, chainBytes);
+	}
+
+	// One row of blocks of one level of one layer. srcOffset is the RGBA8 level, dstOffset the compressed one.
+	struct BlockRow
+	{
+		size_t srcOffset;
+		size_t dstOffset;
+		uint32_t width;
+		uint32_t height;
+		uint32_t y;
+	};
+
+	static std::vector<BlockRow> blockRows(uint32_t width, uint32_t height, uint32_t mipLevels, uint32_t layerCount, VkFormat format)
+	{
+		std::vector<BlockRow> rows;
+		size_t srcOffset = 0;
+		size_t dstOffset = 0;
+		for (uint32_t layer = 0; layer < layerCount; layer++)
+			for (uint32_t level = 0; level < mipLevels; level++) {
+				const VkExtent2D extent = MipGenerator::levelExtent(width, height, level);
+				const size_t rowSize = ((extent.width + 3) / 4) * MipGenerator::blockSize(format);
+				for (uint32_t y = 0; y < extent.height; y += 4)
+					rows.push_back({ srcOffset, dstOffset + (y / 4) * rowSize, extent.width, extent.height, y });
+
+				srcOffset += MipGenerator::levelSize(width, height, level, VK_FORMAT_R8G8B8A8_UNORM);
+				dstOffset += MipGenerator::levelSize(width, height, level, format);
+			}
+
+		return rows;
+	}
+
+	static void gatherBlock(const uint8_t* level, uint32_t width, uint32_t height, uint32_t x, uint32_t y, uint8_t texels[64])
+	{
+		for (uint32_t j = 0; j < 4; j++)
+			for (uint32_t i = 0; i < 4; i++) {
+				const size_t texel = static_cast<size_t>(std::min(y + j, height - 1)) * width + std::min(x + i, width - 1);
+				memcpy(texels + (j * 4 + i) * 4, level + texel * 4, 4);
+			}
+	}
+
+	static void scatterBlock(const uint8_t texels[64], uint32_t width, uint32_t height, uint32_t x, uint32_t y, uint8_t* level)
+	{
+		for (uint32_t j = 0; j < 4 && y + j < height; j++)
+			for (uint32_t i = 0; i < 4 && x + i < width; i++)
+				memcpy(level + (static_cast<size_t>(y + j) * width + x + i) * 4, texels + (j * 4 + i) * 4, 4);
+	}
+
+	static uint16_t packRgb565(const float color[3])
+	{
+		const uint32_t r = static_cast<uint32_t>(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+		const uint32_t g = static_cast<uint32_t>(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+		const uint32_t b = static_cast<uint32_t>(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+
+		return static_cast<uint16_t>(r << 11 | g << 5 | b);
+	}
+
+	static void unpackRgb565(uint16_t packed, int32_t color[3])
+	{
+		const int32_t r = packed >> 11 & 31;
+		const int32_t g = packed >> 5 & 63;
+		const int32_t b = packed & 31;
+		color[0] = r << 3 | r >> 2;
+		color[1] = g << 2 | g >> 4;
+		color[2] = b << 3 | b >> 2;
+	}
+
+	// 4 color palette of color0 > color1, 3 colors and black otherwise
+	static void colorPalette(uint16_t color0, uint16_t color1, int32_t palette[4][3])
+	{
+		unpackRgb565(color0, palette[0]);
+		unpackRgb565(color1, palette[1]);
+		for (uint32_t c = 0; c < 3; c++) {
+			if (color0 > color1) {
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			else {
+				palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+				palette[3][c] = 0;
+			}
+		}
+	}
+
+	// Nearest palette entry of each texel, returns the squared error
+	static uint32_t selectColorIndices(const uint8_t texels[64], const int32_t palette[4][3], uint32_t indices[16])
+	{
+		uint32_t totalError = 0;
+		for (uint32_t i = 0; i < 16; i++) {
+			uint32_t bestError = ~0u;
+			for (uint32_t p = 0; p < 4; p++) {
+				uint32_t error = 0;
+				for (uint32_t c = 0; c < 3; c++) {
+					const int32_t difference = texels[i * 4 + c] - palette[p][c];
+					error += static_cast<uint32_t>(difference * difference);
+				}
+
+				if (error < bestError) {
+					bestError = error;
+					indices[i] = p;
+				}
+			}
+			totalError += bestError;
+		}
+
+		return totalError;
+	}
+
+	// Endpoints of the 4 color mode, color0 > color1 unless both are equal
+	static uint32_t fitColors(const uint8_t texels[64], const float endpoint0[3], const float endpoint1[3], uint16_t& color0, uint16_t& color1, uint32_t indices[16])
+	{
+		color0 = packRgb565(endpoint0);
+		color1 = packRgb565(endpoint1);
+		if (color0 < color1)
+			std::swap(color0, color1);
+
+		int32_t palette[4][3];
+		colorPalette(color0, color1, palette);
+		if (color0 == color1) {
+			std::fill(indices, indices + 16, 0u);
+			uint32_t error = 0;
+			for (uint32_t i = 0; i < 16; i++)
+				for (uint32_t c = 0; c < 3; c++)
+					error += static_cast<uint32_t>((texels[i * 4 + c] - palette[0][c]) * (texels[i * 4 + c] - palette[0][c]));
+			return error;
+		}
+
+		return selectColorIndices(texels, palette, indices);
+	}
+
+	static void encodeColor(const uint8_t texels[64], uint8_t* block)
+	{
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+		for (uint32_t i = 0; i < 16; i++)
+			for (uint32_t c = 0; c < 3; c++)
+				mean[c] += texels[i * 4 + c] / 16.0f;
+
+		float covariance[6] = {}; // rr, rg, rb, gg, gb, bb
+		for (uint32_t i = 0; i < 16; i++) {
+			const float r = texels[i * 4] - mean[0];
+			const float g = texels[i * 4 + 1] - mean[1];
+			const float b = texels[i * 4 + 2] - mean[2];
+			covariance[0] += r * r;
+			covariance[1] += r * g;
+			covariance[2] += r * b;
+			covariance[3] += g * g;
+			covariance[4] += g * b;
+			covariance[5] += b * b;
+		}
+
+		// Principal axis by power iteration
+		float axis[3] = { 1.0f, 1.0f, 1.0f };
+		for (uint32_t iteration = 0; iteration < 8; iteration++) {
+			const float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+			const float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+			const float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+			const float length = std::max(std::max(std::abs(x), std::abs(y)), std::abs(z));
+			if (length < 1e-6f)
+				break;
+
+			axis[0] = x / length;
+			axis[1] = y / length;
+			axis[2] = z / length;
+		}
+
+		float minProjection = std::numeric_limits<float>::max();
+		float maxProjection = -std::numeric_limits<float>::max();
+		for (uint32_t i = 0; i < 16; i++) {
+			const float projection = (texels[i * 4] - mean[0]) * axis[0] + (texels[i * 4 + 1] - mean[1]) * axis[1] + (texels[i * 4 + 2] - mean[2]) * axis[2];
+			minProjection = std::min(minProjection, projection);
+			maxProjection = std::max(maxProjection, projection);
+		}
+
+		const float axisLengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+		float endpoint0[3];
+		float endpoint1[3];
+		for (uint32_t c = 0; c < 3; c++) {
+			endpoint0[c] = mean[c] + axis[c] * maxProjection / axisLengthSquared;
+			endpoint1[c] = mean[c] + axis[c] * minProjection / axisLengthSquared;
+		}
+
+		uint16_t color0, color1;
+		uint32_t indices[16];
+		uint32_t error = fitColors(texels, endpoint0, endpoint1, color0, color1, indices);
+
+		// Least squares endpoints for the chosen indices, kept when they lower the error
+		if (error > 0 && color0 != color1) {
+			const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+			float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+			float ax[3] = {}, bx[3] = {};
+			for (uint32_t i = 0; i < 16; i++) {
+				const float a = weights[indices[i]];
+				const float b = 1.0f - a;
+				aa += a * a;
+				ab += a * b;
+				bb += b * b;
+				for (uint32_t c = 0; c < 3; c++) {
+					ax[c] += a * texels[i * 4 + c];
+					bx[c] += b * texels[i * 4 + c];
+				}
+			}
+
+			const float determinant = aa * bb - ab * ab;
+			if (std::abs(determinant) > 1e-6f) {
+				float refined0[3], refined1[3];
+				for (uint32_t c = 0; c < 3; c++) {
+					refined0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+					refined1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+				}
+
+				uint16_t refinedColor0, refinedColor1;
+				uint32_t refinedIndices[16];
+				const uint32_t refinedError = fitColors(texels, refined0, refined1, refinedColor0, refinedColor1, refinedIndices);
+				if (refinedError < error) {
+					color0 = refinedColor0;
+					color1 = refinedColor1;
+					memcpy(indices, refinedIndices, sizeof(indices));
+				}
+			}
+		}
+
+		uint32_t packedIndices = 0;
+		for (uint32_t i = 0; i < 16; i++)
+			packedIndices |= indices[i] << (i * 2);
+
+		memcpy(block, &color0, 2);
+		memcpy(block + 2, &color1, 2);
+		memcpy(block + 4, &packedIndices, 4);
+	}
+
+	static void decodeColor(const uint8_t* block, uint8_t texels[64])
+	{
+		uint16_t color0, color1;
+		uint32_t packedIndices;
+		memcpy(&color0, block, 2);
+		memcpy(&color1, block + 2, 2);
+		memcpy(&packedIndices, block + 4, 4);
+
+		int32_t palette[4][3];
+		colorPalette(color0, color1, palette);
+		for (uint32_t i = 0; i < 16; i++) {
+			const uint32_t index = packedIndices >> (i * 2) & 3;
+			for (uint32_t c = 0; c < 3; c++)
+				texels[i * 4 + c] = static_cast<uint8_t>(palette[index][c]);
+			texels[i * 4 + 3] = 255;
+		}
+	}
+
+	// BC4 block, alpha0 > alpha1 selects the 8 value palette
+	static void encodeAlpha(const uint8_t texels[64], uint8_t* block)
+	{
+		uint8_t alpha0 = 0;
+		uint8_t alpha1 = 255;
+		for (uint32_t i = 0; i < 16; i++) {
+			alpha0 = std::max(alpha0, texels[i * 4 + 3]);
+			alpha1 = std::min(alpha1, texels[i * 4 + 3]);
+		}
+
+		uint64_t packedIndices = 0;
+		if (alpha0 > alpha1)
+			for (uint32_t i = 0; i < 16; i++) {
+				// Step 7 is alpha0 (index 0), step 0 is alpha1 (index 1), step s in between is index 8 - s
+				const uint32_t step = static_cast<uint32_t>((texels[i * 4 + 3] - alpha1) * 7.0f / (alpha0 - alpha1) + 0.5f);
+				const uint64_t index = step == 7 ? 0 : (step == 0 ? 1 : 8 - step);
+				packedIndices |= index << (i * 3);
+			}
+
+		block[0] = alpha0;
+		block[1] = alpha1;
+		memcpy(block + 2, &packedIndices, 6);
+	}
+
+	static void decodeAlpha(const uint8_t* block, uint8_t texels[64])
+	{
+		const int32_t alpha0 = block[0];
+		const int32_t alpha1 = block[1];
+		uint64_t packedIndices = 0;
+		memcpy(&packedIndices, block + 2, 6);
+
+		int32_t palette[8] = { alpha0, alpha1 };
+		for (int32_t i = 1; i < 7; i++) {
+			if (alpha0 > alpha1)
+				palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+			else if (i < 5)
+				palette[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+		}
+		if (alpha0 <= alpha1) {
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+
+		for (uint32_t i = 0; i < 16; i++)
+			texels[i * 4 + 3] = static_cast<uint8_t>(palette[packedIndices >> (i * 3) & 7]);
+	}
+};
@@ -77,6 +77,11 @@ public:
 		keyFrames.tick(timeDelta);
 	}
 	
+	const ProjectionViewMat& getProjViewMat() const
+	{
+		return projViewMat;
+	}
+
 	void changeKeyFrameFileName(const std::string& newFileName)
 	{
 		keyFrameFileName = newFileName;
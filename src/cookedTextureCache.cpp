@@ -0,0 +1,109 @@
+#include <filesystem>
+
+#include "cookedTextureCache.h"
+
+// Every array starts at a multiple of this, the mapping itself is page aligned
+#define COOKED_TEXTURE_CACHE_ALIGNMENT 16
+
+struct CookedTextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t arrayCount;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t fileSize;
+};
+
+struct CookedTextureArrayRecord
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t layerCount;
+	uint32_t mipLevels;
+	uint32_t format;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+static uint64_t arraySize(const CookedTextureArrayRecord& record)
+{
+	return record.layerCount * MipGenerator::chainSize(record.width, record.height, record.mipLevels, static_cast<VkFormat>(record.format));
+}
+
+bool CookedTextureCache::load(uint64_t key)
+{
+	arrays.clear();
+	if (!file.open(cacheFile))
+		return false;
+
+	CookedTextureCacheHeader header;
+	if (file.size() < sizeof(header))
+		return false;
+
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != COOKED_TEXTURE_CACHE_MAGIC || header.version != COOKED_TEXTURE_CACHE_VERSION || header.key != key || header.fileSize != file.size() ||
+		header.arrayCount > (file.size() - sizeof(header)) / sizeof(CookedTextureArrayRecord)) {
+		file.close();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.arrayCount; i++) {
+		CookedTextureArrayRecord record;
+		memcpy(&record, file.data() + sizeof(header) + i * sizeof(record), sizeof(record));
+
+		const uint64_t size = arraySize(record);
+		if (size == 0 || record.offset % COOKED_TEXTURE_CACHE_ALIGNMENT != 0 || record.offset > file.size() || size > file.size() - record.offset) {
+			arrays.clear();
+			file.close();
+			return false;
+		}
+
+		arrays.push_back({ record.width, record.height, record.layerCount, record.mipLevels, static_cast<VkFormat>(record.format), file.data() + record.offset });
+	}
+
+	return true;
+}
+
+void CookedTextureCache::save(uint64_t key, const std::vector<CookedTextureArray>& arrays) const
+{
+	CookedTextureCacheHeader header = {};
+	header.magic = COOKED_TEXTURE_CACHE_MAGIC;
+	header.version = COOKED_TEXTURE_CACHE_VERSION;
+	header.arrayCount = static_cast<uint32_t>(arrays.size());
+	header.key = key;
+
+	std::vector<CookedTextureArrayRecord> records;
+	uint64_t offset = ROUND_UP(sizeof(header) + arrays.size() * sizeof(CookedTextureArrayRecord), COOKED_TEXTURE_CACHE_ALIGNMENT);
+	for (const auto& array : arrays) {
+		CookedTextureArrayRecord record = { array.width, array.height, array.layerCount, array.mipLevels, static_cast<uint32_t>(array.format), 0, offset };
+		records.push_back(record);
+		offset = ROUND_UP(offset + arraySize(record), COOKED_TEXTURE_CACHE_ALIGNMENT);
+	}
+	header.fileSize = records.empty() ? offset : records.back().offset + arraySize(records.back());
+
+	// Write to a temporary file first, so that an interrupted write never leaves a truncated cache behind
+	std::string tmpFile = cacheFile + ".tmp";
+	{
+		std::ofstream stream(tmpFile, std::ios::binary | std::ios::trunc);
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		stream.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(CookedTextureArrayRecord));
+
+		const char padding[COOKED_TEXTURE_CACHE_ALIGNMENT] = {};
+		uint64_t written = sizeof(header) + records.size() * sizeof(CookedTextureArrayRecord);
+		for (size_t i = 0; i < arrays.size(); i++) {
+			stream.write(padding, records[i].offset - written);
+			stream.write(reinterpret_cast<const char*>(arrays[i].data), arraySize(records[i]));
+			written = records[i].offset + arraySize(records[i]);
+		}
+
+		if (!stream) {
+			WARN(false, "CookedTextureCache: Failed to write cache file - " + tmpFile);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tmpFile, cacheFile, error);
+	WARN(!error, "CookedTextureCache: Failed to write cache file - " + cacheFile);
+}
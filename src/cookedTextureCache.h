@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "helper.h"
+#include "mappedFile.h"
+
+/*
+ * Cooked texture cache - Texture arrays with their complete mip chains, as produced by TextureGenerator::createTextureArrays(). Later runs memory
+ * map the file and upload the arrays directly, without resizing or filtering. The whole file is valid for one key, a hash over the source
+ * texels, the array layout and the mip settings computed by the TextureGenerator; any other format change must bump COOKED_TEXTURE_CACHE_VERSION.
+ */
+
+#define COOKED_TEXTURE_CACHE_MAGIC 0x4b4f4f43 // "COOK"
+#define COOKED_TEXTURE_CACHE_VERSION 1
+
+struct CookedTextureArray
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t layerCount = 0;
+	uint32_t mipLevels = 0;
+	VkFormat format = VK_FORMAT_UNDEFINED;
+	const uint8_t* data = nullptr; // layer after layer the complete mip chain, see MipGenerator::generate()
+};
+
+class CookedTextureCache
+{
+public:
+	CookedTextureCache(const std::string& cacheFile)
+	{
+		this->cacheFile = cacheFile;
+	}
+
+	// Returns false when the cache is missing or was cooked for another key. The array data points into the mapping of this object.
+	bool load(uint64_t key);
+
+	const std::vector<CookedTextureArray>& getArrays() const
+	{
+		return arrays;
+	}
+
+	void save(uint64_t key, const std::vector<CookedTextureArray>& arrays) const;
+
+private:
+	std::string cacheFile;
+	MappedFile file;
+	std::vector<CookedTextureArray> arrays;
+};
@@ -0,0 +1,682 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include "cpuBvh.h"
+#include "helper.h"
+#include "model.hpp"
+#include "threadPool.h"
+
+// Primitives binned by one task of the parallel binning of the top nodes
+#define BVH_BINNING_RANGE_SIZE 16384
+
+// Maps centers to bins, the scale is 0 on axes where the centers do not spread out
+struct BinMapping
+{
+	glm::vec3 offset;
+	glm::vec3 scale;
+};
+
+static BinMapping binMapping(const BvhBox& centerBounds, uint32_t binCount)
+{
+	BinMapping mapping;
+	mapping.offset = centerBounds.min;
+	for (int axis = 0; axis < 3; axis++) {
+		const float extent = centerBounds.max[axis] - centerBounds.min[axis];
+		mapping.scale[axis] = extent > 0.0f ? static_cast<float>(binCount) / extent : 0.0f;
+	}
+
+	return mapping;
+}
+
+static uint32_t binIndex(const BinMapping& mapping, const glm::vec3& center, int axis, uint32_t binCount)
+{
+	const float scaled = (center[axis] - mapping.offset[axis]) * mapping.scale[axis];
+	return std::min(binCount - 1, static_cast<uint32_t>(std::max(scaled, 0.0f)));
+}
+
+static BvhNode makeNode(const BvhBox& bounds, uint32_t leftOrFirst, uint32_t count)
+{
+	BvhNode node;
+	node.boundsMin = bounds.min;
+	node.leftOrFirst = leftOrFirst;
+	node.boundsMax = bounds.max;
+	node.count = count;
+	return node;
+}
+
+// Levels below a node of count primitives when every node under it is split at the median
+static uint32_t medianLevels(uint32_t count)
+{
+	uint32_t levels = 0;
+	while ((1ull << levels) < count)
+		levels++;
+
+	return levels;
+}
+
+// Whether a node at depth, 1 for the root, may take a SAH split. Its larger child has at most count - 1 primitives one level down, where
+// median splits still end within BVH_STACK_SIZE levels.
+static bool withinDepth(uint32_t depth, uint32_t count)
+{
+	return depth + medianLevels(count) < BVH_STACK_SIZE;
+}
+
+static BvhBox nodeBounds(const BvhNode& node)
+{
+	BvhBox box;
+	box.min = node.boundsMin;
+	box.max = node.boundsMax;
+	return box;
+}
+
+float Bvh::sahCost(const BvhSettings& settings) const
+{
+	if (nodes.empty())
+		return 0.0f;
+
+	const float rootArea = nodeBounds(nodes[0]).area();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (const BvhNode& node : nodes)
+		cost += nodeBounds(node).area() * (node.count > 0 ? node.count * settings.intersectionCost : settings.traversalCost);
+
+	return cost / rootArea;
+}
+
+uint32_t Bvh::leafCount() const
+{
+	uint32_t leaves = 0;
+	for (const BvhNode& node : nodes)
+		leaves += node.count > 0 ? 1 : 0;
+
+	return leaves;
+}
+
+uint32_t Bvh::depth() const
+{
+	if (nodes.empty())
+		return 0;
+
+	uint32_t maxDepth = 0;
+	std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, 1 } };
+	while (!stack.empty()) {
+		const auto [nodeIdx, nodeDepth] = stack.back();
+		stack.pop_back();
+		maxDepth = std::max(maxDepth, nodeDepth);
+		if (nodes[nodeIdx].count == 0) {
+			stack.push_back({ nodes[nodeIdx].leftOrFirst, nodeDepth + 1 });
+			stack.push_back({ nodes[nodeIdx].leftOrFirst + 1, nodeDepth + 1 });
+		}
+	}
+
+	return maxDepth;
+}
+
+void BvhBuilder::add(Bvh& bvh, std::vector<BvhBox>&& boxes)
+{
+	Job job;
+	job.bvh = &bvh;
+	job.boxes = std::move(boxes);
+	job.centers.resize(job.boxes.size());
+	for (size_t i = 0; i < job.boxes.size(); i++)
+		job.centers[i] = job.boxes[i].center();
+
+	jobs.push_back(std::move(job));
+}
+
+void BvhBuilder::build()
+{
+	CHECK(settings.binCount >= 2 && settings.binCount <= BVH_MAX_BIN_COUNT, "BVH bin count out of range");
+
+	ThreadPool& pool = ThreadPool::getInstance();
+	std::vector<Subtree> subtrees;
+
+	// Split the nodes above subtreeSize, the binning of each of them runs on all workers
+	for (uint32_t jobIdx = 0; jobIdx < jobs.size(); jobIdx++) {
+		Job& job = jobs[jobIdx];
+		Bvh& bvh = *job.bvh;
+		const uint32_t primitiveCount = static_cast<uint32_t>(job.boxes.size());
+
+		bvh.nodes.clear();
+		bvh.primitives.resize(primitiveCount);
+		for (uint32_t i = 0; i < primitiveCount; i++)
+			bvh.primitives[i] = i;
+
+		if (primitiveCount == 0)
+			continue;
+
+		BvhBox bounds;
+		BvhBox centerBounds;
+		for (uint32_t i = 0; i < primitiveCount; i++) {
+			bounds.grow(job.boxes[i]);
+			centerBounds.grow(job.centers[i]);
+		}
+
+		bvh.nodes.reserve(2 * primitiveCount - 1);
+		bvh.nodes.push_back(makeNode(bounds, 0, primitiveCount));
+
+		struct Pending
+		{
+			uint32_t node;
+			uint32_t first;
+			uint32_t count;
+			BvhBox centerBounds;
+			uint32_t depth; // 1 for the root
+		};
+		std::vector<Pending> pending = { { 0, 0, primitiveCount, centerBounds, 1 } };
+		while (!pending.empty()) {
+			const Pending current = pending.back();
+			pending.pop_back();
+
+			if (current.count <= settings.subtreeSize) {
+				Subtree subtree;
+				subtree.job = jobIdx;
+				subtree.node = current.node;
+				subtree.first = current.first;
+				subtree.count = current.count;
+				subtree.centerBounds = current.centerBounds;
+				subtree.depth = current.depth;
+				subtrees.push_back(std::move(subtree));
+				continue;
+			}
+
+			// Nodes this large are never leaves
+			Split split;
+			if (withinDepth(current.depth, current.count))
+				split = findSplit(job, current.first, current.count, nodeBounds(bvh.nodes[current.node]), current.centerBounds, true);
+			if (split.axis < 0)
+				split = medianSplit(job, current.first, current.count, current.centerBounds);
+			else
+				partition(job, current.first, current.count, current.centerBounds, split);
+
+			const uint32_t left = static_cast<uint32_t>(bvh.nodes.size());
+			bvh.nodes[current.node].leftOrFirst = left;
+			bvh.nodes[current.node].count = 0;
+			bvh.nodes.push_back(makeNode(split.left, current.first, split.leftCount));
+			bvh.nodes.push_back(makeNode(split.right, current.first + split.leftCount, current.count - split.leftCount));
+			pending.push_back({ left, current.first, split.leftCount, split.leftCenters, current.depth + 1 });
+			pending.push_back({ left + 1, current.first + split.leftCount, current.count - split.leftCount, split.rightCenters, current.depth + 1 });
+		}
+	}
+
+	// Build the subtrees of all trees in parallel, largest first so that no large one starts last
+	std::vector<uint32_t> order(subtrees.size());
+	for (uint32_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&subtrees](uint32_t a, uint32_t b) { return subtrees[a].count > subtrees[b].count; });
+
+	std::atomic<uint32_t> next = 0;
+	pool.parallelFor(pool.size(), [&](size_t, size_t) {
+		for (uint32_t i = next++; i < order.size(); i = next++)
+			buildSubtree(jobs[subtrees[order[i]].job], subtrees[order[i]]);
+	});
+
+	// Splice the subtrees into their trees, the root replaces the node it was built for and the others are appended
+	for (Subtree& subtree : subtrees) {
+		std::vector<BvhNode>& nodes = jobs[subtree.job].bvh->nodes;
+		const uint32_t base = static_cast<uint32_t>(nodes.size());
+		for (BvhNode& node : subtree.nodes) {
+			if (node.count == 0)
+				node.leftOrFirst += base - 1;
+		}
+
+		nodes[subtree.node] = subtree.nodes[0];
+		nodes.insert(nodes.end(), subtree.nodes.begin() + 1, subtree.nodes.end());
+	}
+
+	for (Job& job : jobs)
+		job.bvh->nodes.shrink_to_fit();
+
+	jobs.clear();
+}
+
+BvhBuilder::Split BvhBuilder::findSplit(const Job& job, uint32_t first, uint32_t count, const BvhBox& bounds, const BvhBox& centerBounds, bool parallel) const
+{
+	const uint32_t binCount = settings.binCount;
+	Bin bins[3 * BVH_MAX_BIN_COUNT];
+	if (parallel) {
+		std::mutex binsMutex;
+		ThreadPool::getInstance().parallelFor(count, [&](size_t begin, size_t end) {
+			Bin localBins[3 * BVH_MAX_BIN_COUNT];
+			binPrimitives(job, first + static_cast<uint32_t>(begin), static_cast<uint32_t>(end - begin), centerBounds, localBins);
+
+			std::lock_guard<std::mutex> lock(binsMutex);
+			for (uint32_t i = 0; i < 3 * binCount; i++) {
+				bins[i].bounds.grow(localBins[i].bounds);
+				bins[i].count += localBins[i].count;
+			}
+		}, BVH_BINNING_RANGE_SIZE);
+	}
+	else {
+		binPrimitives(job, first, count, centerBounds, bins);
+	}
+
+	// Sweep the bin boundaries of every axis, left to right for the left sides and right to left for the right sides
+	const float parentArea = bounds.area();
+	float leftCost[BVH_MAX_BIN_COUNT];
+	Split best;
+	for (int axis = 0; axis < 3; axis++) {
+		if (centerBounds.max[axis] <= centerBounds.min[axis])
+			continue;
+
+		const Bin* axisBins = &bins[axis * binCount];
+		BvhBox left;
+		uint32_t leftCount = 0;
+		for (uint32_t i = 1; i < binCount; i++) {
+			left.grow(axisBins[i - 1].bounds);
+			leftCount += axisBins[i - 1].count;
+			leftCost[i] = left.area() * leftCount;
+		}
+
+		BvhBox right;
+		uint32_t rightCount = 0;
+		for (uint32_t i = binCount - 1; i > 0; i--) {
+			right.grow(axisBins[i].bounds);
+			rightCount += axisBins[i].count;
+			if (rightCount == 0 || rightCount == count)
+				continue;
+
+			const float cost = settings.traversalCost + settings.intersectionCost * (leftCost[i] + right.area() * rightCount) / parentArea;
+			if (cost < best.cost) {
+				best.axis = axis;
+				best.bin = i;
+				best.cost = cost;
+			}
+		}
+	}
+
+	if (best.axis < 0)
+		return best;
+
+	const Bin* axisBins = &bins[best.axis * binCount];
+	for (uint32_t i = 0; i < binCount; i++) {
+		if (i < best.bin) {
+			best.left.grow(axisBins[i].bounds);
+			best.leftCount += axisBins[i].count;
+		}
+		else {
+			best.right.grow(axisBins[i].bounds);
+		}
+	}
+
+	return best;
+}
+
+BvhBuilder::Split BvhBuilder::medianSplit(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds) const
+{
+	// Halves the node along the widest spread of the centers, any order is as good as another when they all coincide
+	Split split;
+	split.leftCount = count / 2;
+	const glm::vec3 extent = centerBounds.max - centerBounds.min;
+	const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	if (extent[axis] > 0.0f) {
+		uint32_t* primitives = job.bvh->primitives.data();
+		std::nth_element(primitives + first, primitives + first + split.leftCount, primitives + first + count,
+			[&job, axis](uint32_t a, uint32_t b) { return job.centers[a][axis] < job.centers[b][axis]; });
+	}
+
+	for (uint32_t slot = first; slot < first + count; slot++) {
+		const uint32_t primitive = job.bvh->primitives[slot];
+		BvhBox& bounds = slot < first + split.leftCount ? split.left : split.right;
+		BvhBox& centers = slot < first + split.leftCount ? split.leftCenters : split.rightCenters;
+		bounds.grow(job.boxes[primitive]);
+		centers.grow(job.centers[primitive]);
+	}
+
+	return split;
+}
+
+void BvhBuilder::partition(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds, Split& split) const
+{
+	// Collects the center bounds of the children on the way, the bins only hold the boxes
+	const BinMapping mapping = binMapping(centerBounds, settings.binCount);
+	uint32_t* primitives = job.bvh->primitives.data();
+	uint32_t left = first;
+	uint32_t right = first + count;
+	while (left < right) {
+		const glm::vec3& center = job.centers[primitives[left]];
+		if (binIndex(mapping, center, split.axis, settings.binCount) < split.bin) {
+			split.leftCenters.grow(center);
+			left++;
+		}
+		else {
+			split.rightCenters.grow(center);
+			std::swap(primitives[left], primitives[--right]);
+		}
+	}
+}
+
+void BvhBuilder::binPrimitives(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds, Bin* bins) const
+{
+	const uint32_t binCount = settings.binCount;
+	const BinMapping mapping = binMapping(centerBounds, binCount);
+	for (uint32_t slot = first; slot < first + count; slot++) {
+		const uint32_t primitive = job.bvh->primitives[slot];
+		const glm::vec3& center = job.centers[primitive];
+		for (int axis = 0; axis < 3; axis++) {
+			if (mapping.scale[axis] == 0.0f)
+				continue;
+
+			Bin& bin = bins[axis * binCount + binIndex(mapping, center, axis, binCount)];
+			bin.bounds.grow(job.boxes[primitive]);
+			bin.count++;
+		}
+	}
+}
+
+void BvhBuilder::buildSubtree(const Job& job, Subtree& subtree) const
+{
+	struct Pending
+	{
+		uint32_t node;
+		uint32_t first;
+		uint32_t count;
+		BvhBox centerBounds;
+		uint32_t depth;
+	};
+
+	std::vector<BvhNode>& nodes = subtree.nodes;
+	nodes.reserve(2 * subtree.count - 1);
+	nodes.push_back(job.bvh->nodes[subtree.node]);
+
+	std::vector<Pending> pending = { { 0, subtree.first, subtree.count, subtree.centerBounds, subtree.depth } };
+	while (!pending.empty()) {
+		const Pending current = pending.back();
+		pending.pop_back();
+		if (current.count == 1)
+			continue;
+
+		// Past the depth budget small nodes become leaves and large ones are halved
+		Split split;
+		if (withinDepth(current.depth, current.count))
+			split = findSplit(job, current.first, current.count, nodeBounds(nodes[current.node]), current.centerBounds, false);
+		else if (current.count <= settings.maxLeafSize)
+			continue;
+		const float leafCost = current.count * settings.intersectionCost;
+		if (current.count <= settings.maxLeafSize && split.cost >= leafCost)
+			continue;
+
+		if (split.axis < 0)
+			split = medianSplit(job, current.first, current.count, current.centerBounds);
+		else
+			partition(job, current.first, current.count, current.centerBounds, split);
+
+		const uint32_t left = static_cast<uint32_t>(nodes.size());
+		nodes[current.node].leftOrFirst = left;
+		nodes[current.node].count = 0;
+		nodes.push_back(makeNode(split.left, current.first, split.leftCount));
+		nodes.push_back(makeNode(split.right, current.first + split.leftCount, current.count - split.leftCount));
+		pending.push_back({ left, current.first, split.leftCount, split.leftCenters, current.depth + 1 });
+		pending.push_back({ left + 1, current.first + split.leftCount, current.count - split.leftCount, split.rightCenters, current.depth + 1 });
+	}
+}
+
+void SceneBvh::build(const Model& model, const BvhSettings& settings)
+{
+	this->settings = settings;
+	stats = BvhBuildStats();
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	// Aliases use the BVH of the mesh they alias, which comes before them
+	const uint32_t meshCount = static_cast<uint32_t>(model.meshes.size());
+	meshToBvh.resize(meshCount);
+	std::vector<uint32_t> bvhToMesh;
+	for (uint32_t meshIdx = 0; meshIdx < meshCount; meshIdx++) {
+		if (model.meshAliases[meshIdx] == meshIdx) {
+			meshToBvh[meshIdx] = static_cast<uint32_t>(bvhToMesh.size());
+			bvhToMesh.push_back(meshIdx);
+		}
+		else {
+			meshToBvh[meshIdx] = meshToBvh[model.meshAliases[meshIdx]];
+		}
+	}
+
+	meshBvhs.clear();
+	meshBvhs.resize(bvhToMesh.size());
+	std::vector<std::vector<BvhBox>> boxes(bvhToMesh.size());
+	ThreadPool& pool = ThreadPool::getInstance();
+	pool.parallelFor(bvhToMesh.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const MeshOffsets& offsets = model.meshOffsets[bvhToMesh[i]];
+			const uint32_t* indices = &model.indices[offsets.indexOffset];
+			boxes[i].resize(offsets.indexCount / 3);
+			for (uint32_t triangle = 0; triangle < offsets.indexCount / 3; triangle++) {
+				for (uint32_t corner = 0; corner < 3; corner++)
+					boxes[i][triangle].grow(model.vertices[indices[3 * triangle + corner]].pos);
+			}
+		}
+	});
+
+	BvhBuilder builder(settings);
+	for (size_t i = 0; i < meshBvhs.size(); i++)
+		builder.add(meshBvhs[i].bvh, std::move(boxes[i]));
+	builder.build();
+
+	// Store the triangles in leaf order, so that a leaf reads one contiguous range
+	pool.parallelFor(bvhToMesh.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			MeshBvh& mesh = meshBvhs[i];
+			const uint32_t* indices = &model.indices[model.meshOffsets[bvhToMesh[i]].indexOffset];
+			mesh.triangles.resize(mesh.bvh.primitives.size());
+			for (size_t slot = 0; slot < mesh.triangles.size(); slot++) {
+				const uint32_t* triangle = &indices[3 * mesh.bvh.primitives[slot]];
+				const glm::vec3& v0 = model.vertices[triangle[0]].pos;
+				mesh.triangles[slot] = { v0, model.vertices[triangle[1]].pos - v0, model.vertices[triangle[2]].pos - v0 };
+			}
+		}
+	});
+
+	stats.meshBuildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	stats.meshBvhCount = static_cast<uint32_t>(meshBvhs.size());
+	double weightedCost = 0.0;
+	for (const MeshBvh& mesh : meshBvhs) {
+		stats.triangleCount += mesh.triangles.size();
+		stats.nodeCount += mesh.bvh.nodes.size();
+		weightedCost += static_cast<double>(mesh.bvh.sahCost(settings)) * mesh.triangles.size();
+	}
+	stats.meshSahCost = stats.triangleCount > 0 ? static_cast<float>(weightedCost / stats.triangleCount) : 0.0f;
+
+	updateInstances(model);
+}
+
+void SceneBvh::updateInstances(const Model& model)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	const uint32_t instanceCount = static_cast<uint32_t>(model.instanceData_dynamic.size());
+	instances.resize(instanceCount);
+	std::vector<BvhBox> boxes(instanceCount);
+	for (uint32_t i = 0; i < instanceCount; i++) {
+		const glm::mat4& transform = model.instanceData_dynamic[i].model;
+		instances[i].worldToObject = glm::inverse(transform);
+		instances[i].meshBvh = meshToBvh[model.meshPointers[i]];
+
+		// World space box around the transformed corners of the root box
+		const Bvh& bvh = meshBvhs[instances[i].meshBvh].bvh;
+		if (bvh.nodes.empty())
+			continue;
+
+		const BvhNode& root = bvh.nodes[0];
+		for (uint32_t corner = 0; corner < 8; corner++) {
+			const glm::vec3 point((corner & 1) ? root.boundsMax.x : root.boundsMin.x, (corner & 2) ? root.boundsMax.y : root.boundsMin.y,
+				(corner & 4) ? root.boundsMax.z : root.boundsMin.z);
+			boxes[i].grow(glm::vec3(transform * glm::vec4(point, 1.0f)));
+		}
+	}
+
+	BvhBuilder builder(settings);
+	builder.add(instanceBvh, std::move(boxes));
+	builder.build();
+
+	stats.instanceBuildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	stats.instanceSahCost = instanceBvh.sahCost(settings);
+}
+
+bool SceneBvh::intersect(const BvhRay& ray, BvhHit& hit) const
+{
+	hit = BvhHit();
+	hit.t = ray.tMax;
+	return traverse<false>(ray, hit);
+}
+
+bool SceneBvh::occluded(const BvhRay& ray) const
+{
+	BvhHit hit;
+	hit.t = ray.tMax;
+	return traverse<true>(ray, hit);
+}
+
+void SceneBvh::printReport() const
+{
+	const double mTrisPerSecond = stats.meshBuildMs > 0.0 ? stats.triangleCount / (stats.meshBuildMs * 1000.0) : 0.0;
+	std::cout << "CPU BVH - " << stats.meshBvhCount << " mesh BVHs over " << stats.triangleCount << " triangles, " << stats.nodeCount << " nodes, built in "
+		<< stats.meshBuildMs << " ms (" << mTrisPerSecond << " Mtris/s) on " << ThreadPool::getInstance().size() << " threads, SAH cost: "
+		<< stats.meshSahCost << std::endl;
+	std::cout << "CPU BVH - " << instances.size() << " instances, " << instanceBvh.nodes.size() << " nodes, built in " << stats.instanceBuildMs
+		<< " ms, SAH cost: " << stats.instanceSahCost << std::endl;
+}
+
+// Distance to the entry of the box, FLT_MAX when the ray misses it within [tMin, tMax]
+static float intersectBox(const BvhNode& node, const glm::vec3& origin, const glm::vec3& inverseDirection, float tMin, float tMax)
+{
+	const glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+	const glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+	const glm::vec3 near = glm::min(t0, t1);
+	const glm::vec3 far = glm::max(t0, t1);
+	const float entry = std::max(std::max(near.x, near.y), std::max(near.z, tMin));
+	const float exit = std::min(std::min(far.x, far.y), std::min(far.z, tMax));
+	return entry <= exit ? entry : FLT_MAX;
+}
+
+// Components of 0 would give NaN for rays starting on a slab
+static glm::vec3 safeInverse(const glm::vec3& direction)
+{
+	glm::vec3 inverse;
+	for (int i = 0; i < 3; i++)
+		inverse[i] = 1.0f / (std::fabs(direction[i]) > 1e-20f ? direction[i] : std::copysign(1e-20f, direction[i]));
+
+	return inverse;
+}
+
+// Visits the leaves front to back, leaf(node) returns true to end the traversal
+template<typename Leaf>
+static void traverseBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float tMin, const float& tMax, Leaf&& leaf)
+{
+	if (bvh.nodes.empty())
+		return;
+
+	const glm::vec3 inverseDirection = safeInverse(direction);
+	if (intersectBox(bvh.nodes[0], origin, inverseDirection, tMin, tMax) == FLT_MAX)
+		return;
+
+	struct Entry
+	{
+		uint32_t node;
+		float t;
+	};
+	Entry stack[BVH_STACK_SIZE];
+	uint32_t stackSize = 0;
+	uint32_t nodeIdx = 0;
+	for (;;) {
+		const BvhNode& node = bvh.nodes[nodeIdx];
+		if (node.count > 0) {
+			if (leaf(node))
+				return;
+		}
+		else {
+			uint32_t nearIdx = node.leftOrFirst;
+			uint32_t farIdx = node.leftOrFirst + 1;
+			float nearT = intersectBox(bvh.nodes[nearIdx], origin, inverseDirection, tMin, tMax);
+			float farT = intersectBox(bvh.nodes[farIdx], origin, inverseDirection, tMin, tMax);
+			if (farT < nearT) {
+				std::swap(nearIdx, farIdx);
+				std::swap(nearT, farT);
+			}
+
+			if (nearT != FLT_MAX) {
+				if (farT != FLT_MAX)
+					stack[stackSize++] = { farIdx, farT };
+				nodeIdx = nearIdx;
+				continue;
+			}
+		}
+
+		// Skip nodes behind the closest hit found after they were pushed
+		do {
+			if (stackSize == 0)
+				return;
+			stackSize--;
+		} while (stack[stackSize].t > tMax);
+		nodeIdx = stack[stackSize].node;
+	}
+}
+
+template<bool anyHit>
+bool SceneBvh::traverse(const BvhRay& ray, BvhHit& hit) const
+{
+	bool found = false;
+	traverseBvh(instanceBvh, ray.origin, ray.direction, ray.tMin, hit.t, [&](const BvhNode& leaf) {
+		for (uint32_t slot = leaf.leftOrFirst; slot < leaf.leftOrFirst + leaf.count; slot++) {
+			const uint32_t instanceIdx = instanceBvh.primitives[slot];
+			const Instance& instance = instances[instanceIdx];
+
+			// The direction is not normalized, so that t is the same in object and world space
+			const glm::vec3 origin = glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.0f));
+			const glm::vec3 direction = glm::vec3(instance.worldToObject * glm::vec4(ray.direction, 0.0f));
+			if (traverseMesh<anyHit>(meshBvhs[instance.meshBvh], origin, direction, ray.tMin, hit)) {
+				hit.instanceIdx = instanceIdx;
+				found = true;
+				if (anyHit)
+					return true;
+			}
+		}
+		return false;
+	});
+
+	return found;
+}
+
+template<bool anyHit>
+bool SceneBvh::traverseMesh(const MeshBvh& mesh, const glm::vec3& origin, const glm::vec3& direction, float tMin, BvhHit& hit) const
+{
+	bool found = false;
+	traverseBvh(mesh.bvh, origin, direction, tMin, hit.t, [&](const BvhNode& leaf) {
+		for (uint32_t slot = leaf.leftOrFirst; slot < leaf.leftOrFirst + leaf.count; slot++) {
+			// Moeller-Trumbore, both sides
+			const Triangle& triangle = mesh.triangles[slot];
+			const glm::vec3 p = glm::cross(direction, triangle.e2);
+			const float determinant = glm::dot(triangle.e1, p);
+			if (determinant == 0.0f)
+				continue;
+
+			const float inverseDeterminant = 1.0f / determinant;
+			const glm::vec3 s = origin - triangle.v0;
+			const float u = glm::dot(s, p) * inverseDeterminant;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+
+			const glm::vec3 q = glm::cross(s, triangle.e1);
+			const float v = glm::dot(direction, q) * inverseDeterminant;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+
+			const float t = glm::dot(triangle.e2, q) * inverseDeterminant;
+			if (t <= tMin || t >= hit.t)
+				continue;
+
+			hit.t = t;
+			hit.barycentrics = glm::vec2(u, v);
+			hit.primitiveIdx = mesh.bvh.primitives[slot];
+			found = true;
+			if (anyHit)
+				return true;
+		}
+		return false;
+	});
+
+	return found;
+}
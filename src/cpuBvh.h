@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class Model;
+
+// Traversal stack entries, BvhBuilder keeps the trees at most this deep
+#define BVH_STACK_SIZE 64
+#define BVH_MAX_BIN_COUNT 32
+
+/*
+ * CPU BVH - Traces rays against a Model without ray tracing hardware, e.g. for visibility queries in tools. Two levels like the acceleration
+ * structures: a BVH per mesh over its triangles, which aliased meshes share, and an instance BVH over the instances with their transforms in
+ * instanceData_dynamic.
+ * Both levels are built with a binned SAH (surface area heuristic). A node is split at the bin boundary with the lowest expected cost of a
+ * ray that hits the node, it becomes a leaf when no split is cheaper than testing all of its primitives. Builds run on the ThreadPool: nodes
+ * above subtreeSize primitives are split one after the other with their binning spread over the workers, the subtrees below that, of all
+ * meshes together, are built by one task each, largest first. Nodes that a skewed input pushes close to BVH_STACK_SIZE levels are split at
+ * the median instead, which bounds the depth of the rest of their subtree by log2 of their primitive count.
+ * Hits report the instance and the triangle within its mesh, i.e. gl_InstanceCustomIndexNV and gl_PrimitiveID of the hit shaders, and the
+ * barycentrics of the hit attributes. Triangles are hit from both sides, like the TLAS instances with TRIANGLE_CULL_DISABLE.
+ */
+
+struct BvhBox
+{
+	glm::vec3 min = glm::vec3(FLT_MAX);
+	glm::vec3 max = glm::vec3(-FLT_MAX);
+
+	void grow(const glm::vec3& point)
+	{
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	void grow(const BvhBox& box)
+	{
+		min = glm::min(min, box.min);
+		max = glm::max(max, box.max);
+	}
+
+	glm::vec3 center() const
+	{
+		return 0.5f * (min + max);
+	}
+
+	// 0 for empty boxes
+	float area() const
+	{
+		const glm::vec3 extent = max - min;
+		return extent.x < 0.0f ? 0.0f : 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+};
+
+struct BvhNode
+{
+	glm::vec3 boundsMin;
+	uint32_t leftOrFirst; // inner nodes: the left child, the right one follows it. Leaves: the first slot in Bvh::primitives
+	glm::vec3 boundsMax;
+	uint32_t count; // primitives of a leaf, 0 for inner nodes
+};
+
+struct BvhSettings
+{
+	uint32_t binCount = 16; // at most BVH_MAX_BIN_COUNT
+	uint32_t maxLeafSize = 8; // larger nodes are always split
+	float traversalCost = 1.0f; // of an inner node, relative to intersectionCost
+	float intersectionCost = 1.0f; // of a primitive
+	uint32_t subtreeSize = 4096; // nodes with fewer primitives are built by a single task
+};
+
+// Tree over primitives given by their boxes, the root is nodes[0]. Leaf slots [first, first + count) hold the primitives primitives[slot].
+class Bvh
+{
+public:
+	std::vector<BvhNode> nodes;
+	std::vector<uint32_t> primitives;
+
+	// Expected cost of a ray that hits the root, the sum over the nodes of their area relative to the root times traversalCost for inner
+	// nodes and count * intersectionCost for leaves. Lower is better, comparable between builds of the same primitives.
+	float sahCost(const BvhSettings& settings = BvhSettings()) const;
+
+	uint32_t leafCount() const;
+	uint32_t depth() const;
+};
+
+class BvhBuilder
+{
+public:
+	BvhBuilder(const BvhSettings& settings = BvhSettings()) : settings(settings) {}
+
+	// boxes[i] is the box of primitive i, bvh must stay alive until build() returned
+	void add(Bvh& bvh, std::vector<BvhBox>&& boxes);
+
+	// Builds every tree added since the last call
+	void build();
+
+private:
+	struct Job
+	{
+		Bvh* bvh;
+		std::vector<BvhBox> boxes;
+		std::vector<glm::vec3> centers;
+	};
+
+	// Node below subtreeSize, built into nodes with the subtree root at nodes[0] and spliced into the tree afterwards
+	struct Subtree
+	{
+		uint32_t job;
+		uint32_t node;
+		uint32_t first;
+		uint32_t count;
+		BvhBox centerBounds;
+		uint32_t depth;
+		std::vector<BvhNode> nodes;
+	};
+
+	struct Bin
+	{
+		BvhBox bounds;
+		uint32_t count = 0;
+	};
+
+	struct Split
+	{
+		int axis = -1; // -1 when the centers do not spread out on any axis
+		uint32_t bin = 0; // bins below go left
+		float cost = FLT_MAX; // relative to intersectionCost of a single primitive
+		BvhBox left;
+		BvhBox right;
+		BvhBox leftCenters; // filled by partition()
+		BvhBox rightCenters;
+		uint32_t leftCount = 0;
+	};
+
+	BvhSettings settings;
+	std::vector<Job> jobs;
+
+	Split findSplit(const Job& job, uint32_t first, uint32_t count, const BvhBox& bounds, const BvhBox& centerBounds, bool parallel) const;
+	Split medianSplit(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds) const;
+	void partition(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds, Split& split) const;
+	void binPrimitives(const Job& job, uint32_t first, uint32_t count, const BvhBox& centerBounds, Bin* bins) const;
+	void buildSubtree(const Job& job, Subtree& subtree) const;
+};
+
+struct BvhRay
+{
+	glm::vec3 origin;
+	float tMin = 0.0f;
+	glm::vec3 direction;
+	float tMax = FLT_MAX;
+};
+
+struct BvhHit
+{
+	float t = FLT_MAX; // in units of the ray direction
+	glm::vec2 barycentrics = glm::vec2(0.0f); // weights of the second and third vertex
+	uint32_t instanceIdx = 0xffffffff;
+	uint32_t primitiveIdx = 0xffffffff; // triangle of the mesh
+
+	bool isHit() const
+	{
+		return instanceIdx != 0xffffffff;
+	}
+};
+
+struct BvhBuildStats
+{
+	uint32_t meshBvhCount = 0;
+	uint64_t triangleCount = 0;
+	uint64_t nodeCount = 0;
+	double meshBuildMs = 0.0;
+	double instanceBuildMs = 0.0;
+	float meshSahCost = 0.0f; // average weighted by the triangle counts
+	float instanceSahCost = 0.0f;
+};
+
+class SceneBvh
+{
+public:
+	// Mesh BVHs for every mesh that is not an alias, then the instance BVH
+	void build(const Model& model, const BvhSettings& settings = BvhSettings());
+
+	// Rebuilds the instance BVH after Model::updateMeshData() moved instances, the mesh BVHs are kept
+	void updateInstances(const Model& model);
+
+	// Closest hit in (ray.tMin, ray.tMax)
+	bool intersect(const BvhRay& ray, BvhHit& hit) const;
+
+	// Any hit in (ray.tMin, ray.tMax), for shadow rays
+	bool occluded(const BvhRay& ray) const;
+
+	const BvhBuildStats& getStats() const
+	{
+		return stats;
+	}
+
+	void printReport() const;
+
+private:
+	// Vertices in the order of the leaf slots
+	struct Triangle
+	{
+		glm::vec3 v0;
+		glm::vec3 e1; // v1 - v0
+		glm::vec3 e2; // v2 - v0
+	};
+
+	struct MeshBvh
+	{
+		Bvh bvh;
+		std::vector<Triangle> triangles;
+	};
+
+	struct Instance
+	{
+		glm::mat4 worldToObject;
+		uint32_t meshBvh;
+	};
+
+	BvhSettings settings;
+	BvhBuildStats stats;
+	std::vector<MeshBvh> meshBvhs;
+	std::vector<uint32_t> meshToBvh; // meshBvhs index of each mesh
+	std::vector<Instance> instances;
+	Bvh instanceBvh;
+
+	template<bool anyHit>
+	bool traverse(const BvhRay& ray, BvhHit& hit) const;
+
+	template<bool anyHit>
+	bool traverseMesh(const MeshBvh& mesh, const glm::vec3& origin, const glm::vec3& direction, float tMin, BvhHit& hit) const;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+/*
+ * CPU visibility tests shared by the mesh processing and draw preparation code.
+ * Frustum planes are extracted from a projection matrix with Vulkan clip space conventions (0 <= z <= w), the normals point inwards.
+ * Pass projView * model to test object space bounds against the view frustum.
+ */
+struct Frustum
+{
+	glm::vec4 planes[6]; // left, right, bottom, top, near, far
+
+	Frustum() {}
+
+	Frustum(const glm::mat4& m)
+	{
+		const glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+		const glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+		const glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+		const glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		planes[4] = row2;
+		planes[5] = row3 - row2;
+
+		// Normalized planes give signed distances, which the sphere test needs
+		for (auto& plane : planes) {
+			float length = glm::length(glm::vec3(plane));
+			if (length > 0.0f)
+				plane /= length;
+		}
+	}
+
+	// sphere is center, radius. Conservative, spheres close to a frustum corner may pass.
+	bool intersectsSphere(const glm::vec4& sphere) const
+	{
+		for (const auto& plane : planes)
+			if (glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w < -sphere.w)
+				return false;
+
+		return true;
+	}
+};
+
+// True when every triangle inside the normal cone faces away from cameraPos. The cone is axis, cutoff, see Meshlet in hostDeviceShared.h.
+inline bool isConeBackfacing(const glm::vec4& cone, const glm::vec3& coneApex, const glm::vec3& cameraPos)
+{
+	if (cone.w > 1.0f)
+		return false;
+
+	glm::vec3 view = coneApex - cameraPos;
+	float length = glm::length(view);
+
+	return length > 0.0f && glm::dot(view, glm::vec3(cone)) >= cone.w * length;
+}
+
+// Object space sphere under model, the radius is scaled by the largest axis scale of model
+inline glm::vec4 transformSphere(const glm::mat4& model, const glm::vec4& sphere)
+{
+	float scale = std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))), glm::length(glm::vec3(model[2])));
+
+	return glm::vec4(glm::vec3(model * glm::vec4(glm::vec3(sphere), 1.0f)), sphere.w * scale);
+}
+
+// Smallest sphere enclosing both spheres
+inline glm::vec4 mergeSpheres(const glm::vec4& a, const glm::vec4& b)
+{
+	const glm::vec3 offset = glm::vec3(b) - glm::vec3(a);
+	const float distance = glm::length(offset);
+	if (distance + b.w <= a.w)
+		return a;
+	if (distance + a.w <= b.w)
+		return b;
+
+	const float radius = 0.5f * (distance + a.w + b.w);
+	return glm::vec4(glm::vec3(a) + offset * ((radius - a.w) / distance), radius);
+}
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLOAT_PACKER_SSE2
+#endif
+
+#if defined(__F16C__) || defined(__AVX2__)
+#include <immintrin.h>
+#define FLOAT_PACKER_F16C
+#endif
+
+#include "vulkan/vulkan.h"
+#include "threadPool.h"
+
+/*
+ * Float packer - Converts RGBA32F texels to the smaller float formats of the HDR texture arrays.
+ * VK_FORMAT_R16G16B16A16_SFLOAT: half floats, rounded to nearest even. Denormals, infinities and NaNs are kept, values above the half range
+ * become infinity. Four floats per iteration with F16C or SSE2 (scalar fallback otherwise), all paths give the same bits except NaN payloads.
+ * VK_FORMAT_E5B9G9R9_UFLOAT_PACK32: RGB with a shared exponent as specified by Vulkan, alpha is dropped and samples as 1. Negative values and
+ * NaNs become 0. The mantissas are relative to the largest channel, meant for parameter maps whose channels have similar magnitudes.
+ * unpack() restores RGBA32F, e.g. to measure the error of a conversion.
+ */
+class FloatPacker
+{
+public:
+	static const size_t RANGE_SIZE = 16384; // texels per task of pack() and unpack()
+
+	// Bytes per texel of the formats above, 0 otherwise
+	static size_t texelSize(VkFormat format)
+	{
+		return format == VK_FORMAT_R16G16B16A16_SFLOAT ? 8 : (format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? 4 : 0);
+	}
+
+	static uint16_t floatToHalf(float value)
+	{
+		uint32_t x;
+		memcpy(&x, &value, sizeof(x));
+
+		const uint32_t sign = x & SIGN_MASK;
+		x ^= sign;
+
+		uint32_t half;
+		if (x >= HALF_OVERFLOW)
+			half = x > FLOAT_INFINITY ? 0x7e00 : 0x7c00;
+		else if (x < HALF_NORMAL_MIN) {
+			// The float adder rounds the mantissa to the denormal spacing of half floats
+			float shifted;
+			memcpy(&shifted, &x, sizeof(shifted));
+			shifted += denormMagic();
+			uint32_t bits;
+			memcpy(&bits, &shifted, sizeof(bits));
+			half = bits - DENORM_MAGIC;
+		}
+		else {
+			const uint32_t mantissaOdd = (x >> 13) & 1;
+			half = (x + REBIAS + mantissaOdd) >> 13;
+		}
+
+		return static_cast<uint16_t>(half | (sign >> 16));
+	}
+
+	static float halfToFloat(uint16_t half)
+	{
+		const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+		const uint32_t exponent = (half >> 10) & 0x1f;
+		const uint32_t mantissa = half & 0x3ff;
+
+		if (exponent == 0) {
+			const float value = std::ldexp(static_cast<float>(mantissa), -24);
+			return sign ? -value : value;
+		}
+
+		const uint32_t bits = sign | (exponent == 31 ? 0x7f800000 | (mantissa << 13) : ((exponent + 112) << 23) | (mantissa << 13));
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+
+		return value;
+	}
+
+	static void floatsToHalves(const float* src, uint16_t* dst, size_t count)
+	{
+		size_t i = 0;
+
+#if defined(FLOAT_PACKER_F16C)
+		for (; i + 4 <= count; i += 4)
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#elif defined(FLOAT_PACKER_SSE2)
+		// Same steps as floatToHalf(), the three cases are selected with masks
+		const __m128i signMask = _mm_set1_epi32(static_cast<int32_t>(SIGN_MASK));
+		const __m128i overflowMin = _mm_set1_epi32(HALF_OVERFLOW - 1);
+		const __m128i floatInfinity = _mm_set1_epi32(FLOAT_INFINITY);
+		const __m128i normalMin = _mm_set1_epi32(HALF_NORMAL_MIN);
+		const __m128i denormMagicBits = _mm_set1_epi32(DENORM_MAGIC);
+		const __m128 denormMagicFloat = _mm_set1_ps(denormMagic());
+		const __m128i rebias = _mm_set1_epi32(static_cast<int32_t>(REBIAS));
+		const __m128i one = _mm_set1_epi32(1);
+		const __m128i halfInfinity = _mm_set1_epi32(0x7c00);
+		const __m128i halfNan = _mm_set1_epi32(0x7e00);
+
+		for (; i + 4 <= count; i += 4) {
+			__m128i x = _mm_castps_si128(_mm_loadu_ps(src + i));
+			const __m128i sign = _mm_and_si128(x, signMask);
+			x = _mm_xor_si128(x, sign);
+
+			const __m128i isOverflow = _mm_cmpgt_epi32(x, overflowMin);
+			const __m128i overflow = select(_mm_cmpgt_epi32(x, floatInfinity), halfNan, halfInfinity);
+
+			const __m128i isDenorm = _mm_cmplt_epi32(x, normalMin);
+			const __m128i denorm = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(x), denormMagicFloat)), denormMagicBits);
+
+			const __m128i mantissaOdd = _mm_and_si128(_mm_srli_epi32(x, 13), one);
+			const __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, rebias), mantissaOdd), 13);
+
+			__m128i half = select(isOverflow, overflow, select(isDenorm, denorm, normal));
+			half = _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+
+			// Sign extend, so that the saturating pack keeps the 16 bits as they are
+			half = _mm_srai_epi32(_mm_slli_epi32(half, 16), 16);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(half, half));
+		}
+#endif
+
+		for (; i < count; i++)
+			dst[i] = floatToHalf(src[i]);
+	}
+
+	static void halvesToFloats(const uint16_t* src, float* dst, size_t count)
+	{
+		size_t i = 0;
+
+#ifdef FLOAT_PACKER_F16C
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(dst + i, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i))));
+#endif
+
+		for (; i < count; i++)
+			dst[i] = halfToFloat(src[i]);
+	}
+
+	static uint32_t packSharedExponent(float r, float g, float b)
+	{
+		const float red = clampShared(r);
+		const float green = clampShared(g);
+		const float blue = clampShared(b);
+		const float maxChannel = std::max(red, std::max(green, blue));
+
+		// floor(log2(maxChannel)) is the frexp exponent - 1
+		int maxExponent = -SHARED_BIAS - 1;
+		if (maxChannel > 0.0f) {
+			std::frexp(maxChannel, &maxExponent);
+			maxExponent = std::max(maxExponent - 1, -SHARED_BIAS - 1);
+		}
+
+		int exponent = maxExponent + 1 + SHARED_BIAS;
+		if (static_cast<uint32_t>(std::floor(std::ldexp(maxChannel, SHARED_MANTISSA_BITS + SHARED_BIAS - exponent) + 0.5f)) == (1u << SHARED_MANTISSA_BITS))
+			exponent++;
+
+		auto mantissa = [exponent](float value) {
+			return static_cast<uint32_t>(std::floor(std::ldexp(value, SHARED_MANTISSA_BITS + SHARED_BIAS - exponent) + 0.5f));
+		};
+
+		return mantissa(red) | (mantissa(green) << 9) | (mantissa(blue) << 18) | (static_cast<uint32_t>(exponent) << 27);
+	}
+
+	static void unpackSharedExponent(uint32_t packed, float rgb[3])
+	{
+		const int exponent = static_cast<int>(packed >> 27) - SHARED_BIAS - SHARED_MANTISSA_BITS;
+		for (uint32_t c = 0; c < 3; c++)
+			rgb[c] = std::ldexp(static_cast<float>((packed >> (9 * c)) & 0x1ff), exponent);
+	}
+
+	// texelCount RGBA32F texels to texelCount * texelSize(format) bytes, in parallel on the ThreadPool
+	static void pack(const float* src, size_t texelCount, VkFormat format, void* dst)
+	{
+		ThreadPool::getInstance().parallelFor(texelCount, [&](size_t first, size_t last) {
+			if (format == VK_FORMAT_R16G16B16A16_SFLOAT)
+				floatsToHalves(src + first * 4, static_cast<uint16_t*>(dst) + first * 4, (last - first) * 4);
+			else
+				for (size_t i = first; i < last; i++)
+					static_cast<uint32_t*>(dst)[i] = packSharedExponent(src[i * 4], src[i * 4 + 1], src[i * 4 + 2]);
+		}, RANGE_SIZE);
+	}
+
+	static void unpack(const void* src, size_t texelCount, VkFormat format, float* dst)
+	{
+		ThreadPool::getInstance().parallelFor(texelCount, [&](size_t first, size_t last) {
+			if (format == VK_FORMAT_R16G16B16A16_SFLOAT)
+				halvesToFloats(static_cast<const uint16_t*>(src) + first * 4, dst + first * 4, (last - first) * 4);
+			else
+				for (size_t i = first; i < last; i++) {
+					unpackSharedExponent(static_cast<const uint32_t*>(src)[i], dst + i * 4);
+					dst[i * 4 + 3] = 1.0f;
+				}
+		}, RANGE_SIZE);
+	}
+
+	// Largest difference relative to max(1, |reference|), i.e. absolute for parameters below 1. Channels that can not be stored, alpha of
+	// E5B9G9R9 and values out of the range of the format, are skipped.
+	static float maxRelativeError(const float* reference, const float* test, size_t texelCount, VkFormat format)
+	{
+		const uint32_t channels = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? 3 : 4;
+		const float maxValue = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? SHARED_MAX : 65504.0f;
+		const float minValue = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ? 0.0f : -65504.0f;
+
+		float error = 0.0f;
+		for (size_t i = 0; i < texelCount; i++)
+			for (uint32_t c = 0; c < channels; c++) {
+				const float value = reference[i * 4 + c];
+				if (value >= minValue && value <= maxValue)
+					error = std::max(error, std::abs(test[i * 4 + c] - value) / std::max(1.0f, std::abs(value)));
+			}
+
+		return error;
+	}
+
+	// Checks the half conversions and throws on the first failure:
+	// - Every half survives halfToFloat() and floatToHalf(), NaNs stay NaN.
+	// - Both neighbors of every midpoint between consecutive halves round to the nearer half, the midpoint itself to the even one. This
+	//   covers each rounding boundary of the normal and denormal ranges and of the overflow to infinity at 65520.
+	// - floatsToHalves() and halvesToFloats() of this build (F16C, SSE2 or scalar) give the same bits as the scalar functions.
+	// - pack() and unpack() to R16G16B16A16_SFLOAT stay within 2^-11 relative to max(1, |value|) and E5B9G9R9 within 2^-9 for gray
+	//   values, whose channels share the exponent without loss.
+	static void selfTest()
+	{
+		auto fail = [](const std::string& message) { throw std::runtime_error("FloatPacker: " + message); };
+		auto isNanHalf = [](uint16_t half) { return (half & 0x7c00) == 0x7c00 && (half & 0x3ff) != 0; };
+
+		std::vector<float> values;
+		std::vector<uint16_t> expected;
+		for (uint32_t half = 0; half < 0x10000; half++) {
+			const float value = halfToFloat(static_cast<uint16_t>(half));
+			if (isNanHalf(static_cast<uint16_t>(half)) ? !isNanHalf(floatToHalf(value)) : floatToHalf(value) != half)
+				fail("Half " + std::to_string(half) + " does not survive the round trip.");
+			values.push_back(value);
+			expected.push_back(static_cast<uint16_t>(half));
+
+			// Positive finite halves and their negatives, 0x7bff is the largest one and its upper neighbor is infinity
+			const uint32_t magnitude = half & 0x7fff;
+			if (magnitude >= 0x7c00)
+				continue;
+
+			const float next = magnitude == 0x7bff ? 65536.0f : halfToFloat(static_cast<uint16_t>(magnitude + 1));
+			const float midpoint = 0.5f * (std::abs(value) + next); // exact, halves have at most 11 significant bits
+			const float sign = (half & 0x8000) != 0 ? -1.0f : 1.0f;
+			const uint16_t upper = static_cast<uint16_t>(half + 1);
+			const float candidates[3] = { std::nextafter(midpoint, 0.0f), midpoint, std::nextafter(midpoint, 65536.0f) };
+			const uint16_t rounded[3] = { static_cast<uint16_t>(half), (half & 1) != 0 ? upper : static_cast<uint16_t>(half), upper };
+			for (uint32_t i = 0; i < 3; i++) {
+				if (floatToHalf(sign * candidates[i]) != rounded[i])
+					fail("Float " + std::to_string(sign * candidates[i]) + " is not rounded to the nearest half, ties to even.");
+				values.push_back(sign * candidates[i]);
+				expected.push_back(rounded[i]);
+			}
+		}
+
+		std::vector<uint16_t> halves(values.size());
+		floatsToHalves(values.data(), halves.data(), values.size());
+		for (size_t i = 0; i < values.size(); i++)
+			if (isNanHalf(expected[i]) ? !isNanHalf(halves[i]) : halves[i] != expected[i])
+				fail("floatsToHalves() differs from floatToHalf() for " + std::to_string(values[i]) + ".");
+
+		std::vector<float> floats(halves.size());
+		halvesToFloats(halves.data(), floats.data(), halves.size());
+		for (size_t i = 0; i < halves.size(); i++) {
+			const float scalar = halfToFloat(halves[i]);
+			if (memcmp(&scalar, &floats[i], sizeof(float)) != 0 && !(scalar != scalar && floats[i] != floats[i]))
+				fail("halvesToFloats() differs from halfToFloat().");
+		}
+
+		const size_t texelCount = 100000;
+		std::mt19937 rng(15);
+		std::uniform_real_distribution<float> distribution(-1000.0f, 1000.0f);
+		std::vector<float> texels(texelCount * 4);
+		std::vector<float> gray(texelCount * 4);
+		for (size_t i = 0; i < texels.size(); i++) {
+			texels[i] = distribution(rng);
+			gray[i] = i % 4 == 3 ? 1.0f : std::abs(texels[i - i % 4]);
+		}
+
+		std::vector<uint16_t> packedHalves(texelCount * 4);
+		std::vector<uint32_t> packedShared(texelCount);
+		std::vector<float> unpacked(texelCount * 4);
+		pack(texels.data(), texelCount, VK_FORMAT_R16G16B16A16_SFLOAT, packedHalves.data());
+		unpack(packedHalves.data(), texelCount, VK_FORMAT_R16G16B16A16_SFLOAT, unpacked.data());
+		const float halfError = maxRelativeError(texels.data(), unpacked.data(), texelCount, VK_FORMAT_R16G16B16A16_SFLOAT);
+		if (halfError > 1.0f / 2048.0f)
+			fail("Half texels exceed a relative error of 2^-11.");
+
+		pack(gray.data(), texelCount, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32, packedShared.data());
+		unpack(packedShared.data(), texelCount, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32, unpacked.data());
+		const float sharedError = maxRelativeError(gray.data(), unpacked.data(), texelCount, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32);
+		if (sharedError > 1.0f / 512.0f)
+			fail("Shared exponent gray texels exceed a relative error of 2^-9.");
+
+#if defined(FLOAT_PACKER_F16C)
+		const char* path = "F16C";
+#elif defined(FLOAT_PACKER_SSE2)
+		const char* path = "SSE2";
+#else
+		const char* path = "scalar";
+#endif
+		std::cout << "Half floats - " << values.size() << " values rounded as expected, batch conversion " << path << std::endl;
+		std::cout << "\tR16G16B16A16_SFLOAT: max relative error " << halfError << std::endl;
+		std::cout << "\tE5B9G9R9 gray      : max relative error " << sharedError << std::endl;
+	}
+
+private:
+	static const uint32_t SIGN_MASK = 0x80000000u;
+	static const uint32_t FLOAT_INFINITY = 255u << 23;
+	static const uint32_t HALF_OVERFLOW = (127u + 16u) << 23; // 65536, rounds to infinity from 65520 on through the normal path
+	static const uint32_t HALF_NORMAL_MIN = 113u << 23; // 2^-14
+	static const uint32_t DENORM_MAGIC = ((127u - 15u) + (23u - 10u) + 1u) << 23; // 0.5
+	static const uint32_t REBIAS = (static_cast<uint32_t>(15 - 127) << 23) + 0xfff; // exponent bias and rounding, wraps around
+
+	static const int SHARED_MANTISSA_BITS = 9;
+	static const int SHARED_BIAS = 15;
+	static constexpr float SHARED_MAX = 511.0f / 512.0f * 65536.0f;
+
+	static float denormMagic()
+	{
+		float value;
+		const uint32_t bits = DENORM_MAGIC;
+		memcpy(&value, &bits, sizeof(value));
+
+		return value;
+	}
+
+	static float clampShared(float value)
+	{
+		return value > 0.0f ? std::min(value, SHARED_MAX) : 0.0f;
+	}
+
+#if defined(FLOAT_PACKER_SSE2) && !defined(FLOAT_PACKER_F16C)
+	static __m128i select(const __m128i& mask, const __m128i& a, const __m128i& b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+#endif
+};
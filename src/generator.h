@@ -28,11 +28,21 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 #include "vulkan/vulkan.h"
 #include "helper.h"
+#include "mipGenerator.h"
+#include "blockCompressor.h"
+#include "floatPacker.h"
+#include "cookedTextureCache.h"
+#include "imageDecoder.h"
+#include "../shaders/hostDeviceShared.h"
 #include <string>
 #include <vector>
 #include <map>
+#include <array>
+#include <limits>
+#include <cstring>
 #include <random>
 #include <chrono>
+#include <memory>
 
 class FboManager
 {
@@ -180,35 +190,585 @@ private:
 	}
 };
 
+// Footprint of a texture set uploaded with TextureGenerator::createTextureArrays(), mip chains included
+struct TextureMemoryReport
+{
+	size_t textureCount = 0;
+	size_t constantCount = 0; // single color textures, stored as material constants
+	size_t inlineConstantCount = 0; // distinct colors of addConstant(), never textures
+	size_t bucketCount = 0;
+	VkDeviceSize singleArrayBytes = 0; // every texture resized to the largest one in a single array, uncompressed
+	VkDeviceSize bucketBytes = 0;
+	size_t compressedBucketCount = 0;
+	double minPsnr = std::numeric_limits<double>::infinity(); // of the compressed arrays, only measured when they are cooked
+	size_t packedBucketCount = 0; // RGBA32F arrays stored as half floats or shared exponent RGB
+	float maxPackError = 0.0f; // of the packed arrays, see FloatPacker::maxRelativeError(), only measured when they are cooked
+	uint64_t hostCopies = 0; // of pixels by createTextureArrays(), see PixelBuffer::stats()
+	uint64_t hostCopyBytes = 0;
+	bool cookedCacheHit = false; // the arrays were read from the cooked cache file
+};
+
 class TextureGenerator 
 {
 public:
+	static constexpr uint32_t INLINE_CONSTANT_BIT = 0x80000000u; // of the indices returned by addConstant()
+
 	TextureGenerator(std::string _appName = "")
 	{
 		appName = _appName;
 	}
-	size_t addTexture(Image2d textureImage)
+	size_t addTexture(Image2d&& textureImage)
 	{	
-		textureCache.push_back(textureImage);
+		textureCache.push_back(std::move(textureImage));
 		return textureCache.size();
 	}
 
+	// Image of ImageDecoder::decode(), the slot is reserved right away and the pixels are waited for when they are first needed
+	size_t addTexture(std::future<Image2d> decodedImage)
+	{
+		pendingTextures.push_back({ textureCache.size(), std::move(decodedImage) });
+		textureCache.push_back(Image2d());
+		return textureCache.size();
+	}
+
+	// Moves the decoded images into their slots. Waits for all decodes before throwing, the first error does not leave images behind.
+	void waitForTextures()
+	{
+		std::string error;
+		for (auto& pending : pendingTextures) {
+			try {
+				textureCache[pending.first] = pending.second.get();
+			}
+			catch (const std::exception& e) {
+				error += std::string(e.what()) + "\n";
+			}
+		}
+		pendingTextures.clear();
+
+		CHECK(error.empty(), appName + " TextureGenerator: Failed to decode textures.\n" + error);
+	}
+
+	// Color or parameter that is never a texture, e.g. a material without a texture. Equal colors share an entry. Returns an index with
+	// INLINE_CONSTANT_BIT set, which can be used wherever a texture index is expected; its handle is CONSTANT_TEXTURE.
+	uint32_t addConstant(const glm::vec4& color, bool hdr = false)
+	{
+		const VkFormat format = hdr ? VK_FORMAT_R32G32B32A32_SFLOAT : VK_FORMAT_R8G8B8A8_UNORM;
+		CHECK(inlineConstants.empty() || constantFormat == format, appName + " TextureGenerator: Format for all constants must be same.");
+		constantFormat = format;
+
+		const std::array<float, 4> key = { color.x, color.y, color.z, color.w };
+		auto constant = constantIndices.find(key);
+		if (constant != constantIndices.end())
+			return constant->second;
+
+		CHECK(inlineConstants.size() < INLINE_CONSTANT_BIT, appName + " TextureGenerator: Too many constants.");
+		const uint32_t index = INLINE_CONSTANT_BIT | static_cast<uint32_t>(inlineConstants.size());
+		inlineConstants.push_back(color);
+		constantIndices[key] = index;
+
+		return index;
+	}
+
+	static bool isInlineConstant(size_t textureIdx)
+	{
+		return (textureIdx & INLINE_CONSTANT_BIT) != 0;
+	}
+
+	// A texture or a constant of this generator
+	bool isValid(size_t textureIdx) const
+	{
+		return isInlineConstant(textureIdx) ? (textureIdx & ~static_cast<size_t>(INLINE_CONSTANT_BIT)) < inlineConstants.size() : textureIdx < textureCache.size();
+	}
+
+	// Number of textures, constants are not counted
 	size_t size() const
 	{
 		return textureCache.size();
 	}
 
+	bool empty() const
+	{
+		return textureCache.empty() && inlineConstants.empty();
+	}
+
+	// Colors of addConstant() in the order they were added
+	const std::vector<glm::vec4>& getInlineConstants() const
+	{
+		return inlineConstants;
+	}
+
+	// Pixels are only valid until createTexture() is called. Decoded textures are only there after waitForTextures().
+	const std::vector<Image2d>& getTextures() const
+	{
+		CHECK(pendingTextures.empty(), appName + " TextureGenerator: Textures are still decoding, call waitForTextures() first.");
+		return textureCache;
+	}
+
+	// Filter of the mip chains and of resized textures
+	void setMipSettings(const MipSettings& settings)
+	{
+		mipSettings = settings;
+	}
+
+	// RGBA8 arrays are block compressed with BlockCompressor when the device supports BC formats
+	void setCompression(bool enable)
+	{
+		compression = enable;
+	}
+
+	// Storage of RGBA32F arrays, VK_FORMAT_R32G32B32A32_SFLOAT (default) or a format of FloatPacker. Falls back to RGBA32F when the device can
+	// not sample the format.
+	void setFloatFormat(VkFormat format)
+	{
+		CHECK(format == VK_FORMAT_R32G32B32A32_SFLOAT || FloatPacker::texelSize(format) > 0, appName + " TextureGenerator: Unsupported float texture format.");
+		floatFormat = format;
+	}
+
+	// createTextureArrays() uploads the cooked arrays of this file when they were cooked from the same textures and settings, otherwise it
+	// writes the file. No caching when empty.
+	void setCookedCacheFile(const std::string& path)
+	{
+		cookedCacheFile = path;
+	}
+
 	void createTexture(const VkPhysicalDevice& physicalDevice, const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage& textureImage, VkImageView &textureImageView, VkSampler &sampler, VmaAllocation& textureImageAllocation)
 	{	
+		waitForTextures();
 		fixTextureCache();
-		createTextureImage(physicalDevice, device, allocator, queue, commandPool, textureImage, textureImageAllocation, textureCache[0].mipLevels());
+		createTextureImage(device, allocator, queue, commandPool, textureImage, textureImageAllocation, textureCache[0].mipLevels());
 		textureImageView = createImageView(device, textureImage, textureCache[0].format, VK_IMAGE_ASPECT_COLOR_BIT, textureCache[0].mipLevels(), static_cast<uint32_t>(textureCache.size()));
 		createTextureSampler(device, sampler, textureCache[0].mipLevels());
 	}
+
+	// Groups the textures into at most TEXTURE_BUCKET_COUNT arrays by size and uploads one image per array. Textures with a single color are
+	// not uploaded, their handle is CONSTANT_TEXTURE and getConstant() returns the color. Sizes are only merged, i.e. textures upscaled, when
+	// there are more distinct sizes than arrays. The mip chains are built on the CPU, or taken from the cooked cache file. Pixels are only valid
+	// until this call. Release with cleanUp().
+	void createTextureArrays(const VkPhysicalDevice& physicalDevice, const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool)
+	{
+		if (compression && !supportsBlockCompression(physicalDevice)) {
+			WARN(false, appName + " TextureGenerator: BC formats are not supported, textures are not compressed.");
+			compression = false;
+		}
+
+		if (floatFormat != VK_FORMAT_R32G32B32A32_SFLOAT && !supportsSampledFormat(physicalDevice, floatFormat)) {
+			WARN(false, appName + " TextureGenerator: Float texture format is not supported, textures are stored as RGBA32F.");
+			floatFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
+		}
+
+		std::vector<ImageStaging> staging = cookTextureArrays([&allocator](const TextureBucket& bucket, uint32_t layerCount) {
+			return createImageStaging(allocator, { bucket.width, bucket.height }, bucket.format, layerCount, bucket.mipLevels);
+		});
+
+		uint32_t maxMipLevels = 1;
+		for (size_t i = 0; i < buckets.size(); i++) {
+			TextureBucket& bucket = buckets[i];
+			const uint32_t layerCount = std::max<uint32_t>(static_cast<uint32_t>(bucket.textures.size()), 1);
+			VkExtent2D extent = { bucket.width, bucket.height };
+			uploadImageStaging(device, allocator, queue, commandPool, staging[i], bucket.image, bucket.imageAllocation, extent, VK_IMAGE_USAGE_SAMPLED_BIT, bucket.format,
+				layerCount, bucket.mipLevels);
+			bucket.imageView = createImageView(device, bucket.image, bucket.format, VK_IMAGE_ASPECT_COLOR_BIT, bucket.mipLevels, layerCount);
+			maxMipLevels = std::max(maxMipLevels, bucket.mipLevels);
+		}
+
+		createTextureSampler(device, bucketSampler, maxMipLevels);
+	}
+
+	// createTextureArrays() without a device, for host side checks: the arrays are cooked into heap memory, which stands in for the staging
+	// buffers, and dropped. getMemoryReport() and the cooked cache file are as after createTextureArrays(), and the pixels are released.
+	void cookTextureArraysOnHost()
+	{
+		std::vector<std::unique_ptr<uint8_t[]>> memory;
+		cookTextureArrays([&memory](const TextureBucket& bucket, uint32_t layerCount) {
+			ImageStaging staging;
+			staging.size = layerCount * MipGenerator::chainSize(bucket.width, bucket.height, bucket.mipLevels, bucket.format);
+			memory.emplace_back(new uint8_t[static_cast<size_t>(staging.size)]);
+			staging.data = memory.back().get();
+			return staging;
+		});
+	}
+
+	// bucket << 24 | layer, or CONSTANT_TEXTURE. Valid after createTextureArrays().
+	uint32_t getHandle(size_t textureIdx) const
+	{
+		if (isInlineConstant(textureIdx))
+			return CONSTANT_TEXTURE;
+
+		CHECK(textureIdx < handles.size(), appName + " TextureGenerator: Texture handles have not been assigned.");
+		return handles[textureIdx];
+	}
+
+	// Color of a texture with handle CONSTANT_TEXTURE, normalized for LDR textures
+	glm::vec4 getConstant(size_t textureIdx) const
+	{
+		if (isInlineConstant(textureIdx)) {
+			CHECK(isValid(textureIdx), appName + " TextureGenerator: This constant does not exist.");
+			return inlineConstants[textureIdx & ~static_cast<size_t>(INLINE_CONSTANT_BIT)];
+		}
+
+		CHECK(textureIdx < constants.size(), appName + " TextureGenerator: Texture handles have not been assigned.");
+		return constants[textureIdx];
+	}
+
+	// One entry per bucket slot of the shaders, unused slots repeat the first array
+	std::vector<VkDescriptorImageInfo> getDescriptorImageInfos() const
+	{
+		std::vector<VkDescriptorImageInfo> imageInfos(TEXTURE_BUCKET_COUNT);
+		for (uint32_t i = 0; i < TEXTURE_BUCKET_COUNT; i++) {
+			const TextureBucket& bucket = buckets[i < buckets.size() ? i : 0];
+			imageInfos[i] = { bucketSampler, bucket.imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		}
+
+		return imageInfos;
+	}
+
+	const TextureMemoryReport& getMemoryReport() const
+	{
+		return memoryReport;
+	}
+
+	void printMemoryReport() const
+	{
+		const double mb = 1.0 / (1024.0 * 1024.0);
+		std::cout << appName << " memory - " << memoryReport.textureCount << " textures, " << memoryReport.constantCount << " constant, "
+			<< memoryReport.inlineConstantCount << " inline constants, "
+			<< memoryReport.bucketCount << " arrays: " << memoryReport.bucketBytes * mb << " MB (single array: " << memoryReport.singleArrayBytes * mb << " MB)" << std::endl;
+		if (memoryReport.compressedBucketCount > 0)
+			std::cout << appName << " compression - " << memoryReport.compressedBucketCount << " BC arrays, min PSNR: " << memoryReport.minPsnr << " dB" << std::endl;
+		if (memoryReport.packedBucketCount > 0)
+			std::cout << appName << " packing - " << memoryReport.packedBucketCount << " arrays, max relative error: " << memoryReport.maxPackError << std::endl;
+		const size_t uploadedCount = memoryReport.textureCount - memoryReport.constantCount;
+		if (uploadedCount > 0)
+			std::cout << appName << " host copies - " << static_cast<double>(memoryReport.hostCopies) / uploadedCount << " per texture, "
+				<< memoryReport.hostCopyBytes * mb << " MB" << std::endl;
+	}
+
+	void cleanUp(const VkDevice& device, const VmaAllocator& allocator)
+	{
+		vkDestroySampler(device, bucketSampler, nullptr);
+		bucketSampler = VK_NULL_HANDLE;
+
+		for (auto& bucket : buckets) {
+			vkDestroyImageView(device, bucket.imageView, nullptr);
+			vmaDestroyImage(allocator, bucket.image, bucket.imageAllocation);
+		}
+		buckets.clear();
+	}
 private:
+	// Texture array of one size class
+	struct TextureBucket
+	{
+		uint32_t width;
+		uint32_t height;
+		std::vector<uint32_t> textures; // layer i is texture textures[i]
+		uint32_t mipLevels = 1;
+		VkFormat format = VK_FORMAT_UNDEFINED; // of the array, block compressed when enabled
+		VkImage image = VK_NULL_HANDLE;
+		VmaAllocation imageAllocation = VK_NULL_HANDLE;
+		VkImageView imageView = VK_NULL_HANDLE;
+	};
+
 	std::string appName;
-	std::vector<Image2d> textureCache;
+	std::vector<Image2d> textureCache; // slots of pendingTextures hold empty images until waitForTextures()
+	std::vector<std::pair<size_t, std::future<Image2d>>> pendingTextures; // slot, image
+	std::vector<TextureBucket> buckets;
+	std::vector<uint32_t> handles;
+	std::vector<glm::vec4> constants;
+	std::vector<glm::vec4> inlineConstants;
+	std::map<std::array<float, 4>, uint32_t> constantIndices; // color, index with INLINE_CONSTANT_BIT
+	VkFormat constantFormat = VK_FORMAT_UNDEFINED;
+	VkSampler bucketSampler = VK_NULL_HANDLE;
+	TextureMemoryReport memoryReport;
+	MipSettings mipSettings;
+	std::string cookedCacheFile;
+	bool compression = false;
+	VkFormat floatFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
+
+	// Of the textures, or of the constants when there are none
+	VkFormat arrayFormat() const
+	{
+		return textureCache.empty() ? constantFormat : textureCache[0].format;
+	}
+
+	// Sampled with linear filtering
+	static bool supportsSampledFormat(const VkPhysicalDevice& physicalDevice, VkFormat format)
+	{
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+		const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+
+		return (formatProperties.optimalTilingFeatures & required) == required;
+	}
+
+	static bool supportsBlockCompression(const VkPhysicalDevice& physicalDevice)
+	{
+		VkPhysicalDeviceFeatures features;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+
+		return features.textureCompressionBC && supportsSampledFormat(physicalDevice, VK_FORMAT_BC1_RGB_UNORM_BLOCK) &&
+			supportsSampledFormat(physicalDevice, VK_FORMAT_BC3_UNORM_BLOCK);
+	}
+
+	// True when all pixels are equal to the first one
+	static bool isConstant(const Image2d& image, glm::vec4& color)
+	{
+		const size_t pixelSize = static_cast<size_t>(imageFormatToBytes(image.format));
+		const unsigned char* pixels = static_cast<const unsigned char*>(image.pixels());
+		for (size_t offset = pixelSize; offset < image.sizeInBytes(); offset += pixelSize)
+			if (memcmp(pixels, pixels + offset, pixelSize) != 0)
+				return false;
+
+		if (image.format == VK_FORMAT_R32G32B32A32_SFLOAT)
+			color = glm::vec4(((const float*)pixels)[0], ((const float*)pixels)[1], ((const float*)pixels)[2], ((const float*)pixels)[3]);
+		else
+			color = glm::vec4(pixels[0], pixels[1], pixels[2], pixels[3]) / 255.0f;
+
+		return true;
+	}
+
+	void assignBuckets()
+	{
+		CHECK(!empty(), appName + " TextureGenerator: Provided texture cache is empty");
+		const VkFormat format = arrayFormat();
+		CHECK(format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R32G32B32A32_SFLOAT,
+			appName + " TextureGenerator: Texture arrays support RGBA8 and RGBA32F textures.");
+		CHECK(inlineConstants.empty() || constantFormat == format, appName + " TextureGenerator: Constants must have the format of the textures.");
+
+		handles.assign(textureCache.size(), CONSTANT_TEXTURE);
+		constants.assign(textureCache.size(), glm::vec4(0.0f));
+		memoryReport = TextureMemoryReport();
+		memoryReport.textureCount = textureCache.size();
+		memoryReport.inlineConstantCount = inlineConstants.size();
+
+		uint32_t maxWidth = 0;
+		uint32_t maxHeight = 0;
+		std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> sizeClasses;
+		for (uint32_t i = 0; i < textureCache.size(); i++) {
+			const Image2d& image = textureCache[i];
+			CHECK(image.format == format, appName + " TextureGenerator: Format for all texture images must be same in the texture cache.");
+
+			maxWidth = std::max(maxWidth, image.width);
+			maxHeight = std::max(maxHeight, image.height);
+
+			if (isConstant(image, constants[i]))
+				memoryReport.constantCount++;
+			else
+				sizeClasses[{ image.width, image.height }].push_back(i);
+		}
+
+		buckets.clear();
+		for (const auto& sizeClass : sizeClasses) {
+			TextureBucket bucket;
+			bucket.width = sizeClass.first.first;
+			bucket.height = sizeClass.first.second;
+			bucket.textures = sizeClass.second;
+			buckets.push_back(bucket);
+		}
+
+		// Merge the pair of size classes that wastes the fewest texels, until the classes fit in the descriptor arrays
+		while (buckets.size() > TEXTURE_BUCKET_COUNT) {
+			size_t bestA = 0;
+			size_t bestB = 1;
+			uint64_t bestCost = std::numeric_limits<uint64_t>::max();
+			for (size_t a = 0; a < buckets.size(); a++)
+				for (size_t b = a + 1; b < buckets.size(); b++) {
+					uint64_t width = std::max(buckets[a].width, buckets[b].width);
+					uint64_t height = std::max(buckets[a].height, buckets[b].height);
+					uint64_t cost = (width * height - static_cast<uint64_t>(buckets[a].width) * buckets[a].height) * buckets[a].textures.size() +
+						(width * height - static_cast<uint64_t>(buckets[b].width) * buckets[b].height) * buckets[b].textures.size();
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestA = a;
+						bestB = b;
+					}
+				}
+
+			buckets[bestA].width = std::max(buckets[bestA].width, buckets[bestB].width);
+			buckets[bestA].height = std::max(buckets[bestA].height, buckets[bestB].height);
+			buckets[bestA].textures.insert(buckets[bestA].textures.end(), buckets[bestB].textures.begin(), buckets[bestB].textures.end());
+			buckets.erase(buckets.begin() + bestB);
+		}
+
+		// Textures are resized to the size of their bucket by cookArrays()
+		for (uint32_t bucketIdx = 0; bucketIdx < buckets.size(); bucketIdx++) {
+			TextureBucket& bucket = buckets[bucketIdx];
+			for (uint32_t layer = 0; layer < bucket.textures.size(); layer++)
+				handles[bucket.textures[layer]] = bucketIdx << 24 | layer;
+
+			bucket.mipLevels = bucketMipLevels(bucket);
+			bucket.format = format;
+			if (compression && format == VK_FORMAT_R8G8B8A8_UNORM) {
+				bool opaque = true;
+				for (uint32_t textureIdx : bucket.textures)
+					opaque = opaque && BlockCompressor::isOpaque(textureCache[textureIdx].pixels(), static_cast<size_t>(textureCache[textureIdx].width) * textureCache[textureIdx].height);
+
+				bucket.format = opaque ? VK_FORMAT_BC1_RGB_UNORM_BLOCK : VK_FORMAT_BC3_UNORM_BLOCK;
+				memoryReport.compressedBucketCount++;
+			}
+			else if (format == VK_FORMAT_R32G32B32A32_SFLOAT && floatFormat != format) {
+				bucket.format = floatFormat;
+				memoryReport.packedBucketCount++;
+			}
+
+			memoryReport.bucketBytes += MipGenerator::chainSize(bucket.width, bucket.height, bucket.mipLevels, bucket.format) * bucket.textures.size();
+		}
+
+		if (buckets.empty()) {
+			TextureBucket bucket;
+			bucket.width = 1;
+			bucket.height = 1;
+			bucket.format = format;
+			buckets.push_back(bucket);
+			memoryReport.bucketBytes += imageFormatToBytes(format);
+		}
+
+		memoryReport.bucketCount = buckets.size();
+		if (!textureCache.empty())
+			memoryReport.singleArrayBytes = MipGenerator::chainSize(maxWidth, maxHeight, Image2d::mipLevels(maxWidth, maxHeight), format) * textureCache.size();
+	}
 		
+	// Mip levels of a texture of the bucket size
+	uint32_t bucketMipLevels(const TextureBucket& bucket) const
+	{
+		return Image2d::mipLevels(bucket.width, bucket.height);
+	}
+
+	// Source texels and everything the cooked arrays depend on
+	uint64_t computeCookKey() const
+	{
+		const uint32_t settings[6] = { static_cast<uint32_t>(mipSettings.filter), mipSettings.srgb ? 1u : 0u, compression ? 1u : 0u, static_cast<uint32_t>(floatFormat),
+			TEXTURE_BUCKET_COUNT, static_cast<uint32_t>(textureCache.size()) };
+		uint64_t key = fnv1a(settings, sizeof(settings));
+		for (const auto& image : textureCache) {
+			const uint32_t description[4] = { image.width, image.height, static_cast<uint32_t>(image.format), image.mipLevels() };
+			key = fnv1a(description, sizeof(description), key);
+			key = fnv1a(image.pixels(), image.sizeInBytes(), key);
+		}
+
+		return key;
+	}
+
+	bool matchesBuckets(const std::vector<CookedTextureArray>& arrays) const
+	{
+		if (arrays.size() != buckets.size())
+			return false;
+
+		for (size_t i = 0; i < buckets.size(); i++)
+			if (arrays[i].width != buckets[i].width || arrays[i].height != buckets[i].height || arrays[i].mipLevels != buckets[i].mipLevels ||
+				arrays[i].layerCount != std::max<size_t>(buckets[i].textures.size(), 1) || arrays[i].format != buckets[i].format)
+				return false;
+
+		return true;
+	}
+
+	// Host side of createTextureArrays(): assigns the buckets and fills the staging memory of allocateStaging(bucket, layerCount) for each,
+	// from the cooked cache file or by cookArrays(). Releases the pixels of the textures.
+	template<typename AllocateStaging>
+	std::vector<ImageStaging> cookTextureArrays(AllocateStaging&& allocateStaging)
+	{
+		waitForTextures();
+
+		// Hashed before assignBuckets(), the cache holds the resized textures
+		const uint64_t cookKey = cookedCacheFile.empty() ? 0 : computeCookKey();
+		assignBuckets();
+
+		CookedTextureCache cache(cookedCacheFile);
+		const bool cached = !cookedCacheFile.empty() && cache.load(cookKey) && matchesBuckets(cache.getArrays());
+
+		// The arrays are cooked straight into the staging memory of the upload, so that the pixels are copied once on the host: level 0 into
+		// the mip chain, or the cooked arrays out of the cache file
+		const uint64_t hostCopies = PixelBuffer::stats().hostCopies;
+		const uint64_t hostCopyBytes = PixelBuffer::stats().hostCopyBytes;
+		std::vector<ImageStaging> staging;
+		for (const auto& bucket : buckets)
+			staging.push_back(allocateStaging(bucket, std::max<uint32_t>(static_cast<uint32_t>(bucket.textures.size()), 1)));
+
+		if (cached) {
+			for (size_t i = 0; i < buckets.size(); i++) {
+				memcpy(staging[i].data, cache.getArrays()[i].data, static_cast<size_t>(staging[i].size));
+				PixelBuffer::countCopies(cache.getArrays()[i].layerCount, staging[i].size);
+			}
+		}
+		else {
+			auto start = std::chrono::high_resolution_clock::now();
+			std::vector<CookedTextureArray> cookedArrays = cookArrays(staging);
+			std::cout << appName << " mip chains: " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+
+			if (!cookedCacheFile.empty())
+				cache.save(cookKey, cookedArrays);
+		}
+
+		for (auto& texture : textureCache)
+			texture.cleanUp();
+
+		memoryReport.hostCopies = PixelBuffer::stats().hostCopies - hostCopies;
+		memoryReport.hostCopyBytes = PixelBuffer::stats().hostCopyBytes - hostCopyBytes;
+		memoryReport.cookedCacheHit = cached;
+
+		return staging;
+	}
+
+	// Resizes the textures to their bucket and builds the mip chains of all arrays into staging[i], compressed when the bucket format is a BC
+	// format and packed when it is a format of FloatPacker. The errors are measured on the staging memory. The returned arrays point into it.
+	std::vector<CookedTextureArray> cookArrays(const std::vector<ImageStaging>& staging)
+	{
+		waitForTextures();
+
+		const VkFormat format = arrayFormat();
+		std::vector<CookedTextureArray> arrays(buckets.size());
+
+		for (size_t i = 0; i < buckets.size(); i++) {
+			const TextureBucket& bucket = buckets[i];
+			std::vector<const void*> layerData;
+			for (uint32_t textureIdx : bucket.textures) {
+				// Resizing keeps the texture coordinates valid, even across aspect ratios
+				Image2d& image = textureCache[textureIdx];
+				if (image.width != bucket.width || image.height != bucket.height)
+					image.resize(bucket.width, bucket.height, mipSettings);
+
+				layerData.push_back(image.pixels());
+			}
+
+			// Only when every texture is constant, the descriptors still need an image
+			const float whiteHdr[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+			const unsigned char whiteLdr[4] = { 255, 255, 255, 255 };
+			if (layerData.empty())
+				layerData.push_back(format == VK_FORMAT_R32G32B32A32_SFLOAT ? static_cast<const void*>(whiteHdr) : static_cast<const void*>(whiteLdr));
+
+			const uint32_t layerCount = static_cast<uint32_t>(layerData.size());
+			const size_t levelZeroBytes = MipGenerator::levelSize(bucket.width, bucket.height, 0, format);
+			PixelBuffer::countCopies(layerCount, layerCount * levelZeroBytes); // level 0 of each layer, by MipGenerator::generate()
+
+			if (bucket.format == format)
+				MipGenerator::generate(layerData, bucket.width, bucket.height, format, bucket.mipLevels, mipSettings, staging[i].data);
+			else {
+				std::vector<uint8_t> mipChains(layerCount * MipGenerator::chainSize(bucket.width, bucket.height, bucket.mipLevels, format));
+				MipGenerator::generate(layerData, bucket.width, bucket.height, format, bucket.mipLevels, mipSettings, mipChains.data());
+
+				if (FloatPacker::texelSize(bucket.format) > 0) {
+					const size_t texelCount = mipChains.size() / MipGenerator::texelSize(format);
+					FloatPacker::pack(reinterpret_cast<const float*>(mipChains.data()), texelCount, bucket.format, staging[i].data);
+
+					std::vector<float> decoded(texelCount * 4);
+					FloatPacker::unpack(staging[i].data, texelCount, bucket.format, decoded.data());
+					memoryReport.maxPackError = std::max(memoryReport.maxPackError,
+						FloatPacker::maxRelativeError(reinterpret_cast<const float*>(mipChains.data()), decoded.data(), texelCount, bucket.format));
+				}
+				else {
+					BlockCompressor::compressChains(mipChains.data(), bucket.width, bucket.height, bucket.mipLevels, layerCount, bucket.format, staging[i].data);
+
+					std::vector<uint8_t> decoded(mipChains.size());
+					BlockCompressor::decompressChains(staging[i].data, bucket.width, bucket.height, bucket.mipLevels, layerCount, bucket.format, decoded.data());
+					memoryReport.minPsnr = std::min(memoryReport.minPsnr, BlockCompressor::psnr(mipChains.data(), decoded.data(), mipChains.size()));
+				}
+			}
+
+			arrays[i] = { bucket.width, bucket.height, layerCount, bucket.mipLevels, bucket.format, staging[i].data };
+		}
+
+		return arrays;
+	}
+
 	void fixTextureCache()
 	{
 		CHECK(!textureCache.empty(), appName + " TextureGenerator: Provided texture cache is empty");
@@ -239,7 +799,7 @@ private:
 
 		for (auto& image : textureCache)
 			if (image.width != maxWidth || image.height != maxHeight)
-				image.resize(maxWidth, maxHeight);
+				image.resize(maxWidth, maxHeight, mipSettings);
 
 		// check size and mipLevels of all images are same
 		uint32_t mipLevels = textureCache[0].mipLevels();
@@ -251,115 +811,26 @@ private:
 		}
 	}
 
-	void createTextureImage(const VkPhysicalDevice& physicalDevice, const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage &textureImage, VmaAllocation &textureImageAllocation, uint32_t mipLevels)
+	void createTextureImage(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage &textureImage, VmaAllocation &textureImageAllocation, uint32_t mipLevels)
 	{	
 		std::vector<const void*> layerData;
 		VkExtent2D extent = { textureCache[0].width,  textureCache[0].height };
+		VkFormat format = textureCache[0].format;
 
 		for (auto& texture : textureCache)
-			layerData.push_back(texture.pixels);
-						
-		createImageD(device, allocator, queue, commandPool, textureImage, textureImageAllocation, extent, VK_IMAGE_USAGE_SAMPLED_BIT, layerData, textureCache[0].format, VK_SAMPLE_COUNT_1_BIT, mipLevels);
-		
-		for (auto& texture : textureCache)
-			texture.cleanUp();
-				
-		generateMipmaps(physicalDevice, device, queue, commandPool, textureImage,
-			textureCache[0].format, extent, mipLevels, static_cast<uint32_t>(textureCache.size()));
-	}
-	
-	void generateMipmaps(const VkPhysicalDevice& physicalDevice, const VkDevice& device, const VkQueue& queue, const VkCommandPool& commandPool,
-		VkImage image, VkFormat imageFormat, VkExtent2D extent, uint32_t mipLevels, uint32_t layerCount)
-	{
-		if (mipLevels == 1) {
-			transitionImageLayout(device, queue, commandPool, image, imageFormat,
-				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mipLevels, layerCount);
-			return;
-		}
+			layerData.push_back(texture.pixels());
 
-		// Check if image format supports linear blitting
-		VkFormatProperties formatProperties;
-		vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
+		// The mip chains are built in the staging memory, level 0 is the only host copy
+		CHECK(MipGenerator::texelSize(format) > 0, appName + " TextureGenerator: Texture image format is unsupported.");
+		ImageStaging staging = createImageStaging(allocator, extent, format, static_cast<uint32_t>(layerData.size()), mipLevels);
+		MipGenerator::generate(layerData, extent.width, extent.height, format, mipLevels, mipSettings, staging.data);
+		PixelBuffer::countCopies(layerData.size(), layerData.size() * MipGenerator::levelSize(extent.width, extent.height, 0, format));
 
-		CHECK((formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT),
-			appName + " TextureGenerator: texture image format does not support linear blitting!");
-		
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands(device, commandPool);
-
-		VkImageMemoryBarrier barrier = {};
-		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrier.image = image;
-		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrier.subresourceRange.baseArrayLayer = 0;
-		barrier.subresourceRange.layerCount = layerCount;
-		barrier.subresourceRange.levelCount = 1;
-
-		int32_t mipWidth = extent.width;
-		int32_t mipHeight = extent.height;
-
-		for (uint32_t i = 1; i < mipLevels; i++) {
-			barrier.subresourceRange.baseMipLevel = i - 1;
-			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-			barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-			vkCmdPipelineBarrier(commandBuffer,
-				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-				0, nullptr,
-				0, nullptr,
-				1, &barrier);
-
-			VkImageBlit blit = {};
-			blit.srcOffsets[0] = { 0, 0, 0 };
-			blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
-			blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-			blit.srcSubresource.mipLevel = i - 1;
-			blit.srcSubresource.baseArrayLayer = 0;
-			blit.srcSubresource.layerCount = layerCount;
-			blit.dstOffsets[0] = { 0, 0, 0 };
-			blit.dstOffsets[1] = { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
-			blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-			blit.dstSubresource.mipLevel = i;
-			blit.dstSubresource.baseArrayLayer = 0;
-			blit.dstSubresource.layerCount = layerCount;
-
-			vkCmdBlitImage(commandBuffer,
-				image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-				image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-				1, &blit,
-				VK_FILTER_LINEAR);
-
-			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-			barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-			vkCmdPipelineBarrier(commandBuffer,
-				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-				0, nullptr,
-				0, nullptr,
-				1, &barrier);
-
-			if (mipWidth > 1) mipWidth /= 2;
-			if (mipHeight > 1) mipHeight /= 2;
-		}
-
-		barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-		vkCmdPipelineBarrier(commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrier);
+		for (auto& texture : textureCache)
+			texture.cleanUp();
 
-		endSingleTimeCommands(device, queue, commandPool, commandBuffer);
+		uploadImageStaging(device, allocator, queue, commandPool, staging, textureImage, textureImageAllocation, extent, VK_IMAGE_USAGE_SAMPLED_BIT, format,
+			static_cast<uint32_t>(layerData.size()), mipLevels);
 	}
 
 	void createTextureSampler(const VkDevice& device, VkSampler& sampler, uint32_t mipLevels)
@@ -396,26 +867,32 @@ public:
 	}
 	void bindBuffer(VkDescriptorSetLayoutBinding layout, VkDescriptorBufferInfo bufferInfo) 
 	{
-		VkDescriptorImageInfo imageInfo = {};
 		VkWriteDescriptorSetAccelerationStructureNV tlasInfo = {};
 		bindings.push_back(layout);
-		descriptorTypeInfo.push_back({ bufferInfo, imageInfo, tlasInfo, TYPE_BUFFER });
+		descriptorTypeInfo.push_back({ bufferInfo, {}, tlasInfo, TYPE_BUFFER });
 	}
 
 	void bindImage(VkDescriptorSetLayoutBinding layout, VkDescriptorImageInfo imageInfo) 
 	{
+		bindImages(layout, { imageInfo });
+	}
+
+	// Array binding, one image info per array element
+	void bindImages(VkDescriptorSetLayoutBinding layout, const std::vector<VkDescriptorImageInfo>& imageInfos)
+	{
+		CHECK(imageInfos.size() == layout.descriptorCount, appName + " DescriptorSetGenerator: Image count must match the descriptor count of the binding.");
+
 		VkDescriptorBufferInfo bufferInfo = {};
 		VkWriteDescriptorSetAccelerationStructureNV tlasInfo = {};
 		bindings.push_back(layout);
-		descriptorTypeInfo.push_back({ bufferInfo, imageInfo, tlasInfo, TYPE_IMAGE });
+		descriptorTypeInfo.push_back({ bufferInfo, imageInfos, tlasInfo, TYPE_IMAGE });
 	}
 
 	void bindTLAS(VkDescriptorSetLayoutBinding layout, VkWriteDescriptorSetAccelerationStructureNV tlasInfo) 
 	{
 		VkDescriptorBufferInfo bufferInfo = {};
-		VkDescriptorImageInfo imageInfo = {};
 		bindings.push_back(layout);
-		descriptorTypeInfo.push_back({ bufferInfo, imageInfo, tlasInfo, TYPE_TLAS });
+		descriptorTypeInfo.push_back({ bufferInfo, {}, tlasInfo, TYPE_TLAS });
 	}
 
 	void generateDescriptorSet(const VkDevice &device, VkDescriptorSetLayout* layout, VkDescriptorPool* descriptorPool, VkDescriptorSet* descriptorSets, uint32_t maxSets = 1) 
@@ -445,7 +922,7 @@ private:
 	struct DescriptorTypeInfo 
 	{
 		VkDescriptorBufferInfo bufferInfo;
-		VkDescriptorImageInfo imageInfo;
+		std::vector<VkDescriptorImageInfo> imageInfos;
 		VkWriteDescriptorSetAccelerationStructureNV tlasInfo;
 		DESCRIPTOR_TYPE type;
 	};
@@ -470,7 +947,7 @@ private:
 		for (auto& binding : bindings) {
 			VkDescriptorPoolSize poolSize;
 			poolSize.type = binding.descriptorType;
-			poolSize.descriptorCount = maxSets;
+			poolSize.descriptorCount = binding.descriptorCount * maxSets;
 			poolSizes.push_back(poolSize);
 		}
 
@@ -508,7 +985,7 @@ private:
 			if (descriptorTypeInfo[i].type == TYPE_BUFFER)
 				write.pBufferInfo = &descriptorTypeInfo[i].bufferInfo;
 			else if (descriptorTypeInfo[i].type == TYPE_IMAGE)
-				write.pImageInfo = &descriptorTypeInfo[i].imageInfo;
+				write.pImageInfo = descriptorTypeInfo[i].imageInfos.data();
 			else if (descriptorTypeInfo[i].type == TYPE_TLAS)
 				write.pNext = &descriptorTypeInfo[i].tlasInfo;
 			else
@@ -2,6 +2,7 @@
 #include "vk_mem_alloc.h"
 
 #include <array>
+#include <cstring>
 
 extern std::vector<char> readFile(const std::string& filename) 
 {
@@ -36,6 +37,8 @@ extern VkPhysicalDeviceFeatures checkSupportedDeviceFeatures(const VkPhysicalDev
 			vk_requiredFeatures.drawIndirectFirstInstance = VK_TRUE;
 		else if (std::strcmp(requiredFeature, "shaderStorageImageExtendedFormats") == 0 && supportedFeatures.shaderStorageImageExtendedFormats)
 			vk_requiredFeatures.shaderStorageImageExtendedFormats = VK_TRUE;
+		else if (std::strcmp(requiredFeature, "textureCompressionBC") == 0) // optional, textures stay uncompressed without it
+			vk_requiredFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
 		else
 			CHECK(false, std::string("physical device feature '") + requiredFeature + "' not found or unsupported!");
 	}
@@ -367,6 +370,88 @@ extern void createImageD(const VkDevice& device, const VmaAllocator& allocator,
 	vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferAllocation);
 }
 
+extern void createImageM(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage& image, VmaAllocation& imageAllocation,
+	const VkExtent2D& extent, const VkImageUsageFlags& usage, const void* srcData, const VkFormat format, const uint32_t layers, const uint32_t mipLevels)
+{
+	CHECK_DBG_ONLY(layers > 0 && srcData != nullptr, "createImageM: data source cannot be null.");
+
+	ImageStaging staging = createImageStaging(allocator, extent, format, layers, mipLevels);
+	PixelBuffer::copy(staging.data, srcData, static_cast<size_t>(staging.size));
+	uploadImageStaging(device, allocator, queue, commandPool, staging, image, imageAllocation, extent, usage, format, layers, mipLevels);
+}
+
+extern ImageStaging createImageStaging(const VmaAllocator& allocator, const VkExtent2D& extent, const VkFormat format, const uint32_t layers, const uint32_t mipLevels)
+{
+	CHECK_DBG_ONLY(layers > 0, "createImageStaging: image needs at least one layer.");
+
+	const VkDeviceSize layerSizeBytes = MipGenerator::chainSize(extent.width, extent.height, mipLevels, format);
+	CHECK(layerSizeBytes > 0, "createImageStaging: Image format is unsupported.");
+
+	ImageStaging staging;
+	staging.size = layers * layerSizeBytes;
+	staging.data = static_cast<uint8_t*>(createBuffer(allocator, staging.buffer, staging.allocation, staging.size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT));
+
+	return staging;
+}
+
+extern void uploadImageStaging(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, ImageStaging& staging, VkImage& image,
+	VmaAllocation& imageAllocation, const VkExtent2D& extent, const VkImageUsageFlags& usage, const VkFormat format, const uint32_t layers, const uint32_t mipLevels)
+{
+	const VkDeviceSize layerSizeBytes = MipGenerator::chainSize(extent.width, extent.height, mipLevels, format);
+	CHECK(staging.data != nullptr && staging.size == layers * layerSizeBytes, "uploadImageStaging: Staging memory does not match the image.");
+
+	VkImageCreateInfo imageCreateInfo = {};
+	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.extent.width = extent.width;
+	imageCreateInfo.extent.height = extent.height;
+	imageCreateInfo.extent.depth = 1;
+	imageCreateInfo.mipLevels = mipLevels;
+	imageCreateInfo.arrayLayers = layers;
+	imageCreateInfo.format = format;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | usage;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo allocCreateInfo = {};
+	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(allocator, &imageCreateInfo, &allocCreateInfo, &image, &imageAllocation, nullptr),
+		"Failed to create image!");
+
+	// One region per layer and level, the levels of a layer are tightly packed
+	std::vector<VkBufferImageCopy> bufferCopyRegions;
+	for (uint32_t layer = 0; layer < layers; layer++) {
+		VkDeviceSize offset = layer * layerSizeBytes;
+		for (uint32_t level = 0; level < mipLevels; level++) {
+			VkExtent2D levelExtent = MipGenerator::levelExtent(extent.width, extent.height, level);
+
+			VkBufferImageCopy bufferCopyRegion = {};
+			bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			bufferCopyRegion.imageSubresource.mipLevel = level;
+			bufferCopyRegion.imageSubresource.baseArrayLayer = layer;
+			bufferCopyRegion.imageSubresource.layerCount = 1;
+			bufferCopyRegion.imageExtent.width = levelExtent.width;
+			bufferCopyRegion.imageExtent.height = levelExtent.height;
+			bufferCopyRegion.imageExtent.depth = 1;
+			bufferCopyRegion.bufferOffset = offset;
+			bufferCopyRegions.push_back(bufferCopyRegion);
+
+			offset += MipGenerator::levelSize(extent.width, extent.height, level, format);
+		}
+	}
+
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands(device, commandPool);
+	cmdTransitionImageLayout(commandBuffer, image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, layers);
+	vkCmdCopyBufferToImage(commandBuffer, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(bufferCopyRegions.size()), bufferCopyRegions.data());
+	cmdTransitionImageLayout(commandBuffer, image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mipLevels, layers);
+	endSingleTimeCommands(device, queue, commandPool, commandBuffer);
+
+	vmaDestroyBuffer(allocator, staging.buffer, staging.allocation);
+	staging = ImageStaging();
+}
+
 extern VkImageView createImageView(const VkDevice& device, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels, uint32_t layerCount) 
 {
 	VkImageViewCreateInfo viewInfo = {};
@@ -613,4 +698,25 @@ extern inline glm::vec3 cartesianToSpherical(const glm::vec3& cartesian)
 {	
 	float phi = atan2(cartesian.y, cartesian.x);
 	return glm::vec3(glm::length(cartesian), atan2(glm::length(glm::vec2(cartesian)), cartesian.z), phi >= 0 ? phi : 2 * PI + phi);
-}
\ No newline at end of file
+}
+
+extern uint64_t fnv1a(const void* data, size_t sizeInBytes, uint64_t seed)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	uint64_t hash = seed;
+
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= sizeInBytes; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001b3ull;
+	}
+
+	for (; i < sizeInBytes; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
@@ -15,6 +15,9 @@
 #include "imgui.h"
 #include <glm/glm.hpp>
 
+#include "mipGenerator.h"
+#include "pixelBuffer.h"
+
 #define ROOT std::string("D:/projects/Rayster")
 
 #ifndef NDEBUG
@@ -95,9 +98,11 @@ struct SwapChainSupportDetails {
 	std::vector<VkPresentModeKHR> presentModes;
 };
 
+VkDeviceSize imageFormatToBytes(VkFormat format);
+
+// Move only, the pixels are owned by a PixelBuffer
 struct Image2d
 {
-	void* pixels = nullptr;
 	uint32_t width = 0;
 	uint32_t height = 0;
 	VkFormat format = VK_FORMAT_UNDEFINED;
@@ -108,103 +113,116 @@ struct Image2d
 		if (forceMipLevelToOne)
 			return 1;
 
-		if (format == VK_FORMAT_R32G32B32A32_SFLOAT)
-			return 1;
+		return mipLevels(width, height);
+	}
 
+	static uint32_t mipLevels(uint32_t width, uint32_t height)
+	{
 		return static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
 	}
 
 	Image2d(const std::string texturePath)
 	{
 		int texChannels, iWidth, iHeight;
-		pixels = stbi_load(texturePath.c_str(), &iWidth, &iHeight, &texChannels, STBI_rgb_alpha);
-		CHECK(pixels, "Image2d : Failed to load texture image - " + texturePath);
+		void* decoded = stbi_load(texturePath.c_str(), &iWidth, &iHeight, &texChannels, STBI_rgb_alpha);
+		CHECK(decoded, "Image2d : Failed to load texture image - " + texturePath);
 		
 		width = static_cast<uint32_t> (iWidth);
 		height = static_cast<uint32_t> (iHeight);
 		format = VK_FORMAT_R8G8B8A8_UNORM;
 		path = texturePath;
+		buffer = PixelBuffer::adoptStb(decoded, sizeInBytes());
 	}
 
+	Image2d(const Image2d&) = delete;
+	Image2d& operator=(const Image2d&) = delete;
+	Image2d(Image2d&&) = default;
+	Image2d& operator=(Image2d&&) = default;
+
+	// Null afterwards
 	void cleanUp()
 	{	
-		if (!externalAlocation)
-			stbi_image_free(pixels);
+		buffer.reset();
 	}
 
+	// Small images come from PixelPool
 	Image2d(uint32_t width = 1, uint32_t height = 1, glm::vec4 color = glm::vec4(1.0f), bool hdr = false)
 	{
 		this->width = width;
 		this->height = height;
-		if (hdr) {
-			format = VK_FORMAT_R32G32B32A32_SFLOAT;
-			pixels = new float[(size_t)width * height * 4];
+		format = hdr ? VK_FORMAT_R32G32B32A32_SFLOAT : VK_FORMAT_R8G8B8A8_UNORM;
+		buffer = PixelBuffer::allocate(sizeInBytes());
 
+		if (hdr) {
 			for (size_t i = 0; i < width * height * 4; i += 4) {
-				((float*)pixels)[i] = color.x;
-				((float*)pixels)[i + 1] = color.y;
-				((float*)pixels)[i + 2] = color.z;
-				((float*)pixels)[i + 3] = color.w;
+				((float*)pixels())[i] = color.x;
+				((float*)pixels())[i + 1] = color.y;
+				((float*)pixels())[i + 2] = color.z;
+				((float*)pixels())[i + 3] = color.w;
 			}
 		}
 		else {
-			format = VK_FORMAT_R8G8B8A8_UNORM;
-			pixels = new unsigned char[(size_t)width * height * 4];
-
 			auto floatToUint8 = [](float a)
 			{
 				return static_cast<unsigned char>(static_cast<uint32_t>(a * 255) & 0xff);
 			};
 
 			for (size_t i = 0; i < width * height * 4; i += 4) {
-				((unsigned char*)pixels)[i] = floatToUint8(color.x);
-				((unsigned char*)pixels)[i + 1] = floatToUint8(color.y);
-				((unsigned char*)pixels)[i + 2] = floatToUint8(color.z);
-				((unsigned char*)pixels)[i + 3] = floatToUint8(color.w);
+				((unsigned char*)pixels())[i] = floatToUint8(color.x);
+				((unsigned char*)pixels())[i + 1] = floatToUint8(color.y);
+				((unsigned char*)pixels())[i + 2] = floatToUint8(color.z);
+				((unsigned char*)pixels())[i + 3] = floatToUint8(color.w);
 			}
 		}
 
 		path = "";
 	}
 
-	void resize(uint32_t newWidth, uint32_t newHeight)
+	// Copy of raw pixels
+	Image2d(uint32_t width, uint32_t height, VkFormat format, const void* srcData)
 	{
-		if (format == VK_FORMAT_R8G8B8A8_UNORM) {
-			void* newPixels = new unsigned char[(size_t)newWidth * newHeight * 4];
-			CHECK(stbir_resize_uint8((const unsigned char*)pixels, width, height, 0, (unsigned char *)newPixels, newWidth, newHeight, 0, 4) > 0,
-				"Image2d: Failed to resize image.");
-
-			if (!externalAlocation)
-				stbi_image_free(pixels);
-			else
-				WARN(false, "Image2d: Memory for image - " + path + " is allocated by user. Cannot free memory for resize.");
-				
-			pixels = newPixels;
-			
-			width = newWidth;
-			height = newHeight;
-
-			externalAlocation = false;
-		}
-		else if (format == VK_FORMAT_R32G32B32A32_SFLOAT) {
-			void* newPixels = new float[(size_t)newWidth * newHeight * 4];
-			CHECK (stbir_resize_float((const float*)pixels, width, height, 0, (float *)newPixels, newWidth, newHeight, 0, 4) >0,
-				"Image2d: Failed to resize image.");
-			
-			if (!externalAlocation)
-				stbi_image_free(pixels);
-			else
-				WARN(false, "Image2d: Memory for image - " + path + " is allocated by user. Cannot free memory for resize.");
-
-			pixels = newPixels;
-
-			width = newWidth;
-			height = newHeight;
-
-			externalAlocation = false;
-		}
-		else
-			CHECK(false, "Image2d: Failed to resize image. Format is unsupported.");
+		this->width = width;
+		this->height = height;
+		this->format = format;
+		buffer = PixelBuffer::copyOf(srcData, sizeInBytes());
+
+		path = "";
+	}
+
+	// Takes the pixels without a copy, e.g. a PixelBuffer::share() of a memory mapped scene cache
+	Image2d(uint32_t width, uint32_t height, VkFormat format, PixelBuffer&& pixelBuffer)
+	{
+		this->width = width;
+		this->height = height;
+		this->format = format;
+		CHECK(pixelBuffer.size() == sizeInBytes(), "Image2d : Size of the pixel buffer does not match the image.");
+		buffer = std::move(pixelBuffer);
+
+		path = "";
+	}
+
+	// Read only when the pixels are shared
+	void* pixels() const
+	{
+		return buffer.data();
+	}
+
+	size_t sizeInBytes() const
+	{
+		return (size_t)width * height * imageFormatToBytes(format);
+	}
+
+	// Resampled with MipGenerator, the settings must match the ones of the mip chain
+	void resize(uint32_t newWidth, uint32_t newHeight, const MipSettings& settings = MipSettings())
+	{
+		CHECK(MipGenerator::texelSize(format) > 0, "Image2d: Failed to resize image. Format is unsupported.");
+
+		PixelBuffer resized = PixelBuffer::allocate((size_t)newWidth * newHeight * MipGenerator::texelSize(format));
+		MipGenerator::resize(pixels(), width, height, resized.data(), newWidth, newHeight, format, settings);
+		buffer = std::move(resized);
+
+		width = newWidth;
+		height = newHeight;
 	}
 
 	// This is specific to ImGui fonts
@@ -220,18 +238,17 @@ struct Image2d
 		int textHeight;
 		io.Fonts->GetTexDataAsRGBA32(&fontData, &textWidth, &textHeight);
 		
-		pixels = static_cast<void*>(fontData);
 		width = static_cast<uint32_t>(textWidth);
 		height = static_cast<uint32_t>(textHeight);
 		format = VK_FORMAT_R8G8B8A8_UNORM;
+		buffer = PixelBuffer::borrow(fontData, sizeInBytes());
 
 		this->forceMipLevelToOne = forceMipLevelToOne;
-		this->externalAlocation = true;
 
 		path = "";
 	}
 private:
-	bool externalAlocation = false;
+	PixelBuffer buffer;
 	bool forceMipLevelToOne = false;
 };
 
@@ -247,12 +264,14 @@ VkFormat findSupportedFormat(VkPhysicalDevice& physicalDevice, const std::vector
 VkFormat findDepthFormat(VkPhysicalDevice& physicalDevice);
 SwapChainSupportDetails querySwapChainSupport(const VkPhysicalDevice& device, const VkSurfaceKHR& surface);
 QueueFamilyIndices findQueueFamilies(const VkPhysicalDevice& device, const VkSurfaceKHR& surface);
-VkDeviceSize imageFormatToBytes(VkFormat format);
 uint32_t queryComputeSharedMemSize(const VkPhysicalDevice& device);
 //(r, theta, phi) -> (x, y, z)
 glm::vec3 sphericalToCartesian(const glm::vec3&);
 //(x, y, z) -> (r, theta, phi)
 glm::vec3 cartesianToSpherical(const glm::vec3&);
+// FNV-1a over 64 bit words, the tail bytes are hashed one by one. Pass the previous result as seed to hash data in pieces, the result equals
+// one call over all of it when every piece but the last is a multiple of 8 bytes.
+uint64_t fnv1a(const void* data, size_t sizeInBytes, uint64_t seed = 0xcbf29ce484222325ull);
 
 /* 
  * Image and buffer management functions
@@ -270,6 +289,21 @@ void createImageP(const VkDevice& device, const VmaAllocator& allocator, const V
 void createImageD(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage& image, VmaAllocation& imageAllocation,
 	const VkExtent2D& extent, const VkImageUsageFlags& usage, const std::vector<const void*>& srcData, const VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT, 
 	const VkSampleCountFlagBits& sampleCount = VK_SAMPLE_COUNT_1_BIT, const uint32_t mipLevels = 1);
+// create sampled image with every mip level initialized. srcData holds layer after layer the complete mip chain, see MipGenerator. Layout is SHADER_READ_ONLY_OPTIMAL afterwards.
+void createImageM(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkImage& image, VmaAllocation& imageAllocation,
+	const VkExtent2D& extent, const VkImageUsageFlags& usage, const void* srcData, const VkFormat format, const uint32_t layers, const uint32_t mipLevels);
+// Mapped staging memory for the mip chains of an image, lets the data be built in place instead of being copied in by createImageM()
+struct ImageStaging
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VmaAllocation allocation = VK_NULL_HANDLE;
+	uint8_t* data = nullptr; // layer after layer the complete mip chain, see MipGenerator
+	VkDeviceSize size = 0;
+};
+ImageStaging createImageStaging(const VmaAllocator& allocator, const VkExtent2D& extent, const VkFormat format, const uint32_t layers, const uint32_t mipLevels);
+// create sampled image from the filled staging memory like createImageM() and release the staging buffer
+void uploadImageStaging(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, ImageStaging& staging, VkImage& image,
+	VmaAllocation& imageAllocation, const VkExtent2D& extent, const VkImageUsageFlags& usage, const VkFormat format, const uint32_t layers, const uint32_t mipLevels);
 // Create a memory mapped host side statging buffer for gpu to cpu transfer
 void* createStagingBuffer(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool, VkBuffer& stagingBuffer, VmaAllocation& stagingBufferAllocation, VkDeviceSize sizeInBytes);
 // create a host side memory mapped staging buffer and device side buffer. Required explicit transfer of data from staging to device buffers. 
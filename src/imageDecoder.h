@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+
+#include "helper.h"
+#include "threadPool.h"
+
+struct DecodeBenchmarkResult
+{
+	size_t fileCount = 0;
+	size_t decodedBytes = 0; // RGBA8
+	double serialMs = 0;
+	double parallelMs = 0;
+};
+
+/*
+ * Image decoder - Decodes image files with stb_image on the ThreadPool. decode() returns right away, TextureGenerator keeps the future and
+ * only waits when the pixels are needed, hence the textures of a scene are decoded in parallel with each other and with the mesh import.
+ * Decode errors, e.g. missing files, are thrown by future.get(). Do not wait on a decode from one of the pool workers.
+ */
+class ImageDecoder
+{
+public:
+	static std::future<Image2d> decode(const std::string& path)
+	{
+		return ThreadPool::getInstance().enqueue([path]() { return Image2d(path); });
+	}
+
+	// Decodes every JPG and PNG file below directory once on the calling thread and once with decode(), prints and returns the timings
+	static DecodeBenchmarkResult benchmark(const std::string& directory)
+	{
+		std::vector<std::string> paths = findImages(directory);
+		CHECK(!paths.empty(), "ImageDecoder: No JPG or PNG files found in " + directory);
+
+		DecodeBenchmarkResult result;
+		result.fileCount = paths.size();
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (const auto& path : paths) {
+			Image2d image(path);
+			result.decodedBytes += image.sizeInBytes();
+			image.cleanUp();
+		}
+		result.serialMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		std::vector<std::future<Image2d>> futures;
+		for (const auto& path : paths)
+			futures.push_back(decode(path));
+		for (auto& future : futures)
+			future.get().cleanUp();
+		result.parallelMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		const double mb = result.decodedBytes / (1024.0 * 1024.0);
+		std::cout << "Decode benchmark - " << result.fileCount << " files, " << mb << " MB decoded" << std::endl;
+		std::cout << "\tSerial  : " << result.serialMs << " ms, " << mb * 1000.0 / result.serialMs << " MB/s" << std::endl;
+		std::cout << "\tParallel: " << result.parallelMs << " ms, " << mb * 1000.0 / result.parallelMs << " MB/s on "
+			<< ThreadPool::getInstance().size() << " threads" << std::endl;
+
+		return result;
+	}
+
+private:
+	// Sorted, so that repeated runs decode in the same order
+	static std::vector<std::string> findImages(const std::string& directory)
+	{
+		std::vector<std::string> paths;
+		std::error_code error;
+		for (auto it = std::filesystem::recursive_directory_iterator(directory, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+			if (!it->is_regular_file(error))
+				continue;
+
+			std::string extension = it->path().extension().string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			if (extension == ".jpg" || extension == ".jpeg" || extension == ".png")
+				paths.push_back(it->path().string());
+		}
+
+		std::sort(paths.begin(), paths.end());
+
+		return paths;
+	}
+};
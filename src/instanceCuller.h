@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <chrono>
+#include <iostream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define INSTANCE_CULLER_SSE
+#endif
+
+#include <glm/glm.hpp>
+
+#include "helper.h"
+#include "culling.h"
+#include "threadPool.h"
+
+// Bounding spheres as structure of arrays, sphere i is (x[i], y[i], z[i]) with radius[i]
+struct SphereArray
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<float> radius;
+
+	void resize(size_t count)
+	{
+		x.resize(count);
+		y.resize(count);
+		z.resize(count);
+		radius.resize(count);
+	}
+
+	uint32_t size() const
+	{
+		return static_cast<uint32_t>(x.size());
+	}
+
+	void set(size_t i, const glm::vec4& sphere)
+	{
+		x[i] = sphere.x;
+		y[i] = sphere.y;
+		z[i] = sphere.z;
+		radius[i] = sphere.w;
+	}
+};
+
+/*
+ * Instance culler - Tests bounding spheres against the six planes of a frustum, four spheres per SSE iteration (scalar fallback otherwise).
+ * The indices of the visible spheres are written in ascending order, hence instances grouped by mesh stay grouped after compaction.
+ * cullRange() is the single threaded kernel and only depends on culling.h, so that it can be benchmarked on its own. cull() splits large
+ * inputs into ranges of RANGE_SIZE spheres on the ThreadPool and closes the gaps between the ranges afterwards.
+ */
+class InstanceCuller
+{
+public:
+	static const uint32_t RANGE_SIZE = 8192; // spheres per task, cull() stays on the calling thread below two ranges
+
+	// Writes the indices i in [begin, end) of the spheres intersecting the frustum to visible[0, 1, ...], returns their count.
+	// visible must hold end - begin entries.
+	static uint32_t cullRange(const Frustum& frustum, const SphereArray& spheres, uint32_t begin, uint32_t end, uint32_t* visible)
+	{
+		uint32_t visibleCount = 0;
+		uint32_t i = begin;
+
+#ifdef INSTANCE_CULLER_SSE
+		__m128 planes[6][4];
+		for (uint32_t p = 0; p < 6; p++)
+			for (uint32_t c = 0; c < 4; c++)
+				planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+
+		for (; i + 4 <= end; i += 4) {
+			const __m128 x = _mm_loadu_ps(spheres.x.data() + i);
+			const __m128 y = _mm_loadu_ps(spheres.y.data() + i);
+			const __m128 z = _mm_loadu_ps(spheres.z.data() + i);
+			const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius.data() + i));
+
+			// Not-less-than keeps NaN spheres visible, same as Frustum::intersectsSphere()
+			__m128 inside = _mm_cmpnlt_ps(planeDistance(planes[0], x, y, z), negRadius);
+			for (uint32_t p = 1; p < 6; p++)
+				inside = _mm_and_ps(inside, _mm_cmpnlt_ps(planeDistance(planes[p], x, y, z), negRadius));
+
+			// Branchless compaction, the slot is only kept when the lane is visible
+			const int mask = _mm_movemask_ps(inside);
+			for (uint32_t lane = 0; lane < 4; lane++) {
+				visible[visibleCount] = i + lane;
+				visibleCount += (mask >> lane) & 1;
+			}
+		}
+#endif
+
+		for (; i < end; i++) {
+			visible[visibleCount] = i;
+			visibleCount += frustum.intersectsSphere(glm::vec4(spheres.x[i], spheres.y[i], spheres.z[i], spheres.radius[i])) ? 1 : 0;
+		}
+
+		return visibleCount;
+	}
+
+	// visible is resized to the sphere count, the first returned count entries are valid
+	static uint32_t cull(const Frustum& frustum, const SphereArray& spheres, std::vector<uint32_t>& visible)
+	{
+		const uint32_t count = spheres.size();
+		visible.resize(count);
+
+		const uint32_t rangeCount = (count + RANGE_SIZE - 1) / RANGE_SIZE;
+		if (rangeCount < 2)
+			return cullRange(frustum, spheres, 0, count, visible.data());
+
+		// Each range writes to its own slice of visible
+		std::vector<uint32_t> rangeVisibleCounts(rangeCount);
+		ThreadPool::getInstance().parallelFor(rangeCount, [&](size_t first, size_t last) {
+			for (size_t range = first; range < last; range++) {
+				uint32_t begin = static_cast<uint32_t>(range) * RANGE_SIZE;
+				uint32_t end = std::min(begin + RANGE_SIZE, count);
+				rangeVisibleCounts[range] = cullRange(frustum, spheres, begin, end, visible.data() + begin);
+			}
+		});
+
+		uint32_t visibleCount = rangeVisibleCounts[0];
+		for (uint32_t range = 1; range < rangeCount; range++) {
+			memmove(visible.data() + visibleCount, visible.data() + range * RANGE_SIZE, sizeof(uint32_t) * rangeVisibleCounts[range]);
+			visibleCount += rangeVisibleCounts[range];
+		}
+
+		return visibleCount;
+	}
+
+	// Times cullRange() on its own against the scalar Frustum::intersectsSphere() loop it replaced, and cull() on the thread pool.
+	// Best of several runs over 1M random spheres around a unit frustum, the three must agree on the visible indices.
+	static void benchmark()
+	{
+		const uint32_t count = 1000000;
+		const uint32_t runCount = 5;
+
+		Frustum frustum(glm::mat4(1.0f)); // -1 <= x, y <= 1, 0 <= z <= 1
+		std::mt19937 rng(10);
+		std::uniform_real_distribution<float> position(-3.0f, 3.0f);
+		std::uniform_real_distribution<float> radius(0.0f, 0.5f);
+		SphereArray spheres;
+		spheres.resize(count);
+		std::vector<glm::vec4> sphereVectors(count);
+		for (uint32_t i = 0; i < count; i++) {
+			sphereVectors[i] = glm::vec4(position(rng), position(rng), position(rng), radius(rng));
+			spheres.set(i, sphereVectors[i]);
+		}
+
+		auto bestOf = [&](auto&& body) {
+			double best = 1e30;
+			for (uint32_t run = 0; run < runCount; run++) {
+				auto start = std::chrono::high_resolution_clock::now();
+				body();
+				best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+			}
+			return best;
+		};
+
+		std::vector<uint32_t> reference(count);
+		uint32_t referenceCount = 0;
+		const double scalarMs = bestOf([&]() {
+			referenceCount = 0;
+			for (uint32_t i = 0; i < count; i++)
+				if (frustum.intersectsSphere(sphereVectors[i]))
+					reference[referenceCount++] = i;
+		});
+
+		std::vector<uint32_t> visible(count);
+		uint32_t visibleCount = 0;
+		const double kernelMs = bestOf([&]() { visibleCount = cullRange(frustum, spheres, 0, count, visible.data()); });
+		CHECK(visibleCount == referenceCount && std::equal(visible.begin(), visible.begin() + visibleCount, reference.begin()),
+			"InstanceCuller: cullRange() differs from Frustum::intersectsSphere().");
+
+		const double parallelMs = bestOf([&]() { visibleCount = cull(frustum, spheres, visible); });
+		CHECK(visibleCount == referenceCount && std::equal(visible.begin(), visible.begin() + visibleCount, reference.begin()),
+			"InstanceCuller: cull() differs from Frustum::intersectsSphere().");
+
+		std::cout << "Culling benchmark - " << count << " spheres, " << referenceCount << " visible, best of " << runCount << " runs" << std::endl;
+		std::cout << "\tScalar  : " << scalarMs << " ms, " << count / (1000.0 * scalarMs) << " Mspheres/s" << std::endl;
+#ifdef INSTANCE_CULLER_SSE
+		std::cout << "\tKernel  : " << kernelMs << " ms, " << count / (1000.0 * kernelMs) << " Mspheres/s, SSE" << std::endl;
+#else
+		std::cout << "\tKernel  : " << kernelMs << " ms, " << count / (1000.0 * kernelMs) << " Mspheres/s, scalar fallback" << std::endl;
+#endif
+		std::cout << "\tParallel: " << parallelMs << " ms, " << count / (1000.0 * parallelMs) << " Mspheres/s on "
+			<< ThreadPool::getInstance().size() << " threads" << std::endl;
+	}
+
+private:
+#ifdef INSTANCE_CULLER_SSE
+	static __m128 planeDistance(const __m128 plane[4], const __m128& x, const __m128& y, const __m128& z)
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[0], x), _mm_mul_ps(plane[1], y)), _mm_add_ps(_mm_mul_ps(plane[2], z), plane[3]));
+	}
+#endif
+};
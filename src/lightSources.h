@@ -256,18 +256,20 @@ public:
 			}
 
 			CHECK(globalInstanceIdx <= 0xffff, "AreaLightSources : Number of globalInstances must be <= 0xffff.");
-			for (uint32_t i = 0, primitiveIdx = 0; mesh != nullptr && i < mesh->indices.size(); i += 3, primitiveIdx++) {
-				dPdf.add(computeArea(l2w_3 * (mesh->vertices[mesh->indices[i]].pos),
-					l2w_3 * (mesh->vertices[mesh->indices[i + 1]].pos),
-					l2w_3 * (mesh->vertices[mesh->indices[i + 2]].pos)) * (instance.data.z & 0xff));
-				CHECK(primitiveIdx <= 0xffff, "AreaLightSources : Number of primitives must be <= 0xffff.");
-				triangleIdxs.push_back(globalInstanceIdx << 16 | primitiveIdx);
-			}
-
-			// Verify whether primitive offsets for the area emitters are correct
 			if (mesh != nullptr) {
+				const MeshOffsets& offsets = model->meshOffsets[model->meshPointers[globalInstanceIdx]];
+				const uint32_t* indices = &model->indices[offsets.indexOffset];
+				for (uint32_t i = 0, primitiveIdx = 0; i < offsets.indexCount; i += 3, primitiveIdx++) {
+					dPdf.add(computeArea(l2w_3 * (model->vertices[indices[i]].pos),
+						l2w_3 * (model->vertices[indices[i + 1]].pos),
+						l2w_3 * (model->vertices[indices[i + 2]].pos)) * (instance.data.z & 0xff));
+					CHECK(primitiveIdx <= 0xffff, "AreaLightSources : Number of primitives must be <= 0xffff.");
+					triangleIdxs.push_back(globalInstanceIdx << 16 | primitiveIdx);
+				}
+
+				// Verify whether primitive offsets for the area emitters are correct
 				CHECK(areaLightPrimitiveOffsetCounter == (instance.data.z >> 8), "AreaLightSources: areaLight primitive offsets are incorrect.");
-				areaLightPrimitiveOffsetCounter += static_cast<uint32_t>(mesh->indices.size());
+				areaLightPrimitiveOffsetCounter += offsets.indexCount;
 			}
 			
 			globalInstanceIdx++;
@@ -281,13 +283,20 @@ public:
 
 		// create the TLAS solely for light sources
 		// We use reference the same BLAS from model.hpp for light meshes.
-		as_topLevel.create(device, allocator, static_cast<uint32_t>(boundingSpheres.size()), false);
+		as_topLevel.create(device, allocator, static_cast<uint32_t>(boundingSpheres.size()), true);
 		createBuffer(device, allocator, queue, commandPool, lightInstanceToGlobalInstanceBuffer, lightInstanceToGlobalInstanceAllocation, boundingSphereInstanceIndexes.size() * sizeof(boundingSphereInstanceIndexes[0]), boundingSphereInstanceIndexes.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	}
 
+	// Records the TLAS update chosen by updateData(), the light data is only copied after it changed
 	void cmdTransferData(const VkCommandBuffer& cmdBuffer)
 	{	
-		as_topLevel.cmdBuild(cmdBuffer, static_cast<uint32_t>(boundingSpheres.size()), false);
+		if (tlasUpdate != TlasUpdatePolicy::SKIP)
+			as_topLevel.cmdBuild(cmdBuffer, static_cast<uint32_t>(boundingSpheres.size()), tlasUpdate == TlasUpdatePolicy::REFIT);
+		tlasUpdate = TlasUpdatePolicy::SKIP;
+
+		if (!dataChanged)
+			return;
+		dataChanged = false;
 
 		VkBufferCopy copyRegion = {};
 		copyRegion.size = sizeof(lightVertices[0]) * lightVertices.size();
@@ -315,21 +324,30 @@ public:
 			0, nullptr);
 	}
 
+	// Recomputes the light data when Model::updateMeshData() changed transforms since the last call
 	void updateData()
 	{	
+		const bool changed = transformVersion != model->transformVersion;
+		if (!changed) {
+			tlasUpdate = std::max(tlasUpdate, tlasPolicy.update(false, boundingSpheres));
+			return;
+		}
+		transformVersion = model->transformVersion;
+		dataChanged = true;
+
 		uint32_t lightIndex = 0;
 		for (uint32_t triIdx : triangleIdxs) {
 			uint32_t instanceIdx = triIdx >> 16;
 			uint32_t primitiveIdx = 3 * (triIdx & 0xffff);
 
 			uint32_t meshIdx = model->meshPointers[instanceIdx];
-			const Mesh* mesh = model->meshes[meshIdx];
+			const uint32_t* indices = &model->indices[model->meshOffsets[meshIdx].indexOffset + primitiveIdx];
 			
 			//std::cout << determinant(model->instanceData_dynamic[instanceIdx].model) << std::endl;
 
-			lightVertices[lightIndex] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(mesh->vertices[mesh->indices[primitiveIdx]].pos, 1.0f);
-			lightVertices[lightIndex + 1] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(mesh->vertices[mesh->indices[primitiveIdx + 1]].pos, 1.0f);
-			lightVertices[lightIndex + 2] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(mesh->vertices[mesh->indices[primitiveIdx + 2]].pos, 1.0f);
+			lightVertices[lightIndex] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(model->vertices[indices[0]].pos, 1.0f);
+			lightVertices[lightIndex + 1] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(model->vertices[indices[1]].pos, 1.0f);
+			lightVertices[lightIndex + 2] = model->instanceData_dynamic[instanceIdx].model * glm::vec4(model->vertices[indices[2]].pos, 1.0f);
 			
 			// also save un normalized normal as it also gives the area i.e area = length(normal) * 0.5
 			glm::vec3 normal = glm::cross(glm::vec3(lightVertices[lightIndex] - lightVertices[lightIndex + 1]), glm::vec3(lightVertices[lightIndex] - lightVertices[lightIndex + 2]));
@@ -346,11 +364,7 @@ public:
 			uint32_t meshIdx = model->meshPointers[bndSphInstIdx];
 			const Mesh* mesh = model->meshes[meshIdx];
 			glm::mat4 l2w = model->instanceData_dynamic[bndSphInstIdx].model;
-			glm::vec4 center = l2w * glm::vec4(glm::vec3(mesh->boundingSphere), 1.0f);
-			glm::mat3 l2w_3 = glm::mat3(l2w);
-			// multiply radius with largest eigenvalue of orthogonal matrix
-			center.w = std::max(std::max(glm::length(l2w_3[0]), glm::length(l2w_3[1])), glm::length(l2w_3[2])) * mesh->boundingSphere.w;
-			boundingSpheres[boundingSphereIdx] = center;
+			boundingSpheres[boundingSphereIdx] = transformSphere(l2w, mesh->boundingSphere);
 			
 			
 			TopLevelAccelerationStructureData data;
@@ -361,7 +375,7 @@ public:
 			data.mask = 0xff;
 			data.instanceOffset = 0; // Since this is used to determine hit group index compuation, this may change
 			data.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
-			data.blasHandle = mesh->as_bottomLevel.handle;
+			data.blasHandle = model->getMeshBlas(meshIdx).handle;
 			tlas_instanceData.push_back(data);
 						
 			boundingSphereIdx++;
@@ -371,6 +385,7 @@ public:
 			"LightSources: Number of instances for Top Level Accelaration structure should match dynamic instance data count.");
 
 		as_topLevel.updateInstanceData(tlas_instanceData);
+		tlasUpdate = std::max(tlasUpdate, tlasPolicy.update(true, boundingSpheres));
 
 		memcpy(mptrLightVertices, lightVertices.data(), sizeof(lightVertices[0]) * lightVertices.size());
 		memcpy(mptrBoundingSpheres, boundingSpheres.data(), sizeof(boundingSpheres[0]) * boundingSpheres.size());
@@ -433,6 +448,11 @@ public:
 		return as_topLevel.getDescriptorTlasInfo();
 	}
 
+	const TlasUpdateStats& getTlasUpdateStats() const
+	{
+		return tlasPolicy.getStats();
+	}
+
 private:
 	const Model* model;
 	std::vector<uint32_t> triangleIdxs; // MSB 16 bit - instance index, LSB 16 bit primitive index
@@ -460,6 +480,10 @@ private:
 	// Top level AS for meshes containing light sources
 	TopLevelAccelerationStructure as_topLevel;
 	std::vector<TopLevelAccelerationStructureData> tlas_instanceData;
+	TlasUpdatePolicy tlasPolicy;
+	TlasUpdatePolicy::Decision tlasUpdate = TlasUpdatePolicy::SKIP; // recorded by the next cmdTransferData()
+	uint64_t transformVersion = ~0ull; // of Model::transformVersion the light data was computed for
+	bool dataChanged = false; // light vertices and bounding spheres wait for cmdTransferData()
 
 	// map gl_InstanceId to global instance index
 	VkBuffer lightInstanceToGlobalInstanceBuffer;
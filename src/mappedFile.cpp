@@ -0,0 +1,87 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mappedFile.h"
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	fileHandle = file;
+
+	LARGE_INTEGER sizeInBytes;
+	if (!GetFileSizeEx(file, &sizeInBytes) || sizeInBytes.QuadPart == 0) {
+		close();
+		return false;
+	}
+
+	mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle == nullptr) {
+		close();
+		return false;
+	}
+
+	ptr = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	if (ptr == nullptr) {
+		close();
+		return false;
+	}
+
+	fileSize = static_cast<size_t>(sizeInBytes.QuadPart);
+#else
+	fileDescriptor = ::open(path.c_str(), O_RDONLY);
+	if (fileDescriptor < 0)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(fileDescriptor, &fileStat) != 0 || fileStat.st_size == 0) {
+		close();
+		return false;
+	}
+
+	void* mapping = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+	if (mapping == MAP_FAILED) {
+		close();
+		return false;
+	}
+
+	ptr = static_cast<const uint8_t*>(mapping);
+	fileSize = static_cast<size_t>(fileStat.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (ptr != nullptr)
+		UnmapViewOfFile(ptr);
+	if (mappingHandle != nullptr)
+		CloseHandle(mappingHandle);
+	if (fileHandle != nullptr)
+		CloseHandle(fileHandle);
+
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	if (ptr != nullptr)
+		munmap(const_cast<uint8_t*>(ptr), fileSize);
+	if (fileDescriptor >= 0)
+		::close(fileDescriptor);
+
+	fileDescriptor = -1;
+#endif
+	ptr = nullptr;
+	fileSize = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// Read only memory mapping of a complete file
+class MappedFile
+{
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(const std::string& path);
+	void close();
+
+	const uint8_t* data() const
+	{
+		return ptr;
+	}
+
+	size_t size() const
+	{
+		return fileSize;
+	}
+
+private:
+	const uint8_t* ptr = nullptr;
+	size_t fileSize = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fileDescriptor = -1;
+#endif
+};
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "model.hpp"
+
+/*
+ * Mesh optimizer - Reorders the triangles and vertices of an indexed mesh for the raster pipeline without changing the geometry.
+ * Vertex cache   : Tipsify (Sander, Nehab, Barczak - Fast triangle reordering for vertex locality and reduced overdraw, 2007). Triangles are emitted
+ *                  as fans around a fanning vertex, the next fanning vertex is the adjacent vertex that is still in the simulated cache after its
+ *                  remaining triangles are emitted.
+ * Overdraw       : Optional, from the same paper. The Tipsify output is split into clusters at dead ends and wherever the running cache miss ratio of a
+ *                  cluster is low enough, clusters facing away from the mesh centroid are drawn first. This trades some cache efficiency for less
+ *                  overdraw and is therefore off by default.
+ * Vertex fetch   : Vertices are renumbered in order of first use by the index buffer, unused vertices are moved to the end.
+ * The quality is reported as ACMR (transformed vertices per triangle) and ATVR (transformed vertices per vertex) of a simulated FIFO or LRU post
+ * transform cache, hence it can be measured without a GPU.
+ */
+
+enum class VertexCachePolicy { FIFO, LRU };
+
+struct VertexCacheStatistics
+{
+	uint64_t transformedVertices = 0; // cache misses
+	uint64_t triangleCount = 0;
+	uint64_t vertexCount = 0;
+
+	float acmr() const
+	{
+		return triangleCount > 0 ? static_cast<float>(transformedVertices) / triangleCount : 0.0f;
+	}
+
+	float atvr() const
+	{
+		return vertexCount > 0 ? static_cast<float>(transformedVertices) / vertexCount : 0.0f;
+	}
+
+	void operator+=(const VertexCacheStatistics& other)
+	{
+		transformedVertices += other.transformedVertices;
+		triangleCount += other.triangleCount;
+		vertexCount += other.vertexCount;
+	}
+};
+
+class MeshOptimizer
+{
+public:
+	// Cache size assumed by Tipsify and the default of the simulated cache
+	static const uint32_t CACHE_SIZE = 16;
+
+	// Runs the vertex cache, optional overdraw and vertex fetch passes on mesh, returns the simulated cache statistics before and after
+	static void optimize(Mesh& mesh, bool optimizeOverdraw = false, VertexCacheStatistics* before = nullptr, VertexCacheStatistics* after = nullptr)
+	{
+		CHECK(mesh.indices.size() % 3 == 0, "MeshOptimizer: Index count is not a multiple of 3.");
+
+		const uint32_t vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+		if (before != nullptr)
+			*before += analyzeVertexCache(mesh.indices, vertexCount);
+
+		std::vector<uint32_t> clusters;
+		optimizeVertexCache(mesh.indices, vertexCount, CACHE_SIZE, &clusters);
+		if (optimizeOverdraw)
+			MeshOptimizer::optimizeOverdraw(mesh.indices, mesh.vertices, clusters);
+		optimizeVertexFetch(mesh.vertices, mesh.indices);
+
+		if (after != nullptr)
+			*after += analyzeVertexCache(mesh.indices, vertexCount);
+	}
+
+	// Tipsify triangle reordering. clusters receives the first triangle of each run started at a dead end, including triangle 0.
+	static void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize = CACHE_SIZE, std::vector<uint32_t>* clusters = nullptr)
+	{
+		const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+		if (clusters != nullptr)
+			clusters->clear();
+		if (triangleCount == 0)
+			return;
+
+		// Vertex to triangle adjacency, liveTriangles counts the triangles of each vertex not emitted yet
+		std::vector<uint32_t> liveTriangles(vertexCount, 0);
+		for (uint32_t index : indices) {
+			CHECK(index < vertexCount, "MeshOptimizer: Index out of range.");
+			liveTriangles[index]++;
+		}
+
+		std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+		for (uint32_t v = 0; v < vertexCount; v++)
+			adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+
+		std::vector<uint32_t> adjacency(indices.size());
+		std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (uint32_t i = 0; i < indices.size(); i++)
+			adjacency[fill[indices[i]]++] = i / 3;
+
+		std::vector<uint32_t> cacheTime(vertexCount, 0);
+		std::vector<bool> emitted(triangleCount, false);
+		std::vector<uint32_t> deadEnds;
+		std::vector<uint32_t> candidates;
+		std::vector<uint32_t> output;
+		output.reserve(indices.size());
+
+		uint32_t time = cacheSize + 1;
+		uint32_t cursor = 0;
+		while (liveTriangles[cursor] == 0)
+			cursor++;
+		int64_t fanning = cursor;
+		bool deadEnd = true;
+
+		while (fanning >= 0) {
+			if (deadEnd && clusters != nullptr)
+				clusters->push_back(static_cast<uint32_t>(output.size() / 3));
+
+			candidates.clear();
+			for (uint32_t i = adjacencyOffsets[fanning]; i < adjacencyOffsets[fanning + 1]; i++) {
+				uint32_t triangle = adjacency[i];
+				if (emitted[triangle])
+					continue;
+
+				for (uint32_t corner = 0; corner < 3; corner++) {
+					uint32_t v = indices[3 * triangle + corner];
+					output.push_back(v);
+					deadEnds.push_back(v);
+					candidates.push_back(v);
+					liveTriangles[v]--;
+					if (time - cacheTime[v] > cacheSize)
+						cacheTime[v] = time++;
+				}
+				emitted[triangle] = true;
+			}
+
+			fanning = nextFanningVertex(candidates, liveTriangles, cacheTime, time, cacheSize, deadEnds, cursor, deadEnd);
+		}
+
+		indices.swap(output);
+	}
+
+	// Sorts the clusters from optimizeVertexCache() so that triangles facing away from the mesh centroid are drawn first
+	static void optimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& hardClusters, uint32_t cacheSize = CACHE_SIZE, float threshold = 1.05f)
+	{
+		const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+		if (triangleCount == 0)
+			return;
+
+		std::vector<uint32_t> clusters = splitClusters(indices, static_cast<uint32_t>(vertices.size()), hardClusters, cacheSize, threshold);
+
+		glm::vec3 meshCentroid(0.0f);
+		float meshArea = 0.0f;
+		std::vector<glm::vec3> centroids(clusters.size(), glm::vec3(0.0f));
+		std::vector<glm::vec3> normals(clusters.size(), glm::vec3(0.0f));
+		for (size_t c = 0; c < clusters.size(); c++) {
+			uint32_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+			float area = 0.0f;
+			for (uint32_t t = clusters[c]; t < end; t++) {
+				const glm::vec3& p0 = vertices[indices[3 * t + 0]].pos;
+				const glm::vec3& p1 = vertices[indices[3 * t + 1]].pos;
+				const glm::vec3& p2 = vertices[indices[3 * t + 2]].pos;
+				glm::vec3 n = glm::cross(p1 - p0, p2 - p0); // length is twice the area
+				float a = glm::length(n);
+				normals[c] += n;
+				centroids[c] += (p0 + p1 + p2) * (a / 3.0f);
+				area += a;
+			}
+
+			meshCentroid += centroids[c];
+			meshArea += area;
+			centroids[c] = area > 0.0f ? centroids[c] / area : vertices[indices[3 * clusters[c]]].pos;
+			float length = glm::length(normals[c]);
+			normals[c] = length > 0.0f ? normals[c] / length : glm::vec3(0.0f);
+		}
+		meshCentroid = meshArea > 0.0f ? meshCentroid / meshArea : glm::vec3(0.0f);
+
+		std::vector<float> sortKeys(clusters.size());
+		for (size_t c = 0; c < clusters.size(); c++)
+			sortKeys[c] = glm::dot(centroids[c] - meshCentroid, normals[c]);
+
+		std::vector<uint32_t> order(clusters.size());
+		for (uint32_t c = 0; c < order.size(); c++)
+			order[c] = c;
+		std::stable_sort(order.begin(), order.end(), [&sortKeys](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+		std::vector<uint32_t> output;
+		output.reserve(indices.size());
+		for (uint32_t c : order) {
+			uint32_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+			output.insert(output.end(), indices.begin() + 3 * clusters[c], indices.begin() + 3 * end);
+		}
+
+		indices.swap(output);
+	}
+
+	// Renumbers vertices in order of first use, vertices not referenced by indices keep their relative order at the end
+	static void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+	{
+		const uint32_t unassigned = 0xffffffff;
+		std::vector<uint32_t> remap(vertices.size(), unassigned);
+		std::vector<Vertex> output;
+		output.reserve(vertices.size());
+
+		for (auto& index : indices) {
+			if (remap[index] == unassigned) {
+				remap[index] = static_cast<uint32_t>(output.size());
+				output.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+
+		for (size_t v = 0; v < vertices.size(); v++)
+			if (remap[v] == unassigned)
+				output.push_back(vertices[v]);
+
+		vertices.swap(output);
+	}
+
+	// Simulates a post transform cache of cacheSize entries over the index buffer
+	static VertexCacheStatistics analyzeVertexCache(const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize = CACHE_SIZE, VertexCachePolicy policy = VertexCachePolicy::FIFO)
+	{
+		CHECK(cacheSize > 0, "MeshOptimizer: Cache size must be positive.");
+
+		VertexCacheStatistics statistics;
+		statistics.triangleCount = indices.size() / 3;
+		statistics.vertexCount = vertexCount;
+
+		// FIFO - a vertex is cached while fewer than cacheSize misses happened since it was loaded
+		// LRU - a vertex is cached while fewer than cacheSize distinct vertices were referenced since its last use
+		std::vector<uint64_t> timestamp(vertexCount, 0);
+		std::vector<uint32_t> lru;
+		lru.reserve(cacheSize + 1);
+		uint64_t misses = 0;
+
+		for (uint32_t index : indices) {
+			CHECK(index < vertexCount, "MeshOptimizer: Index out of range.");
+
+			if (policy == VertexCachePolicy::FIFO) {
+				if (timestamp[index] == 0 || misses - timestamp[index] >= cacheSize) {
+					misses++;
+					timestamp[index] = misses;
+				}
+			}
+			else {
+				auto it = std::find(lru.begin(), lru.end(), index);
+				if (it != lru.end())
+					lru.erase(it);
+				else {
+					misses++;
+					if (lru.size() == cacheSize)
+						lru.pop_back();
+				}
+				lru.insert(lru.begin(), index);
+			}
+		}
+
+		statistics.transformedVertices = misses;
+
+		return statistics;
+	}
+
+private:
+	static int64_t nextFanningVertex(const std::vector<uint32_t>& candidates, const std::vector<uint32_t>& liveTriangles, const std::vector<uint32_t>& cacheTime,
+		uint32_t time, uint32_t cacheSize, std::vector<uint32_t>& deadEnds, uint32_t& cursor, bool& deadEnd)
+	{
+		// Prefer the candidate that entered the cache earliest and stays in it after fanning its remaining triangles
+		int64_t best = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t v : candidates) {
+			if (liveTriangles[v] == 0)
+				continue;
+
+			int64_t priority = 0;
+			if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+				priority = time - cacheTime[v];
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				best = v;
+			}
+		}
+
+		deadEnd = best < 0;
+		if (!deadEnd)
+			return best;
+
+		// Dead end - recently used vertices first, then the next vertex in input order
+		while (!deadEnds.empty()) {
+			uint32_t v = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveTriangles[v] > 0)
+				return v;
+		}
+
+		while (cursor < liveTriangles.size()) {
+			if (liveTriangles[cursor] > 0)
+				return cursor;
+			cursor++;
+		}
+
+		return -1;
+	}
+
+	// Adds soft boundaries inside the hard clusters wherever the FIFO miss ratio of the current cluster drops to threshold times that of the whole mesh
+	static std::vector<uint32_t> splitClusters(const std::vector<uint32_t>& indices, uint32_t vertexCount, const std::vector<uint32_t>& hardClusters, uint32_t cacheSize, float threshold)
+	{
+		const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+		const float targetAcmr = analyzeVertexCache(indices, vertexCount, cacheSize).acmr() * threshold;
+
+		std::vector<uint32_t> clusters;
+		std::vector<uint64_t> timestamp(vertexCount, 0);
+		uint64_t misses = 0;
+		uint64_t clusterMisses = 0;
+		uint32_t clusterStart = 0;
+		size_t nextHard = 0;
+
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			bool hard = nextHard < hardClusters.size() && hardClusters[nextHard] == t;
+			if (hard)
+				nextHard++;
+
+			// Soft boundaries reset the simulated cache, the new cluster may be drawn after any other one
+			bool soft = t > clusterStart && static_cast<float>(clusterMisses) / (t - clusterStart) <= targetAcmr;
+			if (t == 0 || hard || soft) {
+				clusters.push_back(t);
+				clusterStart = t;
+				clusterMisses = 0;
+				misses += cacheSize;
+			}
+
+			for (uint32_t corner = 0; corner < 3; corner++) {
+				uint32_t v = indices[3 * t + corner];
+				if (timestamp[v] == 0 || misses - timestamp[v] >= cacheSize) {
+					misses++;
+					clusterMisses++;
+					timestamp[v] = misses;
+				}
+			}
+		}
+
+		return clusters;
+	}
+};
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+
+#include "model.hpp"
+#include "meshOptimizer.h"
+
+/*
+ * Mesh simplifier - Edge collapse simplification driven by quadric error metrics (Garland, Heckbert - Surface simplification using quadric error
+ * metrics, 1997), used to build the level of detail chain of a Mesh.
+ * Collapses are half edge collapses, i.e. a vertex is merged into one of its neighbours. No new vertices are created, hence every level of
+ * detail is just another index set over the vertices of the mesh.
+ * Vertices sharing their position with another vertex lie on a UV, normal or material seam (the welder already merged identical vertices)
+ * and are locked. Vertices on open borders may only slide along the border, an extra quadric per border edge keeps the outline in place.
+ * Collapses that flip a triangle are rejected.
+ * The error of a collapse is the area weighted RMS distance to the planes of the merged triangles, in object space units.
+ */
+class MeshSimplifier
+{
+public:
+	// Collapses edges until at most targetIndexCount indices are left or the next collapse exceeds targetError. Returns the new index set,
+	// resultError receives the largest error of all collapses.
+	static std::vector<uint32_t> simplify(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount,
+		float targetError, float* resultError = nullptr)
+	{
+		CHECK(indices.size() % 3 == 0, "MeshSimplifier: Index count is not a multiple of 3.");
+
+		MeshSimplifier simplifier(vertices, indices);
+		simplifier.collapse(targetIndexCount / 3, static_cast<double>(targetError));
+
+		if (resultError != nullptr)
+			*resultError = static_cast<float>(simplifier.maxError);
+
+		return simplifier.compact();
+	}
+
+	// Fills mesh.lods with up to lodCount levels, each with about reduction times the triangles of the previous one. Stops early when a level
+	// cannot be reduced further without exceeding maxRelativeError times the bounding sphere radius.
+	static void generateLods(Mesh& mesh, uint32_t lodCount, float reduction = 0.5f, float maxRelativeError = 0.05f)
+	{
+		CHECK(reduction > 0.0f && reduction < 1.0f, "MeshSimplifier: Reduction must be in (0, 1).");
+
+		mesh.lods.clear();
+		const float maxError = maxRelativeError * mesh.boundingSphere.w;
+		const std::vector<uint32_t>* previous = &mesh.indices;
+		float previousError = 0.0f;
+
+		for (uint32_t lod = 0; lod < lodCount; lod++) {
+			size_t target = static_cast<size_t>(previous->size() / 3 * reduction) * 3;
+			if (target < 3)
+				break;
+
+			// Simplifying from the previous level keeps the chain nested, the errors add up
+			float error;
+			std::vector<uint32_t> lodIndices = simplify(mesh.vertices, *previous, target, maxError - previousError, &error);
+			if (lodIndices.empty() || lodIndices.size() > previous->size() * (1.0f + reduction) / 2)
+				break;
+
+			MeshOptimizer::optimizeVertexCache(lodIndices, static_cast<uint32_t>(mesh.vertices.size()));
+			previousError += error;
+			mesh.lods.push_back({ std::move(lodIndices), previousError });
+			previous = &mesh.lods.back().indices;
+		}
+	}
+
+private:
+	enum VertexKind : uint8_t { MANIFOLD, BORDER, LOCKED };
+
+	// Symmetric 4x4 matrix of the plane equations, plus the total weight of the planes
+	struct Quadric
+	{
+		double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0, b0 = 0, b1 = 0, b2 = 0, c = 0;
+		double weight = 0;
+
+		Quadric() {}
+
+		// Plane n.x + d = 0 with unit normal n
+		Quadric(const glm::dvec3& n, double d, double w)
+		{
+			a00 = w * n.x * n.x; a01 = w * n.x * n.y; a02 = w * n.x * n.z;
+			a11 = w * n.y * n.y; a12 = w * n.y * n.z; a22 = w * n.z * n.z;
+			b0 = w * n.x * d; b1 = w * n.y * d; b2 = w * n.z * d;
+			c = w * d * d;
+			weight = w;
+		}
+
+		void operator+=(const Quadric& q)
+		{
+			a00 += q.a00; a01 += q.a01; a02 += q.a02; a11 += q.a11; a12 += q.a12; a22 += q.a22;
+			b0 += q.b0; b1 += q.b1; b2 += q.b2; c += q.c;
+			weight += q.weight;
+		}
+
+		// Weighted mean squared distance of p to the planes
+		double error(const glm::vec3& p) const
+		{
+			double x = p.x, y = p.y, z = p.z;
+			double e = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z) + 2 * (b0 * x + b1 * y + b2 * z) + c;
+
+			return weight > 0 ? std::max(e, 0.0) / weight : 0.0;
+		}
+	};
+
+	struct Collapse
+	{
+		double cost;
+		uint32_t from;
+		uint32_t to;
+		uint32_t fromVersion;
+		uint32_t toVersion;
+
+		bool operator<(const Collapse& other) const
+		{
+			return cost > other.cost; // min heap
+		}
+	};
+
+	const std::vector<Vertex>& vertices;
+	std::vector<uint32_t> triangles; // 3 vertex indices per triangle
+	std::vector<bool> removed;
+	std::vector<std::vector<uint32_t>> vertexTriangles; // may list removed triangles
+	std::vector<uint32_t> positionIds; // first vertex with the same position
+	std::vector<VertexKind> kinds;
+	std::vector<Quadric> quadrics;
+	std::vector<uint32_t> versions;
+	std::priority_queue<Collapse> heap;
+	size_t triangleCount;
+	double maxError = 0.0;
+
+	MeshSimplifier(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) : vertices(vertices), triangles(indices)
+	{
+		const size_t vertexCount = vertices.size();
+		triangleCount = indices.size() / 3;
+		removed.assign(triangleCount, false);
+		vertexTriangles.resize(vertexCount);
+		quadrics.resize(vertexCount);
+		versions.assign(vertexCount, 0);
+		kinds.assign(vertexCount, MANIFOLD);
+
+		positionIds.resize(vertexCount);
+		std::unordered_map<glm::vec3, uint32_t> positions;
+		positions.reserve(vertexCount);
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			auto it = positions.emplace(vertices[v].pos, v);
+			positionIds[v] = it.first->second;
+			if (!it.second) {
+				kinds[v] = LOCKED;
+				kinds[it.first->second] = LOCKED;
+			}
+		}
+
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			CHECK(triangles[3 * t] < vertexCount && triangles[3 * t + 1] < vertexCount && triangles[3 * t + 2] < vertexCount,
+				"MeshSimplifier: Index out of range.");
+
+			for (uint32_t corner = 0; corner < 3; corner++)
+				vertexTriangles[triangles[3 * t + corner]].push_back(t);
+
+			glm::dvec3 p0(vertices[triangles[3 * t + 0]].pos), p1(vertices[triangles[3 * t + 1]].pos), p2(vertices[triangles[3 * t + 2]].pos);
+			glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+			double area = glm::length(n);
+			if (area <= 0.0)
+				continue;
+
+			n /= area;
+			Quadric q(n, -glm::dot(n, p0), area * 0.5);
+			for (uint32_t corner = 0; corner < 3; corner++)
+				quadrics[triangles[3 * t + corner]] += q;
+		}
+
+		// Open edges at position level, i.e. half edges without a twin
+		std::unordered_map<uint64_t, uint32_t> halfEdges;
+		halfEdges.reserve(triangles.size());
+		for (uint32_t i = 0; i < triangles.size(); i++)
+			halfEdges[positionEdge(triangles[i], triangles[next(i)])]++;
+
+		for (uint32_t i = 0; i < triangles.size(); i++) {
+			uint32_t a = triangles[i], b = triangles[next(i)];
+			if (halfEdges.count(positionEdge(b, a)) != 0)
+				continue;
+
+			if (kinds[a] == MANIFOLD)
+				kinds[a] = BORDER;
+			if (kinds[b] == MANIFOLD)
+				kinds[b] = BORDER;
+
+			// Plane through the edge, perpendicular to the triangle, keeps the border from shrinking
+			uint32_t t = i / 3;
+			glm::dvec3 p0(vertices[triangles[3 * t + 0]].pos), p1(vertices[triangles[3 * t + 1]].pos), p2(vertices[triangles[3 * t + 2]].pos);
+			glm::dvec3 edge = glm::dvec3(vertices[b].pos) - glm::dvec3(vertices[a].pos);
+			glm::dvec3 n = glm::cross(glm::cross(p1 - p0, p2 - p0), edge);
+			double length = glm::length(n);
+			if (length <= 0.0)
+				continue;
+
+			n /= length;
+			Quadric q(n, -glm::dot(n, glm::dvec3(vertices[a].pos)), glm::dot(edge, edge) * 10.0);
+			quadrics[a] += q;
+			quadrics[b] += q;
+		}
+
+		for (uint32_t t = 0; t < triangleCount; t++)
+			for (uint32_t corner = 0; corner < 3; corner++) {
+				uint32_t a = triangles[3 * t + corner], b = triangles[3 * t + (corner + 1) % 3];
+				pushCollapse(a, b);
+				pushCollapse(b, a);
+			}
+	}
+
+	static uint32_t next(uint32_t i)
+	{
+		return i % 3 == 2 ? i - 2 : i + 1;
+	}
+
+	uint64_t positionEdge(uint32_t a, uint32_t b) const
+	{
+		return (static_cast<uint64_t>(positionIds[a]) << 32) | positionIds[b];
+	}
+
+	bool isBorderEdge(uint32_t a, uint32_t b) const
+	{
+		// A border edge is used by a single live triangle, compared by position since b may have seam copies
+		uint32_t count = 0;
+		for (uint32_t t : vertexTriangles[a]) {
+			if (removed[t])
+				continue;
+			for (uint32_t corner = 0; corner < 3; corner++)
+				if (positionIds[triangles[3 * t + corner]] == positionIds[b])
+					count++;
+		}
+
+		return count == 1;
+	}
+
+	void pushCollapse(uint32_t from, uint32_t to)
+	{
+		if (kinds[from] == LOCKED)
+			return;
+		if (kinds[from] == BORDER && (kinds[to] == MANIFOLD || !isBorderEdge(from, to)))
+			return;
+
+		Quadric q = quadrics[from];
+		q += quadrics[to];
+		heap.push({ q.error(vertices[to].pos), from, to, versions[from], versions[to] });
+	}
+
+	// Moving from onto to must not flip or degenerate any triangle that survives the collapse
+	bool flipsTriangle(uint32_t from, uint32_t to) const
+	{
+		const glm::vec3& target = vertices[to].pos;
+		for (uint32_t t : vertexTriangles[from]) {
+			if (removed[t])
+				continue;
+
+			uint32_t corner = triangles[3 * t] == from ? 0 : (triangles[3 * t + 1] == from ? 1 : 2);
+			uint32_t b = triangles[3 * t + (corner + 1) % 3], c = triangles[3 * t + (corner + 2) % 3];
+			if (b == to || c == to)
+				continue;
+
+			const glm::vec3& pb = vertices[b].pos;
+			const glm::vec3& pc = vertices[c].pos;
+			glm::vec3 before = glm::cross(pb - vertices[from].pos, pc - vertices[from].pos);
+			glm::vec3 after = glm::cross(pb - target, pc - target);
+			if (glm::dot(before, after) <= 0.0f)
+				return true;
+		}
+
+		return false;
+	}
+
+	void collapse(size_t targetTriangleCount, double targetError)
+	{
+		const double maxCost = targetError * targetError;
+
+		while (triangleCount > targetTriangleCount && !heap.empty()) {
+			Collapse collapse = heap.top();
+			heap.pop();
+
+			if (collapse.fromVersion != versions[collapse.from] || collapse.toVersion != versions[collapse.to])
+				continue;
+			if (collapse.cost > maxCost)
+				break;
+			if (flipsTriangle(collapse.from, collapse.to))
+				continue;
+
+			const uint32_t from = collapse.from, to = collapse.to;
+			for (uint32_t t : vertexTriangles[from]) {
+				if (removed[t])
+					continue;
+
+				uint32_t* tri = &triangles[3 * t];
+				if (tri[0] == to || tri[1] == to || tri[2] == to) {
+					removed[t] = true;
+					triangleCount--;
+				}
+				else {
+					for (uint32_t corner = 0; corner < 3; corner++)
+						if (tri[corner] == from)
+							tri[corner] = to;
+					vertexTriangles[to].push_back(t);
+				}
+			}
+
+			vertexTriangles[from].clear();
+			quadrics[to] += quadrics[from];
+			versions[from]++;
+			versions[to]++;
+			maxError = std::max(maxError, std::sqrt(collapse.cost));
+
+			// Only the quadric of the surviving vertex changed, requeue its edges
+			auto& adjacent = vertexTriangles[to];
+			adjacent.erase(std::remove_if(adjacent.begin(), adjacent.end(), [this](uint32_t t) { return removed[t]; }), adjacent.end());
+			for (uint32_t t : adjacent)
+				for (uint32_t corner = 0; corner < 3; corner++) {
+					uint32_t v = triangles[3 * t + corner];
+					if (v != to) {
+						pushCollapse(to, v);
+						pushCollapse(v, to);
+					}
+				}
+		}
+	}
+
+	std::vector<uint32_t> compact() const
+	{
+		std::vector<uint32_t> result;
+		result.reserve(triangleCount * 3);
+		for (size_t t = 0; t < removed.size(); t++)
+			if (!removed[t])
+				result.insert(result.end(), triangles.begin() + 3 * t, triangles.begin() + 3 * t + 3);
+
+		return result;
+	}
+};
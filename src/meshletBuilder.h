@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <random>
+#include <iostream>
+
+#include <glm/glm.hpp>
+
+#include "helper.h"
+#include "culling.h"
+#include "../shaders/hostDeviceShared.h"
+
+/*
+ * Meshlet builder - Splits the index buffer of a mesh into clusters of at most maxVertices unique vertices and maxTriangles triangles.
+ * Triangles are taken in index buffer order, i.e. after MeshOptimizer the clusters follow the vertex cache order and each one is a contiguous
+ * index range that can be drawn with a single VkDrawIndexedIndirectCommand.
+ * Each cluster stores an AABB, a bounding sphere (AABB center) and a normal cone for backface culling. The cone apex is the point on the
+ * axis behind all triangle planes (Kapoulkine, meshoptimizer), hence the test of isConeBackfacing() is exact for any camera position.
+ * Cones wider than acos(0.1) are disabled. VertexType is Vertex of model.hpp.
+ */
+class MeshletBuilder
+{
+public:
+	static const uint32_t MAX_VERTICES = 64;
+	static const uint32_t MAX_TRIANGLES = 124;
+
+	// firstIndex of the returned meshlets is relative to indices, meshIdx is 0
+	template<typename VertexType>
+	static std::vector<Meshlet> build(const std::vector<VertexType>& vertices, const std::vector<uint32_t>& indices, uint32_t maxVertices = MAX_VERTICES,
+		uint32_t maxTriangles = MAX_TRIANGLES)
+	{
+		CHECK(indices.size() % 3 == 0, "MeshletBuilder: Index count is not a multiple of 3.");
+		CHECK(maxVertices >= 3 && maxTriangles >= 1, "MeshletBuilder: Meshlet limits too small.");
+
+		std::vector<Meshlet> meshlets;
+		std::vector<uint32_t> stamp(vertices.size(), 0); // meshlet count + 1 when the vertex is part of the current meshlet
+		uint32_t firstIndex = 0;
+		uint32_t vertexCount = 0;
+
+		for (uint32_t i = 0; i < indices.size(); i += 3) {
+			uint32_t current = static_cast<uint32_t>(meshlets.size()) + 1;
+			uint32_t newVertices = 0;
+			for (uint32_t corner = 0; corner < 3; corner++) {
+				uint32_t v = indices[i + corner];
+				CHECK(v < vertices.size(), "MeshletBuilder: Index out of range.");
+				bool repeated = (corner > 0 && v == indices[i]) || (corner > 1 && v == indices[i + 1]);
+				if (stamp[v] != current && !repeated)
+					newVertices++;
+			}
+
+			if (vertexCount + newVertices > maxVertices || (i - firstIndex) / 3 >= maxTriangles) {
+				meshlets.push_back(makeMeshlet(vertices, indices, firstIndex, i - firstIndex, vertexCount));
+				firstIndex = i;
+				vertexCount = 0;
+				current++;
+			}
+
+			for (uint32_t corner = 0; corner < 3; corner++)
+				if (stamp[indices[i + corner]] != current) {
+					stamp[indices[i + corner]] = current;
+					vertexCount++;
+				}
+		}
+
+		if (firstIndex < indices.size())
+			meshlets.push_back(makeMeshlet(vertices, indices, firstIndex, static_cast<uint32_t>(indices.size()) - firstIndex, vertexCount));
+
+		return meshlets;
+	}
+
+	// Builds the meshlets of a UV sphere and checks their bounds, the normal cones and the frustum test of culling.h against brute force
+	static void selfTest()
+	{
+		struct TestVertex
+		{
+			glm::vec3 pos;
+		};
+
+		const uint32_t segments = 60;
+		std::vector<TestVertex> vertices;
+		std::vector<uint32_t> indices;
+		for (uint32_t y = 0; y <= segments; y++)
+			for (uint32_t x = 0; x <= segments; x++) {
+				float phi = 2.0f * 3.14159265f * x / segments;
+				float theta = -1.5f + 3.0f * y / segments; // the poles are left open, no degenerate triangles
+				vertices.push_back({ glm::vec3(std::cos(phi) * std::cos(theta), std::sin(phi) * std::cos(theta), std::sin(theta)) });
+			}
+		for (uint32_t y = 0; y < segments; y++)
+			for (uint32_t x = 0; x < segments; x++) {
+				uint32_t i = y * (segments + 1) + x;
+				for (uint32_t index : { i, i + 1, i + segments + 1, i + 1, i + segments + 2, i + segments + 1 })
+					indices.push_back(index);
+			}
+
+		std::vector<Meshlet> meshlets = build(vertices, indices);
+		uint32_t nextIndex = 0;
+		uint32_t coneCount = 0;
+		for (const auto& meshlet : meshlets) {
+			CHECK(meshlet.firstIndex == nextIndex, "MeshletBuilder: Meshlets do not cover the index buffer in order.");
+			CHECK(meshlet.indexCount <= 3 * MAX_TRIANGLES, "MeshletBuilder: Too many triangles in a meshlet.");
+			nextIndex += meshlet.indexCount;
+
+			std::vector<uint32_t> unique(indices.begin() + meshlet.firstIndex, indices.begin() + meshlet.firstIndex + meshlet.indexCount);
+			std::sort(unique.begin(), unique.end());
+			unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+			CHECK(unique.size() == meshlet.vertexCount && unique.size() <= MAX_VERTICES, "MeshletBuilder: Wrong vertex count.");
+
+			for (uint32_t v : unique)
+				CHECK(glm::length(vertices[v].pos - glm::vec3(meshlet.boundingSphere)) <= meshlet.boundingSphere.w * 1.0001f,
+					"MeshletBuilder: Vertex outside of the bounding sphere.");
+
+			coneCount += meshlet.cone.w <= 1.0f ? 1 : 0;
+		}
+		CHECK(nextIndex == indices.size(), "MeshletBuilder: Meshlets do not cover the index buffer.");
+		CHECK(coneCount * 2 > meshlets.size(), "MeshletBuilder: Most normal cones of a smooth sphere should be enabled.");
+
+		// A backfacing cluster must not contain a triangle that faces the camera
+		std::mt19937 rng(9);
+		std::uniform_real_distribution<float> position(-5.0f, 5.0f);
+		uint32_t backfacingCount = 0;
+		uint32_t testCount = 0;
+		for (uint32_t camera = 0; camera < 1000; camera++) {
+			glm::vec3 cameraPos(position(rng), position(rng), position(rng));
+			for (const auto& meshlet : meshlets) {
+				testCount++;
+				if (!isConeBackfacing(meshlet.cone, glm::vec3(meshlet.coneApex), cameraPos))
+					continue;
+
+				backfacingCount++;
+				for (uint32_t i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.indexCount; i += 3)
+					CHECK(glm::dot(triangleNormal(vertices, indices, i), vertices[indices[i]].pos - cameraPos) >= -1e-5f,
+						"MeshletBuilder: Cluster with a front facing triangle culled as backfacing.");
+			}
+		}
+
+		// Vulkan projection (glm::perspectiveRH_ZO) looking down -z. A culled sphere must not contain a point inside the clip volume.
+		const float nearPlane = 0.1f;
+		const float farPlane = 10.0f;
+		const float focal = 1.0f / std::tan(0.4f);
+		glm::mat4 proj(0.0f);
+		proj[0][0] = focal;
+		proj[1][1] = focal;
+		proj[2][2] = farPlane / (nearPlane - farPlane);
+		proj[2][3] = -1.0f;
+		proj[3][2] = -farPlane * nearPlane / (farPlane - nearPlane);
+		Frustum frustum(proj);
+
+		CHECK(frustum.intersectsSphere(glm::vec4(0.0f, 0.0f, -5.0f, 1.0f)), "Frustum: Sphere in front of the camera culled.");
+		CHECK(!frustum.intersectsSphere(glm::vec4(0.0f, 0.0f, 5.0f, 1.0f)), "Frustum: Sphere behind the camera not culled.");
+		CHECK(!frustum.intersectsSphere(glm::vec4(0.0f, 0.0f, -20.0f, 1.0f)), "Frustum: Sphere beyond the far plane not culled.");
+		CHECK(!frustum.intersectsSphere(glm::vec4(50.0f, 0.0f, -5.0f, 1.0f)), "Frustum: Sphere beside the frustum not culled.");
+
+		std::uniform_real_distribution<float> center(-15.0f, 15.0f);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		uint32_t culledCount = 0;
+		for (uint32_t s = 0; s < 10000; s++) {
+			glm::vec4 sphere(center(rng), center(rng), center(rng), 0.1f + 2.0f * (unit(rng) + 1.0f));
+			if (frustum.intersectsSphere(sphere))
+				continue;
+
+			culledCount++;
+			for (uint32_t p = 0; p < 64; p++) {
+				glm::vec3 offset(unit(rng), unit(rng), unit(rng));
+				if (glm::length(offset) > 1.0f)
+					continue;
+
+				glm::vec4 clip = proj * glm::vec4(glm::vec3(sphere) + offset * sphere.w, 1.0f);
+				bool inside = std::abs(clip.x) <= clip.w && std::abs(clip.y) <= clip.w && clip.z >= 0.0f && clip.z <= clip.w;
+				CHECK(!inside, "Frustum: Culled sphere reaches into the view frustum.");
+			}
+		}
+
+		std::cout << "Meshlet culling - " << meshlets.size() << " meshlets, " << coneCount << " with normal cones" << std::endl;
+		std::cout << "\tBackface: " << 100.0 * backfacingCount / testCount << "% of the clusters culled over 1000 cameras" << std::endl;
+		std::cout << "\tFrustum : " << culledCount << " of 10000 spheres culled" << std::endl;
+	}
+
+private:
+	template<typename VertexType>
+	static Meshlet makeMeshlet(const std::vector<VertexType>& vertices, const std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, uint32_t vertexCount)
+	{
+		Meshlet meshlet = {};
+		meshlet.firstIndex = firstIndex;
+		meshlet.indexCount = indexCount;
+		meshlet.meshIdx = 0;
+		meshlet.vertexCount = vertexCount;
+
+		glm::vec3 aabbMin(std::numeric_limits<float>::max());
+		glm::vec3 aabbMax(-std::numeric_limits<float>::max());
+		for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++) {
+			aabbMin = glm::min(aabbMin, vertices[indices[i]].pos);
+			aabbMax = glm::max(aabbMax, vertices[indices[i]].pos);
+		}
+
+		glm::vec3 center = (aabbMin + aabbMax) * 0.5f;
+		float radius = 0.0f;
+		for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++)
+			radius = std::max(radius, glm::length(vertices[indices[i]].pos - center));
+
+		meshlet.aabbMin = glm::vec4(aabbMin, 0.0f);
+		meshlet.aabbMax = glm::vec4(aabbMax, 0.0f);
+		meshlet.boundingSphere = glm::vec4(center, radius);
+
+		// Normal cone around the mean triangle normal
+		glm::vec3 axis(0.0f);
+		for (uint32_t i = firstIndex; i < firstIndex + indexCount; i += 3) {
+			glm::vec3 n = triangleNormal(vertices, indices, i);
+			axis += n;
+		}
+
+		meshlet.cone = glm::vec4(0.0f, 0.0f, 1.0f, 2.0f);
+		meshlet.coneApex = glm::vec4(center, 0.0f);
+		float axisLength = glm::length(axis);
+		if (axisLength <= 0.0f)
+			return meshlet;
+		axis /= axisLength;
+
+		float minDot = 1.0f;
+		for (uint32_t i = firstIndex; i < firstIndex + indexCount; i += 3) {
+			glm::vec3 n = triangleNormal(vertices, indices, i);
+			if (n != glm::vec3(0.0f))
+				minDot = std::min(minDot, glm::dot(n, axis));
+		}
+
+		if (minDot <= 0.1f)
+			return meshlet;
+
+		// Move the apex back along the axis until it lies behind every triangle plane
+		float maxT = 0.0f;
+		for (uint32_t i = firstIndex; i < firstIndex + indexCount; i += 3) {
+			glm::vec3 n = triangleNormal(vertices, indices, i);
+			if (n == glm::vec3(0.0f))
+				continue;
+
+			float t = glm::dot(center - vertices[indices[i]].pos, n) / glm::dot(axis, n);
+			maxT = std::max(maxT, t);
+		}
+
+		meshlet.cone = glm::vec4(axis, std::sqrt(1.0f - minDot * minDot));
+		meshlet.coneApex = glm::vec4(center - axis * maxT, 0.0f);
+
+		return meshlet;
+	}
+
+	// Unit normal, zero for degenerate triangles
+	template<typename VertexType>
+	static glm::vec3 triangleNormal(const std::vector<VertexType>& vertices, const std::vector<uint32_t>& indices, uint32_t i)
+	{
+		const glm::vec3& p0 = vertices[indices[i]].pos;
+		glm::vec3 n = glm::cross(vertices[indices[i + 1]].pos - p0, vertices[indices[i + 2]].pos - p0);
+		float length = glm::length(n);
+
+		return length > 0.0f ? n / length : glm::vec3(0.0f);
+	}
+};
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+#include <chrono>
+#include <iostream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MIP_GENERATOR_SSE
+#endif
+
+#include "vulkan/vulkan.h"
+#include "threadPool.h"
+#include "floatPacker.h"
+
+enum class MipFilter
+{
+	BOX,
+	KAISER // Kaiser windowed sinc, width 3, alpha 4
+};
+
+struct MipSettings
+{
+	MipFilter filter = MipFilter::KAISER;
+	bool srgb = true; // RGB of RGBA8 textures is sRGB encoded and filtered in linear space. Alpha and RGBA32F textures are always linear.
+};
+
+/*
+ * Mip generator - Builds complete mip chains on the CPU, so that textures are uploaded in one copy instead of a chain of blits that needs linear
+ * filter support for the format. Each level is filtered from the previous one with a separable filter that wraps at the borders, same as the
+ * REPEAT samplers of the textures. Texels are processed as linear float RGBA, one SSE register per texel (scalar fallback otherwise).
+ * Levels are split into tiles of TILE_ROWS rows, the tiles of all layers of a level run in parallel on the ThreadPool.
+ * Only depends on Vulkan for VkFormat, supported formats are VK_FORMAT_R8G8B8A8_UNORM and VK_FORMAT_R32G32B32A32_SFLOAT. The size functions also
+ * cover the block compressed formats of BlockCompressor and the float formats of FloatPacker.
+ */
+class MipGenerator
+{
+public:
+	static const uint32_t TILE_ROWS = 16;
+
+	static VkExtent2D levelExtent(uint32_t width, uint32_t height, uint32_t level)
+	{
+		return { std::max(width >> level, 1u), std::max(height >> level, 1u) };
+	}
+
+	// 0 for unsupported formats
+	static size_t texelSize(VkFormat format)
+	{
+		return format == VK_FORMAT_R8G8B8A8_UNORM ? 4 : (format == VK_FORMAT_R32G32B32A32_SFLOAT ? 16 : 0);
+	}
+
+	// Bytes per 4x4 block of the block compressed formats of BlockCompressor, 0 otherwise
+	static size_t blockSize(VkFormat format)
+	{
+		return format == VK_FORMAT_BC1_RGB_UNORM_BLOCK ? 8 : (format == VK_FORMAT_BC3_UNORM_BLOCK ? 16 : 0);
+	}
+
+	static size_t levelSize(uint32_t width, uint32_t height, uint32_t level, VkFormat format)
+	{
+		VkExtent2D extent = levelExtent(width, height, level);
+		if (blockSize(format) > 0)
+			return static_cast<size_t>((extent.width + 3) / 4) * ((extent.height + 3) / 4) * blockSize(format);
+
+		return static_cast<size_t>(extent.width) * extent.height * (FloatPacker::texelSize(format) > 0 ? FloatPacker::texelSize(format) : texelSize(format));
+	}
+
+	static size_t chainSize(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format)
+	{
+		size_t size = 0;
+		for (uint32_t level = 0; level < mipLevels; level++)
+			size += levelSize(width, height, level, format);
+
+		return size;
+	}
+
+	// layers[i] is level 0 of layer i. dst receives chainSize() bytes per layer, layer after layer, each with its levels in order.
+	static void generate(const std::vector<const void*>& layers, uint32_t width, uint32_t height, VkFormat format, uint32_t mipLevels,
+		const MipSettings& settings, uint8_t* dst)
+	{
+		const uint32_t layerCount = static_cast<uint32_t>(layers.size());
+		const size_t layerChainSize = chainSize(width, height, mipLevels, format);
+		const bool srgb = settings.srgb && format == VK_FORMAT_R8G8B8A8_UNORM;
+
+		for (uint32_t layer = 0; layer < layerCount; layer++)
+			memcpy(dst + layer * layerChainSize, layers[layer], levelSize(width, height, 0, format));
+
+		// Linear float copy of the previous level of each layer, level 0 is decoded on the fly
+		std::vector<std::vector<float>> previous(layerCount);
+		std::vector<std::vector<float>> current(layerCount);
+		size_t levelOffset = levelSize(width, height, 0, format);
+
+		for (uint32_t level = 1; level < mipLevels; level++) {
+			const VkExtent2D srcExtent = levelExtent(width, height, level - 1);
+			const VkExtent2D dstExtent = levelExtent(width, height, level);
+			const FilterTaps columnTaps = computeTaps(srcExtent.width, dstExtent.width, settings.filter);
+			const FilterTaps rowTaps = computeTaps(srcExtent.height, dstExtent.height, settings.filter);
+			const bool keepLinear = level + 1 < mipLevels;
+
+			for (uint32_t layer = 0; layer < layerCount; layer++)
+				current[layer].resize(keepLinear ? static_cast<size_t>(dstExtent.width) * dstExtent.height * 4 : 0);
+
+			const uint32_t tileCount = (dstExtent.height + TILE_ROWS - 1) / TILE_ROWS;
+			ThreadPool::getInstance().parallelFor(static_cast<size_t>(layerCount) * tileCount, [&](size_t first, size_t last) {
+				Scratch scratch;
+				for (size_t task = first; task < last; task++) {
+					const uint32_t layer = static_cast<uint32_t>(task / tileCount);
+					const uint32_t rowBegin = static_cast<uint32_t>(task % tileCount) * TILE_ROWS;
+					const uint32_t rowEnd = std::min(rowBegin + TILE_ROWS, dstExtent.height);
+
+					Image src = level == 1 ?
+						Image{ layers[layer], srcExtent.width, srcExtent.height, format, srgb } :
+						Image{ previous[layer].data(), srcExtent.width, srcExtent.height, VK_FORMAT_R32G32B32A32_SFLOAT, false };
+					uint8_t* dstLevel = dst + layer * layerChainSize + levelOffset;
+
+					resampleRows(src, columnTaps, rowTaps, dstExtent.width, rowBegin, rowEnd, keepLinear ? current[layer].data() : nullptr,
+						dstLevel, format, srgb, scratch);
+				}
+			});
+
+			std::swap(previous, current);
+			levelOffset += levelSize(width, height, level, format);
+		}
+	}
+
+	// Resamples src to dst with the filter of settings, in parallel over tiles of rows
+	static void resize(const void* src, uint32_t srcWidth, uint32_t srcHeight, void* dst, uint32_t dstWidth, uint32_t dstHeight, VkFormat format,
+		const MipSettings& settings)
+	{
+		const bool srgb = settings.srgb && format == VK_FORMAT_R8G8B8A8_UNORM;
+		const FilterTaps columnTaps = computeTaps(srcWidth, dstWidth, settings.filter);
+		const FilterTaps rowTaps = computeTaps(srcHeight, dstHeight, settings.filter);
+		const Image image = { src, srcWidth, srcHeight, format, srgb };
+
+		const uint32_t tileCount = (dstHeight + TILE_ROWS - 1) / TILE_ROWS;
+		ThreadPool::getInstance().parallelFor(tileCount, [&](size_t first, size_t last) {
+			Scratch scratch;
+			for (size_t tile = first; tile < last; tile++) {
+				const uint32_t rowBegin = static_cast<uint32_t>(tile) * TILE_ROWS;
+				resampleRows(image, columnTaps, rowTaps, dstWidth, rowBegin, std::min(rowBegin + TILE_ROWS, dstHeight), nullptr,
+					static_cast<uint8_t*>(dst), format, srgb, scratch);
+			}
+		});
+	}
+
+	// Quality and speed of the mip chains, throws when a check fails.
+	// Quality: level 0 is a sum of sine waves that tile the texture. The ideal level l keeps the waves below its Nyquist frequency unchanged
+	// and removes the others, each level is compared against that as PSNR over the [0, 1] range. Box filtered RGBA32F levels must also be the
+	// exact 2x2 averages of the previous level, and constant RGBA8 textures must stay constant with both filters.
+	// Speed: full chains of four 2048x2048 sRGB RGBA8 layers, in level 0 texels per second.
+	static void benchmark()
+	{
+		auto fail = [](const std::string& message) { throw std::runtime_error("MipGenerator: " + message); };
+		const MipFilter filters[2] = { MipFilter::BOX, MipFilter::KAISER };
+		const char* filterNames[2] = { "Box   ", "Kaiser" };
+
+		struct Wave
+		{
+			float fx, fy, amplitude;
+		};
+		const Wave waves[4] = { { 3.0f, 5.0f, 0.15f }, { 20.0f, 7.0f, 0.1f }, { 60.0f, 90.0f, 0.08f }, { 200.0f, 150.0f, 0.05f } };
+		auto sineImage = [&](uint32_t w, uint32_t h, bool bandLimited) {
+			std::vector<float> image(static_cast<size_t>(w) * h * 4);
+			for (uint32_t y = 0; y < h; y++)
+				for (uint32_t x = 0; x < w; x++) {
+					const double u = (x + 0.5) / w;
+					const double v = (y + 0.5) / h;
+					double value = 0.5;
+					for (const auto& wave : waves)
+						if (!bandLimited || (wave.fx < 0.5 * w && wave.fy < 0.5 * h))
+							value += wave.amplitude * std::sin(2.0 * 3.14159265358979 * (wave.fx * u + wave.fy * v));
+					std::fill_n(image.begin() + (static_cast<size_t>(y) * w + x) * 4, 4, static_cast<float>(value));
+				}
+			return image;
+		};
+
+		const uint32_t size = 512;
+		const uint32_t mipLevels = 6;
+		const VkFormat floatFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
+		const std::vector<float> level0 = sineImage(size, size, false);
+		std::vector<uint8_t> chain(chainSize(size, size, mipLevels, floatFormat));
+		double minPsnr[2] = { 1e30, 1e30 };
+		for (uint32_t f = 0; f < 2; f++) {
+			MipSettings settings;
+			settings.filter = filters[f];
+			generate({ level0.data() }, size, size, floatFormat, mipLevels, settings, chain.data());
+
+			size_t offset = levelSize(size, size, 0, floatFormat);
+			for (uint32_t level = 1; level < mipLevels; level++) {
+				const VkExtent2D extent = levelExtent(size, size, level);
+				const std::vector<float> ideal = sineImage(extent.width, extent.height, true);
+				const float* texels = reinterpret_cast<const float*>(chain.data() + offset);
+				double squaredError = 0.0;
+				for (size_t i = 0; i < ideal.size(); i++)
+					squaredError += (texels[i] - ideal[i]) * static_cast<double>(texels[i] - ideal[i]);
+				minPsnr[f] = std::min(minPsnr[f], 10.0 * std::log10(ideal.size() / squaredError));
+
+				if (filters[f] == MipFilter::BOX) {
+					const float* previous = reinterpret_cast<const float*>(chain.data() + offset - levelSize(size, size, level - 1, floatFormat));
+					const size_t previousRow = static_cast<size_t>(extent.width) * 8;
+					for (uint32_t y = 0; y < extent.height; y++)
+						for (uint32_t i = 0; i < extent.width * 4; i++) {
+							const float* p = previous + y * 2 * previousRow + (i / 4) * 8 + i % 4;
+							const float average = 0.25f * (p[0] + p[4] + p[previousRow] + p[previousRow + 4]);
+							if (std::abs(texels[y * extent.width * 4 + i] - average) > 1e-6f)
+								fail("Box filtered level is not the 2x2 average of the previous level.");
+						}
+				}
+
+				offset += levelSize(size, size, level, floatFormat);
+			}
+		}
+		if (minPsnr[1] < 40.0 || minPsnr[1] < minPsnr[0] + 3.0)
+			fail("Kaiser filtered levels are below 40 dB or not better than the box filter.");
+
+		const uint32_t constantWidth = 37; // odd sizes, the filters must not leak the border wrap into the constant
+		const uint32_t constantHeight = 20;
+		const uint8_t color[4] = { 200, 17, 90, 128 };
+		std::vector<uint8_t> constant(static_cast<size_t>(constantWidth) * constantHeight * 4);
+		for (size_t i = 0; i < constant.size(); i++)
+			constant[i] = color[i % 4];
+		std::vector<uint8_t> constantChain(chainSize(constantWidth, constantHeight, 6, VK_FORMAT_R8G8B8A8_UNORM));
+		for (MipFilter filter : filters) {
+			MipSettings settings;
+			settings.filter = filter;
+			generate({ constant.data() }, constantWidth, constantHeight, VK_FORMAT_R8G8B8A8_UNORM, 6, settings, constantChain.data());
+			for (size_t i = 0; i < constantChain.size(); i++)
+				if (constantChain[i] != color[i % 4])
+					fail("Constant texture does not stay constant.");
+		}
+
+		const uint32_t speedSize = 2048;
+		const uint32_t layerCount = 4;
+		const uint32_t speedLevels = 12;
+		std::vector<std::vector<uint8_t>> layers(layerCount, std::vector<uint8_t>(static_cast<size_t>(speedSize) * speedSize * 4));
+		std::vector<const void*> layerData;
+		for (auto& layer : layers) {
+			for (size_t i = 0; i < layer.size(); i++)
+				layer[i] = static_cast<uint8_t>((i * 2654435761u + layerData.size()) >> 24);
+			layerData.push_back(layer.data());
+		}
+		std::vector<uint8_t> speedChain(chainSize(speedSize, speedSize, speedLevels, VK_FORMAT_R8G8B8A8_UNORM) * layerCount);
+
+		std::cout << "Mip benchmark - quality over " << mipLevels - 1 << " levels of a " << size << "x" << size << " RGBA32F texture, speed of "
+			<< layerCount << " " << speedSize << "x" << speedSize << " sRGB RGBA8 layers on " << ThreadPool::getInstance().size() << " threads" << std::endl;
+		for (uint32_t f = 0; f < 2; f++) {
+			MipSettings settings;
+			settings.filter = filters[f];
+			const auto start = std::chrono::high_resolution_clock::now();
+			generate(layerData, speedSize, speedSize, VK_FORMAT_R8G8B8A8_UNORM, speedLevels, settings, speedChain.data());
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+			std::cout << "\t" << filterNames[f] << ": min PSNR " << minPsnr[f] << " dB, " << ms << " ms, "
+				<< static_cast<double>(speedSize) * speedSize * layerCount / (1000.0 * ms) << " Mtexels/s" << std::endl;
+		}
+	}
+
+private:
+	struct Tap
+	{
+		uint32_t index;
+		float weight;
+	};
+
+	// Taps of destination texel i are taps[offsets[i], offsets[i + 1])
+	struct FilterTaps
+	{
+		std::vector<uint32_t> offsets;
+		std::vector<Tap> taps;
+	};
+
+	// Level 0 in its own format, or a previous level as linear float RGBA
+	struct Image
+	{
+		const void* data;
+		uint32_t width;
+		uint32_t height;
+		VkFormat format;
+		bool srgb;
+	};
+
+	// Per task buffers, reused across the tiles of a range
+	struct Scratch
+	{
+		std::vector<float> decodedRow;
+		std::vector<float> filteredRows; // horizontally filtered source rows of the tile
+		std::vector<int32_t> rowSlots;   // source row -> row of filteredRows, -1 when unused
+		std::vector<float> accumulator;
+	};
+
+	static FilterTaps computeTaps(uint32_t srcSize, uint32_t dstSize, MipFilter filter)
+	{
+		const float ratio = static_cast<float>(srcSize) / dstSize;
+		const float scale = std::max(ratio, 1.0f); // upsampling interpolates with the filter at source resolution
+		const float radius = (filter == MipFilter::BOX ? 0.5f : KAISER_WIDTH) * scale;
+
+		FilterTaps filterTaps;
+		filterTaps.offsets.push_back(0);
+		for (uint32_t i = 0; i < dstSize; i++) {
+			const float center = (i + 0.5f) * ratio;
+			const int32_t first = static_cast<int32_t>(std::floor(center - radius));
+			const int32_t last = static_cast<int32_t>(std::ceil(center + radius));
+
+			const size_t begin = filterTaps.taps.size();
+			float weightSum = 0.0f;
+			for (int32_t j = first; j < last; j++) {
+				float weight;
+				if (filter == MipFilter::BOX)
+					weight = std::max(0.0f, std::min(j + 1.0f, center + radius) - std::max(static_cast<float>(j), center - radius));
+				else
+					weight = kaiser((j + 0.5f - center) / scale);
+
+				if (weight == 0.0f)
+					continue;
+
+				const int32_t wrapped = ((j % static_cast<int32_t>(srcSize)) + static_cast<int32_t>(srcSize)) % static_cast<int32_t>(srcSize);
+				filterTaps.taps.push_back({ static_cast<uint32_t>(wrapped), weight });
+				weightSum += weight;
+			}
+
+			for (size_t t = begin; t < filterTaps.taps.size(); t++)
+				filterTaps.taps[t].weight /= weightSum;
+			filterTaps.offsets.push_back(static_cast<uint32_t>(filterTaps.taps.size()));
+		}
+
+		return filterTaps;
+	}
+
+	static constexpr float KAISER_WIDTH = 3.0f;
+	static constexpr float KAISER_ALPHA = 4.0f;
+
+	static float kaiser(float t)
+	{
+		if (std::abs(t) >= KAISER_WIDTH)
+			return 0.0f;
+
+		const float x = t / KAISER_WIDTH;
+		const float window = besselI0(KAISER_ALPHA * std::sqrt(1.0f - x * x)) / besselI0(KAISER_ALPHA);
+		const float sinc = t == 0.0f ? 1.0f : std::sin(3.14159265358979324f * t) / (3.14159265358979324f * t);
+
+		return sinc * window;
+	}
+
+	// Modified Bessel function of the first kind, series expansion
+	static float besselI0(float x)
+	{
+		float sum = 1.0f;
+		float term = 1.0f;
+		for (int k = 1; k < 32 && term > sum * 1e-8f; k++) {
+			term *= (x * x * 0.25f) / (static_cast<float>(k) * k);
+			sum += term;
+		}
+
+		return sum;
+	}
+
+	static const uint32_t SRGB_ENCODE_STEPS = 4096;
+
+	struct SrgbTables
+	{
+		float decode[256];
+		float thresholds[255];                      // linear value half way between the codes k and k + 1
+		uint8_t encodeStart[SRGB_ENCODE_STEPS + 1]; // code of linear value i / SRGB_ENCODE_STEPS
+	};
+
+	static const SrgbTables& srgbTables()
+	{
+		static const SrgbTables tables = []() {
+			SrgbTables values;
+			for (uint32_t i = 0; i < 256; i++)
+				values.decode[i] = srgbToLinear(i / 255.0f);
+			for (uint32_t k = 0; k < 255; k++)
+				values.thresholds[k] = srgbToLinear((k + 0.5f) / 255.0f);
+			for (uint32_t i = 0; i <= SRGB_ENCODE_STEPS; i++)
+				values.encodeStart[i] = static_cast<uint8_t>(std::upper_bound(values.thresholds, values.thresholds + 255, static_cast<float>(i) / SRGB_ENCODE_STEPS) - values.thresholds);
+			return values;
+		}();
+
+		return tables;
+	}
+
+	static float srgbToLinear(float c)
+	{
+		return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	// Exact round to nearest in sRGB space, the table gives the code at the start of the step and the thresholds resolve the rest
+	static uint8_t encodeSrgb(const SrgbTables& tables, float linear)
+	{
+		linear = std::min(std::max(linear, 0.0f), 1.0f);
+		uint32_t code = tables.encodeStart[static_cast<uint32_t>(linear * SRGB_ENCODE_STEPS)];
+		while (code < 255 && linear >= tables.thresholds[code])
+			code++;
+
+		return static_cast<uint8_t>(code);
+	}
+
+	static uint8_t encodeUnorm(float value)
+	{
+		return static_cast<uint8_t>(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+
+	// Row y of image as linear float RGBA
+	static const float* sourceRow(const Image& image, uint32_t y, const SrgbTables& tables, Scratch& scratch)
+	{
+		if (image.format == VK_FORMAT_R32G32B32A32_SFLOAT)
+			return static_cast<const float*>(image.data) + static_cast<size_t>(y) * image.width * 4;
+
+		const uint8_t* texels = static_cast<const uint8_t*>(image.data) + static_cast<size_t>(y) * image.width * 4;
+		scratch.decodedRow.resize(static_cast<size_t>(image.width) * 4);
+		for (size_t i = 0; i < static_cast<size_t>(image.width) * 4; i += 4) {
+			for (size_t c = 0; c < 3; c++)
+				scratch.decodedRow[i + c] = image.srgb ? tables.decode[texels[i + c]] : texels[i + c] / 255.0f;
+			scratch.decodedRow[i + 3] = texels[i + 3] / 255.0f;
+		}
+
+		return scratch.decodedRow.data();
+	}
+
+	static void filterTexel(const float* row, const Tap* begin, const Tap* end, float* dst)
+	{
+#ifdef MIP_GENERATOR_SSE
+		__m128 sum = _mm_setzero_ps();
+		for (const Tap* tap = begin; tap != end; tap++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + tap->index * 4), _mm_set1_ps(tap->weight)));
+		_mm_storeu_ps(dst, sum);
+#else
+		float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (const Tap* tap = begin; tap != end; tap++)
+			for (uint32_t c = 0; c < 4; c++)
+				sum[c] += row[tap->index * 4 + c] * tap->weight;
+		memcpy(dst, sum, sizeof(sum));
+#endif
+	}
+
+	// dst[i] += src[i] * weight, count is a multiple of 4
+	static void accumulateRow(float* dst, const float* src, float weight, size_t count)
+	{
+#ifdef MIP_GENERATOR_SSE
+		const __m128 w = _mm_set1_ps(weight);
+		for (size_t i = 0; i < count; i += 4)
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), w)));
+#else
+		for (size_t i = 0; i < count; i++)
+			dst[i] += src[i] * weight;
+#endif
+	}
+
+	// Writes the destination rows [rowBegin, rowEnd) to dstLinear (optional, float RGBA) and dstEncoded (format of the texture)
+	static void resampleRows(const Image& src, const FilterTaps& columnTaps, const FilterTaps& rowTaps, uint32_t dstWidth, uint32_t rowBegin, uint32_t rowEnd,
+		float* dstLinear, uint8_t* dstEncoded, VkFormat format, bool srgb, Scratch& scratch)
+	{
+		const size_t rowFloats = static_cast<size_t>(dstWidth) * 4;
+		const SrgbTables& tables = srgbTables();
+
+		// Filter every source row the tile reads horizontally, once
+		scratch.rowSlots.assign(src.height, -1);
+		uint32_t slotCount = 0;
+		for (uint32_t y = rowBegin; y < rowEnd; y++)
+			for (uint32_t t = rowTaps.offsets[y]; t < rowTaps.offsets[y + 1]; t++)
+				if (scratch.rowSlots[rowTaps.taps[t].index] < 0)
+					scratch.rowSlots[rowTaps.taps[t].index] = static_cast<int32_t>(slotCount++);
+
+		scratch.filteredRows.resize(slotCount * rowFloats);
+		for (uint32_t y = 0; y < src.height; y++) {
+			if (scratch.rowSlots[y] < 0)
+				continue;
+
+			const float* row = sourceRow(src, y, tables, scratch);
+			float* filtered = scratch.filteredRows.data() + scratch.rowSlots[y] * rowFloats;
+			for (uint32_t x = 0; x < dstWidth; x++) {
+				const Tap* taps = columnTaps.taps.data();
+				filterTexel(row, taps + columnTaps.offsets[x], taps + columnTaps.offsets[x + 1], filtered + x * 4);
+			}
+		}
+
+		// Vertical pass over whole rows
+		scratch.accumulator.resize(rowFloats);
+		for (uint32_t y = rowBegin; y < rowEnd; y++) {
+			float* accumulator = dstLinear ? dstLinear + y * rowFloats : scratch.accumulator.data();
+			std::fill(accumulator, accumulator + rowFloats, 0.0f);
+			for (uint32_t t = rowTaps.offsets[y]; t < rowTaps.offsets[y + 1]; t++) {
+				const Tap& tap = rowTaps.taps[t];
+				accumulateRow(accumulator, scratch.filteredRows.data() + scratch.rowSlots[tap.index] * rowFloats, tap.weight, rowFloats);
+			}
+
+			if (format == VK_FORMAT_R32G32B32A32_SFLOAT) {
+				memcpy(dstEncoded + y * rowFloats * sizeof(float), accumulator, rowFloats * sizeof(float));
+				continue;
+			}
+
+			uint8_t* dstRow = dstEncoded + y * rowFloats;
+			for (size_t i = 0; i < rowFloats; i += 4) {
+				for (size_t c = 0; c < 3; c++)
+					dstRow[i + c] = srgb ? encodeSrgb(tables, accumulator[i + c]) : encodeUnorm(accumulator[i + c]);
+				dstRow[i + 3] = encodeUnorm(accumulator[i + 3]);
+			}
+		}
+	}
+};
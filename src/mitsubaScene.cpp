@@ -0,0 +1,459 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "mitsubaScene.h"
+
+static const std::string EMPTY_STRING;
+
+const std::string& MitsubaScene::XmlNode::attribute(const std::string& key) const
+{
+	for (const auto& attribute : attributes)
+		if (attribute.first == key)
+			return attribute.second;
+
+	return EMPTY_STRING;
+}
+
+static size_t lineOf(const std::string& text, size_t pos)
+{
+	return std::count(text.begin(), text.begin() + std::min(pos, text.size()), '\n') + 1;
+}
+
+static bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static std::string decodeEntities(const std::string& value)
+{
+	static const std::pair<const char*, char> ENTITIES[] = { { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+
+	std::string decoded;
+	for (size_t i = 0; i < value.size(); i++) {
+		bool replaced = false;
+		if (value[i] == '&')
+			for (const auto& entity : ENTITIES)
+				if (value.compare(i, strlen(entity.first), entity.first) == 0) {
+					decoded += entity.second;
+					i += strlen(entity.first) - 1;
+					replaced = true;
+					break;
+				}
+
+		if (!replaced)
+			decoded += value[i];
+	}
+
+	return decoded;
+}
+
+// Elements and attributes only, text, comments, processing instructions and the doctype are skipped
+MitsubaScene::XmlNode MitsubaScene::parseXml(const std::string& text, const std::string& file)
+{
+	std::vector<XmlNode> stack(1);
+	size_t pos = 0;
+
+	auto fail = [&text, &file](size_t at) {
+		return "MitsubaScene: Malformed XML - " + file + " line " + std::to_string(lineOf(text, at));
+	};
+	auto skipTo = [&text, &pos, &fail](const char* terminator) {
+		const size_t end = text.find(terminator, pos);
+		CHECK(end != std::string::npos, fail(pos));
+		pos = end + strlen(terminator);
+	};
+	auto readName = [&text, &pos]() {
+		const size_t start = pos;
+		while (pos < text.size() && !isSpace(text[pos]) && text[pos] != '/' && text[pos] != '>' && text[pos] != '=')
+			pos++;
+		return text.substr(start, pos - start);
+	};
+	auto skipSpace = [&text, &pos]() {
+		while (pos < text.size() && isSpace(text[pos]))
+			pos++;
+	};
+
+	while ((pos = text.find('<', pos)) != std::string::npos) {
+		if (text.compare(pos, 4, "<!--") == 0) {
+			skipTo("-->");
+		}
+		else if (text.compare(pos, 2, "<?") == 0) {
+			skipTo("?>");
+		}
+		else if (text.compare(pos, 2, "<!") == 0) {
+			skipTo(">");
+		}
+		else if (text.compare(pos, 2, "</") == 0) {
+			const size_t start = pos;
+			pos += 2;
+			const std::string name = readName();
+			skipSpace();
+			CHECK(pos < text.size() && text[pos] == '>' && stack.size() > 1 && stack.back().name == name, fail(start));
+			pos++;
+
+			XmlNode node = std::move(stack.back());
+			stack.pop_back();
+			stack.back().children.push_back(std::move(node));
+		}
+		else {
+			const size_t start = pos;
+			pos++;
+			XmlNode node;
+			node.name = readName();
+			CHECK(!node.name.empty(), fail(start));
+
+			bool closed = false;
+			for (;;) {
+				skipSpace();
+				CHECK(pos < text.size(), fail(start));
+				if (text[pos] == '>') {
+					pos++;
+					break;
+				}
+				if (text[pos] == '/') {
+					CHECK(text.compare(pos, 2, "/>") == 0, fail(pos));
+					pos += 2;
+					closed = true;
+					break;
+				}
+
+				const std::string key = readName();
+				skipSpace();
+				CHECK(!key.empty() && pos < text.size() && text[pos] == '=', fail(pos));
+				pos++;
+				skipSpace();
+				CHECK(pos < text.size() && (text[pos] == '"' || text[pos] == '\''), fail(pos));
+				const size_t end = text.find(text[pos], pos + 1);
+				CHECK(end != std::string::npos, fail(pos));
+				node.attributes.push_back({ key, decodeEntities(text.substr(pos + 1, end - pos - 1)) });
+				pos = end + 1;
+			}
+
+			if (closed)
+				stack.back().children.push_back(std::move(node));
+			else
+				stack.push_back(std::move(node));
+		}
+	}
+
+	CHECK(stack.size() == 1, "MitsubaScene: Unclosed element <" + stack.back().name + "> - " + file);
+	for (auto& node : stack.front().children)
+		if (node.name == "scene")
+			return std::move(node);
+
+	throw std::runtime_error("MitsubaScene: No <scene> element - " + file);
+}
+
+// Comma or space separated
+static std::vector<float> parseFloats(const std::string& value)
+{
+	std::vector<float> values;
+	const char* cursor = value.c_str();
+	for (;;) {
+		while (*cursor == ',' || isSpace(*cursor))
+			cursor++;
+		if (*cursor == '\0')
+			break;
+
+		char* end;
+		const float v = strtof(cursor, &end);
+		if (end == cursor)
+			return {};
+		values.push_back(v);
+		cursor = end;
+	}
+
+	return values;
+}
+
+static float floatAttribute(const std::string& value, float defaultValue)
+{
+	const std::vector<float> values = parseFloats(value);
+	return values.size() == 1 ? values[0] : defaultValue;
+}
+
+static glm::vec3 vec3Attribute(const std::string& value, const glm::vec3& defaultValue)
+{
+	const std::vector<float> values = parseFloats(value);
+	return values.size() == 3 ? glm::vec3(values[0], values[1], values[2]) : defaultValue;
+}
+
+// rgb or a constant spectrum, false for anything else, e.g. a texture
+static bool readColor(const std::string& element, const std::string& value, glm::vec3& color)
+{
+	if (element != "rgb" && element != "spectrum")
+		return false;
+
+	const std::vector<float> values = parseFloats(value);
+	if (values.size() == 1)
+		color = glm::vec3(values[0]);
+	else if (values.size() == 3 && element == "rgb")
+		color = glm::vec3(values[0], values[1], values[2]);
+	else
+		return false;
+
+	return true;
+}
+
+// Each operation is applied after the ones before it, as in Mitsuba
+glm::mat4 MitsubaScene::parseTransform(const XmlNode& node)
+{
+	glm::mat4 transform(1.0f);
+	for (const auto& child : node.children) {
+		glm::mat4 op(1.0f);
+		if (child.name == "matrix") {
+			const std::vector<float> values = parseFloats(child.attribute("value"));
+			CHECK(values.size() == 16, "MitsubaScene: A matrix needs 16 values.");
+			op = glm::transpose(glm::make_mat4(values.data())); // row major in the file
+		}
+		else if (child.name == "translate") {
+			op = glm::translate(op, glm::vec3(floatAttribute(child.attribute("x"), 0.0f), floatAttribute(child.attribute("y"), 0.0f),
+				floatAttribute(child.attribute("z"), 0.0f)));
+		}
+		else if (child.name == "scale") {
+			const float uniform = floatAttribute(child.attribute("value"), 1.0f);
+			op = glm::scale(op, glm::vec3(floatAttribute(child.attribute("x"), uniform), floatAttribute(child.attribute("y"), uniform),
+				floatAttribute(child.attribute("z"), uniform)));
+		}
+		else if (child.name == "rotate") {
+			const glm::vec3 axis(floatAttribute(child.attribute("x"), 0.0f), floatAttribute(child.attribute("y"), 0.0f), floatAttribute(child.attribute("z"), 0.0f));
+			CHECK(glm::length(axis) > 0.0f, "MitsubaScene: A rotation needs an axis.");
+			op = glm::rotate(op, glm::radians(floatAttribute(child.attribute("angle"), 0.0f)), glm::normalize(axis));
+		}
+		else if (child.name == "lookat") {
+			const glm::vec3 origin = vec3Attribute(child.attribute("origin"), glm::vec3(0.0f));
+			const glm::vec3 direction = glm::normalize(vec3Attribute(child.attribute("target"), glm::vec3(0.0f, 0.0f, 1.0f)) - origin);
+			const glm::vec3 left = glm::normalize(glm::cross(vec3Attribute(child.attribute("up"), glm::vec3(0.0f, 1.0f, 0.0f)), direction));
+			op = glm::mat4(glm::vec4(left, 0.0f), glm::vec4(glm::cross(direction, left), 0.0f), glm::vec4(direction, 0.0f), glm::vec4(origin, 1.0f));
+		}
+		else {
+			WARN(false, "MitsubaScene: Skipping unsupported transform <" + child.name + ">.");
+		}
+
+		transform = op * transform;
+	}
+
+	return transform;
+}
+
+MitsubaBsdf MitsubaScene::parseBsdf(const XmlNode& node)
+{
+	const std::string& type = node.attribute("type");
+	if (type == "twosided") {
+		for (const auto& child : node.children)
+			if (child.name == "bsdf") {
+				MitsubaBsdf bsdf = parseBsdf(child);
+				bsdf.id = node.attribute("id");
+				return bsdf;
+			}
+
+		throw std::runtime_error("MitsubaScene: twosided without a nested bsdf.");
+	}
+
+	MitsubaBsdf bsdf;
+	bsdf.id = node.attribute("id");
+
+	const bool dielectric = type == "dielectric" || type == "roughdielectric" || type == "thindielectric";
+	const bool microfacet = type == "simplemicrofacet" || type == "roughconductor" || type == "conductor" || type == "roughplastic" || type == "plastic";
+	if (dielectric || type == "roughplastic" || type == "plastic")
+		bsdf.intIor = 1.5f;
+	if (type == "conductor" || type == "plastic" || type == "dielectric")
+		bsdf.alpha = 0.01f; // smooth
+
+	uint32_t distribution = BECKMANN;
+	bool hasDiffuse = false;
+	for (const auto& child : node.children) {
+		const std::string& name = child.attribute("name");
+		const std::string& value = child.attribute("value");
+		if (name == "alpha") {
+			bsdf.alpha = floatAttribute(value, bsdf.alpha);
+		}
+		else if (name == "intIOR" || name == "extIOR") {
+			const std::vector<float> ior = parseFloats(value);
+			WARN(ior.size() == 1, "MitsubaScene: Only numeric IORs are supported, " + bsdf.id + " keeps the default.");
+			if (ior.size() == 1)
+				(name == "intIOR" ? bsdf.intIor : bsdf.extIor) = ior[0];
+		}
+		else if (name == "distribution") {
+			WARN(value == "ggx" || value == "beckmann", "MitsubaScene: Distribution " + value + " is replaced by beckmann.");
+			distribution = value == "ggx" ? GGX : BECKMANN;
+		}
+		else if (name == "reflectance" || name == "diffuseReflectance") {
+			hasDiffuse = readColor(child.name, value, bsdf.diffuse);
+			WARN(hasDiffuse, "MitsubaScene: Only rgb and constant spectrum reflectances are supported, " + bsdf.id + " keeps the default.");
+		}
+		else if (name == "specularReflectance") {
+			WARN(readColor(child.name, value, bsdf.specular), "MitsubaScene: Only rgb and constant spectrum reflectances are supported, " + bsdf.id + " keeps the default.");
+		}
+	}
+
+	if (type == "diffuse")
+		bsdf.materialType = DIFFUSE;
+	else if (dielectric || (type == "simplemicrofacet" && !hasDiffuse && bsdf.intIor != bsdf.extIor))
+		bsdf.materialType = DIELECTRIC;
+	else if (microfacet)
+		bsdf.materialType = distribution;
+	else
+		WARN(false, "MitsubaScene: Unsupported bsdf " + type + " is replaced by diffuse.");
+
+	return bsdf;
+}
+
+void MitsubaScene::parseSensor(const XmlNode& node)
+{
+	if (sensor.found)
+		return;
+
+	const std::string& type = node.attribute("type");
+	WARN(type == "perspective" || type == "thinlens", "MitsubaScene: Sensor " + type + " is treated as perspective.");
+	sensor.found = true;
+
+	for (const auto& child : node.children) {
+		const std::string& name = child.attribute("name");
+		if (child.name == "transform" && name == "toWorld") {
+			const glm::mat4 toWorld = parseTransform(child);
+			for (int row = 0; row < 4; row++)
+				for (int column = 0; column < 4; column++)
+					sensor.toWorld[row * 4 + column] = toWorld[column][row];
+		}
+		else if (name == "fov") {
+			sensor.fov = floatAttribute(child.attribute("value"), sensor.fov);
+		}
+		else if (name == "focusDistance") {
+			sensor.focusDistance = floatAttribute(child.attribute("value"), sensor.focusDistance);
+		}
+	}
+}
+
+void MitsubaScene::parseShape(const XmlNode& node)
+{
+	const std::string& type = node.attribute("type");
+	if (type != "obj" && type != "rectangle") {
+		WARN(false, "MitsubaScene: Skipping unsupported shape " + type + ".");
+		return;
+	}
+
+	MitsubaShape shape;
+	std::string path;
+	bool flipNormals = false;
+	bool hasBsdf = false;
+	for (const auto& child : node.children) {
+		const std::string& name = child.attribute("name");
+		if (child.name == "string" && name == "filename") {
+			path = resolve(child.attribute("value"));
+		}
+		else if (child.name == "boolean" && name == "flipNormals") {
+			flipNormals = child.attribute("value") == "true";
+		}
+		else if (child.name == "transform" && name == "toWorld") {
+			shape.toWorld = parseTransform(child);
+		}
+		else if (child.name == "bsdf") {
+			shape.bsdf = static_cast<uint32_t>(bsdfs.size());
+			bsdfs.push_back(parseBsdf(child));
+			if (!bsdfs.back().id.empty())
+				bsdfIds[bsdfs.back().id] = shape.bsdf;
+			hasBsdf = true;
+		}
+		else if (child.name == "ref") {
+			const auto bsdf = bsdfIds.find(child.attribute("id"));
+			CHECK(bsdf != bsdfIds.end(), "MitsubaScene: Unknown bsdf " + child.attribute("id") + ".");
+			shape.bsdf = bsdf->second;
+			hasBsdf = true;
+		}
+		else if (child.name == "emitter") {
+			WARN(child.attribute("type") == "area", "MitsubaScene: Skipping unsupported shape emitter " + child.attribute("type") + ".");
+			if (child.attribute("type") != "area")
+				continue;
+
+			shape.radiance = glm::vec3(1.0f);
+			for (const auto& parameter : child.children)
+				if (parameter.attribute("name") == "radiance")
+					WARN(readColor(parameter.name, parameter.attribute("value"), shape.radiance), "MitsubaScene: Only rgb and constant spectrum radiances are supported.");
+		}
+	}
+
+	CHECK(type != "obj" || !path.empty(), "MitsubaScene: obj shape without a filename.");
+	if (!hasBsdf) {
+		shape.bsdf = static_cast<uint32_t>(bsdfs.size());
+		bsdfs.push_back(MitsubaBsdf());
+	}
+
+	shape.mesh = addMesh(path, flipNormals);
+	shapes.push_back(shape);
+}
+
+uint32_t MitsubaScene::addMesh(const std::string& path, bool flipNormals)
+{
+	const auto mesh = meshIds.insert({ path + (flipNormals ? "|flipped" : ""), static_cast<uint32_t>(meshes.size()) });
+	if (mesh.second)
+		meshes.push_back({ path, flipNormals });
+
+	return mesh.first->second;
+}
+
+// Next to the scene file, then in each search path with the relative path and with the file name alone
+std::string MitsubaScene::resolve(const std::string& fileName) const
+{
+	const std::filesystem::path file(fileName);
+	if (file.is_absolute()) {
+		CHECK(std::filesystem::exists(file), "MitsubaScene: File not found - " + fileName);
+		return fileName;
+	}
+
+	std::vector<std::filesystem::path> candidates = { std::filesystem::path(sceneFile).parent_path() / file };
+	for (const auto& searchPath : searchPaths)
+		candidates.push_back(std::filesystem::path(searchPath) / file);
+	for (const auto& searchPath : searchPaths)
+		candidates.push_back(std::filesystem::path(searchPath) / file.filename());
+
+	for (const auto& candidate : candidates)
+		if (std::filesystem::exists(candidate))
+			return candidate.string();
+
+	throw std::runtime_error("MitsubaScene: File not found - " + fileName);
+}
+
+MitsubaScene::MitsubaScene(const std::string& sceneFile, const std::vector<std::string>& searchPaths) : sceneFile(sceneFile), searchPaths(searchPaths)
+{
+	std::ifstream stream(sceneFile, std::ios::binary);
+	CHECK(stream, "MitsubaScene: Failed to open " + sceneFile);
+	std::stringstream text;
+	text << stream.rdbuf();
+
+	const XmlNode scene = parseXml(text.str(), sceneFile);
+	for (const auto& node : scene.children) {
+		if (node.name == "sensor") {
+			parseSensor(node);
+		}
+		else if (node.name == "bsdf") {
+			const uint32_t bsdf = static_cast<uint32_t>(bsdfs.size());
+			bsdfs.push_back(parseBsdf(node));
+			if (!bsdfs.back().id.empty())
+				bsdfIds[bsdfs.back().id] = bsdf;
+		}
+		else if (node.name == "shape") {
+			parseShape(node);
+		}
+		else if (node.name == "emitter" || node.name == "include" || node.name == "texture") {
+			WARN(false, "MitsubaScene: Skipping unsupported <" + node.name + " type=\"" + node.attribute("type") + "\">.");
+		}
+	}
+}
+
+std::vector<std::string> MitsubaScene::getMeshFiles() const
+{
+	std::vector<std::string> files;
+	std::unordered_set<std::string> added;
+	for (const auto& mesh : meshes)
+		if (!mesh.path.empty() && added.insert(mesh.path).second)
+			files.push_back(mesh.path);
+
+	return files;
+}
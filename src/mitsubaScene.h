@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "model.hpp"
+
+/*
+ * Mitsuba scene - Reads a scene in the Mitsuba 0.6 XML format into plain arrays that a scene loader turns into a Model, see loadMitsuba() in
+ * sceneManager.cpp. Supported are
+ * sensor   The toWorld transform and fov of the first perspective sensor, passed as is to Camera::setCamera(), like the hand written scenes do.
+ * bsdf     diffuse -> DIFFUSE, simplemicrofacet, roughconductor, roughplastic -> GGX or BECKMANN by their distribution, dielectric and
+ *          roughdielectric -> DIELECTRIC, twosided is replaced by its nested bsdf. A simplemicrofacet with an index of refraction but no
+ *          reflectance is a DIELECTRIC as well. Only rgb and spectrum values with a single value are read, textures keep the default.
+ * shape    obj files and rectangles, with a toWorld transform made of matrix, translate, scale, rotate and lookat, an inline bsdf or a ref to
+ *          a named one. Shapes that use the same file share a mesh and become instances of it.
+ * emitter  area emitters of shapes, their rgb radiance goes into the radiance of the instance.
+ * Anything else, e.g. the integrator, environment emitters or other shape types, is skipped with a warning when it affects the image.
+ */
+
+struct MitsubaBsdf
+{
+	std::string id; // empty for inline bsdfs
+	uint32_t materialType = DIFFUSE; // BRDF_TYPE
+	glm::vec3 diffuse = glm::vec3(0.5f);
+	glm::vec3 specular = glm::vec3(1.0f);
+	float alpha = 0.1f;
+	float intIor = 1.0f;
+	float extIor = 1.0f;
+};
+
+struct MitsubaMesh
+{
+	std::string path; // empty for the rectangle, [-1, 1]^2 in the xy plane facing +z
+	bool flipNormals = false;
+};
+
+struct MitsubaShape
+{
+	uint32_t mesh; // into getMeshes()
+	uint32_t bsdf; // into getBsdfs()
+	glm::mat4 toWorld = glm::mat4(1.0f);
+	glm::vec3 radiance = glm::vec3(0.0f); // non-zero for area emitters
+};
+
+struct MitsubaSensor
+{
+	bool found = false;
+	std::array<float, 16> toWorld = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 }; // row major, as in the file
+	float fov = 45.0f;
+	float focusDistance = 5.0f;
+};
+
+class MitsubaScene
+{
+public:
+	// Relative file names are looked up next to the scene file, then in each search path. Throws when the file is malformed or a mesh is missing.
+	MitsubaScene(const std::string& sceneFile, const std::vector<std::string>& searchPaths = {});
+
+	const std::vector<MitsubaBsdf>& getBsdfs() const
+	{
+		return bsdfs;
+	}
+
+	const std::vector<MitsubaMesh>& getMeshes() const
+	{
+		return meshes;
+	}
+
+	const std::vector<MitsubaShape>& getShapes() const
+	{
+		return shapes;
+	}
+
+	const MitsubaSensor& getSensor() const
+	{
+		return sensor;
+	}
+
+	// Every obj file of the scene, once
+	std::vector<std::string> getMeshFiles() const;
+
+private:
+	struct XmlNode
+	{
+		std::string name;
+		std::vector<std::pair<std::string, std::string>> attributes;
+		std::vector<XmlNode> children;
+
+		// Empty when missing
+		const std::string& attribute(const std::string& key) const;
+	};
+
+	std::string sceneFile;
+	std::vector<std::string> searchPaths;
+	std::vector<MitsubaBsdf> bsdfs;
+	std::vector<MitsubaMesh> meshes;
+	std::vector<MitsubaShape> shapes;
+	MitsubaSensor sensor;
+	std::unordered_map<std::string, uint32_t> bsdfIds; // named bsdfs by id
+	std::unordered_map<std::string, uint32_t> meshIds; // by path and flipNormals
+
+	static XmlNode parseXml(const std::string& text, const std::string& file);
+	static glm::mat4 parseTransform(const XmlNode& node);
+	static MitsubaBsdf parseBsdf(const XmlNode& node);
+
+	void parseSensor(const XmlNode& node);
+	void parseShape(const XmlNode& node);
+	uint32_t addMesh(const std::string& path, bool flipNormals);
+	std::string resolve(const std::string& fileName) const;
+};
@@ -3,16 +3,26 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <unordered_map>
+#include <memory>
 
 #include "vulkan/vulkan.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtx/hash.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include "helper.h"
 #include "accelerationStructure.h"
 #include "generator.h"
+#include "vertexCompression.h"
+#include "../shaders/hostDeviceShared.h"
+#include "meshletBuilder.h"
+#include "instanceCuller.h"
+#include "tlasUpdatePolicy.h"
+#include "blasPlanner.h"
+#include "tiledTextureCache.h"
 
 /*
  * Mesh organisation philosphy - Think of each mesh having one or more instances. A model is composed of several such meshes and their instanaces. Simply put,
@@ -28,7 +38,9 @@
 
  * Accelaration Structure notes - We want to minimize the number of bottom level accelaration structures for performance reasons. 
  * Ideally one should categorize the meshes into groups and create one bottom level accelaration structure for each group.
- * In our implementation we will simply associate one BLAS for each mesh. Thus we assume each mesh is already a combination of several other meshes as explained above.
+ * Each mesh gets a BLAS of its own, except runs of small static meshes that BlasPlanner groups into one BLAS, see blasPlanner.h. The TLAS instance
+ * of a group carries the index of the first instance of the group as custom index, the hit shaders read InstanceData_static through it.
+ * BLAS are compacted after the build unless disabled with setBlasCompaction().
  * Also we simply use graphics queues and buffers for constructing the accelaration structure.
  */
 
@@ -45,6 +57,7 @@ struct Material
 	uint32_t specularTextureIdx;
 	uint32_t alphaIntExtIorTextureIdx;
 	uint32_t materialType;
+	glm::vec3 emission = glm::vec3(0.0f);
 };
 
 struct Vertex 
@@ -57,7 +70,7 @@ struct Vertex
 
 	bool operator==(const Vertex& other) const 
 	{
-		return pos == other.pos && color == other.color && normal == other.normal && texCoord == other.texCoord;
+		return pos == other.pos && color == other.color && normal == other.normal && texCoord == other.texCoord && materialIndex == other.materialIndex;
 	}
 };
 
@@ -67,7 +80,12 @@ namespace std
 	{
 		size_t operator()(Vertex const& vertex) const 
 		{
-			return ((hash<glm::vec3>()(vertex.pos) ^ (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^ (hash<glm::vec2>()(vertex.texCoord) << 1);
+			size_t seed = hash<glm::vec3>()(vertex.pos);
+			glm::detail::hash_combine(seed, hash<glm::vec3>()(vertex.color));
+			glm::detail::hash_combine(seed, hash<glm::vec3>()(vertex.normal));
+			glm::detail::hash_combine(seed, hash<glm::vec2>()(vertex.texCoord));
+			glm::detail::hash_combine(seed, hash<uint32_t>()(vertex.materialIndex));
+			return seed;
 		}
 	};
 }
@@ -78,7 +96,7 @@ namespace std
 // Per instance data, not meant for draw time updates
 struct InstanceData_static 
 {
-	glm::uvec4 data; // material index, primitive start offset, area light offset (24 bit) | radiance of light source (8 bit), 0
+	glm::uvec4 data; // material index, primitive start offset, area light offset (24 bit) | radiance of light source (8 bit), mesh index
 };
 
 // Per instance data, update at drawtime
@@ -88,6 +106,30 @@ struct InstanceData_dynamic {
 	glm::mat4 modelPrev;
 };
 
+// Input to Model::addInstances()
+struct InstanceDescriptor
+{
+	uint32_t meshIdx;
+	glm::mat4 transform;
+	uint32_t materialIndex = 0xffffffff; // Overrides the per vertex material when provided
+	uint32_t radiance = 0; // Non-zero for area light sources
+};
+
+// Coarser level of detail of a mesh, indexes the vertices of the mesh. See meshSimplifier.h
+struct MeshLod
+{
+	std::vector<uint32_t> indices;
+	float error; // object space distance to the full detail mesh
+};
+
+// Location of a coarser level of detail in Model::lodIndices
+struct MeshLodRange
+{
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error;
+};
+
 // defines a single mesh and its instances
 class Mesh 
 {
@@ -95,6 +137,8 @@ public:
 	// define a single mesh
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
+	// level of detail 1, 2, ... with increasing error, level 0 is indices
+	std::vector<MeshLod> lods;
 	// set of instance count for this type of mesh
 	uint32_t instanceCount = 0;
 	// compute bounding sphere, store center and radius
@@ -102,7 +146,8 @@ public:
 
 	BottomLevelAccelerationStructure as_bottomLevel;
 
-	void initBLAS(const VkDevice& device, const VkCommandBuffer &cmdBuf, const VmaAllocator& allocator, const VkBuffer &vertexBuffer, const VkDeviceSize vertexBufferOffset, const VkBuffer &indexBuffer, const VkDeviceSize indexBufferOffset) 
+	// Creates the BLAS, it is built by the batch of Model::createRtxBuffers()
+	void initBLAS(const VkDevice& device, const VmaAllocator& allocator, const VkBuffer &vertexBuffer, const VkDeviceSize vertexBufferOffset, const VkBuffer &indexBuffer, const VkDeviceSize indexBufferOffset, const VkDeviceSize vertexStride = sizeof(Vertex), bool allowCompaction = false) 
 	{
 		CHECK(vertexBuffer != VK_NULL_HANDLE,
 			"Model: Vertex buffer for creating BLAS not initialized");
@@ -111,7 +156,14 @@ public:
 			"Model: Vertex indices for creating BLAS not initialized");
 
 		std::vector<VkGeometryNV> vGeometry;
+		vGeometry.push_back(triangleGeometry(vertexBuffer, vertexBufferOffset, static_cast<uint32_t>(vertices.size()), vertexStride, indexBuffer, indexBufferOffset,
+			static_cast<uint32_t>(indices.size())));
+		as_bottomLevel.create(device, allocator, vGeometry, false, allowCompaction);
+	}
 
+	static VkGeometryNV triangleGeometry(const VkBuffer& vertexBuffer, const VkDeviceSize vertexBufferOffset, uint32_t vertexCount, const VkDeviceSize vertexStride,
+		const VkBuffer& indexBuffer, const VkDeviceSize indexBufferOffset, uint32_t indexCount)
+	{
 		VkGeometryNV geometry;
 		geometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
 		geometry.pNext = nullptr;
@@ -120,13 +172,13 @@ public:
 		geometry.geometry.triangles.pNext = nullptr;
 		geometry.geometry.triangles.vertexData = vertexBuffer;
 		geometry.geometry.triangles.vertexOffset = vertexBufferOffset;
-		geometry.geometry.triangles.vertexCount = static_cast<uint32_t>(vertices.size());
-		geometry.geometry.triangles.vertexStride = sizeof(Vertex);
+		geometry.geometry.triangles.vertexCount = vertexCount;
+		geometry.geometry.triangles.vertexStride = vertexStride;
 		// Limitation to 3xfloat32 for vertices
 		geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
 		geometry.geometry.triangles.indexData = indexBuffer;
 		geometry.geometry.triangles.indexOffset = indexBufferOffset;
-		geometry.geometry.triangles.indexCount = static_cast<uint32_t>(indices.size());
+		geometry.geometry.triangles.indexCount = indexCount;
 		// Limitation to 32-bit indices
 		geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
 		geometry.geometry.triangles.transformData = VK_NULL_HANDLE;
@@ -134,9 +186,7 @@ public:
 		geometry.geometry.aabbs = { VK_STRUCTURE_TYPE_GEOMETRY_AABB_NV };
 		geometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
 
-		vGeometry.push_back(geometry);
-		as_bottomLevel.create(device, allocator, vGeometry);
-		as_bottomLevel.cmdBuild(cmdBuf, vGeometry);
+		return geometry;
 	}
 
 	void normailze(float scale, const glm::vec3 &shift = glm::vec3(0.0f))
@@ -160,6 +210,8 @@ public:
 			vertex.pos *= scale;
 			vertex.pos += shift;
 		}
+
+		computeBoundingSphere();
 	}
 
 	void computeBoundingSphere()
@@ -180,152 +232,362 @@ public:
 // composed of individual meshes
 class Model {
 public:
-	VkImageView ldrTextureImageView;
-	VkSampler ldrTextureSampler = VK_NULL_HANDLE;
-
-	VkImageView hdrTextureImageView;
-	VkSampler hdrTextureSampler = VK_NULL_HANDLE;
-	
 	~Model()
 	{
 		for (auto mesh : meshes)
 			delete mesh;
 	}
 
+	// A mesh with the same vertices, indices and levels of detail as an earlier one, e.g. the same file loaded twice, keeps its index but
+	// aliases the earlier mesh: it shares its vertices, indices and BLAS, only its instances are its own.
 	uint32_t addMesh(Mesh* mesh) 
 	{	
-		size_t indexOffset = 0;
-		size_t meshVertexOffset = 0;
-
-		for (auto& mesh : meshes) {
-			indexOffset += mesh->indices.size();
-			meshVertexOffset += mesh->vertices.size();
-		}
+		const uint32_t original = findDuplicateMesh(*mesh);
+		if (original != 0xffffffff)
+			return addMeshAlias(mesh, original);
+
+		CHECK(vertices.size() + mesh->vertices.size() <= 0xffffffff && indices.size() + mesh->indices.size() <= 0xffffffff,
+			"Model: Vertex and index count must fit in 32 bits.");
+
+		// Offsets are a running prefix sum over the meshes added so far
+		MeshOffsets offsets;
+		offsets.vertexOffset = static_cast<uint32_t>(vertices.size());
+		offsets.indexOffset = static_cast<uint32_t>(indices.size());
+		offsets.vertexCount = static_cast<uint32_t>(mesh->vertices.size());
+		offsets.indexCount = static_cast<uint32_t>(mesh->indices.size());
+		meshOffsets.push_back(offsets);
 		
 		vertices.insert(vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
 		indices.insert(indices.end(), mesh->indices.begin(), mesh->indices.end());
 		indicesRtx.insert(indicesRtx.end(), mesh->indices.begin(), mesh->indices.end());
 		
-		for (size_t i = indexOffset; i < indices.size(); i++)
-			indices[i] += static_cast<uint32_t>(meshVertexOffset);
+		for (size_t i = offsets.indexOffset; i < indices.size(); i++)
+			indices[i] += offsets.vertexOffset;
+
+		// Coarser levels follow each other in lodIndices, which is uploaded right after indices
+		if (meshLodOffsets.empty())
+			meshLodOffsets.push_back(0);
+		for (const auto& lod : mesh->lods) {
+			CHECK(lodIndices.size() + lod.indices.size() <= 0xffffffff, "Model: Vertex and index count must fit in 32 bits.");
+			lodRanges.push_back({ static_cast<uint32_t>(lodIndices.size()), static_cast<uint32_t>(lod.indices.size()), lod.error });
+			for (uint32_t index : lod.indices)
+				lodIndices.push_back(index + offsets.vertexOffset);
+		}
+		meshLodOffsets.push_back(static_cast<uint32_t>(lodRanges.size()));
+
+		// Clusters of the level 0 indices, for culling at a finer granularity than meshes
+		if (meshletOffsets.empty())
+			meshletOffsets.push_back(0);
+		for (auto meshlet : MeshletBuilder::build(mesh->vertices, mesh->indices)) {
+			meshlet.firstIndex += offsets.indexOffset;
+			meshlet.meshIdx = static_cast<uint32_t>(meshes.size());
+			meshlets.push_back(meshlet);
+		}
+		meshletOffsets.push_back(static_cast<uint32_t>(meshlets.size()));
 
 		VkDrawIndexedIndirectCommand indirectCmd = {};
 		indirectCmd.firstInstance = 0; // Tells Vulkan which index of the instanceData (Static and Dynamic) to look at, this must be updated after adding each instance
 		indirectCmd.instanceCount = mesh->instanceCount; // also update after adding each insatnce
-		indirectCmd.firstIndex = static_cast<uint32_t>(indexOffset);
-		indirectCmd.indexCount = static_cast<uint32_t>(mesh->indices.size());
+		indirectCmd.firstIndex = offsets.indexOffset;
+		indirectCmd.indexCount = offsets.indexCount;
 
 		indirectCommands.push_back(indirectCmd);
 		
+		meshHashes.emplace(hashMesh(*mesh), static_cast<uint32_t>(meshes.size()));
+		meshAliases.push_back(static_cast<uint32_t>(meshes.size()));
 		meshes.push_back(mesh);
 
 		return static_cast<uint32_t>(meshes.size());
 	}
 
-	uint32_t addLdrTexture(Image2d texture)
+	// Loads the tiles of the LDR textures, or writes them when the file is missing or stale
+	void createTiledTextures()
+	{
+		if (tiledTextureCacheFile.empty())
+			return;
+
+		ldrTexGen.waitForTextures();
+		const std::vector<Image2d>& textures = ldrTexGen.getTextures();
+		const uint64_t key = TiledTextureCache::computeKey(textures);
+		tiledTextures = std::make_unique<TiledTextureCache>(tiledTextureCacheFile);
+		if (!tiledTextures->load(key, virtualPageTable)) {
+			auto start = std::chrono::high_resolution_clock::now();
+			tiledTextures->save(key, textures);
+			std::cout << "Model: Tiled textures written in " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+			if (!tiledTextures->load(key, virtualPageTable)) {
+				WARN(false, "Model: Tiled texture cache can not be loaded, virtual texturing is disabled - " + tiledTextureCacheFile);
+				tiledTextures.reset();
+				return;
+			}
+		}
+
+		std::cout << "Model: " << virtualPageTable.pageCount() << " virtual texture pages of " << virtualPageTable.textureCount() << " textures, "
+			<< virtualPageTable.pageCount() * TiledTextureCache::tileBytes() / (1024.0 * 1024.0) << " MB of tiles" << std::endl;
+	}
+
+	// Shared by duplicate meshes since the start, see addMesh()
+	void printMeshDedupReport() const
+	{
+		if (dedupStats.meshes == 0)
+			return;
+
+		const size_t vertexSize = packedVertices ? sizeof(PackedVertex) : sizeof(Vertex);
+		const double mb = 1.0 / (1024.0 * 1024.0);
+		// Indices are stored twice, for the raster and for the BLAS builds
+		const double saved = (dedupStats.vertices * vertexSize + dedupStats.indices * 2 * sizeof(uint32_t) + dedupStats.lodIndices * sizeof(uint32_t)) * mb;
+		std::cout << "Mesh deduplication - " << dedupStats.meshes << " of " << meshes.size() << " meshes alias an earlier one, " << saved
+			<< " MB of vertices and indices and " << dedupStats.meshes << " BLAS builds saved" << std::endl;
+	}
+
+	uint32_t addLdrTexture(Image2d&& texture)
 	{	
 		CHECK(texture.format == VK_FORMAT_R8G8B8A8_UNORM,
 			"Model : Ldr texture must be VK_FORMAT_R8G8B8A8_UNORM format type");
 
-		return static_cast<uint32_t>(ldrTexGen.addTexture(texture));
+		return static_cast<uint32_t>(ldrTexGen.addTexture(std::move(texture)));
 	}
 
-	uint32_t addHdrTexture(Image2d texture)
+	// Decoded on the thread pool, the returned index is valid right away. The texture must be RGBA8.
+	uint32_t addLdrTexture(const std::string& path)
+	{
+		return static_cast<uint32_t>(ldrTexGen.addTexture(ImageDecoder::decode(path)));
+	}
+
+	uint32_t addHdrTexture(Image2d&& texture)
 	{
 		CHECK(texture.format == VK_FORMAT_R32G32B32A32_SFLOAT,
 			"Model: Hdr texture must be VK_FORMAT_R32G32B32A32_SFLOAT format type");
 
-		return static_cast<uint32_t>(hdrTexGen.addTexture(texture));
+		return static_cast<uint32_t>(hdrTexGen.addTexture(std::move(texture)));
+	}
+
+	// LDR textures are uploaded as BC1 or BC3 when the device supports it. The HDR textures hold values above 1 and stay uncompressed.
+	void setTextureCompression(bool enable)
+	{
+		ldrTexGen.setCompression(enable);
+	}
+
+	// Storage of the HDR (alpha, intIor, extIor) textures, see TextureGenerator::setFloatFormat(). Half floats halve the memory, shared
+	// exponent RGB quarters it with a precision relative to the largest of the three parameters.
+	void setHdrTextureFormat(VkFormat format)
+	{
+		hdrTexGen.setFloatFormat(format);
 	}
 
-	uint32_t addMaterial(uint32_t diffuseTextureIdx, uint32_t specularTextureIdx, uint32_t alphaIorTextureIdx, uint32_t materialfType)
+	// Cooked texture arrays are read from and written to path + ".ldr.tcook" and path + ".hdr.tcook", see CookedTextureCache
+	void setCookedTextureCache(const std::string& path)
 	{
-		CHECK(diffuseTextureIdx < ldrTexGen.size(),
+		ldrTexGen.setCookedCacheFile(path + ".ldr.tcook");
+		hdrTexGen.setCookedCacheFile(path + ".hdr.tcook");
+	}
+
+	// The LDR textures are also cut into the pages of virtual texturing and written to path + ".vtex", see TiledTextureCache. Later runs map
+	// the file. After createBuffers(), getTiledTextures() and getVirtualPageTable() feed a VirtualTextureStreamer.
+	void setTiledTextureCache(const std::string& path)
+	{
+		tiledTextureCacheFile = path + ".vtex";
+	}
+
+	// nullptr without setTiledTextureCache() or when the file could not be written
+	const TiledTextureCache* getTiledTextures() const
+	{
+		return tiledTextures.get();
+	}
+
+	const PageTable& getVirtualPageTable() const
+	{
+		return virtualPageTable;
+	}
+
+	// Color of a material without a texture, equal colors are shared. Unlike addLdrTexture(), the returned value is passed to addMaterial()
+	// as is. It is never uploaded, the shaders read it from the material.
+	uint32_t addLdrConstant(const glm::vec4& color)
+	{
+		return ldrTexGen.addConstant(color);
+	}
+
+	// Parameters of a material without a texture, e.g. roughness alpha and IORs, see addLdrConstant()
+	uint32_t addHdrConstant(const glm::vec4& value)
+	{
+		return hdrTexGen.addConstant(value, true);
+	}
+
+	// Materials that end up equal on the device, e.g. the same constant color added as two textures, are merged by createBuffers()
+	uint32_t addMaterial(uint32_t diffuseTextureIdx, uint32_t specularTextureIdx, uint32_t alphaIorTextureIdx, uint32_t materialfType,
+		const glm::vec3& emission = glm::vec3(0.0f))
+	{
+		CHECK(ldrTexGen.isValid(diffuseTextureIdx),
 			"Model: This ldr texture does not exsist");
 
-		CHECK(specularTextureIdx < ldrTexGen.size(),
+		CHECK(ldrTexGen.isValid(specularTextureIdx),
 			"Model : This ldr texture does not exsist");
 
-		CHECK(alphaIorTextureIdx < hdrTexGen.size(),
+		CHECK(hdrTexGen.isValid(alphaIorTextureIdx),
 			"Model : This hdr texture does not exsist");
 
-		materials.push_back({ diffuseTextureIdx, specularTextureIdx, alphaIorTextureIdx, materialfType });
+		materials.push_back({ diffuseTextureIdx, specularTextureIdx, alphaIorTextureIdx, materialfType, emission });
 
 		return static_cast<uint32_t>(materials.size());
 	}
 	
 	// When non-default materialIndex is provided, it will override the per vertex material.
+	// Each call re-sorts all instances, use addInstances() when adding many instances.
 	uint32_t addInstance(uint32_t meshIdx, glm::mat4 &transform, uint32_t materialIndex = 0xffffffff, uint32_t radiance = 0)
 	{
-		CHECK(meshIdx < meshes.size(), "Model: This mesh does not exsist");
-		CHECK(materialIndex >= 0xffffffff || materialIndex < materials.size(), "Model: This material does not exsist");
-		CHECK(radiance < 256, "Model: Radiance value should be less than 256, since we have 8 bits to represent radiance.");
+		return addInstances({ { meshIdx, transform, materialIndex, radiance } });
+	}
 
-		uint32_t indexOffset = 0;
-		for (uint32_t i = 0; i < meshIdx; i++)
-			indexOffset += static_cast<uint32_t>(meshes[i]->indices.size());
-		
-		InstanceData_static instanceDataStatic;
-		instanceDataStatic.data = glm::uvec4(materialIndex, indexOffset, radiance, 0);
-
-		// When the instance is of type light source, ensure the matrial type is AREA (or other emitter type)
-		if (radiance) {
-			const Mesh* mesh = meshes[meshIdx];
-			if (materialIndex >= 0xffffffff) {
-
-				// Ensure all vertices have a materialIndex that points to a material of type AREA
-				for (const auto& v : mesh->vertices) {
-					if (materials[v.materialIndex].materialType != AREA) {
-						WARN(false, "Model: Material type must be AREA when radiance param is non zero!");
-						materials[v.materialIndex].materialType = AREA;
+	// Instances are stored grouped by mesh, i.e. aaa-bbbbb-ccccc-dddddd. Groups are ordered by the first appearance of their mesh, within a group
+	// the instances keep the order they were added in. All instance tables, the area light offsets and the indirect commands are rebuilt in a
+	// single linear pass.
+	uint32_t addInstances(const std::vector<InstanceDescriptor>& newInstances)
+	{
+		const size_t oldInstanceCount = instanceData_static.size();
+		const size_t instanceCount = oldInstanceCount + newInstances.size();
+
+		for (const auto& instance : newInstances) {
+			CHECK(instance.meshIdx < meshes.size(), "Model: This mesh does not exsist");
+			CHECK(instance.materialIndex >= 0xffffffff || instance.materialIndex < materials.size(), "Model: This material does not exsist");
+			CHECK(instance.radiance < 256, "Model: Radiance value should be less than 256, since we have 8 bits to represent radiance.");
+
+			// When the instance is of type light source, ensure the matrial type is AREA (or other emitter type)
+			if (instance.radiance) {
+				if (instance.materialIndex >= 0xffffffff) {
+
+					// Ensure all vertices have a materialIndex that points to a material of type AREA
+					for (const auto& v : meshes[instance.meshIdx]->vertices) {
+						if (materials[v.materialIndex].materialType != AREA) {
+							WARN(false, "Model: Material type must be AREA when radiance param is non zero!");
+							materials[v.materialIndex].materialType = AREA;
+						}
 					}
 				}
+				else if (materials[instance.materialIndex].materialType != AREA) {
+					WARN(false, "Model: Material type must be AREA (or other emitter type) when radiance param is non zero!");
+					materials[instance.materialIndex].materialType = AREA; // TODO :: change to appropriate emiiter type in future
+				}
 			}
-			else if (materials[materialIndex].materialType != AREA) {
-				WARN(false, "Model: Material type must be AREA (or other emitter type) when radiance param is non zero!");
-				materials[materialIndex].materialType = AREA; // TODO :: change to appropriate emiiter type in future
-			}
+		}
 
-			instanceDataStatic.data.z = instanceDataStatic.data.z | (areaLightPrimitiveOffsetCounter << 8);
-			areaLightPrimitiveOffsetCounter += static_cast<uint32_t>(mesh->indices.size());
+		// Rank the meshes by first appearance, existing instances come first
+		std::vector<uint32_t> groupRank(meshes.size(), 0xffffffff);
+		uint32_t groupCount = 0;
+		for (uint32_t meshIdx : meshPointers)
+			if (groupRank[meshIdx] == 0xffffffff)
+				groupRank[meshIdx] = groupCount++;
+		for (const auto& instance : newInstances)
+			if (groupRank[instance.meshIdx] == 0xffffffff)
+				groupRank[instance.meshIdx] = groupCount++;
+
+		// Counting sort by group
+		std::vector<uint32_t> groupStart(groupCount + 1, 0);
+		for (uint32_t meshIdx : meshPointers)
+			groupStart[groupRank[meshIdx] + 1]++;
+		for (const auto& instance : newInstances)
+			groupStart[groupRank[instance.meshIdx] + 1]++;
+		for (uint32_t i = 0; i < groupCount; i++)
+			groupStart[i + 1] += groupStart[i];
+
+		std::vector<InstanceData_static> sortedStatic(instanceCount);
+		std::vector<InstanceData_dynamic> sortedDynamic(instanceCount);
+		std::vector<uint32_t> sortedMeshPointers(instanceCount);
+		std::vector<uint32_t> groupFill(groupStart.begin(), groupStart.end() - 1);
+
+		for (size_t i = 0; i < oldInstanceCount; i++) {
+			uint32_t dst = groupFill[groupRank[meshPointers[i]]]++;
+			sortedStatic[dst] = instanceData_static[i];
+			sortedDynamic[dst] = instanceData_dynamic[i];
+			sortedMeshPointers[dst] = meshPointers[i];
 		}
-		
-		// assumes instances have meshIdx in groups i.e. aaa-bbbbb-ccccc-dddddd. 
-		uint32_t firstInstance = 0;
-		while (firstInstance < meshPointers.size() && meshPointers[firstInstance] != meshIdx)
-			firstInstance++;
 
-		if (meshPointers.size() < 2 || firstInstance >= meshPointers.size() - 1) {
-			instanceData_static.push_back(instanceDataStatic);
-			instanceData_dynamic.push_back({ transform, glm::transpose(glm::inverse(transform)), transform });
-			meshPointers.push_back(meshIdx);
+		for (const auto& instance : newInstances) {
+			uint32_t dst = groupFill[groupRank[instance.meshIdx]]++;
+			sortedStatic[dst].data = glm::uvec4(instance.materialIndex, meshOffsets[instance.meshIdx].indexOffset, instance.radiance, instance.meshIdx);
+			sortedDynamic[dst] = { instance.transform, glm::transpose(glm::inverse(instance.transform)), instance.transform };
+			sortedMeshPointers[dst] = instance.meshIdx;
 		}
-		else {
-			instanceData_static.insert(instanceData_static.begin() + firstInstance + 1, 1, instanceDataStatic);
-			instanceData_dynamic.insert(instanceData_dynamic.begin() + firstInstance + 1, 1, { transform, glm::transpose(glm::inverse(transform)), transform });
-			meshPointers.insert(meshPointers.begin() + firstInstance + 1, 1, meshIdx);
+
+		instanceData_static.swap(sortedStatic);
+		instanceData_dynamic.swap(sortedDynamic);
+		meshPointers.swap(sortedMeshPointers);
+
+		// Area light primitive offsets follow the storage order of the light instances, AreaLightSources relies on this
+		areaLightPrimitiveOffsetCounter = 0;
+		for (size_t i = 0; i < instanceCount; i++) {
+			uint32_t& radianceAndOffset = instanceData_static[i].data.z;
+			if (radianceAndOffset & 0xff) {
+				radianceAndOffset = (radianceAndOffset & 0xff) | (areaLightPrimitiveOffsetCounter << 8);
+				areaLightPrimitiveOffsetCounter += meshOffsets[meshPointers[i]].indexCount;
+			}
 		}
-		
-		meshes[meshIdx]->instanceCount++;
 
 		for (uint32_t meshIdx = 0; meshIdx < meshes.size(); meshIdx++) {
-			firstInstance = 0;
-			while (firstInstance < meshPointers.size() && meshPointers[firstInstance] != meshIdx)
-				firstInstance++;
-
-			indirectCommands[meshIdx].firstInstance = firstInstance;
+			uint32_t rank = groupRank[meshIdx];
+			meshes[meshIdx]->instanceCount = rank == 0xffffffff ? 0 : groupStart[rank + 1] - groupStart[rank];
+			indirectCommands[meshIdx].firstInstance = rank == 0xffffffff ? static_cast<uint32_t>(instanceCount) : groupStart[rank];
 			indirectCommands[meshIdx].instanceCount = meshes[meshIdx]->instanceCount;
-
 		}
 
 		return static_cast<uint32_t>(instanceData_static.size());
 	}
 
-	static std::vector<VkVertexInputBindingDescription> getBindingDescription() 
+	// Scaling of addInstances() from 1k to 1M instances over 64 meshes, and of one addInstance() call per instance up to 10k for comparison.
+	// Host side only, the models never create device resources.
+	static void benchmarkAddInstances()
+	{
+		const uint32_t meshCount = 64;
+		auto addMeshes = [meshCount](Model& model) {
+			for (uint32_t meshIdx = 0; meshIdx < meshCount; meshIdx++) {
+				// Distinct positions, so that no mesh aliases another
+				Mesh* mesh = new Mesh();
+				for (uint32_t i = 0; i < 3; i++) {
+					Vertex vertex = {};
+					vertex.pos = glm::vec3(static_cast<float>(meshIdx), i == 1 ? 1.0f : 0.0f, i == 2 ? 1.0f : 0.0f);
+					mesh->vertices.push_back(vertex);
+					mesh->indices.push_back(i);
+				}
+				mesh->computeBoundingSphere();
+				model.addMesh(mesh);
+			}
+		};
+
+		std::cout << "Instance benchmark - " << meshCount << " meshes" << std::endl;
+		for (uint32_t instanceCount = 1000; instanceCount <= 1000000; instanceCount *= 10) {
+			std::mt19937 random(instanceCount);
+			std::vector<InstanceDescriptor> instances(instanceCount);
+			for (auto& instance : instances) {
+				instance.meshIdx = random() % meshCount;
+				instance.transform = glm::translate(glm::mat4(1.0f), glm::vec3(static_cast<float>(random() % 1024), 0.0f, static_cast<float>(random() % 1024)));
+			}
+
+			Model bulk;
+			addMeshes(bulk);
+			auto start = std::chrono::high_resolution_clock::now();
+			bulk.addInstances(instances);
+			const double bulkMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			std::cout << "\t" << instanceCount << " instances: addInstances() " << bulkMs << " ms, " << instanceCount / (bulkMs * 1000.0) << " Minstances/s";
+
+			if (instanceCount <= 10000) {
+				Model single;
+				addMeshes(single);
+				start = std::chrono::high_resolution_clock::now();
+				for (auto& instance : instances)
+					single.addInstance(instance.meshIdx, instance.transform, instance.materialIndex, instance.radiance);
+				const double singleMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+				std::cout << ", addInstance() " << singleMs << " ms";
+
+				CHECK(single.meshPointers == bulk.meshPointers, "Model: addInstance() and addInstances() disagree on the instance order.");
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	// Pass packedVertices = true for models using setPackedVertices(), see vertexCompression.h
+	static std::vector<VkVertexInputBindingDescription> getBindingDescription(bool packedVertices = false) 
 	{
 		std::array<VkVertexInputBindingDescription, 3> bindingDescription = {};
 		bindingDescription[0].binding = VERTEX_BINDING_ID;
-		bindingDescription[0].stride = sizeof(Vertex);
+		bindingDescription[0].stride = packedVertices ? sizeof(PackedVertex) : sizeof(Vertex);
 		bindingDescription[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
 		bindingDescription[1].binding = STATIC_INSTANCE_BINDING_ID;
@@ -339,7 +601,8 @@ public:
 		return std::vector<VkVertexInputBindingDescription>(bindingDescription.begin(), bindingDescription.end());
 	}
 
-	static std::vector<VkVertexInputAttributeDescription> getAttributeDescriptions() 
+	// The packed layout uses location 1 for the color palette index | material index and has no location 17
+	static std::vector<VkVertexInputAttributeDescription> getAttributeDescriptions(bool packedVertices = false) 
 	{
 		std::array<VkVertexInputAttributeDescription, 18> attributeDescriptions = {};
 		uint32_t location = 0;
@@ -347,28 +610,28 @@ public:
 		attributeDescriptions[location].binding = VERTEX_BINDING_ID;
 		attributeDescriptions[location].location = location;
 		attributeDescriptions[location].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[location].offset = offsetof(Vertex, pos);
+		attributeDescriptions[location].offset = packedVertices ? offsetof(PackedVertex, pos) : offsetof(Vertex, pos);
 
 		location++;
 
 		attributeDescriptions[location].binding = VERTEX_BINDING_ID;
 		attributeDescriptions[location].location = location;
-		attributeDescriptions[location].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[location].offset = offsetof(Vertex, color);
+		attributeDescriptions[location].format = packedVertices ? VK_FORMAT_R32_UINT : VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[location].offset = packedVertices ? offsetof(PackedVertex, colorMaterial) : offsetof(Vertex, color);
 
 		location++;
 
 		attributeDescriptions[location].binding = VERTEX_BINDING_ID;
 		attributeDescriptions[location].location = location;
-		attributeDescriptions[location].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[location].offset = offsetof(Vertex, normal);
+		attributeDescriptions[location].format = packedVertices ? VK_FORMAT_R16G16_SNORM : VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescriptions[location].offset = packedVertices ? offsetof(PackedVertex, normal) : offsetof(Vertex, normal);
 
 		location++;
 
 		attributeDescriptions[location].binding = VERTEX_BINDING_ID;
 		attributeDescriptions[location].location = location;
-		attributeDescriptions[location].format = VK_FORMAT_R32G32_SFLOAT;
-		attributeDescriptions[location].offset = offsetof(Vertex, texCoord);
+		attributeDescriptions[location].format = packedVertices ? VK_FORMAT_R16G16_SFLOAT : VK_FORMAT_R32G32_SFLOAT;
+		attributeDescriptions[location].offset = packedVertices ? offsetof(PackedVertex, texCoord) : offsetof(Vertex, texCoord);
 
 		location++;
 
@@ -472,9 +735,21 @@ public:
 		attributeDescriptions[location].format = VK_FORMAT_R32_UINT;
 		attributeDescriptions[location].offset = offsetof(Vertex, materialIndex);
 
-		return std::vector<VkVertexInputAttributeDescription>(attributeDescriptions.begin(), attributeDescriptions.end());
+		return std::vector<VkVertexInputAttributeDescription>(attributeDescriptions.begin(), attributeDescriptions.end() - (packedVertices ? 1 : 0));
+	}
+
+	// TEXTURE_BUCKET_COUNT combined image samplers each, bind as sampler2DArray[TEXTURE_BUCKET_COUNT]. See shaders/materialTextures.h
+	std::vector<VkDescriptorImageInfo> getLdrTextureDescriptorImageInfos() const
+	{
+		return ldrTexGen.getDescriptorImageInfos();
+	}
+
+	std::vector<VkDescriptorImageInfo> getHdrTextureDescriptorImageInfos() const
+	{
+		return hdrTexGen.getDescriptorImageInfos();
 	}
 
+	// Holds DeviceMaterial of hostDeviceShared.h
 	VkDescriptorBufferInfo getMaterialDescriptorBufferInfo() const
 	{
 		VkDescriptorBufferInfo descriptorBufferInfo = {};
@@ -485,9 +760,12 @@ public:
 		return descriptorBufferInfo;
 	}
 
-	// Used to transfer vetex data to Rtx shader as raw buffer
-	VkDescriptorBufferInfo getVertexDescriptorBufferInfo() const
+	// Used to transfer vetex data to Rtx shader as raw buffer, holds PackedVertex (shaders/packedVertex.h) with setPackedVertices().
+	// packedShaders tells whether the hit shaders read the buffer with unpackVertex() of shaders/packedVertex.h.
+	VkDescriptorBufferInfo getVertexDescriptorBufferInfo(bool packedShaders = false) const
 	{
+		CHECK(packedShaders == packedVertices, "Model: Vertex buffer format does not match the shaders, see setPackedVertices().");
+
 		VkDescriptorBufferInfo descriptorBufferInfo = {};
 		descriptorBufferInfo.buffer = vertexBuffer;
 		descriptorBufferInfo.offset = 0;
@@ -507,6 +785,50 @@ public:
 		return descriptorBufferInfo;
 	}
 
+	// Per mesh offsets into the vertex and index buffers, see MeshOffsets
+	VkDescriptorBufferInfo getMeshOffsetsDescriptorBufferInfo() const
+	{
+		VkDescriptorBufferInfo descriptorBufferInfo = {};
+		descriptorBufferInfo.buffer = meshOffsetsBuffer;
+		descriptorBufferInfo.offset = 0;
+		descriptorBufferInfo.range = VK_WHOLE_SIZE;
+
+		return descriptorBufferInfo;
+	}
+
+	const std::vector<MeshOffsets>& getMeshOffsets() const
+	{
+		return meshOffsets;
+	}
+
+	// Vertex colors referenced by packed vertices, one vec4 per color. Only available with setPackedVertices().
+	VkDescriptorBufferInfo getColorPaletteDescriptorBufferInfo() const
+	{
+		CHECK(packedVertices, "Model: Color palette is only created for packed vertices.");
+
+		VkDescriptorBufferInfo descriptorBufferInfo = {};
+		descriptorBufferInfo.buffer = colorPaletteBuffer;
+		descriptorBufferInfo.offset = 0;
+		descriptorBufferInfo.range = VK_WHOLE_SIZE;
+
+		return descriptorBufferInfo;
+	}
+
+	// Upload vertices as PackedVertex (24 bytes) instead of Vertex (48 bytes), must be called before createBuffers().
+	// The shaders of the apps still read the 48 byte Vertex: cmdDraw() and getVertexDescriptorBufferInfo() throw for packed models unless
+	// the caller states that its pipeline uses getAttributeDescriptions(true) and its hit shaders include shaders/packedVertex.h.
+	void setPackedVertices(bool enable)
+	{
+		CHECK(vertexBuffer == VK_NULL_HANDLE, "Model: Vertex format must be selected before creating buffers.");
+
+		packedVertices = enable;
+	}
+
+	bool usesPackedVertices() const
+	{
+		return packedVertices;
+	}
+
 	// Used to transfer per instance static data to Rtx shader as raw buffer
 	VkDescriptorBufferInfo getStaticInstanceDescriptorBufferInfo() const
 	{
@@ -518,6 +840,129 @@ public:
 		return descriptorBufferInfo;
 	}
 
+	// Meshlets of all meshes, those of mesh i are [getMeshletOffsets()[i], getMeshletOffsets()[i + 1])
+	const std::vector<Meshlet>& getMeshlets() const
+	{
+		return meshlets;
+	}
+
+	const std::vector<uint32_t>& getMeshletOffsets() const
+	{
+		return meshletOffsets;
+	}
+
+	VkDescriptorBufferInfo getMeshletDescriptorBufferInfo() const
+	{
+		VkDescriptorBufferInfo descriptorBufferInfo = {};
+		descriptorBufferInfo.buffer = meshletBuffer;
+		descriptorBufferInfo.offset = 0;
+		descriptorBufferInfo.range = VK_WHOLE_SIZE;
+
+		return descriptorBufferInfo;
+	}
+
+	// True when any mesh was added with levels of detail. The raster pass then issues one indirect draw per instance.
+	bool hasLods() const
+	{
+		return !lodRanges.empty();
+	}
+
+	// Picks the level of detail of each instance from the projected size of its bounding sphere: the coarsest level whose error, scaled by
+	// the sphere's radius in pixels over its object space radius, stays below pixelError. Area lights always use level 0 so that the
+	// rasterized emitters match the sampled triangles. Call once per frame after the camera update and cullInstances(), only the visible
+	// instances get a draw. No-op without levels of detail.
+	void selectLods(const glm::mat4& view, const glm::mat4& proj, uint32_t screenHeight, float pixelError = 1.0f)
+	{
+		if (!hasLods() || mappedLodIndirectCmdPtr == nullptr)
+			return;
+
+		const float pixelsPerUnit = std::abs(proj[1][1]) * screenHeight * 0.5f; // at unit distance
+		for (uint32_t slot = 0; slot < lodIndirectCommands.size(); slot++) {
+			if (slot >= visibleInstanceCount) {
+				lodIndirectCommands[slot] = {};
+				continue;
+			}
+
+			const uint32_t i = visibleInstances[slot];
+			const uint32_t meshIdx = meshPointers[i];
+			const uint32_t lodCount = meshLodOffsets[meshIdx + 1] - meshLodOffsets[meshIdx];
+			uint32_t lod = 0;
+
+			if (lodCount > 0 && (instanceData_static[i].data.z & 0xff) == 0) {
+				const glm::mat4& model = instanceData_dynamic[i].model;
+				const glm::vec4& sphere = meshes[meshIdx]->boundingSphere;
+				float scale = std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))), glm::length(glm::vec3(model[2])));
+				float distance = glm::length(glm::vec3(view * model * glm::vec4(glm::vec3(sphere), 1.0f)));
+
+				if (distance > sphere.w * scale) {
+					float projectedRadius = sphere.w * scale * pixelsPerUnit / distance;
+					float pixelsPerObjectUnit = projectedRadius / std::max(sphere.w, 1e-8f);
+					while (lod < lodCount && lodRanges[meshLodOffsets[meshIdx] + lod].error * pixelsPerObjectUnit <= pixelError)
+						lod++;
+				}
+			}
+
+			lodIndirectCommands[slot] = lodCommand(i, lod, slot);
+		}
+
+		memcpy(mappedLodIndirectCmdPtr, lodIndirectCommands.data(), sizeof(VkDrawIndexedIndirectCommand) * lodIndirectCommands.size());
+	}
+
+	// Frustum culls the instances against projView with their transformed Mesh::boundingSphere and compacts the visible ones for the raster
+	// pass: their instance data is copied in order to host visible vertex buffers and the per mesh commands of the indirect buffer get the
+	// visible instanceCount. Ray tracing keeps using all instances. Call once per frame after updateMeshData() and before selectLods().
+	uint32_t cullInstances(const glm::mat4& projView)
+	{
+		CHECK(mappedIndirectCmdPtr != nullptr, "Model: Buffers must be created before culling instances.");
+
+		const uint32_t instanceCount = static_cast<uint32_t>(instanceData_dynamic.size());
+		instanceSpheres.resize(instanceCount);
+		ThreadPool::getInstance().parallelFor(instanceCount, [this](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				instanceSpheres.set(i, transformSphere(instanceData_dynamic[i].model, meshes[meshPointers[i]]->boundingSphere));
+			}
+		}, InstanceCuller::RANGE_SIZE);
+
+		visibleInstanceCount = InstanceCuller::cull(Frustum(projView), instanceSpheres, visibleInstances);
+
+		InstanceData_static* visibleStatic = static_cast<InstanceData_static*>(mappedVisibleStaticInstancePtr);
+		InstanceData_dynamic* visibleDynamic = static_cast<InstanceData_dynamic*>(mappedVisibleDynamicInstancePtr);
+		ThreadPool::getInstance().parallelFor(visibleInstanceCount, [&](size_t begin, size_t end) {
+			for (size_t slot = begin; slot < end; slot++) {
+				visibleStatic[slot] = instanceData_static[visibleInstances[slot]];
+				visibleDynamic[slot] = instanceData_dynamic[visibleInstances[slot]];
+			}
+		}, InstanceCuller::RANGE_SIZE);
+
+		// Visible instances keep their mesh grouping, each group is a contiguous run of slots
+		visibleIndirectCommands = indirectCommands;
+		for (auto& cmd : visibleIndirectCommands) {
+			cmd.firstInstance = visibleInstanceCount;
+			cmd.instanceCount = 0;
+		}
+		for (uint32_t slot = 0; slot < visibleInstanceCount; slot++) {
+			VkDrawIndexedIndirectCommand& cmd = visibleIndirectCommands[meshPointers[visibleInstances[slot]]];
+			if (cmd.instanceCount++ == 0)
+				cmd.firstInstance = slot;
+		}
+		memcpy(mappedIndirectCmdPtr, visibleIndirectCommands.data(), sizeof(VkDrawIndexedIndirectCommand) * visibleIndirectCommands.size());
+
+		instanceCulling = true;
+
+		return visibleInstanceCount;
+	}
+
+	// Raster instance k of the last cullInstances() is instance getVisibleInstances()[k], k < getVisibleInstanceCount()
+	const std::vector<uint32_t>& getVisibleInstances() const
+	{
+		return visibleInstances;
+	}
+
+	uint32_t getVisibleInstanceCount() const
+	{
+		return visibleInstanceCount;
+	}
+
 	void updateMeshData(bool animate = false)
 	{	
 		if (animate) {
@@ -526,16 +971,21 @@ public:
 				instance.modelPrev = instance.model;
 				instance.model = glm::translate<float>(instance.model, glm::vec3(0.0, 0.0, 0.0));
 				glm::mat4 rotate = glm::identity<glm::mat4>();
-				if (idx == 1) {
+				switch (instanceAnimation(idx)) {
+				case InstanceAnimation::SPIN:
 					instance.model = glm::rotate<float>(instance.model, 0.05f, glm::vec3(1, 1, 0));
-				}
-				else if (idx == 2 || idx == 3) {
+					break;
+				case InstanceAnimation::ORBIT:
 					rotate = glm::rotate<float>(rotate, 0.05f, glm::vec3(0, 1, 0));
 					instance.model = rotate * instance.model;
+					break;
+				default:
+					break;
 				}
 				instance.modelIT = glm::transpose(glm::inverse(instance.model));
 				idx++;
 			}
+			transformVersion++;
 		}
 		memcpy(mappedDynamicInstancePtr, instanceData_dynamic.data(), sizeof(instanceData_dynamic[0]) * instanceData_dynamic.size());
 	}
@@ -564,112 +1014,237 @@ public:
 			0, nullptr);
 	}
 
-	void cmdDraw(const VkCommandBuffer& cmdBuffer) 
+	// packedPipeline tells whether the bound pipeline was created with getBindingDescription(true) and getAttributeDescriptions(true)
+	void cmdDraw(const VkCommandBuffer& cmdBuffer, bool packedPipeline = false) 
 	{
+		CHECK(packedPipeline == packedVertices, "Model: Vertex buffer format does not match the pipeline, see setPackedVertices().");
+
 		VkBuffer vertexBuffers[] = { vertexBuffer };
 		VkDeviceSize offsets[] = { 0 };
 		vkCmdBindVertexBuffers(cmdBuffer, VERTEX_BINDING_ID, 1, vertexBuffers, offsets);
-		VkBuffer staticInstanceBuffers[] = { staticInstanceBuffer };
+		VkBuffer staticInstanceBuffers[] = { instanceCulling ? visibleStaticInstanceBuffer : staticInstanceBuffer };
 		vkCmdBindVertexBuffers(cmdBuffer, STATIC_INSTANCE_BINDING_ID, 1, staticInstanceBuffers, offsets);
-		VkBuffer dynamicInstanceBuffers[] = { dynamicInstanceBuffer };
+		VkBuffer dynamicInstanceBuffers[] = { instanceCulling ? visibleDynamicInstanceBuffer : dynamicInstanceBuffer };
 		vkCmdBindVertexBuffers(cmdBuffer, DYNAMIC_INSTANCE_BINDING_ID, 1, dynamicInstanceBuffers, offsets);
 		vkCmdBindIndexBuffer(cmdBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 		
-		vkCmdDrawIndexedIndirect(cmdBuffer, indirectCmdBuffer, 0, static_cast<uint32_t>(meshes.size()), sizeof(VkDrawIndexedIndirectCommand));
+		if (hasLods())
+			vkCmdDrawIndexedIndirect(cmdBuffer, lodIndirectCmdBuffer, 0, static_cast<uint32_t>(lodIndirectCommands.size()), sizeof(VkDrawIndexedIndirectCommand));
+		else
+			vkCmdDrawIndexedIndirect(cmdBuffer, indirectCmdBuffer, 0, static_cast<uint32_t>(meshes.size()), sizeof(VkDrawIndexedIndirectCommand));
 		//vkCmdDrawIndexed(cmdBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
 	}
 
 	void createBuffers(const VkPhysicalDevice& physicalDevice, const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool) 
 	{	
-		CHECK(ldrTexGen.size() != 0, "Model: LDR textures have not been added.");
+		CHECK(!ldrTexGen.empty(), "Model: LDR textures have not been added.");
 
-		CHECK(hdrTexGen.size() != 0, "Model: HDR textures have not been added.");
+		CHECK(!hdrTexGen.empty(), "Model: HDR textures have not been added.");
 
 		CHECK(materials.size() != 0, "Model: Materials have not been added.");
 
 		CHECK(meshes.size() != 0, "Model: Meshes have not been added.");
 
-		createBuffer(device, allocator, queue, commandPool, materialBuffer, materialBufferAllocation, sizeof(Material) * materials.size(), materials.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-		createBuffer(device, allocator, queue, commandPool, vertexBuffer, vertexBufferAllocation, sizeof(Vertex) * vertices.size(), vertices.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		// Tiles are cut before the texture arrays release the pixels
+		createTiledTextures();
+
+		// Textures first, the materials reference their handles
+		ldrTexGen.createTextureArrays(physicalDevice, device, allocator, queue, commandPool);
+		hdrTexGen.createTextureArrays(physicalDevice, device, allocator, queue, commandPool);
+		ldrTexGen.printMemoryReport();
+		hdrTexGen.printMemoryReport();
+		printMeshDedupReport();
+
+		std::vector<DeviceMaterial> deviceMaterials = getDeviceMaterials();
+		mergeEqualMaterials(deviceMaterials);
+		createBuffer(device, allocator, queue, commandPool, materialBuffer, materialBufferAllocation, sizeof(DeviceMaterial) * deviceMaterials.size(), deviceMaterials.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		if (packedVertices) {
+			VertexPacker packer;
+			std::vector<PackedVertex> packed = packer.encode(vertices);
+			createBuffer(device, allocator, queue, commandPool, vertexBuffer, vertexBufferAllocation, sizeof(PackedVertex) * packed.size(), packed.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			createBuffer(device, allocator, queue, commandPool, colorPaletteBuffer, colorPaletteBufferAllocation, sizeof(glm::vec4) * packer.getPalette().size(), packer.getPalette().data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		}
+		else
+			createBuffer(device, allocator, queue, commandPool, vertexBuffer, vertexBufferAllocation, sizeof(Vertex) * vertices.size(), vertices.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 		createBuffer(device, allocator, queue, commandPool, staticInstanceBuffer, staticInstanceBufferAllocation, sizeof(instanceData_static[0]) * instanceData_static.size(), instanceData_static.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 		createDynamicInstanceBuffer(device, allocator, queue, commandPool);
-		createBuffer(device, allocator, queue, commandPool, indexBuffer, indexBufferAllocation, sizeof(indices[0]) * indices.size(), indices.data(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-		createBuffer(device, allocator, queue, commandPool, indirectCmdBuffer, indirectCmdBufferAllocation, sizeof(VkDrawIndexedIndirectCommand) * meshes.size(), indirectCommands.data(), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
-		ldrTexGen.createTexture(physicalDevice, device, allocator, queue, commandPool, ldrTextureImage, ldrTextureImageView, ldrTextureSampler, ldrTextureImageAllocation);
-		hdrTexGen.createTexture(physicalDevice, device, allocator, queue, commandPool, hdrTextureImage, hdrTextureImageView, hdrTextureSampler, hdrTextureImageAllocation);
+		createVisibleInstanceBuffers(allocator);
+		if (hasLods()) {
+			std::vector<uint32_t> allIndices(indices);
+			allIndices.insert(allIndices.end(), lodIndices.begin(), lodIndices.end());
+			createBuffer(device, allocator, queue, commandPool, indexBuffer, indexBufferAllocation, sizeof(allIndices[0]) * allIndices.size(), allIndices.data(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			createLodIndirectBuffer(allocator);
+		}
+		else
+			createBuffer(device, allocator, queue, commandPool, indexBuffer, indexBufferAllocation, sizeof(indices[0]) * indices.size(), indices.data(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		createBuffer(device, allocator, queue, commandPool, meshOffsetsBuffer, meshOffsetsBufferAllocation, sizeof(MeshOffsets) * meshOffsets.size(), meshOffsets.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		createBuffer(device, allocator, queue, commandPool, meshletBuffer, meshletBufferAllocation, sizeof(Meshlet) * meshlets.size(), meshlets.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		// Host visible, rewritten by cullInstances()
+		mappedIndirectCmdPtr = createBuffer(allocator, indirectCmdBuffer, indirectCmdBufferAllocation, sizeof(VkDrawIndexedIndirectCommand) * meshes.size(), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+		memcpy(mappedIndirectCmdPtr, indirectCommands.data(), sizeof(VkDrawIndexedIndirectCommand) * indirectCommands.size());
 	}
 
 	void createRtxBuffers(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool) 
 	{
-		VkDeviceSize vertexOffsetInBytes = 0;
-		VkDeviceSize indexOffsetInBytes = 0;
 		createBuffer(device, allocator, queue, commandPool, indexBufferRtx, indexBufferRtxAllocation, sizeof(indicesRtx[0]) * indicesRtx.size(), indicesRtx.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		// Positions are fp32 at offset 0 in both vertex formats
+		VkDeviceSize vertexStride = packedVertices ? sizeof(PackedVertex) : sizeof(Vertex);
+		planBlasGroups();
+
+		// Meshes outside of the groups have a BLAS of their own, aliases use the one of their mesh
+		std::vector<BottomLevelAccelerationStructure*> structures;
+		for (size_t i = 0; i < meshes.size(); i++) {
+			if (meshBlasGroup[i] != 0xffffffff || meshAliases[i] != i)
+				continue;
+			meshes[i]->initBLAS(device, allocator, vertexBuffer, static_cast<VkDeviceSize>(meshOffsets[i].vertexOffset) * vertexStride,
+				indexBufferRtx, static_cast<VkDeviceSize>(meshOffsets[i].indexOffset) * sizeof(uint32_t), vertexStride, blasCompaction);
+			structures.push_back(&meshes[i]->as_bottomLevel);
+		}
+
+		// A group is one geometry over the index range of its meshes, the indices of the raster index buffer already address the global vertices
+		groupBlas.resize(blasGroups.size());
+		for (size_t i = 0; i < blasGroups.size(); i++) {
+			const MeshOffsets& first = meshOffsets[blasGroups[i].firstMesh];
+			const MeshOffsets& last = meshOffsets[blasGroups[i].firstMesh + blasGroups[i].meshCount - 1];
+			std::vector<VkGeometryNV> geometry = { Mesh::triangleGeometry(vertexBuffer, 0, last.vertexOffset + last.vertexCount, vertexStride, indexBuffer,
+				static_cast<VkDeviceSize>(first.indexOffset) * sizeof(uint32_t), last.indexOffset + last.indexCount - first.indexOffset) };
+			groupBlas[i].create(device, allocator, geometry, false, blasCompaction);
+			structures.push_back(&groupBlas[i]);
+		}
+
+		// All BLAS are built in one batch that shares the scratch buffer of the largest of them
+		AccelerationStructureScratch scratch;
+		for (auto structure : structures)
+			scratch.reserve(*structure);
+		scratch.create(allocator);
+
+		CompactedSizeQuery compactedSizes;
+		std::vector<VkAccelerationStructureNV> handles;
+		if (blasCompaction) {
+			compactedSizes.create(device, static_cast<uint32_t>(structures.size()));
+			for (auto structure : structures)
+				handles.push_back(structure->getAccelerationStructure());
+		}
+
 		VkCommandBuffer cmdBuf = beginSingleTimeCommands(device, commandPool);
-		for (auto &mesh : meshes) {
-			mesh->initBLAS(device, cmdBuf, allocator, vertexBuffer, vertexOffsetInBytes, indexBufferRtx, indexOffsetInBytes);
-			vertexOffsetInBytes += static_cast<VkDeviceSize>(mesh->vertices.size() * sizeof(Vertex));
-			indexOffsetInBytes += static_cast<VkDeviceSize>(mesh->indices.size() * sizeof(uint32_t));
+		for (auto structure : structures)
+			structure->cmdBuild(cmdBuf, scratch);
+		if (blasCompaction)
+			compactedSizes.cmdWrite(cmdBuf, handles);
+		endSingleTimeCommands(device, queue, commandPool, cmdBuf);
+
+		const double mb = 1.0 / (1024.0 * 1024.0);
+		std::cout << "BLAS scratch - shared: " << scratch.getSize() * mb << " MB, " << scratch.getReservedCount() << " separate buffers: "
+			<< scratch.getReservedTotal() * mb << " MB" << std::endl;
+		scratch.cleanUp(allocator);
+
+		// The compacted copies replace the built structures, which are released once the copies completed
+		cmdBuf = beginSingleTimeCommands(device, commandPool);
+		std::vector<BottomLevelAccelerationStructure> uncompacted;
+		if (blasCompaction) {
+			const std::vector<VkDeviceSize> sizes = compactedSizes.getSizes(device);
+			compactedSizes.cleanUp(device);
+			for (size_t i = 0; i < structures.size(); i++) {
+				BottomLevelAccelerationStructure compacted;
+				compacted.createCompacted(device, allocator, sizes[i]);
+				compacted.cmdCopyCompacted(cmdBuf, *structures[i]);
+				uncompacted.push_back(*structures[i]);
+				*structures[i] = compacted;
+			}
 		}
 
-		as_topLevel.create(device, allocator, static_cast<uint32_t>(instanceData_dynamic.size()), false);
+		// Updatable, moving instances are refitted, see TlasUpdatePolicy
+		as_topLevel.create(device, allocator, getTlasInstanceCount(), true);
+		tlasPolicy.invalidate();
+		tlasTransformVersion = ~0ull;
 		updateTlasData();
-		as_topLevel.cmdBuild(cmdBuf, static_cast<uint32_t>(instanceData_dynamic.size()), false);
+		cmdUpdateTlas(cmdBuf);
 		endSingleTimeCommands(device, queue, commandPool, cmdBuf);
+
+		VkDeviceSize uncompactedSize = 0;
+		VkDeviceSize compactedSize = 0;
+		for (size_t i = 0; i < uncompacted.size(); i++) {
+			uncompactedSize += uncompacted[i].getResidentSize();
+			compactedSize += structures[i]->getResidentSize();
+			uncompacted[i].cleanUp(device, allocator);
+		}
+
+		std::cout << "BLAS - " << structures.size() << " for " << meshes.size() << " meshes, " << blasGroups.size() << " groups, TLAS instances: "
+			<< getTlasInstanceCount() << " of " << instanceData_static.size() << std::endl;
+		if (blasCompaction)
+			std::cout << "BLAS compaction - " << uncompactedSize * mb << " MB -> " << compactedSize * mb << " MB" << std::endl;
+		AccelerationStructure::printMemoryReport();
+	}
+
+	// Takes effect with the next createRtxBuffers()
+	void setBlasPlannerSettings(const BlasPlannerSettings& settings)
+	{
+		blasPlannerSettings = settings;
 	}
 
+	void setBlasCompaction(bool enable)
+	{
+		blasCompaction = enable;
+	}
+
+	// Records the update chosen by updateTlasData() since the last call: a full build, a refit or nothing when no instance moved
 	void cmdUpdateTlas(const VkCommandBuffer& cmdBuf)
 	{
-		as_topLevel.cmdBuild(cmdBuf, static_cast<uint32_t>(instanceData_dynamic.size()), false);
+		if (tlasUpdate != TlasUpdatePolicy::SKIP)
+			as_topLevel.cmdBuild(cmdBuf, static_cast<uint32_t>(tlas_instanceData.size()), tlasUpdate == TlasUpdatePolicy::REFIT);
+		tlasUpdate = TlasUpdatePolicy::SKIP;
 	}
 
+	// Rewrites the TLAS instances when updateMeshData() changed a transform since the last call, and lets the TlasUpdatePolicy choose
+	// what the next cmdUpdateTlas() records
 	void updateTlasData() 
 	{
-		tlas_instanceData.clear();
-		uint32_t globalInstanceId = 0;
-		for (auto& instance :instanceData_dynamic) {
-			TopLevelAccelerationStructureData data;
-			// Copy first three rows of transformation matrix of each instance
-			glm::mat4 modelTrans = glm::transpose(instance.model);
-			memcpy(data.transform, &modelTrans, sizeof(data.transform));
-			data.instanceId = globalInstanceId;
-			data.mask = 0xff;
-			data.instanceOffset = 0; // Since this is used to determine hit group index compuation, this may change
-			data.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
-			data.blasHandle = meshes[meshPointers[globalInstanceId]]->as_bottomLevel.handle;
-			tlas_instanceData.push_back(data);
-			globalInstanceId++;
-		}
+		const bool changed = tlasTransformVersion != transformVersion;
+		if (changed)
+			writeTlasData();
 
-		CHECK_DBG_ONLY(globalInstanceId == instanceData_dynamic.size(),
-			"Model: Number of instances for Top Level Accelaration structure should match dynamic instance data count.");
+		tlasUpdate = std::max(tlasUpdate, tlasPolicy.update(changed, tlasSpheres));
+	}
 
-		as_topLevel.updateInstanceData(tlas_instanceData);
+	const TlasUpdateStats& getTlasUpdateStats() const
+	{
+		return tlasPolicy.getStats();
+	}
+
+	void setTlasUpdateSettings(const TlasUpdateSettings& settings)
+	{
+		tlasPolicy.setSettings(settings);
 	}
 
 	void cleanUp(const VkDevice& device, const VmaAllocator& allocator) 
 	{	
-		vkDestroySampler(device, hdrTextureSampler, nullptr);
-		vkDestroyImageView(device, hdrTextureImageView, nullptr);
-		vmaDestroyImage(allocator, hdrTextureImage, hdrTextureImageAllocation);
-
-		vkDestroySampler(device, ldrTextureSampler, nullptr);
-		vkDestroyImageView(device, ldrTextureImageView, nullptr);
-		vmaDestroyImage(allocator, ldrTextureImage, ldrTextureImageAllocation);
+		hdrTexGen.cleanUp(device, allocator);
+		ldrTexGen.cleanUp(device, allocator);
 		
 		vmaDestroyBuffer(allocator, indirectCmdBuffer, indirectCmdBufferAllocation);
+		vmaDestroyBuffer(allocator, lodIndirectCmdBuffer, lodIndirectCmdBufferAllocation);
+		vmaDestroyBuffer(allocator, meshOffsetsBuffer, meshOffsetsBufferAllocation);
+		vmaDestroyBuffer(allocator, meshletBuffer, meshletBufferAllocation);
 		vmaDestroyBuffer(allocator, indexBuffer, indexBufferAllocation);
 		vmaDestroyBuffer(allocator, dynamicInstanceBuffer, dynamicInstanceBufferAllocation);
 		vmaUnmapMemory(allocator, dynamicInstanceStagingBufferAllocation);
 		vmaDestroyBuffer(allocator, dynamicInstanceStagingBuffer, dynamicInstanceStagingBufferAllocation);
 		vmaDestroyBuffer(allocator, staticInstanceBuffer, staticInstanceBufferAllocation);
+		vmaDestroyBuffer(allocator, visibleDynamicInstanceBuffer, visibleDynamicInstanceBufferAllocation);
+		vmaDestroyBuffer(allocator, visibleStaticInstanceBuffer, visibleStaticInstanceBufferAllocation);
+		vmaDestroyBuffer(allocator, colorPaletteBuffer, colorPaletteBufferAllocation);
 		vmaDestroyBuffer(allocator, vertexBuffer, vertexBufferAllocation);
 		vmaDestroyBuffer(allocator, materialBuffer, materialBufferAllocation);
 	}
 
 	void cleanUpRtx(const VkDevice& device, const VmaAllocator& allocator) 
 	{
-		for (auto& mesh : meshes)
-			mesh->as_bottomLevel.cleanUp(device, allocator);
+		for (size_t i = 0; i < meshes.size(); i++)
+			if (meshBlasGroup[i] == 0xffffffff && meshAliases[i] == i)
+				meshes[i]->as_bottomLevel.cleanUp(device, allocator);
+		for (auto& blas : groupBlas)
+			blas.cleanUp(device, allocator);
+		groupBlas.clear();
 
 		as_topLevel.cleanUp(device, allocator);
 		vmaDestroyBuffer(allocator, indexBufferRtx, indexBufferRtxAllocation);
@@ -681,6 +1256,8 @@ public:
 	}
 private:
 	friend class AreaLightSources;
+	friend class SceneCache;
+	friend class SceneBvh;
 
 	std::vector<Material> materials; // store matrials
 	std::vector<Mesh *> meshes; // ideally store unique meshes
@@ -689,14 +1266,33 @@ private:
 	std::vector<InstanceData_static> instanceData_static; // concatenate instances from all meshes. Note each mesh can have multiple instances. 
 	std::vector<InstanceData_dynamic> instanceData_dynamic;  // concatenate instances from all meshes. Note each mesh can have multiple instances.
 	std::vector<uint32_t> meshPointers; // Pointer to the mesh for each instance.
+	std::vector<MeshOffsets> meshOffsets; // Offsets of each mesh into the global vertices and indices (indicesRtx share the index offsets).
+	bool packedVertices = false; // Upload vertices as PackedVertex
+	std::vector<uint32_t> lodIndices; // coarser levels of detail of all meshes, indexes the global vertices
+	std::vector<MeshLodRange> lodRanges; // ranges in lodIndices, levels of mesh i are [meshLodOffsets[i], meshLodOffsets[i + 1])
+	std::vector<uint32_t> meshLodOffsets;
+	std::vector<Meshlet> meshlets; // clusters of the level 0 indices of all meshes, firstIndex into indices
+	std::vector<uint32_t> meshletOffsets; // meshlets of mesh i are [meshletOffsets[i], meshletOffsets[i + 1])
+	std::vector<uint32_t> meshAliases; // mesh whose storage and BLAS mesh i uses, i itself unless it is a duplicate
+	std::unordered_multimap<uint64_t, uint32_t> meshHashes; // hashMesh() of the meshes that are not aliases
+	struct
+	{
+		uint32_t meshes = 0;
+		uint64_t vertices = 0;
+		uint64_t indices = 0;
+		uint64_t lodIndices = 0;
+	} dedupStats; // storage the aliases share, see printMeshDedupReport()
 	
 	void *mappedDynamicInstancePtr;
 	std::vector<VkDrawIndexedIndirectCommand> indirectCommands; // Its size is meshes.size().
+	std::vector<VkDrawIndexedIndirectCommand> visibleIndirectCommands; // indirectCommands over the visible instances of the last cullInstances()
 	
 	VkBuffer materialBuffer = VK_NULL_HANDLE;
 	VmaAllocation materialBufferAllocation = VK_NULL_HANDLE;
 	VkBuffer vertexBuffer = VK_NULL_HANDLE;
 	VmaAllocation vertexBufferAllocation = VK_NULL_HANDLE;
+	VkBuffer colorPaletteBuffer = VK_NULL_HANDLE;
+	VmaAllocation colorPaletteBufferAllocation = VK_NULL_HANDLE;
 	VkBuffer staticInstanceBuffer = VK_NULL_HANDLE;
 	VmaAllocation staticInstanceBufferAllocation = VK_NULL_HANDLE;
 	VkBuffer dynamicInstanceBuffer = VK_NULL_HANDLE;
@@ -705,26 +1301,213 @@ private:
 	VmaAllocation dynamicInstanceStagingBufferAllocation = VK_NULL_HANDLE;
 	VkBuffer indexBuffer = VK_NULL_HANDLE;
 	VmaAllocation indexBufferAllocation = VK_NULL_HANDLE;
+	VkBuffer meshOffsetsBuffer = VK_NULL_HANDLE;
+	VmaAllocation meshOffsetsBufferAllocation = VK_NULL_HANDLE;
+	VkBuffer meshletBuffer = VK_NULL_HANDLE;
+	VmaAllocation meshletBufferAllocation = VK_NULL_HANDLE;
 	VkBuffer indirectCmdBuffer = VK_NULL_HANDLE;
 	VmaAllocation indirectCmdBufferAllocation = VK_NULL_HANDLE;
+	void* mappedIndirectCmdPtr = nullptr;
+	VkBuffer visibleStaticInstanceBuffer = VK_NULL_HANDLE;
+	VmaAllocation visibleStaticInstanceBufferAllocation = VK_NULL_HANDLE;
+	void* mappedVisibleStaticInstancePtr = nullptr;
+	VkBuffer visibleDynamicInstanceBuffer = VK_NULL_HANDLE;
+	VmaAllocation visibleDynamicInstanceBufferAllocation = VK_NULL_HANDLE;
+	void* mappedVisibleDynamicInstancePtr = nullptr;
+	SphereArray instanceSpheres; // world space bounding sphere of each instance, refreshed by cullInstances()
+	std::vector<uint32_t> visibleInstances; // raster instance k is instance visibleInstances[k], all instances until cullInstances() is called
+	uint32_t visibleInstanceCount = 0;
+	bool instanceCulling = false; // raster binds the visible instance buffers once cullInstances() was called
+	std::vector<VkDrawIndexedIndirectCommand> lodIndirectCommands; // one per instance, only used with levels of detail
+	VkBuffer lodIndirectCmdBuffer = VK_NULL_HANDLE;
+	VmaAllocation lodIndirectCmdBufferAllocation = VK_NULL_HANDLE;
+	void* mappedLodIndirectCmdPtr = nullptr;
 
 	TextureGenerator ldrTexGen = TextureGenerator("Model: LDR texture");
-	VkImage ldrTextureImage;
-	VmaAllocation ldrTextureImageAllocation;
-
-	TextureGenerator hdrTexGen = TextureGenerator("Model: HDR texture");;
-	VkImage hdrTextureImage;
-	VmaAllocation hdrTextureImageAllocation;
+	TextureGenerator hdrTexGen = TextureGenerator("Model: HDR texture");
+	std::string tiledTextureCacheFile; // empty without virtual texturing
+	std::unique_ptr<TiledTextureCache> tiledTextures;
+	PageTable virtualPageTable;
 
 	uint32_t areaLightPrimitiveOffsetCounter = 0;
 
 	/** RTX Data **/
 	TopLevelAccelerationStructure as_topLevel;
 	std::vector<TopLevelAccelerationStructureData> tlas_instanceData;
+	std::vector<glm::vec4> tlasSpheres; // world space bounding spheres of the TLAS instances
+	TlasUpdatePolicy tlasPolicy;
+	TlasUpdatePolicy::Decision tlasUpdate = TlasUpdatePolicy::SKIP; // recorded by the next cmdUpdateTlas()
+	uint64_t transformVersion = 0; // incremented when updateMeshData() changes transforms
+	uint64_t tlasTransformVersion = ~0ull; // of the TLAS instances
 	VkBuffer indexBufferRtx = VK_NULL_HANDLE;
 	VmaAllocation indexBufferRtxAllocation = VK_NULL_HANDLE;
 	std::vector<uint32_t> indicesRtx;
+	BlasPlannerSettings blasPlannerSettings;
+	bool blasCompaction = true;
+	std::vector<BlasGroup> blasGroups; // of two or more meshes
+	std::vector<BottomLevelAccelerationStructure> groupBlas; // of blasGroups
+	std::vector<uint32_t> meshBlasGroup; // into blasGroups, 0xffffffff for meshes with a BLAS of their own
 	
+	static uint64_t hashMesh(const Mesh& mesh)
+	{
+		uint64_t hash = fnv1a(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+		hash = fnv1a(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t), hash);
+		for (const auto& lod : mesh.lods)
+			hash = fnv1a(lod.indices.data(), lod.indices.size() * sizeof(uint32_t), hash);
+
+		return hash;
+	}
+
+	// Earlier mesh that is equal to mesh, 0xffffffff when there is none. Hash collisions are ruled out by comparing the data.
+	uint32_t findDuplicateMesh(const Mesh& mesh) const
+	{
+		auto range = meshHashes.equal_range(hashMesh(mesh));
+		for (auto it = range.first; it != range.second; it++) {
+			const Mesh& other = *meshes[it->second];
+			if (other.vertices.size() != mesh.vertices.size() || other.indices != mesh.indices || other.lods.size() != mesh.lods.size() ||
+				memcmp(other.vertices.data(), mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex)) != 0)
+				continue;
+
+			bool equal = true;
+			for (size_t i = 0; i < mesh.lods.size() && equal; i++)
+				equal = other.lods[i].indices == mesh.lods[i].indices && other.lods[i].error == mesh.lods[i].error;
+			if (equal)
+				return it->second;
+		}
+
+		return 0xffffffff;
+	}
+
+	// Same offsets, levels of detail and meshlets as original, nothing is appended to the vertices and indices
+	uint32_t addMeshAlias(Mesh* mesh, uint32_t original)
+	{
+		const uint32_t meshIdx = static_cast<uint32_t>(meshes.size());
+		const MeshOffsets offsets = meshOffsets[original];
+		meshOffsets.push_back(offsets);
+
+		for (uint32_t i = meshLodOffsets[original]; i < meshLodOffsets[original + 1]; i++) {
+			lodRanges.push_back(lodRanges[i]);
+			dedupStats.lodIndices += lodRanges[i].indexCount;
+		}
+		meshLodOffsets.push_back(static_cast<uint32_t>(lodRanges.size()));
+
+		for (uint32_t i = meshletOffsets[original]; i < meshletOffsets[original + 1]; i++) {
+			Meshlet meshlet = meshlets[i];
+			meshlet.meshIdx = meshIdx;
+			meshlets.push_back(meshlet);
+		}
+		meshletOffsets.push_back(static_cast<uint32_t>(meshlets.size()));
+
+		VkDrawIndexedIndirectCommand indirectCmd = indirectCommands[original];
+		indirectCmd.firstInstance = 0;
+		indirectCmd.instanceCount = mesh->instanceCount;
+		indirectCommands.push_back(indirectCmd);
+
+		dedupStats.meshes++;
+		dedupStats.vertices += offsets.vertexCount;
+		dedupStats.indices += offsets.indexCount;
+
+		meshAliases.push_back(original);
+		meshes.push_back(mesh);
+
+		return static_cast<uint32_t>(meshes.size());
+	}
+
+	// BLAS of a mesh, owned by the mesh it aliases
+	const BottomLevelAccelerationStructure& getMeshBlas(uint32_t meshIdx) const
+	{
+		return meshes[meshAliases[meshIdx]]->as_bottomLevel;
+	}
+
+	void writeTlasData()
+	{
+		tlas_instanceData.clear();
+		tlasSpheres.clear();
+		for (uint32_t globalInstanceId = 0; globalInstanceId < instanceData_dynamic.size(); globalInstanceId++) {
+			const uint32_t meshIdx = meshPointers[globalInstanceId];
+			const uint32_t group = meshBlasGroup[meshIdx];
+			// A group is placed by the instance of its first mesh
+			if (group != 0xffffffff && blasGroups[group].firstMesh != meshIdx)
+				continue;
+
+			const InstanceData_dynamic& instance = instanceData_dynamic[globalInstanceId];
+			TopLevelAccelerationStructureData data;
+			// Copy first three rows of transformation matrix of each instance
+			glm::mat4 modelTrans = glm::transpose(instance.model);
+			memcpy(data.transform, &modelTrans, sizeof(data.transform));
+			data.instanceId = globalInstanceId; // gl_InstanceCustomIndexNV, indexes InstanceData_static in the hit shaders
+			data.mask = 0xff;
+			data.instanceOffset = 0; // Since this is used to determine hit group index compuation, this may change
+			data.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
+			data.blasHandle = group != 0xffffffff ? groupBlas[group].handle : getMeshBlas(meshIdx).handle;
+			tlas_instanceData.push_back(data);
+			tlasSpheres.push_back(transformSphere(instance.model, group != 0xffffffff ? blasGroups[group].boundingSphere : meshes[meshIdx]->boundingSphere));
+		}
+
+		CHECK_DBG_ONLY(tlas_instanceData.size() == getTlasInstanceCount(),
+			"Model: Number of instances for Top Level Accelaration structure should match dynamic instance data count minus the grouped instances.");
+
+		as_topLevel.updateInstanceData(tlas_instanceData);
+		tlasTransformVersion = transformVersion;
+	}
+
+	// Movement of an instance in updateMeshData(animate = true), by instance index. planBlasGroups() only groups instances that stay put.
+	enum class InstanceAnimation
+	{
+		NONE,
+		SPIN, // around its own (1, 1, 0) axis
+		ORBIT // around the world y axis
+	};
+
+	static InstanceAnimation instanceAnimation(uint32_t instanceIdx)
+	{
+		if (instanceIdx == 1)
+			return InstanceAnimation::SPIN;
+		if (instanceIdx == 2 || instanceIdx == 3)
+			return InstanceAnimation::ORBIT;
+
+		return InstanceAnimation::NONE;
+	}
+
+	// Groups the meshes whose single instance is static, see BlasPlanner
+	void planBlasGroups()
+	{
+		std::vector<bool> aliased(meshes.size(), false);
+		for (uint32_t meshIdx = 0; meshIdx < meshes.size(); meshIdx++)
+			if (meshAliases[meshIdx] != meshIdx)
+				aliased[meshIdx] = aliased[meshAliases[meshIdx]] = true;
+
+		std::vector<BlasCandidate> candidates(meshes.size());
+		for (uint32_t meshIdx = 0; meshIdx < meshes.size(); meshIdx++) {
+			BlasCandidate& candidate = candidates[meshIdx];
+			candidate.triangleCount = meshOffsets[meshIdx].indexCount / 3;
+			candidate.boundingSphere = meshes[meshIdx]->boundingSphere;
+			if (meshes[meshIdx]->instanceCount != 1)
+				continue;
+
+			// Meshes that share their storage with an alias are not contiguous with their neighbours
+			const uint32_t instanceIdx = indirectCommands[meshIdx].firstInstance;
+			candidate.groupable = instanceAnimation(instanceIdx) == InstanceAnimation::NONE && (instanceData_static[instanceIdx].data.z & 0xff) == 0 && !aliased[meshIdx];
+			candidate.transform = instanceData_dynamic[instanceIdx].model;
+			candidate.materialIndex = instanceData_static[instanceIdx].data.x;
+		}
+
+		blasGroups = BlasPlanner::plan(candidates, blasPlannerSettings);
+		meshBlasGroup.assign(meshes.size(), 0xffffffff);
+		for (uint32_t group = 0; group < blasGroups.size(); group++)
+			for (uint32_t i = 0; i < blasGroups[group].meshCount; i++)
+				meshBlasGroup[blasGroups[group].firstMesh + i] = group;
+	}
+
+	uint32_t getTlasInstanceCount() const
+	{
+		uint32_t groupedInstances = 0;
+		for (const auto& group : blasGroups)
+			groupedInstances += group.meshCount - 1;
+
+		return static_cast<uint32_t>(instanceData_dynamic.size()) - groupedInstances;
+	}
+
 	void createDynamicInstanceBuffer(const VkDevice& device, const VmaAllocator& allocator, const VkQueue& queue, const VkCommandPool& commandPool) 
 	{
 		VkDeviceSize bufferSize = sizeof(instanceData_dynamic[0]) * instanceData_dynamic.size();
@@ -749,6 +1532,119 @@ private:
 		VK_CHECK(vmaCreateBuffer(allocator, &bufferCreateInfo, &allocCreateInfo, &dynamicInstanceBuffer, &dynamicInstanceBufferAllocation, nullptr),
 			"Model : Failed to create buffer for dynamic instances!");
 	}
+
+	// Materials with the texture handles of the texture generators, single color textures become constants
+	std::vector<DeviceMaterial> getDeviceMaterials() const
+	{
+		std::vector<DeviceMaterial> deviceMaterials(materials.size());
+		for (size_t i = 0; i < materials.size(); i++) {
+			const Material& material = materials[i];
+			DeviceMaterial& deviceMaterial = deviceMaterials[i];
+
+			deviceMaterial = {};
+			deviceMaterial.diffuseTexture = ldrTexGen.getHandle(material.diffuseTextureIdx);
+			deviceMaterial.specularTexture = ldrTexGen.getHandle(material.specularTextureIdx);
+			deviceMaterial.alphaIntExtIorTexture = hdrTexGen.getHandle(material.alphaIntExtIorTextureIdx);
+			deviceMaterial.materialType = material.materialType;
+			deviceMaterial.diffuseConstant = glm::packUnorm4x8(ldrTexGen.getConstant(material.diffuseTextureIdx));
+			deviceMaterial.specularConstant = glm::packUnorm4x8(ldrTexGen.getConstant(material.specularTextureIdx));
+			deviceMaterial.emission = FloatPacker::packSharedExponent(material.emission.x, material.emission.y, material.emission.z);
+			deviceMaterial.alphaIntExtIorConstant = hdrTexGen.getConstant(material.alphaIntExtIorTextureIdx);
+		}
+
+		return deviceMaterials;
+	}
+
+	// Keeps the first of each set of equal device materials, found by hashing, and remaps the material indices of the vertices, meshes and
+	// instances. Must run before the vertex and instance buffers are created.
+	void mergeEqualMaterials(std::vector<DeviceMaterial>& deviceMaterials)
+	{
+		std::vector<uint32_t> remap(deviceMaterials.size());
+		std::unordered_map<uint64_t, uint32_t> firstByHash;
+		std::vector<DeviceMaterial> uniqueDeviceMaterials;
+		std::vector<Material> uniqueMaterials;
+		for (uint32_t i = 0; i < deviceMaterials.size(); i++) {
+			const uint64_t key = fnv1a(&deviceMaterials[i], sizeof(DeviceMaterial));
+			auto first = firstByHash.find(key);
+			if (first != firstByHash.end() && memcmp(&uniqueDeviceMaterials[first->second], &deviceMaterials[i], sizeof(DeviceMaterial)) == 0) {
+				remap[i] = first->second;
+				continue;
+			}
+
+			// On a hash collision the material stays unique
+			remap[i] = static_cast<uint32_t>(uniqueDeviceMaterials.size());
+			if (first == firstByHash.end())
+				firstByHash[key] = remap[i];
+			uniqueDeviceMaterials.push_back(deviceMaterials[i]);
+			uniqueMaterials.push_back(materials[i]);
+		}
+
+		if (uniqueDeviceMaterials.size() == deviceMaterials.size())
+			return;
+
+		std::cout << "Model: " << deviceMaterials.size() << " materials, " << uniqueDeviceMaterials.size() << " after merging equal ones" << std::endl;
+
+		auto remapIndex = [&remap](uint32_t& materialIndex) {
+			if (materialIndex < remap.size())
+				materialIndex = remap[materialIndex];
+		};
+		for (auto& vertex : vertices)
+			remapIndex(vertex.materialIndex);
+		for (auto mesh : meshes)
+			for (auto& vertex : mesh->vertices)
+				remapIndex(vertex.materialIndex);
+		for (auto& instance : instanceData_static)
+			remapIndex(instance.data.x);
+
+		deviceMaterials = std::move(uniqueDeviceMaterials);
+		materials = std::move(uniqueMaterials);
+	}
+
+	// Host visible, written by cullInstances(). Until then every instance is visible.
+	void createVisibleInstanceBuffers(const VmaAllocator& allocator)
+	{
+		visibleInstanceCount = static_cast<uint32_t>(instanceData_static.size());
+		visibleInstances.resize(visibleInstanceCount);
+		for (uint32_t i = 0; i < visibleInstanceCount; i++)
+			visibleInstances[i] = i;
+
+		mappedVisibleStaticInstancePtr = createBuffer(allocator, visibleStaticInstanceBuffer, visibleStaticInstanceBufferAllocation, sizeof(instanceData_static[0]) * instanceData_static.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+		mappedVisibleDynamicInstancePtr = createBuffer(allocator, visibleDynamicInstanceBuffer, visibleDynamicInstanceBufferAllocation, sizeof(instanceData_dynamic[0]) * instanceData_dynamic.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+		memcpy(mappedVisibleStaticInstancePtr, instanceData_static.data(), sizeof(instanceData_static[0]) * instanceData_static.size());
+		memcpy(mappedVisibleDynamicInstancePtr, instanceData_dynamic.data(), sizeof(instanceData_dynamic[0]) * instanceData_dynamic.size());
+	}
+
+	// Host visible, every instance starts at level 0 until selectLods() is called
+	void createLodIndirectBuffer(const VmaAllocator& allocator)
+	{
+		lodIndirectCommands.resize(instanceData_static.size());
+		for (uint32_t i = 0; i < lodIndirectCommands.size(); i++)
+			lodIndirectCommands[i] = lodCommand(i, 0, i);
+
+		mappedLodIndirectCmdPtr = createBuffer(allocator, lodIndirectCmdBuffer, lodIndirectCmdBufferAllocation, sizeof(VkDrawIndexedIndirectCommand) * lodIndirectCommands.size(), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+		memcpy(mappedLodIndirectCmdPtr, lodIndirectCommands.data(), sizeof(VkDrawIndexedIndirectCommand) * lodIndirectCommands.size());
+	}
+
+	// firstInstance is the slot of the instance in the bound instance buffers
+	VkDrawIndexedIndirectCommand lodCommand(uint32_t instanceIdx, uint32_t lod, uint32_t firstInstance) const
+	{
+		const uint32_t meshIdx = meshPointers[instanceIdx];
+
+		VkDrawIndexedIndirectCommand cmd = {};
+		cmd.instanceCount = 1;
+		cmd.firstInstance = firstInstance;
+		if (lod == 0) {
+			cmd.firstIndex = meshOffsets[meshIdx].indexOffset;
+			cmd.indexCount = meshOffsets[meshIdx].indexCount;
+		}
+		else {
+			const MeshLodRange& range = lodRanges[meshLodOffsets[meshIdx] + lod - 1];
+			cmd.firstIndex = static_cast<uint32_t>(indices.size()) + range.firstIndex;
+			cmd.indexCount = range.indexCount;
+		}
+
+		return cmd;
+	}
 };
 
 #undef VERTEX_BINDING_ID
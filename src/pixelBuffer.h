@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "stb_image.h"
+
+/*
+ * Pixel buffers - Owner of the pixels of an Image2d. A buffer is move only and releases its memory the way it was allocated:
+ * HEAP     malloc()/free(), images that are resized or copied.
+ * STB      Decoded by stb_image, released with stbi_image_free().
+ * POOL     Blocks of PixelPool, the single color textures of the loaders, which are far too many to spend a heap allocation on each.
+ * EXTERNAL Memory of someone else, e.g. the ImGui font atlas, never released.
+ * SHARED   Read only view into memory that is kept alive by a shared owner, e.g. the mapping of the scene cache. Nothing is copied.
+ * Every host side copy of pixels goes through copy() or is counted with countCopies(), so that PixelBuffer::stats() tells how often the pixels
+ * of a texture are copied between the file and the staging buffer of the upload.
+ */
+
+// Totals since start up, take the difference of two snapshots to measure a stage
+struct PixelStats
+{
+	std::atomic<uint64_t> heapAllocations{ 0 };
+	std::atomic<uint64_t> poolAllocations{ 0 };
+	std::atomic<uint64_t> hostCopies{ 0 };
+	std::atomic<uint64_t> hostCopyBytes{ 0 };
+};
+
+// Arena of fixed size blocks, chunks are only released at exit
+class PixelPool
+{
+public:
+	static constexpr size_t BLOCK_SIZE = 64; // 4x4 RGBA8 or 2x2 RGBA32F texels
+	static constexpr size_t BLOCKS_PER_CHUNK = 1024;
+
+	static PixelPool& getInstance()
+	{
+		static PixelPool pool;
+		return pool;
+	}
+
+	void* allocate()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (freeBlocks.empty()) {
+			chunks.emplace_back(new uint8_t[BLOCK_SIZE * BLOCKS_PER_CHUNK]);
+			for (size_t i = BLOCKS_PER_CHUNK; i > 0; i--)
+				freeBlocks.push_back(chunks.back().get() + (i - 1) * BLOCK_SIZE);
+		}
+
+		void* block = freeBlocks.back();
+		freeBlocks.pop_back();
+
+		return block;
+	}
+
+	void release(void* block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		freeBlocks.push_back(block);
+	}
+
+	size_t chunkCount()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return chunks.size();
+	}
+
+private:
+	PixelPool() {}
+	PixelPool(const PixelPool&) = delete;
+	PixelPool& operator=(const PixelPool&) = delete;
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<uint8_t[]>> chunks;
+	std::vector<void*> freeBlocks;
+};
+
+class PixelBuffer
+{
+public:
+	PixelBuffer() {}
+	PixelBuffer(const PixelBuffer&) = delete;
+	PixelBuffer& operator=(const PixelBuffer&) = delete;
+
+	PixelBuffer(PixelBuffer&& other) noexcept
+	{
+		take(other);
+	}
+
+	PixelBuffer& operator=(PixelBuffer&& other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			take(other);
+		}
+
+		return *this;
+	}
+
+	~PixelBuffer()
+	{
+		reset();
+	}
+
+	// Uninitialized, from PixelPool when it fits in a block
+	static PixelBuffer allocate(size_t size)
+	{
+		PixelBuffer buffer;
+		buffer.bytes = size;
+		if (size <= PixelPool::BLOCK_SIZE) {
+			buffer.pixels = PixelPool::getInstance().allocate();
+			buffer.owner = Owner::POOL;
+			stats().poolAllocations++;
+		}
+		else {
+			buffer.pixels = malloc(size);
+			buffer.owner = Owner::HEAP;
+			stats().heapAllocations++;
+			if (buffer.pixels == nullptr)
+				throw std::bad_alloc();
+		}
+
+		return buffer;
+	}
+
+	static PixelBuffer adoptStb(void* pixels, size_t size)
+	{
+		return PixelBuffer(pixels, size, Owner::STB);
+	}
+
+	static PixelBuffer borrow(void* pixels, size_t size)
+	{
+		return PixelBuffer(pixels, size, Owner::EXTERNAL);
+	}
+
+	static PixelBuffer share(std::shared_ptr<const void> sharedOwner, const void* pixels, size_t size)
+	{
+		PixelBuffer buffer(const_cast<void*>(pixels), size, Owner::SHARED);
+		buffer.sharedOwner = std::move(sharedOwner);
+
+		return buffer;
+	}
+
+	static PixelBuffer copyOf(const void* src, size_t size)
+	{
+		PixelBuffer buffer = allocate(size);
+		copy(buffer.pixels, src, size);
+
+		return buffer;
+	}
+
+	// Counted in stats()
+	static void copy(void* dst, const void* src, size_t size)
+	{
+		memcpy(dst, src, size);
+		countCopies(1, size);
+	}
+
+	// Copies done elsewhere, e.g. level 0 of the mip chains written by MipGenerator::generate()
+	static void countCopies(uint64_t count, uint64_t bytes)
+	{
+		stats().hostCopies += count;
+		stats().hostCopyBytes += bytes;
+	}
+
+	static PixelStats& stats()
+	{
+		static PixelStats pixelStats;
+		return pixelStats;
+	}
+
+	// Must not be written when shared
+	void* data() const
+	{
+		return pixels;
+	}
+
+	size_t size() const
+	{
+		return bytes;
+	}
+
+	bool isShared() const
+	{
+		return owner == Owner::SHARED;
+	}
+
+	void reset()
+	{
+		if (owner == Owner::HEAP)
+			free(pixels);
+		else if (owner == Owner::STB)
+			stbi_image_free(pixels);
+		else if (owner == Owner::POOL)
+			PixelPool::getInstance().release(pixels);
+
+		pixels = nullptr;
+		bytes = 0;
+		owner = Owner::NONE;
+		sharedOwner.reset();
+	}
+
+private:
+	enum class Owner
+	{
+		NONE,
+		HEAP,
+		STB,
+		POOL,
+		EXTERNAL,
+		SHARED
+	};
+
+	void* pixels = nullptr;
+	size_t bytes = 0;
+	Owner owner = Owner::NONE;
+	std::shared_ptr<const void> sharedOwner;
+
+	PixelBuffer(void* pixels, size_t size, Owner owner) : pixels(pixels), bytes(size), owner(owner) {}
+
+	void take(PixelBuffer& other)
+	{
+		pixels = other.pixels;
+		bytes = other.bytes;
+		owner = other.owner;
+		sharedOwner = std::move(other.sharedOwner);
+
+		other.pixels = nullptr;
+		other.bytes = 0;
+		other.owner = Owner::NONE;
+	}
+};
@@ -0,0 +1,489 @@
+#include <filesystem>
+
+#include "sceneCache.h"
+
+// Every array section starts at a multiple of this, the mapping itself is page aligned
+#define SCENE_CACHE_ALIGNMENT 16
+
+struct SceneCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexSize;
+	uint32_t materialSize;
+	uint32_t staticInstanceSize;
+	uint32_t dynamicInstanceSize;
+	uint32_t sourceFileCount;
+	uint32_t reserved;
+	uint64_t fileSize;
+	uint64_t definitionKey;
+};
+
+struct SceneCacheTextureRecord
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t reserved;
+};
+
+struct SceneCacheMeshRecord
+{
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t instanceCount;
+	uint32_t lodCount;
+	glm::vec4 boundingSphere;
+};
+
+// Follows the vertices and indices of a mesh, once per level of detail, each followed by its indices
+struct SceneCacheLodRecord
+{
+	uint32_t indexCount;
+	float error;
+};
+
+class SceneCacheWriter
+{
+public:
+	std::vector<uint8_t> buffer;
+
+	void write(const void* src, size_t sizeInBytes)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(src);
+		buffer.insert(buffer.end(), bytes, bytes + sizeInBytes);
+	}
+
+	template<typename T>
+	void write(const T& value)
+	{
+		write(&value, sizeof(T));
+	}
+
+	template<typename T>
+	void writeArray(const T* values, size_t count)
+	{
+		align();
+		write(values, sizeof(T) * count);
+	}
+
+	void writeString(const std::string& str)
+	{
+		write(static_cast<uint32_t>(str.size()));
+		write(str.data(), str.size());
+	}
+
+	void align()
+	{
+		buffer.resize(ROUND_UP(buffer.size(), SCENE_CACHE_ALIGNMENT), 0);
+	}
+};
+
+// Bounds checked reads from the mapped file, arrays are returned as pointers into the mapping
+class SceneCacheReader
+{
+public:
+	SceneCacheReader(const uint8_t* data, size_t size)
+	{
+		this->data = data;
+		this->size = size;
+	}
+
+	template<typename T>
+	bool read(T& value)
+	{
+		if (sizeof(T) > size - offset)
+			return false;
+
+		memcpy(&value, data + offset, sizeof(T));
+		offset += sizeof(T);
+		return true;
+	}
+
+	template<typename T>
+	const T* readArray(size_t count)
+	{
+		size_t alignedOffset = ROUND_UP(offset, SCENE_CACHE_ALIGNMENT);
+		if (alignedOffset > size || count > (size - alignedOffset) / sizeof(T))
+			return nullptr;
+
+		const T* values = reinterpret_cast<const T*>(data + alignedOffset);
+		offset = alignedOffset + sizeof(T) * count;
+		return values;
+	}
+
+	bool readString(std::string& str)
+	{
+		uint32_t length;
+		if (!read(length) || length > size - offset)
+			return false;
+
+		str.assign(reinterpret_cast<const char*>(data + offset), length);
+		offset += length;
+		return true;
+	}
+
+private:
+	const uint8_t* data;
+	size_t size;
+	size_t offset = 0;
+};
+
+uint64_t SceneCache::hashFile(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	CHECK(file.is_open(), "SceneCache: Failed to open file - " + path);
+
+	// Only the last chunk can be short, see fnv1a()
+	uint64_t hash = fnv1a(nullptr, 0);
+	std::vector<char> chunk(1 << 20);
+	while (file) {
+		file.read(chunk.data(), chunk.size());
+		hash = fnv1a(chunk.data(), static_cast<size_t>(file.gcount()), hash);
+	}
+
+	return hash;
+}
+
+bool SceneCache::querySourceFile(const std::string& path, SourceFileInfo& info, bool computeHash)
+{
+	std::error_code error;
+	info.size = static_cast<uint64_t>(std::filesystem::file_size(path, error));
+	if (error)
+		return false;
+
+	info.modificationTime = static_cast<int64_t>(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+	if (error)
+		return false;
+
+	info.hash = computeHash ? hashFile(path) : 0;
+	return true;
+}
+
+bool SceneCache::load(Model& model) const
+{
+	CHECK(model.meshes.empty() && model.materials.empty() && model.ldrTexGen.empty() && model.hdrTexGen.empty(),
+		"SceneCache: Model must be empty before loading the cache.");
+
+	// Shared with the textures, which use their pixels in place until they are uploaded
+	std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+	MappedFile& file = *mapping;
+	if (!file.open(cacheFile))
+		return false;
+
+	auto corrupt = [this]()
+	{
+		WARN(false, "SceneCache: Ignoring corrupt cache file - " + cacheFile);
+		return false;
+	};
+
+	SceneCacheReader reader(file.data(), file.size());
+
+	SceneCacheHeader header;
+	if (!reader.read(header) || header.magic != SCENE_CACHE_MAGIC || header.fileSize != file.size())
+		return corrupt();
+
+	if (header.version != SCENE_CACHE_VERSION || header.vertexSize != sizeof(Vertex) || header.materialSize != sizeof(Material) ||
+		header.staticInstanceSize != sizeof(InstanceData_static) || header.dynamicInstanceSize != sizeof(InstanceData_dynamic) ||
+		header.definitionKey != definitionKey || header.sourceFileCount != sourceFiles.size()) {
+		std::cout << "Scene cache is outdated - " << cacheFile << std::endl;
+		return false;
+	}
+
+	for (const auto& path : sourceFiles) {
+		std::string cachedPath;
+		SourceFileInfo cachedInfo, info;
+		if (!reader.readString(cachedPath) || !reader.read(cachedInfo))
+			return corrupt();
+
+		// The source file moved, changed size or was modified. A touched but unmodified file is still a hit.
+		if (cachedPath != path || !querySourceFile(path, info, false) || info.size != cachedInfo.size ||
+			(info.modificationTime != cachedInfo.modificationTime && hashFile(path) != cachedInfo.hash)) {
+			std::cout << "Scene cache is outdated - " << cacheFile << std::endl;
+			return false;
+		}
+	}
+
+	// Validate all sections before touching the model
+	std::vector<SceneCacheTextureRecord> textureRecords[2];
+	std::vector<const void*> texturePixels[2];
+	uint32_t constantCounts[2];
+	const glm::vec4* constants[2];
+	for (uint32_t i = 0; i < 2; i++) {
+		uint32_t count;
+		if (!reader.read(count))
+			return corrupt();
+
+		VkFormat expectedFormat = i == 0 ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R32G32B32A32_SFLOAT;
+		for (uint32_t j = 0; j < count; j++) {
+			SceneCacheTextureRecord record;
+			if (!reader.read(record) || record.format != static_cast<uint32_t>(expectedFormat))
+				return corrupt();
+
+			const uint8_t* pixels = reader.readArray<uint8_t>(static_cast<size_t>(record.width) * record.height * imageFormatToBytes(expectedFormat));
+			if (pixels == nullptr)
+				return corrupt();
+
+			textureRecords[i].push_back(record);
+			texturePixels[i].push_back(pixels);
+		}
+
+		if (!reader.read(constantCounts[i]))
+			return corrupt();
+		constants[i] = reader.readArray<glm::vec4>(constantCounts[i]);
+		if (constants[i] == nullptr)
+			return corrupt();
+	}
+
+	uint32_t materialCount;
+	if (!reader.read(materialCount))
+		return corrupt();
+	const Material* materials = reader.readArray<Material>(materialCount);
+	if (materials == nullptr)
+		return corrupt();
+
+	uint32_t meshCount;
+	if (!reader.read(meshCount))
+		return corrupt();
+	const SceneCacheMeshRecord* meshRecords = reader.readArray<SceneCacheMeshRecord>(meshCount);
+	if (meshRecords == nullptr)
+		return corrupt();
+
+	std::vector<const Vertex*> meshVertices(meshCount);
+	std::vector<const uint32_t*> meshIndices(meshCount);
+	std::vector<std::vector<SceneCacheLodRecord>> lodRecords(meshCount);
+	std::vector<std::vector<const uint32_t*>> lodIndices(meshCount);
+	for (uint32_t i = 0; i < meshCount; i++) {
+		meshVertices[i] = reader.readArray<Vertex>(meshRecords[i].vertexCount);
+		meshIndices[i] = reader.readArray<uint32_t>(meshRecords[i].indexCount);
+		if (meshVertices[i] == nullptr || meshIndices[i] == nullptr)
+			return corrupt();
+
+		for (uint32_t j = 0; j < meshRecords[i].lodCount; j++) {
+			SceneCacheLodRecord record;
+			if (!reader.read(record))
+				return corrupt();
+
+			const uint32_t* indices = reader.readArray<uint32_t>(record.indexCount);
+			if (indices == nullptr)
+				return corrupt();
+
+			lodRecords[i].push_back(record);
+			lodIndices[i].push_back(indices);
+		}
+	}
+
+	uint32_t instanceCount, areaLightPrimitiveOffsetCounter;
+	if (!reader.read(instanceCount))
+		return corrupt();
+	const InstanceData_static* instanceDataStatic = reader.readArray<InstanceData_static>(instanceCount);
+	const InstanceData_dynamic* instanceDataDynamic = reader.readArray<InstanceData_dynamic>(instanceCount);
+	const uint32_t* meshPointers = reader.readArray<uint32_t>(instanceCount);
+	const VkDrawIndexedIndirectCommand* indirectCommands = reader.readArray<VkDrawIndexedIndirectCommand>(meshCount);
+	if (instanceDataStatic == nullptr || instanceDataDynamic == nullptr || meshPointers == nullptr || indirectCommands == nullptr || !reader.read(areaLightPrimitiveOffsetCounter))
+		return corrupt();
+
+	for (uint32_t i = 0; i < instanceCount; i++)
+		if (meshPointers[i] >= meshCount)
+			return corrupt();
+
+	std::cout << "Loading scene from cache...";
+
+	for (uint32_t i = 0; i < 2; i++)
+		for (uint32_t j = 0; j < textureRecords[i].size(); j++) {
+			const SceneCacheTextureRecord& record = textureRecords[i][j];
+			const VkFormat format = static_cast<VkFormat>(record.format);
+			const size_t size = static_cast<size_t>(record.width) * record.height * imageFormatToBytes(format);
+			Image2d texture(record.width, record.height, format, PixelBuffer::share(mapping, texturePixels[i][j], size));
+			if (i == 0)
+				model.addLdrTexture(std::move(texture));
+			else
+				model.addHdrTexture(std::move(texture));
+		}
+
+	// Added in the order they were saved, the indices in the materials stay valid
+	for (uint32_t i = 0; i < 2; i++)
+		for (uint32_t j = 0; j < constantCounts[i]; j++)
+			if (i == 0)
+				model.addLdrConstant(constants[i][j]);
+			else
+				model.addHdrConstant(constants[i][j]);
+
+	model.materials.assign(materials, materials + materialCount);
+
+	for (uint32_t i = 0; i < meshCount; i++) {
+		Mesh* mesh = new Mesh();
+		mesh->vertices.assign(meshVertices[i], meshVertices[i] + meshRecords[i].vertexCount);
+		mesh->indices.assign(meshIndices[i], meshIndices[i] + meshRecords[i].indexCount);
+		mesh->boundingSphere = meshRecords[i].boundingSphere;
+		for (uint32_t j = 0; j < lodRecords[i].size(); j++)
+			mesh->lods.push_back({ std::vector<uint32_t>(lodIndices[i][j], lodIndices[i][j] + lodRecords[i][j].indexCount), lodRecords[i][j].error });
+		model.addMesh(mesh);
+		mesh->instanceCount = meshRecords[i].instanceCount;
+	}
+
+	model.instanceData_static.assign(instanceDataStatic, instanceDataStatic + instanceCount);
+	model.instanceData_dynamic.assign(instanceDataDynamic, instanceDataDynamic + instanceCount);
+	model.meshPointers.assign(meshPointers, meshPointers + instanceCount);
+	model.indirectCommands.assign(indirectCommands, indirectCommands + meshCount);
+	model.areaLightPrimitiveOffsetCounter = areaLightPrimitiveOffsetCounter;
+
+	std::cout << "Done." << std::endl;
+
+	return true;
+}
+
+void SceneCache::save(Model& model) const
+{
+	SceneCacheWriter writer;
+
+	SceneCacheHeader header = {};
+	header.magic = SCENE_CACHE_MAGIC;
+	header.version = SCENE_CACHE_VERSION;
+	header.vertexSize = sizeof(Vertex);
+	header.materialSize = sizeof(Material);
+	header.staticInstanceSize = sizeof(InstanceData_static);
+	header.dynamicInstanceSize = sizeof(InstanceData_dynamic);
+	header.sourceFileCount = static_cast<uint32_t>(sourceFiles.size());
+	header.definitionKey = definitionKey;
+	writer.write(header);
+
+	for (const auto& path : sourceFiles) {
+		SourceFileInfo info;
+		if (!querySourceFile(path, info, true)) {
+			WARN(false, "SceneCache: Cannot find source file - " + path + ". Cache is not written.");
+			return;
+		}
+
+		writer.writeString(path);
+		writer.write(info);
+	}
+
+	for (TextureGenerator* texGen : { &model.ldrTexGen, &model.hdrTexGen }) {
+		texGen->waitForTextures();
+		writer.write(static_cast<uint32_t>(texGen->size()));
+		for (const auto& texture : texGen->getTextures()) {
+			CHECK(texture.pixels() != nullptr, "SceneCache: Texture is already released, cache must be saved before Model::createBuffers().");
+
+			SceneCacheTextureRecord record = { texture.width, texture.height, static_cast<uint32_t>(texture.format), 0 };
+			writer.write(record);
+			writer.writeArray(static_cast<const uint8_t*>(texture.pixels()), texture.sizeInBytes());
+		}
+
+		const std::vector<glm::vec4>& constants = texGen->getInlineConstants();
+		writer.write(static_cast<uint32_t>(constants.size()));
+		writer.writeArray(constants.data(), constants.size());
+	}
+
+	writer.write(static_cast<uint32_t>(model.materials.size()));
+	writer.writeArray(model.materials.data(), model.materials.size());
+
+	std::vector<SceneCacheMeshRecord> meshRecords;
+	for (const auto mesh : model.meshes)
+		meshRecords.push_back({ static_cast<uint32_t>(mesh->vertices.size()), static_cast<uint32_t>(mesh->indices.size()), mesh->instanceCount, static_cast<uint32_t>(mesh->lods.size()), mesh->boundingSphere });
+
+	writer.write(static_cast<uint32_t>(meshRecords.size()));
+	writer.writeArray(meshRecords.data(), meshRecords.size());
+	for (const auto mesh : model.meshes) {
+		writer.writeArray(mesh->vertices.data(), mesh->vertices.size());
+		writer.writeArray(mesh->indices.data(), mesh->indices.size());
+		for (const auto& lod : mesh->lods) {
+			writer.write(SceneCacheLodRecord{ static_cast<uint32_t>(lod.indices.size()), lod.error });
+			writer.writeArray(lod.indices.data(), lod.indices.size());
+		}
+	}
+
+	writer.write(static_cast<uint32_t>(model.instanceData_static.size()));
+	writer.writeArray(model.instanceData_static.data(), model.instanceData_static.size());
+	writer.writeArray(model.instanceData_dynamic.data(), model.instanceData_dynamic.size());
+	writer.writeArray(model.meshPointers.data(), model.meshPointers.size());
+	writer.writeArray(model.indirectCommands.data(), model.indirectCommands.size());
+	writer.write(model.areaLightPrimitiveOffsetCounter);
+
+	header.fileSize = writer.buffer.size();
+	memcpy(writer.buffer.data(), &header, sizeof(header));
+
+	// Write to a temporary file first, so that an interrupted write never leaves a truncated cache behind
+	std::string tmpFile = cacheFile + ".tmp";
+	{
+		std::ofstream file(tmpFile, std::ios::binary | std::ios::trunc);
+		if (!file.write(reinterpret_cast<const char*>(writer.buffer.data()), writer.buffer.size())) {
+			WARN(false, "SceneCache: Failed to write cache file - " + tmpFile);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tmpFile, cacheFile, error);
+	WARN(!error, "SceneCache: Failed to write cache file - " + cacheFile);
+}
+
+void SceneCache::selfTest(const std::string& directory)
+{
+	// Textures that are not constant, in two size classes
+	const uint32_t sizes[3][2] = { { 64, 64 }, { 64, 64 }, { 32, 16 } };
+	std::vector<std::string> texturePaths;
+	for (uint32_t i = 0; i < 3; i++) {
+		const uint32_t width = sizes[i][0];
+		const uint32_t height = sizes[i][1];
+		std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+		for (uint32_t y = 0; y < height; y++)
+			for (uint32_t x = 0; x < width; x++) {
+				uint8_t* texel = &pixels[4 * (static_cast<size_t>(y) * width + x)];
+				texel[0] = static_cast<uint8_t>(4 * x + 50 * i);
+				texel[1] = static_cast<uint8_t>(4 * y);
+				texel[2] = static_cast<uint8_t>((x ^ y) * 8);
+				texel[3] = 255;
+			}
+
+		texturePaths.push_back(directory + "/selfTest" + std::to_string(i) + ".png");
+		CHECK(stbi_write_png(texturePaths.back().c_str(), width, height, 4, pixels.data(), width * 4) != 0, "SceneCache: Failed to write " + texturePaths.back());
+	}
+
+	const std::string cachePath = directory + "/selfTest";
+	SceneCache cache(cachePath + ".scache", 0);
+	cache.addSourceFiles(texturePaths);
+
+	// Host copies per texture from before the textures are added or loaded until the arrays are in the staging memory
+	auto copiesPerTexture = [](const TextureGenerator& texGen, uint64_t copiesBefore) {
+		const TextureMemoryReport& report = texGen.getMemoryReport();
+		CHECK(report.textureCount == 3 && report.constantCount == 0, "SceneCache: Self test textures were taken for constants.");
+		return static_cast<double>(PixelBuffer::stats().hostCopies - copiesBefore) / report.textureCount;
+	};
+
+	uint64_t copiesBefore = PixelBuffer::stats().hostCopies;
+	Model decoded;
+	for (const auto& path : texturePaths)
+		decoded.addLdrTexture(path);
+	cache.save(decoded);
+	decoded.ldrTexGen.cookTextureArraysOnHost();
+	const double decodedCopies = copiesPerTexture(decoded.ldrTexGen, copiesBefore);
+	CHECK(decodedCopies == 1.0, "SceneCache: Decoded textures are copied " + std::to_string(decodedCopies) + " times on the host, expected once.");
+
+	copiesBefore = PixelBuffer::stats().hostCopies;
+	Model viewed;
+	CHECK(cache.load(viewed), "SceneCache: Self test cache was not loaded.");
+	viewed.setCookedTextureCache(cachePath);
+	viewed.ldrTexGen.cookTextureArraysOnHost();
+	const double viewedCopies = copiesPerTexture(viewed.ldrTexGen, copiesBefore);
+	CHECK(!viewed.ldrTexGen.getMemoryReport().cookedCacheHit, "SceneCache: Cooked texture cache was hit before it was written.");
+	CHECK(viewedCopies == 1.0, "SceneCache: Textures of the cache are copied " + std::to_string(viewedCopies) + " times on the host, expected once.");
+
+	copiesBefore = PixelBuffer::stats().hostCopies;
+	Model cooked;
+	CHECK(cache.load(cooked), "SceneCache: Self test cache was not loaded.");
+	cooked.setCookedTextureCache(cachePath);
+	cooked.ldrTexGen.cookTextureArraysOnHost();
+	const double cookedCopies = copiesPerTexture(cooked.ldrTexGen, copiesBefore);
+	CHECK(cooked.ldrTexGen.getMemoryReport().cookedCacheHit, "SceneCache: Cooked texture cache was not hit.");
+	CHECK(cookedCopies == 1.0, "SceneCache: Cooked textures are copied " + std::to_string(cookedCopies) + " times on the host, expected once.");
+
+	std::error_code error;
+	for (const auto& path : texturePaths)
+		std::filesystem::remove(path, error);
+	std::filesystem::remove(cachePath + ".scache", error);
+	std::filesystem::remove(cachePath + ".ldr.tcook", error);
+
+	std::cout << "Scene cache - host copies per texture: " << decodedCopies << " decoded, " << viewedCopies << " from the scene cache, " << cookedCopies
+		<< " from the cooked cache" << std::endl;
+}
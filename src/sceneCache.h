@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "model.hpp"
+#include "mappedFile.h"
+
+/*
+ * Scene cache - Parsing obj files and welding vertices dominates the start up time of every app. The result of a scene load, i.e. the vertex and index arrays
+ * of each mesh and its levels of detail, bounding spheres, textures, material constants, materials and instance tables is written to a single versioned binary file after the first load. Later runs memory
+ * map the file and hand the sections to the Model without touching the source assets.
+ * The cache stores size, modification time and a content hash (FNV-1a) for each source file. A cache is stale when the source list changes or when the size of a
+ * source differs, or its modification time differs and the content hash does not match. Materials, constants and instance tables that a loader defines in code
+ * are covered by its definition key, which the header stores next to the version: a loader passes a new key whenever its code changes, see sceneManager.cpp.
+ * Layout changes of Vertex, Material or instance data are caught by storing their sizes in the header; any other change of the file format must bump
+ * SCENE_CACHE_VERSION.
+ */
+
+#define SCENE_CACHE_MAGIC 0x43545352 // "RSTC"
+#define SCENE_CACHE_VERSION 7
+
+class SceneCache
+{
+public:
+	// definitionKey identifies the code that builds the scene beyond its source files, a cache written with another key is stale
+	SceneCache(const std::string& cacheFile, uint64_t definitionKey)
+	{
+		this->cacheFile = cacheFile;
+		this->definitionKey = definitionKey;
+	}
+
+	// Every file the scene is built from, the cache is invalidated when one of them changes
+	void addSourceFile(const std::string& path)
+	{
+		sourceFiles.push_back(path);
+	}
+
+	void addSourceFiles(const std::vector<std::string>& paths)
+	{
+		sourceFiles.insert(sourceFiles.end(), paths.begin(), paths.end());
+	}
+
+	// Returns false when the cache is missing or stale, the model is left untouched in that case
+	bool load(Model& model) const;
+
+	// Must be called after all meshes, textures, materials and instances are added and before Model::createBuffers(). Waits for the
+	// textures that are still decoding.
+	void save(Model& model) const;
+
+	// Follows the LDR textures of a scene from their source to the staging memory and throws unless every texture is copied exactly once on
+	// the host, see PixelBuffer::stats(). Three paths: PNG files decoded by ImageDecoder, views into the mapping of a loaded cache and
+	// arrays read from the cooked texture cache. Writes its files to directory and removes them, no GPU needed.
+	static void selfTest(const std::string& directory);
+
+private:
+	struct SourceFileInfo
+	{
+		uint64_t size = 0;
+		int64_t modificationTime = 0;
+		uint64_t hash = 0;
+	};
+
+	std::string cacheFile;
+	uint64_t definitionKey;
+	std::vector<std::string> sourceFiles;
+
+	static bool querySourceFile(const std::string& path, SourceFileInfo& info, bool computeHash);
+	static uint64_t hashFile(const std::string& path);
+};
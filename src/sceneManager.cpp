@@ -1,10 +1,20 @@
 #include "sceneManager.h"
+#include "sceneCache.h"
+#include "mitsubaScene.h"
 //#include <assimp/Importer.hpp> 
 #include <glm/gtc/matrix_transform.hpp>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
+#include <chrono>
+#include <limits>
+#include <filesystem>
+#include "threadPool.h"
+#include "vertexWelder.h"
+#include "meshOptimizer.h"
+#include "meshSimplifier.h"
+
 //-----------------------------------------------------------------------------
 // Extract the directory component from a complete path.
 //
@@ -16,6 +26,10 @@
 #define WRONG_PATH_SEP '\\'
 #endif
 
+// Definition key of the scene caches written by the loaders below. They add materials, constants and instance tables in code, which the
+// caches can not see in their source files, and every build of this file changes the key.
+static const uint64_t sceneDefinitionKey = fnv1a(__DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__));
+
 struct NamedMaterial : Material 
 {
 	std::string name;
@@ -42,23 +56,40 @@ static std::string get_path(const std::string& file)
 	return dir;
 }
 
-static Mesh* loadMeshTiny(const char* meshPath, bool invertNormal = false)
-{	
-	std::cout << "Loading Model...";
-
-	Mesh* mesh = new Mesh();
-
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	std::string warn, err;
-
-	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, meshPath)) {
-		throw std::runtime_error(warn + err);
+// Time spent in each stage of the mesh import, in milliseconds. Parse, weld, normals, optimize and lods are summed over all worker threads.
+// Also collects the simulated vertex cache statistics before and after the mesh optimization.
+struct MeshImportTimings
+{
+	double parse = 0.0;
+	double weld = 0.0;
+	double normals = 0.0;
+	double optimize = 0.0;
+	double lods = 0.0;
+	double commit = 0.0;
+	VertexCacheStatistics cacheBefore;
+	VertexCacheStatistics cacheAfter;
+
+	void operator+=(const MeshImportTimings& other)
+	{
+		parse += other.parse;
+		weld += other.weld;
+		normals += other.normals;
+		optimize += other.optimize;
+		lods += other.lods;
+		commit += other.commit;
+		cacheBefore += other.cacheBefore;
+		cacheAfter += other.cacheAfter;
 	}
+};
 
-	std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+static double elapsedMs(const std::chrono::high_resolution_clock::time_point& start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
 
+// One vertex per triangle corner of all shapes, to be welded into an indexed mesh
+static void readCorners(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes, bool invertNormal, std::vector<Vertex>& corners)
+{
 	for (const auto& shape : shapes) {
 		for (const auto& index : shape.mesh.indices) {
 			Vertex vertex = {};
@@ -95,14 +126,39 @@ static Mesh* loadMeshTiny(const char* meshPath, bool invertNormal = false)
 			else
 				vertex.color = { 1.0f, 1.0f, 1.0f };
 
-			if (uniqueVertices.count(vertex) == 0) {
-				uniqueVertices[vertex] = static_cast<uint32_t>(mesh->vertices.size());
-				mesh->vertices.push_back(vertex);
-			}
-
-			mesh->indices.push_back(uniqueVertices[vertex]);
+			corners.push_back(vertex);
 		}
 	}
+}
+
+static Mesh* loadMeshTiny(const char* meshPath, bool invertNormal = false, MeshImportTimings* timings = nullptr, bool optimizeOverdraw = false)
+{	
+	MeshImportTimings localTimings;
+	if (timings == nullptr)
+		timings = &localTimings;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warn, err;
+
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, meshPath)) {
+		throw std::runtime_error(warn + err);
+	}
+
+	timings->parse += elapsedMs(start);
+	start = std::chrono::high_resolution_clock::now();
+
+	Mesh* mesh = new Mesh();
+	std::vector<Vertex> corners;
+	readCorners(attrib, shapes, invertNormal, corners);
+
+	VertexWelder().weld(corners, mesh->vertices, mesh->indices);
+
+	timings->weld += elapsedMs(start);
+	start = std::chrono::high_resolution_clock::now();
 
 	// Compute normal when no normal were provided.
 	if (attrib.normals.empty()) {
@@ -125,10 +181,103 @@ static Mesh* loadMeshTiny(const char* meshPath, bool invertNormal = false)
 	}
 
 	mesh->computeBoundingSphere();
-	std::cout << "Done." << std::endl;
+	timings->normals += elapsedMs(start);
+	start = std::chrono::high_resolution_clock::now();
+
+	MeshOptimizer::optimize(*mesh, optimizeOverdraw, &timings->cacheBefore, &timings->cacheAfter);
+	timings->optimize += elapsedMs(start);
+
 	return mesh;
 }
 
+struct MeshImportJob
+{
+	std::string path;
+	bool invertNormal = false;
+	// Optional per mesh processing, e.g. normalization. Runs on the worker thread right after import.
+	std::function<void(Mesh*)> postProcess;
+	// Sort triangle clusters for less overdraw after the vertex cache optimization
+	bool optimizeOverdraw = false;
+	// Number of coarser levels of detail to generate, after postProcess so that the errors are in final object space
+	uint32_t lodCount = 0;
+};
+
+// Imports the meshes on the shared thread pool, one task per file. The meshes are returned in job order, hence adding them to the model
+// in that order gives exactly the same mesh indices, vertex and index buffers as loading the files one after another.
+static std::vector<Mesh*> loadMeshesTiny(const std::vector<MeshImportJob>& jobs, MeshImportTimings& timings)
+{
+	std::cout << "Loading " << jobs.size() << " meshes on " << ThreadPool::getInstance().size() << " threads...";
+
+	std::vector<MeshImportTimings> jobTimings(jobs.size());
+	std::vector<std::future<Mesh*>> futures;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		futures.push_back(ThreadPool::getInstance().enqueue([&jobs, &jobTimings, i]()
+		{
+			Mesh* mesh = loadMeshTiny(jobs[i].path.c_str(), jobs[i].invertNormal, &jobTimings[i], jobs[i].optimizeOverdraw);
+			if (jobs[i].postProcess)
+				jobs[i].postProcess(mesh);
+			if (jobs[i].lodCount > 0) {
+				auto start = std::chrono::high_resolution_clock::now();
+				MeshSimplifier::generateLods(*mesh, jobs[i].lodCount);
+				jobTimings[i].lods += elapsedMs(start);
+			}
+			return mesh;
+		}));
+	}
+
+	// Wait for every task before reporting a failure, since the tasks reference the job list
+	std::vector<Mesh*> meshes;
+	std::string error;
+	for (size_t i = 0; i < futures.size(); i++) {
+		try {
+			meshes.push_back(futures[i].get());
+		}
+		catch (const std::exception& e) {
+			error += std::string(e.what()) + " (" + jobs[i].path + ")\n";
+			meshes.push_back(nullptr);
+		}
+	}
+
+	if (!error.empty()) {
+		for (auto mesh : meshes)
+			delete mesh;
+		throw std::runtime_error("SceneManager: Failed to load meshes.\n" + error);
+	}
+
+	for (const auto& jobTiming : jobTimings)
+		timings += jobTiming;
+
+	std::cout << "Done." << std::endl;
+
+	return meshes;
+}
+
+// Returns the value of the last Model::addMesh(), i.e. the mesh count
+static uint32_t addMeshes(Model& model, const std::vector<Mesh*>& meshes, MeshImportTimings& timings)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	uint32_t meshCount = 0;
+	for (auto mesh : meshes)
+		meshCount = model.addMesh(mesh);
+
+	timings.commit += elapsedMs(start);
+
+	return meshCount;
+}
+
+static void printMeshImportReport(const MeshImportTimings& timings, size_t fileCount, double wallTime)
+{
+	std::cout << "Mesh import report - " << fileCount << " files, " << wallTime << " ms wall time" << std::endl;
+	std::cout << "\tParse   : " << timings.parse << " ms (thread time)" << std::endl;
+	std::cout << "\tWeld    : " << timings.weld << " ms (thread time)" << std::endl;
+	std::cout << "\tNormals : " << timings.normals << " ms (thread time)" << std::endl;
+	std::cout << "\tOptimize: " << timings.optimize << " ms (thread time)" << std::endl;
+	std::cout << "\tLods    : " << timings.lods << " ms (thread time)" << std::endl;
+	std::cout << "\tVertex cache (FIFO " << MeshOptimizer::CACHE_SIZE << ") ACMR : " << timings.cacheBefore.acmr() << " -> " << timings.cacheAfter.acmr()
+		<< ", ATVR : " << timings.cacheBefore.atvr() << " -> " << timings.cacheAfter.atvr() << std::endl;
+	std::cout << "\tCommit  : " << timings.commit << " ms" << std::endl;
+}
+
 static void loadModelTiny(const char* meshPath, const char* materialPath, Model &model, bool normalize = false, float normScale = 1.0f)
 {	
 	std::cout << "Loading Model...";
@@ -143,48 +292,39 @@ static void loadModelTiny(const char* meshPath, const char* materialPath, Model
 		throw std::runtime_error(warn + err);
 	}
 	
-	uint32_t ldrTexSize = 0;
-	uint32_t hdrTexSize = 0;
 	if (materials.size() < 1) {
-		ldrTexSize = model.addLdrTexture(Image2d(1, 1, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f)));
-		hdrTexSize = model.addHdrTexture(Image2d(1, 1, glm::vec4(0.1f, 1.0f, 1.0f, 1.0f), true));
-		model.addMaterial(0, 0, 0, 0);
+		const uint32_t color = model.addLdrConstant(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+		model.addMaterial(color, color, model.addHdrConstant(glm::vec4(0.1f, 1.0f, 1.0f, 1.0f)), 0);
 	}
 
 	uint32_t materialSize = 0;
 
-	// Collecting the material in the scene
+	// Collecting the material in the scene, the texture files are decoded on the thread pool while the mesh is built. Colors and parameters
+	// without a texture become material constants.
 	for (const auto& material : materials)
 	{	
 		uint32_t diffuseTexureIdx, specularTextureIdx, alphaIntExtIorIdx;
 		if (!material.diffuse_texname.empty())
-			diffuseTexureIdx = model.addLdrTexture(Image2d(std::string(materialPath) + material.diffuse_texname));
+			diffuseTexureIdx = model.addLdrTexture(std::string(materialPath) + material.diffuse_texname) - 1;
 		else
-			diffuseTexureIdx = model.addLdrTexture(Image2d(1, 1, glm::vec4(material.diffuse[0], material.diffuse[1], material.diffuse[2], 1.0f)));
+			diffuseTexureIdx = model.addLdrConstant(glm::vec4(material.diffuse[0], material.diffuse[1], material.diffuse[2], 1.0f));
 
 		if (!material.specular_texname.empty())
-			specularTextureIdx = model.addLdrTexture(Image2d(materialPath + material.specular_texname));
+			specularTextureIdx = model.addLdrTexture(materialPath + material.specular_texname) - 1;
 		else
-			specularTextureIdx = model.addLdrTexture(Image2d(1, 1, glm::vec4(material.specular[0], material.specular[1], material.specular[2], 1.0f)));
+			specularTextureIdx = model.addLdrConstant(glm::vec4(material.specular[0], material.specular[1], material.specular[2], 1.0f));
 
 		if (!material.roughness_texname.empty()) {
 			throw std::runtime_error("SceneManager : Roughness texture not yet handled.");
 		}
 		else
-			alphaIntExtIorIdx = model.addHdrTexture(Image2d(1, 1, glm::vec4(std::sqrt(2 / (material.shininess + 2)), material.ior, 1.0f, 1.0f), true));
+			alphaIntExtIorIdx = model.addHdrConstant(glm::vec4(std::sqrt(2 / (material.shininess + 2)), material.ior, 1.0f, 1.0f));
 		
-		materialSize = model.addMaterial(diffuseTexureIdx - 1, specularTextureIdx - 1, alphaIntExtIorIdx - 1, 1); // the last 1 corresponds to some-non diffuse material
-		ldrTexSize = diffuseTexureIdx + specularTextureIdx;
-		hdrTexSize = alphaIntExtIorIdx;
+		materialSize = model.addMaterial(diffuseTexureIdx, specularTextureIdx, alphaIntExtIorIdx, 1, // the 1 corresponds to some-non diffuse material
+			glm::vec3(material.emission[0], material.emission[1], material.emission[2]));
 	}
-
-	// Model loader expects multi-layer tex image, add a dummy texture to shut up the model loader 
-	if (ldrTexSize < 2)
-		model.addLdrTexture(Image2d(1, 1, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f)));
-	if (hdrTexSize < 2)
-		model.addHdrTexture(Image2d(1, 1, glm::vec4(0.1f, 1.0f, 1.0f, 1.0f), true));
 	
-	std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+	std::vector<Vertex> corners;
 	
 	for (const auto& shape : shapes) {
 		
@@ -238,15 +378,12 @@ static void loadModelTiny(const char* meshPath, const char* materialPath, Model
 				index_cnt = 0;
 			}
 			
-			if (uniqueVertices.count(vertex) == 0) {
-				uniqueVertices[vertex] = static_cast<uint32_t>(mesh->vertices.size());
-				mesh->vertices.push_back(vertex);
-			}
-
-			mesh->indices.push_back(uniqueVertices[vertex]);
+			corners.push_back(vertex);
 		}
 	}
 
+	VertexWelder().weld(corners, mesh->vertices, mesh->indices);
+
 	// Compute normal when no normal were provided.
 	if (attrib.normals.empty()) {
 		for (auto& v : mesh->vertices)
@@ -267,6 +404,9 @@ static void loadModelTiny(const char* meshPath, const char* materialPath, Model
 			v.normal = glm::normalize(v.normal);
 	}
 
+	VertexCacheStatistics cacheBefore, cacheAfter;
+	MeshOptimizer::optimize(*mesh, false, &cacheBefore, &cacheAfter);
+
 	mesh->computeBoundingSphere();
 	if (normalize)
 		mesh->normailze(normScale);
@@ -274,7 +414,7 @@ static void loadModelTiny(const char* meshPath, const char* materialPath, Model
 	glm::mat4 tf = glm::identity<glm::mat4>();
 	model.addInstance(0, tf);
 
-	std::cout << "Done." << std::endl;
+	std::cout << "Done. Vertex cache ACMR : " << cacheBefore.acmr() << " -> " << cacheAfter.acmr() << ", ATVR : " << cacheBefore.atvr() << " -> " << cacheAfter.atvr() << std::endl;
 }
 /*
 static void loadMedievalHouse(Model& model, Camera& cam)
@@ -307,71 +447,88 @@ static void loadSpaceship(Model& model, Camera& cam)
 	cam.setAngleIncrement(0.01f);
 	cam.changeKeyFrameFileName(ROOT + "/models/spaceship/spaceship.bin");
 
+	std::vector<std::string> meshFiles;
+	for (int i = 0; i < 88; i++)
+		meshFiles.push_back(ROOT + "/models/spaceship/meshes/Mesh0"
+			+ std::string((i < 10) ? "0" : "") + std::to_string(i) + ".obj");
+
+	model.setCookedTextureCache(ROOT + "/models/spaceship/spaceship");
+	model.setTextureCompression(true);
+	model.setHdrTextureFormat(VK_FORMAT_R16G16B16A16_SFLOAT);
+	SceneCache cache(ROOT + "/models/spaceship/spaceship.scache", sceneDefinitionKey);
+	cache.addSourceFiles(meshFiles);
+	cache.addSourceFile(ROOT + "/models/spaceship/meshes/quad.obj");
+	cache.addSourceFile(ROOT + "/models/spaceship/light.jpg");
+	if (cache.load(model))
+		return;
+
 	auto changeTexCoord = [](Mesh* mesh)
 	{
 		for (auto& vertex : mesh->vertices)
 			vertex.texCoord = glm::vec2(0.5f);
 	};
 
-	for (int i = 0; i < 88; i++) {
-		std::string meshFile = ROOT + "/models/spaceship/meshes/Mesh0" 
-			+ std::string((i < 10) ? "0" : "") + std::to_string(i) + ".obj";
-		Mesh* mesh = loadMeshTiny(meshFile.c_str());
-		changeTexCoord(mesh);
-		
-		model.addMesh(mesh);
-	}
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshImportJob> jobs;
+	for (const auto& meshFile : meshFiles)
+		jobs.push_back({ meshFile, false, changeTexCoord });
+
+	jobs.push_back({ ROOT + "/models/spaceship/meshes/quad.obj", true }); // no changeTexCoord
 
-	Mesh* mesh = loadMeshTiny((ROOT + "/models/spaceship/meshes/quad.obj").c_str(), true);
-	//changeTexCoord(mesh);
-	uint32_t quadLightIndex = model.addMesh(mesh) - 1;
+	MeshImportTimings timings;
+	uint32_t quadLightIndex = addMeshes(model, loadMeshesTiny(jobs, timings), timings) - 1;
+	printMeshImportReport(timings, jobs.size(), elapsedMs(start));
 		
-	// color textures
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f))); // default diffuse color , 0
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f))); // default specular color, 1
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.578596f, 0.578596f, 0.578596f, 1.0f)));// 2
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.01f, 0.01f, 0.01f, 1.0f))); // 3
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.256f, 0.013f, 0.08f, 1.0f))); // 4
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.034f, 0.014f, 0.008f, 1.0f))); // 5
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.163f, 0.03f, 0.037f, 1.0f))); // 6
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.772f, 0.175f, 0.262f, 1.0f))); // 7
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.025f, 0.025f, 0.025f, 1.0f))); // 8
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f))); // 9
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.1f, 0.1f, 0.1f, 1.0f))); // 10
-	model.addLdrTexture(Image2d(ROOT + "/models/spaceship/light.jpg"));
-	//model.addLdrTexture(Image2d(1, 1, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)));
-	// alpha, intIor, extIor texture
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.1f, 1.0f, 1.0f, 1.0f), true)); // 0
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.2f, 1.5f, 1.0f, 1.0f), true)); // 1
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.4f, 1.5f, 1.0f, 1.0f), true)); // 2
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.01f, 1.5f, 1.0f, 1.0f), true)); // 3
+	// color constants
+	const uint32_t color[] = {
+		model.addLdrConstant(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f)), // default diffuse color , 0
+		model.addLdrConstant(glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)), // default specular color, 1
+		model.addLdrConstant(glm::vec4(0.578596f, 0.578596f, 0.578596f, 1.0f)), // 2
+		model.addLdrConstant(glm::vec4(0.01f, 0.01f, 0.01f, 1.0f)), // 3
+		model.addLdrConstant(glm::vec4(0.256f, 0.013f, 0.08f, 1.0f)), // 4
+		model.addLdrConstant(glm::vec4(0.034f, 0.014f, 0.008f, 1.0f)), // 5
+		model.addLdrConstant(glm::vec4(0.163f, 0.03f, 0.037f, 1.0f)), // 6
+		model.addLdrConstant(glm::vec4(0.772f, 0.175f, 0.262f, 1.0f)), // 7
+		model.addLdrConstant(glm::vec4(0.025f, 0.025f, 0.025f, 1.0f)), // 8
+		model.addLdrConstant(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)), // 9
+		model.addLdrConstant(glm::vec4(0.1f, 0.1f, 0.1f, 1.0f)) // 10
+	};
+	const uint32_t lightTexture = model.addLdrTexture(ROOT + "/models/spaceship/light.jpg") - 1;
+	// alpha, intIor, extIor constants
+	const uint32_t alphaIor[] = {
+		model.addHdrConstant(glm::vec4(0.1f, 1.0f, 1.0f, 1.0f)), // 0
+		model.addHdrConstant(glm::vec4(0.2f, 1.5f, 1.0f, 1.0f)), // 1
+		model.addHdrConstant(glm::vec4(0.4f, 1.5f, 1.0f, 1.0f)), // 2
+		model.addHdrConstant(glm::vec4(0.01f, 1.5f, 1.0f, 1.0f)) // 3
+	};
 	
 	std::vector<NamedMaterial> materials;
-	NamedMaterial m = { "RoughAluminium", 0, 2, 0, GGX };
+	NamedMaterial m = { "RoughAluminium", color[0], color[2], alphaIor[0], GGX };
 	materials.push_back(m);
-	m = { "RoughSteel", 0, 1, 0, GGX };
+	m = { "RoughSteel", color[0], color[1], alphaIor[0], GGX };
 	materials.push_back(m);
-	m = { "DarkPlastic", 3, 1, 1, BECKMANN };
+	m = { "DarkPlastic", color[3], color[1], alphaIor[1], BECKMANN };
 	materials.push_back(m);
-	m = { "PinkLeather", 4, 1, 2, BECKMANN };
+	m = { "PinkLeather", color[4], color[1], alphaIor[2], BECKMANN };
 	materials.push_back(m);
-	m = { "Leather", 5, 1, 2, BECKMANN };
+	m = { "Leather", color[5], color[1], alphaIor[2], BECKMANN };
 	materials.push_back(m);
-	m = { "BrightPinkLeather", 7, 1, 2, BECKMANN };
+	m = { "BrightPinkLeather", color[7], color[1], alphaIor[2], BECKMANN };
 	materials.push_back(m);
-	m = { "Glass", 10, 1, 3, DIELECTRIC };
+	m = { "Glass", color[10], color[1], alphaIor[3], DIELECTRIC };
 	materials.push_back(m);
-	m = { "DarkRubber", 8, 1, 2, GGX };
+	m = { "DarkRubber", color[8], color[1], alphaIor[2], GGX };
 	materials.push_back(m);
-	m = { "Backdrop", 10, 1, 0, DIFFUSE };
+	m = { "Backdrop", color[10], color[1], alphaIor[0], DIFFUSE };
 	materials.push_back(m);
-	m = { "AreaLight", 11, 1, 0, AREA };
+	m = { "AreaLight", lightTexture, color[1], alphaIor[0], AREA };
 	materials.push_back(m);
 
 	for (const auto& material : materials)
 		model.addMaterial(material.diffuseTextureIdx, material.specularTextureIdx, material.alphaIntExtIorTextureIdx, material.materialType);
 
-	auto addInstance = [&materials, &model](std::string matName, uint32_t meshIdx, float scale = 1.0f, float translate = 0.0f, uint32_t radiance = 0)
+	std::vector<InstanceDescriptor> instances;
+	auto addInstance = [&materials, &instances](std::string matName, uint32_t meshIdx, float scale = 1.0f, float translate = 0.0f, uint32_t radiance = 0)
 	{	
 		uint32_t matIdx = 0;
 		for (const auto& material : materials) {
@@ -379,7 +536,7 @@ static void loadSpaceship(Model& model, Camera& cam)
 				glm::mat4 tf = glm::identity<glm::mat4>();
 				tf = glm::translate<float>(tf, glm::vec3(0.0, translate, 0.0));
 				tf = glm::scale(tf, glm::vec3(scale));
-				model.addInstance(meshIdx, tf, matIdx, radiance);
+				instances.push_back({ meshIdx, tf, matIdx, radiance });
 				break;
 			}
 			matIdx++;
@@ -474,6 +631,9 @@ static void loadSpaceship(Model& model, Camera& cam)
 	addInstance("BrightPinkLeather", 0);
 	addInstance("RedLeather", 22);
 	addInstance("AreaLight", quadLightIndex, 0.5f, 2.0f, 1);
+	model.addInstances(instances);
+
+	cache.save(model);
 }
 
 static void loadDefault(Model &model, Camera &cam)
@@ -483,42 +643,43 @@ static void loadDefault(Model &model, Camera &cam)
 	const std::vector<std::string> MODEL_PATHS = { ROOT + "/models/default/meshes/chalet.obj", ROOT + "/models/default/meshes/deer.obj", ROOT + "/models/default/meshes/cat.obj" };
 	const std::vector<std::string> TEXTURE_PATHS = { ROOT + "/models/default/textures/chalet.jpg", ROOT + "/models/default/textures/ubiLogo.jpg" };
 	
-	for (const auto& texturePath : TEXTURE_PATHS)
-		model.addLdrTexture(Image2d(texturePath));
+	model.setCookedTextureCache(ROOT + "/models/default/default");
+	model.setTextureCompression(true);
+	model.setHdrTextureFormat(VK_FORMAT_R16G16B16A16_SFLOAT);
+	SceneCache cache(ROOT + "/models/default/default.scache", sceneDefinitionKey);
+	cache.addSourceFiles(MODEL_PATHS);
+	cache.addSourceFiles(TEXTURE_PATHS);
+	if (cache.load(model))
+		return;
 
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.1f, 1.0f, 1.0f, 1.0f), true));
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.1f, 1.0f, 1.0f, 1.0f), true)); // Need at least two textures, otherwise validation layer may complaint
-
-	Mesh* mesh = loadMeshTiny(MODEL_PATHS[0].c_str());
-	mesh->normailze(0.7f);
-	model.addMesh(mesh);
-	mesh = loadMeshTiny(MODEL_PATHS[1].c_str());
-	mesh->normailze(0.7f);
-	model.addMesh(mesh);
-	mesh = loadMeshTiny(MODEL_PATHS[2].c_str());
-	mesh->normailze(0.7f);
-	model.addMesh(mesh);
-
-	model.addMaterial(1, 1, 0, 0);
-	model.addMaterial(0, 0, 0, 0);
-	
-	glm::mat4 tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 0, 2));
-	model.addInstance(2, tf, 0);
-
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, -2, 0));
-	model.addInstance(0, tf, 1);
+	for (const auto& texturePath : TEXTURE_PATHS)
+		model.addLdrTexture(texturePath);
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(2, 0, 0));
-	model.addInstance(1, tf, 0);
+	const uint32_t alphaIor = model.addHdrConstant(glm::vec4(0.1f, 1.0f, 1.0f, 1.0f));
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 2, 0));
-	model.addInstance(0, tf, 1);
+	auto start = std::chrono::high_resolution_clock::now();
+	auto normalize = [](Mesh* mesh) { mesh->normailze(0.7f); };
+	std::vector<MeshImportJob> jobs;
+	for (const auto& modelPath : MODEL_PATHS)
+		jobs.push_back({ modelPath, false, normalize });
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 0, -2));
-	model.addInstance(2, tf, 0);
+	MeshImportTimings timings;
+	addMeshes(model, loadMeshesTiny(jobs, timings), timings);
+	printMeshImportReport(timings, jobs.size(), elapsedMs(start));
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(-2, 0, 0));
-	model.addInstance(1, tf, 0);
+	model.addMaterial(1, 1, alphaIor, 0);
+	model.addMaterial(0, 0, alphaIor, 0);
+	
+	model.addInstances({
+		{ 2, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 0, 2)), 0 },
+		{ 0, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, -2, 0)), 1 },
+		{ 1, glm::translate(glm::identity<glm::mat4>(), glm::vec3(2, 0, 0)), 0 },
+		{ 0, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 2, 0)), 1 },
+		{ 2, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 0, -2)), 0 },
+		{ 1, glm::translate(glm::identity<glm::mat4>(), glm::vec3(-2, 0, 0)), 0 }
+	});
+
+	cache.save(model);
 }
 
 static void loadBasicShapes(Model& model, Camera &cam)
@@ -531,61 +692,63 @@ static void loadBasicShapes(Model& model, Camera &cam)
 	cam.setAngleIncrement(0.01f);
 	cam.setDistanceIncrement(0.01f);
 
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f))); // 0
-	//model.addLdrTexture(Image2d(1, 1, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)));
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.929f, 0.333f, 0.231f, 1.0f))); // 1
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.125f, 0.388f, 0.608f, 1.0f))); // 2
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.235f, 0.682f, 0.639f, 1.0f))); // 3
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.2f, 0.2f, 0.2f, 1.0f))); // 4
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.0929f, 0.0333f, 0.0231f, 1.0f))); // 5
-	//model.addLdrTexture(Image2d(1, 1, glm::vec4(1.f, 1.f, 1.f, 1.0f)));
-
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.4f, 1.5f, 1.0f, 1.0f), true)); // 0
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.05f, 1.5f, 1.0f, 1.0f), true)); // 1
-
-	model.addMaterial(0, 5, 0, GGX); // floor
-	model.addMaterial(1, 4, 1, GGX); // urchin
-	model.addMaterial(2, 4, 1, GGX); // sphere
-	model.addMaterial(3, 4, 1, GGX); // cube
-	model.addMaterial(0, 5, 0, AREA); // quadLight
-
-	Mesh* mesh = loadMeshTiny((ROOT + "/models/modelLibrary/groundPlane.obj").c_str());
-	mesh->normailze(6.0f);
-	model.addMesh(mesh);
-
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/basic-shapes/cube/cube.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
-
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/basic-shapes/sphere/sphere.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
-
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/animals/urchin/urchin.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
-
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/quadLight.obj").c_str());
-	mesh->normailze(1.25f);
-	model.addMesh(mesh);
-	
-	glm::mat4 tf = glm::identity<glm::mat4>();
-	model.addInstance(0, tf, 0);
+	auto normalize = [](float scale)
+	{
+		return [scale](Mesh* mesh) { mesh->normailze(scale); };
+	};
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 1.0f, 0));
-	model.addInstance(1, tf, 3);
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshImportJob> jobs = {
+		{ ROOT + "/models/modelLibrary/groundPlane.obj", false, normalize(6.0f) },
+		{ ROOT + "/models/modelLibrary/basic-shapes/cube/cube.obj", false, normalize(0.5f) },
+		{ ROOT + "/models/modelLibrary/basic-shapes/sphere/sphere.obj", false, normalize(0.5f) },
+		{ ROOT + "/models/modelLibrary/animals/urchin/urchin.obj", false, normalize(0.5f), false, 4 },
+		{ ROOT + "/models/modelLibrary/quadLight.obj", false, normalize(1.25f) }
+	};
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(-1.6f, 1.2f, 0));
-	model.addInstance(2, tf, 2);
+	model.setCookedTextureCache(ROOT + "/models/modelLibrary/basicShapes");
+	model.setTextureCompression(true);
+	model.setHdrTextureFormat(VK_FORMAT_R16G16B16A16_SFLOAT);
+	SceneCache cache(ROOT + "/models/modelLibrary/basicShapes.scache", sceneDefinitionKey);
+	for (const auto& job : jobs)
+		cache.addSourceFile(job.path);
+	if (cache.load(model))
+		return;
+
+	const uint32_t color[] = {
+		model.addLdrConstant(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f)), // 0
+		model.addLdrConstant(glm::vec4(0.929f, 0.333f, 0.231f, 1.0f)), // 1
+		model.addLdrConstant(glm::vec4(0.125f, 0.388f, 0.608f, 1.0f)), // 2
+		model.addLdrConstant(glm::vec4(0.235f, 0.682f, 0.639f, 1.0f)), // 3
+		model.addLdrConstant(glm::vec4(0.2f, 0.2f, 0.2f, 1.0f)), // 4
+		model.addLdrConstant(glm::vec4(0.0929f, 0.0333f, 0.0231f, 1.0f)) // 5
+	};
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(1.6f, 1.2f, 0));
-	model.addInstance(3, tf, 1);
+	const uint32_t alphaIor[] = {
+		model.addHdrConstant(glm::vec4(0.4f, 1.5f, 1.0f, 1.0f)), // 0
+		model.addHdrConstant(glm::vec4(0.05f, 1.5f, 1.0f, 1.0f)) // 1
+	};
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 4.5f, 0));
-	model.addInstance(4, tf, 4, 7);
+	model.addMaterial(color[0], color[5], alphaIor[0], GGX); // floor
+	model.addMaterial(color[1], color[4], alphaIor[1], GGX); // urchin
+	model.addMaterial(color[2], color[4], alphaIor[1], GGX); // sphere
+	model.addMaterial(color[3], color[4], alphaIor[1], GGX); // cube
+	model.addMaterial(color[0], color[5], alphaIor[0], AREA); // quadLight
 
-	//tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(4.5f, 4.5f, 0));
-	//model.addInstance(4, tf, 4, 7);
+	MeshImportTimings timings;
+	addMeshes(model, loadMeshesTiny(jobs, timings), timings);
+	printMeshImportReport(timings, jobs.size(), elapsedMs(start));
+	
+	model.addInstances({
+		{ 0, glm::identity<glm::mat4>(), 0 },
+		{ 1, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 1.0f, 0)), 3 },
+		{ 2, glm::translate(glm::identity<glm::mat4>(), glm::vec3(-1.6f, 1.2f, 0)), 2 },
+		{ 3, glm::translate(glm::identity<glm::mat4>(), glm::vec3(1.6f, 1.2f, 0)), 1 },
+		{ 4, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 4.5f, 0)), 4, 7 }
+		//{ 4, glm::translate(glm::identity<glm::mat4>(), glm::vec3(4.5f, 4.5f, 0)), 4, 7 }
+	});
+
+	cache.save(model);
 }
 
 static void loadMcMcTest(Model& model, Camera& cam)
@@ -598,67 +761,166 @@ static void loadMcMcTest(Model& model, Camera& cam)
 	cam.setAngleIncrement(0.01f);
 	cam.setDistanceIncrement(0.01f);
 
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.0f, 0.0f, 0.0f, 0.0f))); // 0
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.929f, 0.333f, 0.231f, 1.0f))); // 1
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.125f, 0.388f, 0.608f, 1.0f))); // 2
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.235f, 0.682f, 0.639f, 1.0f))); // 3
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f))); // 4
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f))); // 5
-	model.addLdrTexture(Image2d(1, 1, glm::vec4(1.f, 1.f, 1.f, 1.0f))); // 6
-
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.01f, 1.5f, 1.0f, 1.0f), true)); // 0
-	model.addHdrTexture(Image2d(1, 1, glm::vec4(0.05f, 1.5f, 1.0f, 1.0f), true)); // 1
-
-	model.addMaterial(0, 5, 0, GGX); // floor
-	model.addMaterial(1, 4, 1, GGX); // urchin
-	model.addMaterial(2, 4, 1, GGX); // sphere
-	model.addMaterial(3, 4, 1, GGX); // cube
-	model.addMaterial(6, 5, 0, AREA); // quadLight
-
-	Mesh* mesh = loadMeshTiny((ROOT + "/models/modelLibrary/groundPlane.obj").c_str());
-	mesh->normailze(6.0f);
-	model.addMesh(mesh);
-
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/basic-shapes/cube/cube.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
+	auto normalize = [](float scale)
+	{
+		return [scale](Mesh* mesh) { mesh->normailze(scale); };
+	};
 
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/basic-shapes/sphere/sphere.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshImportJob> jobs = {
+		{ ROOT + "/models/modelLibrary/groundPlane.obj", false, normalize(6.0f) },
+		{ ROOT + "/models/modelLibrary/basic-shapes/cube/cube.obj", false, normalize(0.5f) },
+		{ ROOT + "/models/modelLibrary/basic-shapes/sphere/sphere.obj", false, normalize(0.5f) },
+		{ ROOT + "/models/modelLibrary/animals/urchin/urchin.obj", false, normalize(0.5f), false, 4 },
+		{ ROOT + "/models/modelLibrary/triLight.obj", false, normalize(1.25f) }
+	};
 
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/animals/urchin/urchin.obj").c_str());
-	mesh->normailze(0.5f);
-	model.addMesh(mesh);
+	model.setCookedTextureCache(ROOT + "/models/modelLibrary/mcmcTest");
+	model.setTextureCompression(true);
+	model.setHdrTextureFormat(VK_FORMAT_R16G16B16A16_SFLOAT);
+	SceneCache cache(ROOT + "/models/modelLibrary/mcmcTest.scache", sceneDefinitionKey);
+	for (const auto& job : jobs)
+		cache.addSourceFile(job.path);
+	if (cache.load(model))
+		return;
+
+	const uint32_t color[] = {
+		model.addLdrConstant(glm::vec4(0.0f, 0.0f, 0.0f, 0.0f)), // 0
+		model.addLdrConstant(glm::vec4(0.929f, 0.333f, 0.231f, 1.0f)), // 1
+		model.addLdrConstant(glm::vec4(0.125f, 0.388f, 0.608f, 1.0f)), // 2
+		model.addLdrConstant(glm::vec4(0.235f, 0.682f, 0.639f, 1.0f)), // 3
+		model.addLdrConstant(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)), // 4
+		model.addLdrConstant(glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)) // 5
+	};
 
-	mesh = loadMeshTiny((ROOT + "/models/modelLibrary/triLight.obj").c_str());
-	mesh->normailze(1.25f);
-	model.addMesh(mesh);
+	const uint32_t alphaIor[] = {
+		model.addHdrConstant(glm::vec4(0.01f, 1.5f, 1.0f, 1.0f)), // 0
+		model.addHdrConstant(glm::vec4(0.05f, 1.5f, 1.0f, 1.0f)) // 1
+	};
 
-	glm::mat4 tf = glm::identity<glm::mat4>();
-	model.addInstance(0, tf, 0);
+	model.addMaterial(color[0], color[5], alphaIor[0], GGX); // floor
+	model.addMaterial(color[1], color[4], alphaIor[1], GGX); // urchin
+	model.addMaterial(color[2], color[4], alphaIor[1], GGX); // sphere
+	model.addMaterial(color[3], color[4], alphaIor[1], GGX); // cube
+	model.addMaterial(color[5], color[5], alphaIor[0], AREA); // quadLight
+
+	MeshImportTimings timings;
+	addMeshes(model, loadMeshesTiny(jobs, timings), timings);
+	printMeshImportReport(timings, jobs.size(), elapsedMs(start));
+
+	model.addInstances({
+		{ 0, glm::identity<glm::mat4>(), 0 },
+		//{ 1, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 1.0f, 0)), 3 },
+		//{ 2, glm::translate(glm::identity<glm::mat4>(), glm::vec3(-1.6f, 1.2f, 0)), 2 },
+		//{ 3, glm::translate(glm::identity<glm::mat4>(), glm::vec3(1.6f, 1.2f, 0)), 1 },
+		{ 4, glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 4.5f, 0)), 4, 7 },
+		{ 4, glm::scale(glm::translate(glm::identity<glm::mat4>(), glm::vec3(-3.5f, 4.5f, 0)), glm::vec3(0.5f, 0.5f, 0.5f)), 4, 28 }
+		//{ 4, glm::translate(glm::identity<glm::mat4>(), glm::vec3(4.5f, 4.5f, 0)), 4, 7 }
+	});
+
+	cache.save(model);
+}
 
-	//tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0, 1.0f, 0));
-	//model.addInstance(1, tf, 3);
+// Rectangle of Mitsuba, [-1, 1]^2 in the xy plane facing +z
+static Mesh* createRectangle(bool flipNormals)
+{
+	Mesh* mesh = new Mesh();
+	const glm::vec3 normal(0.0f, 0.0f, flipNormals ? -1.0f : 1.0f);
+	const glm::vec2 corners[] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f } };
+	for (const auto& corner : corners) {
+		Vertex vertex = {};
+		vertex.pos = glm::vec3(corner, 0.0f);
+		vertex.color = glm::vec3(1.0f);
+		vertex.normal = normal;
+		vertex.texCoord = 0.5f * corner + 0.5f;
+		mesh->vertices.push_back(vertex);
+	}
+	mesh->indices = flipNormals ? std::vector<uint32_t>{ 0, 2, 1, 0, 3, 2 } : std::vector<uint32_t>{ 0, 1, 2, 0, 2, 3 };
+	mesh->computeBoundingSphere();
 
-	//tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(-1.6f, 1.2f, 0));
-	//model.addInstance(2, tf, 2);
+	return mesh;
+}
 
-	//tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(1.6f, 1.2f, 0));
-	//model.addInstance(3, tf, 1);
+// Scene in the Mitsuba XML format, see MitsubaScene. Meshes that are not found next to the scene file are looked up in its meshes directory.
+// The cooked textures, the scene cache and the camera key frames are stored next to the scene file.
+static void loadMitsuba(Model& model, Camera& cam, const std::string& sceneFile)
+{
+	const MitsubaScene scene(sceneFile, { get_path(sceneFile) + "meshes" });
+	const std::string basePath = sceneFile.substr(0, sceneFile.find_last_of('.'));
+
+	const MitsubaSensor& sensor = scene.getSensor();
+	if (sensor.found)
+		cam.setCamera(sensor.toWorld, sensor.focusDistance, sensor.fov);
+	cam.changeKeyFrameFileName(basePath + ".bin");
+
+	model.setCookedTextureCache(basePath);
+	model.setTextureCompression(true);
+	model.setHdrTextureFormat(VK_FORMAT_R16G16B16A16_SFLOAT);
+	SceneCache cache(basePath + ".scache", sceneDefinitionKey);
+	cache.addSourceFile(sceneFile);
+	cache.addSourceFiles(scene.getMeshFiles());
+	if (cache.load(model))
+		return;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshImportJob> jobs;
+	for (const auto& mesh : scene.getMeshes())
+		if (!mesh.path.empty())
+			jobs.push_back({ mesh.path, mesh.flipNormals });
+
+	// Rectangles go in between the imported meshes, so that the mesh indices are the ones of the scene
+	MeshImportTimings timings;
+	std::vector<Mesh*> imported = loadMeshesTiny(jobs, timings);
+	std::vector<Mesh*> meshes;
+	size_t nextImported = 0;
+	for (const auto& mesh : scene.getMeshes())
+		meshes.push_back(mesh.path.empty() ? createRectangle(mesh.flipNormals) : imported[nextImported++]);
+	addMeshes(model, meshes, timings);
+	printMeshImportReport(timings, jobs.size(), elapsedMs(start));
+
+	std::vector<uint32_t> bsdfMaterials;
+	for (const auto& bsdf : scene.getBsdfs())
+		bsdfMaterials.push_back(model.addMaterial(model.addLdrConstant(glm::vec4(bsdf.diffuse, 1.0f)), model.addLdrConstant(glm::vec4(bsdf.specular, 1.0f)),
+			model.addHdrConstant(glm::vec4(bsdf.alpha, bsdf.intIor, bsdf.extIor, 1.0f)), bsdf.materialType) - 1);
+
+	// The instance radiance is an integer scale of the color of the AREA material, one material per color
+	std::map<std::array<float, 3>, uint32_t> lightMaterials;
+	std::vector<InstanceDescriptor> instances;
+	for (const auto& shape : scene.getShapes()) {
+		const float maxRadiance = std::max(shape.radiance.x, std::max(shape.radiance.y, shape.radiance.z));
+		if (maxRadiance <= 0.0f) {
+			instances.push_back({ shape.mesh, shape.toWorld, bsdfMaterials[shape.bsdf] });
+			continue;
+		}
 
-	tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 4.5f, 0));
-	model.addInstance(4, tf, 4, 7);
+		WARN(maxRadiance <= 255.0f, "SceneManager: Radiance of an area light is clamped to 255.");
+		const uint32_t radiance = static_cast<uint32_t>(std::min(std::ceil(maxRadiance), 255.0f));
+		const glm::vec3 color = glm::min(shape.radiance / static_cast<float>(radiance), glm::vec3(1.0f));
+		auto material = lightMaterials.find({ color.x, color.y, color.z });
+		if (material == lightMaterials.end())
+			material = lightMaterials.insert({ { color.x, color.y, color.z }, model.addMaterial(model.addLdrConstant(glm::vec4(color, 1.0f)),
+				model.addLdrConstant(glm::vec4(1.0f)), model.addHdrConstant(glm::vec4(0.1f, 1.0f, 1.0f, 1.0f)), AREA) - 1 }).first;
+		instances.push_back({ shape.mesh, shape.toWorld, material->second, radiance });
+	}
+	model.addInstances(instances);
 
-	tf = glm::scale(glm::translate(glm::identity<glm::mat4>(), glm::vec3(-3.5f, 4.5f, 0)), glm::vec3(0.5f, 0.5f, 0.5f));
-	model.addInstance(4, tf, 4, 28);
+	std::cout << "Mitsuba scene - " << scene.getBsdfs().size() << " bsdfs, " << meshes.size() << " meshes, " << instances.size() << " instances" << std::endl;
 
-	//tf = glm::translate(glm::identity<glm::mat4>(), glm::vec3(4.5f, 4.5f, 0));
-	//model.addInstance(4, tf, 4, 7);
+	cache.save(model);
 }
 
 extern void loadScene(Model& model, Camera& cam, const std::string& name)
 {	
+	// Scenes in the Mitsuba format are loaded by path, e.g. ROOT + "/models/spaceship/scene.xml"
+	if (name.size() > 4 && name.compare(name.size() - 4, 4, ".xml") == 0) {
+		loadMitsuba(model, cam, name);
+		return;
+	}
+	if (name.compare("medievalHouse") == 0) {
+		loadMedievalHouse(model, cam);
+		return;
+	}
+
 	//loadMedievalHouse(model, cam);
 	//loadBasicShapes(model, cam);
 	loadSpaceship(model, cam);
@@ -671,4 +933,112 @@ extern void loadScene(Model& model, Camera& cam, const std::string& name)
 		loadSpaceship(model, cam);
 	else
 		throw std::runtime_error("Model not found");
-*/}
\ No newline at end of file
+*/}
+extern void benchmarkVertexWelding(const std::string& directory)
+{
+	// Sorted, so that repeated runs weld in the same order
+	std::vector<std::string> paths;
+	std::error_code error;
+	for (auto it = std::filesystem::recursive_directory_iterator(directory, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+		std::string extension = it->path().extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		if (it->is_regular_file(error) && extension == ".obj")
+			paths.push_back(it->path().string());
+	}
+	std::sort(paths.begin(), paths.end());
+	CHECK(!paths.empty(), "SceneManager: No OBJ files found in " + directory);
+
+	std::vector<std::vector<Vertex>> fileCorners;
+	std::vector<Vertex> allCorners;
+	for (const auto& path : paths) {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		std::string warn, err;
+		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.c_str()))
+			continue;
+
+		fileCorners.emplace_back();
+		readCorners(attrib, shapes, false, fileCorners.back());
+		allCorners.insert(allCorners.end(), fileCorners.back().begin(), fileCorners.back().end());
+	}
+
+	// The dedup the loaders used before VertexWelder, one lookup and one insertion per corner
+	auto weldUnorderedMap = [](const std::vector<Vertex>& corners, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+		std::unordered_map<Vertex, uint32_t> uniqueVertices;
+		vertices.clear();
+		indices.clear();
+		for (const auto& corner : corners) {
+			if (uniqueVertices.count(corner) == 0) {
+				uniqueVertices[corner] = static_cast<uint32_t>(vertices.size());
+				vertices.push_back(corner);
+			}
+			indices.push_back(uniqueVertices[corner]);
+		}
+	};
+
+	std::vector<Vertex> referenceVertices, serialVertices, parallelVertices;
+	std::vector<uint32_t> referenceIndices, serialIndices, parallelIndices;
+	double referenceMs = 0.0, serialMs = 0.0;
+	size_t cornerCount = 0, vertexCount = 0;
+	for (const auto& corners : fileCorners) {
+		auto start = std::chrono::high_resolution_clock::now();
+		weldUnorderedMap(corners, referenceVertices, referenceIndices);
+		referenceMs += elapsedMs(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		VertexWelder().weld(corners, serialVertices, serialIndices, false);
+		serialMs += elapsedMs(start);
+
+		WARN(serialIndices == referenceIndices, "SceneManager: VertexWelder and std::unordered_map disagree, e.g. on NaN attributes.");
+		cornerCount += corners.size();
+		vertexCount += serialVertices.size();
+	}
+
+	// All files as one mesh, large enough for the parallel path
+	auto start = std::chrono::high_resolution_clock::now();
+	VertexWelder().weld(allCorners, serialVertices, serialIndices, false);
+	const double largeSerialMs = elapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	VertexWelder().weld(allCorners, parallelVertices, parallelIndices);
+	const double largeParallelMs = elapsedMs(start);
+	CHECK(parallelIndices == serialIndices, "SceneManager: Parallel and serial welding disagree.");
+	const size_t exactVertexCount = serialVertices.size();
+
+	// Epsilon weld, with corners far outside the grid and non-finite corners appended twice each, so that every one has a duplicate
+	const float extremeValues[] = { 1e30f, -1e30f, std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+		std::numeric_limits<float>::quiet_NaN() };
+	std::vector<Vertex> epsilonCorners = allCorners;
+	for (float value : extremeValues) {
+		Vertex corner = allCorners.front();
+		corner.pos.x = value;
+		corner.texCoord.y = value;
+		epsilonCorners.push_back(corner);
+		epsilonCorners.push_back(corner);
+	}
+
+	const VertexWelder epsilonWelder(1e-6f);
+	start = std::chrono::high_resolution_clock::now();
+	epsilonWelder.weld(epsilonCorners, serialVertices, serialIndices, false);
+	const double epsilonSerialMs = elapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	epsilonWelder.weld(epsilonCorners, parallelVertices, parallelIndices);
+	const double epsilonParallelMs = elapsedMs(start);
+	CHECK(parallelIndices == serialIndices, "SceneManager: Parallel and serial epsilon welding disagree.");
+	CHECK(serialVertices.size() <= exactVertexCount + std::size(extremeValues), "SceneManager: Epsilon welding kept more vertices than exact welding.");
+	for (size_t i = allCorners.size(); i < epsilonCorners.size(); i += 2)
+		CHECK(serialIndices[i] == serialIndices[i + 1], "SceneManager: Epsilon welding split identical extreme corners.");
+
+	auto mCornersPerSecond = [](size_t corners, double ms) { return ms > 0.0 ? corners / (ms * 1000.0) : 0.0; };
+	std::cout << "Weld benchmark - " << fileCorners.size() << " files, " << cornerCount << " corners, " << vertexCount << " vertices" << std::endl;
+	std::cout << "\tunordered_map     : " << referenceMs << " ms, " << mCornersPerSecond(cornerCount, referenceMs) << " Mcorners/s" << std::endl;
+	std::cout << "\tVertexWelder      : " << serialMs << " ms, " << mCornersPerSecond(cornerCount, serialMs) << " Mcorners/s" << std::endl;
+	std::cout << "\tOne mesh, serial  : " << largeSerialMs << " ms, " << mCornersPerSecond(allCorners.size(), largeSerialMs) << " Mcorners/s" << std::endl;
+	std::cout << "\tOne mesh, parallel: " << largeParallelMs << " ms, " << mCornersPerSecond(allCorners.size(), largeParallelMs) << " Mcorners/s on "
+		<< ThreadPool::getInstance().size() << " threads" << std::endl;
+	std::cout << "\tEpsilon, serial   : " << epsilonSerialMs << " ms, " << mCornersPerSecond(epsilonCorners.size(), epsilonSerialMs) << " Mcorners/s, "
+		<< serialVertices.size() << " vertices" << std::endl;
+	std::cout << "\tEpsilon, parallel : " << epsilonParallelMs << " ms, " << mCornersPerSecond(epsilonCorners.size(), epsilonParallelMs) << " Mcorners/s" << std::endl;
+}
@@ -2,4 +2,6 @@
 #include "model.hpp"
 #include "camera.hpp"
 
-void loadScene(Model& model, Camera& cam, const std::string& name = "default");
\ No newline at end of file
+void loadScene(Model& model, Camera& cam, const std::string& name = "default");
+// Times VertexWelder against the std::unordered_map dedup it replaced, on the corners of every OBJ file below directory
+void benchmarkVertexWelding(const std::string& directory);
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+// Fixed size pool of worker threads for CPU side asset processing.
+class ThreadPool
+{
+public:
+	ThreadPool(uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency()))
+	{
+		for (uint32_t i = 0; i < threadCount; i++)
+			workers.emplace_back([this]() { workerLoop(); });
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stop = true;
+		}
+		queueCondition.notify_all();
+
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	// Shared pool used by the loaders
+	static ThreadPool& getInstance()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	template<typename F>
+	auto enqueue(F&& task) -> std::future<decltype(task())>
+	{
+		using ReturnType = decltype(task());
+
+		auto packagedTask = std::make_shared<std::packaged_task<ReturnType()>>(std::forward<F>(task));
+		std::future<ReturnType> result = packagedTask->get_future();
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			tasks.emplace([packagedTask]() { (*packagedTask)(); });
+		}
+		queueCondition.notify_one();
+
+		return result;
+	}
+
+	// Splits [0, count) into contiguous ranges and calls body(begin, end) for each of them, blocks until all ranges are done.
+	// Runs serially when called from one of the workers, so that nested use can not dead lock the pool.
+	void parallelFor(size_t count, const std::function<void(size_t, size_t)>& body, size_t minRangeSize = 1)
+	{
+		if (count == 0)
+			return;
+
+		size_t rangeCount = std::min(static_cast<size_t>(workers.size()), (count + minRangeSize - 1) / std::max(minRangeSize, size_t(1)));
+		if (rangeCount < 2 || isWorkerThread()) {
+			body(0, count);
+			return;
+		}
+
+		size_t rangeSize = (count + rangeCount - 1) / rangeCount;
+		std::vector<std::future<void>> futures;
+		for (size_t begin = rangeSize; begin < count; begin += rangeSize) {
+			size_t end = std::min(begin + rangeSize, count);
+			futures.push_back(enqueue([&body, begin, end]() { body(begin, end); }));
+		}
+
+		// The calling thread takes the first range. Wait for all ranges before rethrowing, the tasks reference body.
+		std::exception_ptr exception;
+		try {
+			body(0, std::min(rangeSize, count));
+		}
+		catch (...) {
+			exception = std::current_exception();
+		}
+
+		for (auto& future : futures) {
+			try {
+				future.get();
+			}
+			catch (...) {
+				if (!exception)
+					exception = std::current_exception();
+			}
+		}
+
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+
+	uint32_t size() const
+	{
+		return static_cast<uint32_t>(workers.size());
+	}
+
+	static bool isWorkerThread()
+	{
+		return workerThread();
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stop = false;
+
+	static bool& workerThread()
+	{
+		thread_local bool isWorker = false;
+		return isWorker;
+	}
+
+	void workerLoop()
+	{
+		workerThread() = true;
+
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [this]() { return stop || !tasks.empty(); });
+				if (stop && tasks.empty())
+					return;
+
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+
+			task();
+		}
+	}
+};
@@ -0,0 +1,159 @@
+#include <filesystem>
+
+#include "tiledTextureCache.h"
+
+// Start of the tiles, the mapping itself is page aligned
+#define TILED_TEXTURE_CACHE_ALIGNMENT 4096
+
+struct TiledTextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t textureCount;
+	uint32_t tileStride;
+	uint64_t key;
+	uint64_t tileOffset;
+	uint64_t fileSize;
+};
+
+struct TiledTextureRecord
+{
+	uint32_t width;
+	uint32_t height;
+};
+
+bool TiledTextureCache::load(uint64_t key, PageTable& pageTable)
+{
+	CHECK(pageTable.textureCount() == 0, "TiledTextureCache: Page table must be empty.");
+	if (!file.open(cacheFile))
+		return false;
+
+	TiledTextureCacheHeader header;
+	if (file.size() < sizeof(header))
+		return false;
+
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != TILED_TEXTURE_CACHE_MAGIC || header.version != TILED_TEXTURE_CACHE_VERSION || header.key != key || header.tileStride != VIRTUAL_TILE_STRIDE ||
+		header.fileSize != file.size() || header.textureCount > (file.size() - sizeof(header)) / sizeof(TiledTextureRecord)) {
+		file.close();
+		return false;
+	}
+
+	PageTable layouts;
+	for (uint32_t i = 0; i < header.textureCount; i++) {
+		TiledTextureRecord record;
+		memcpy(&record, file.data() + sizeof(header) + i * sizeof(record), sizeof(record));
+		if (record.width == 0 || record.height == 0) {
+			file.close();
+			return false;
+		}
+		layouts.addTexture(record.width, record.height);
+	}
+
+	if (header.tileOffset > file.size() || static_cast<uint64_t>(layouts.pageCount()) * tileBytes() != file.size() - header.tileOffset) {
+		file.close();
+		return false;
+	}
+
+	pageTable = layouts;
+	tileOffset = header.tileOffset;
+	tileCount = pageTable.pageCount();
+
+	return true;
+}
+
+// Copies the tile with its border, texels outside the level wrap around like the REPEAT samplers
+static void cutTile(const uint8_t* level, uint32_t levelWidth, uint32_t levelHeight, uint32_t pageX, uint32_t pageY, uint8_t* tile)
+{
+	for (uint32_t row = 0; row < VIRTUAL_TILE_STRIDE; row++) {
+		const int64_t y = static_cast<int64_t>(pageY) * VIRTUAL_TILE_SIZE + row - VIRTUAL_TILE_BORDER;
+		const uint32_t srcY = static_cast<uint32_t>(((y % levelHeight) + levelHeight) % levelHeight);
+		const uint8_t* srcRow = level + static_cast<size_t>(srcY) * levelWidth * 4;
+		uint8_t* dstRow = tile + static_cast<size_t>(row) * VIRTUAL_TILE_STRIDE * 4;
+
+		for (uint32_t column = 0; column < VIRTUAL_TILE_STRIDE; column++) {
+			const int64_t x = static_cast<int64_t>(pageX) * VIRTUAL_TILE_SIZE + column - VIRTUAL_TILE_BORDER;
+			const uint32_t srcX = static_cast<uint32_t>(((x % levelWidth) + levelWidth) % levelWidth);
+			memcpy(dstRow + column * 4, srcRow + srcX * 4, 4);
+		}
+	}
+}
+
+void TiledTextureCache::save(uint64_t key, const std::vector<Image2d>& textures, const MipSettings& settings) const
+{
+	TiledTextureCacheHeader header = {};
+	header.magic = TILED_TEXTURE_CACHE_MAGIC;
+	header.version = TILED_TEXTURE_CACHE_VERSION;
+	header.textureCount = static_cast<uint32_t>(textures.size());
+	header.tileStride = VIRTUAL_TILE_STRIDE;
+	header.key = key;
+	header.tileOffset = ROUND_UP(sizeof(header) + textures.size() * sizeof(TiledTextureRecord), TILED_TEXTURE_CACHE_ALIGNMENT);
+
+	PageTable layouts;
+	std::vector<TiledTextureRecord> records;
+	for (const auto& texture : textures) {
+		CHECK(texture.format == VK_FORMAT_R8G8B8A8_UNORM, "TiledTextureCache: Textures must be VK_FORMAT_R8G8B8A8_UNORM.");
+		layouts.addTexture(texture.width, texture.height);
+		records.push_back({ texture.width, texture.height });
+	}
+	header.fileSize = header.tileOffset + static_cast<uint64_t>(layouts.pageCount()) * tileBytes();
+
+	// Write to a temporary file first, so that an interrupted write never leaves a truncated cache behind
+	std::string tmpFile = cacheFile + ".tmp";
+	{
+		std::ofstream stream(tmpFile, std::ios::binary | std::ios::trunc);
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		stream.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(TiledTextureRecord));
+
+		const std::vector<char> padding(header.tileOffset - sizeof(header) - records.size() * sizeof(TiledTextureRecord), 0);
+		stream.write(padding.data(), padding.size());
+
+		// One texture at a time, the tiles of a level are cut in parallel
+		std::vector<uint8_t> tiles;
+		for (uint32_t textureIdx = 0; textureIdx < textures.size() && stream; textureIdx++) {
+			const Image2d& texture = textures[textureIdx];
+			const VirtualTextureLayout& layout = layouts.getLayout(textureIdx);
+
+			std::vector<uint8_t> chain(MipGenerator::chainSize(texture.width, texture.height, layout.levelCount, texture.format));
+			MipGenerator::generate({ texture.pixels() }, texture.width, texture.height, texture.format, layout.levelCount, settings, chain.data());
+
+			size_t levelOffset = 0;
+			for (uint32_t level = 0; level < layout.levelCount; level++) {
+				const uint32_t pagesX = layout.pagesX(level);
+				const uint32_t pageCount = pagesX * layout.pagesY(level);
+				tiles.resize(pageCount * tileBytes());
+
+				ThreadPool::getInstance().parallelFor(pageCount, [&](size_t first, size_t last) {
+					for (size_t page = first; page < last; page++)
+						cutTile(chain.data() + levelOffset, layout.levelWidth(level), layout.levelHeight(level), static_cast<uint32_t>(page % pagesX),
+							static_cast<uint32_t>(page / pagesX), tiles.data() + page * tileBytes());
+				});
+
+				stream.write(reinterpret_cast<const char*>(tiles.data()), tiles.size());
+				levelOffset += MipGenerator::levelSize(texture.width, texture.height, level, texture.format);
+			}
+		}
+
+		if (!stream) {
+			WARN(false, "TiledTextureCache: Failed to write cache file - " + tmpFile);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tmpFile, cacheFile, error);
+	WARN(!error, "TiledTextureCache: Failed to write cache file - " + cacheFile);
+}
+
+uint64_t TiledTextureCache::computeKey(const std::vector<Image2d>& textures, const MipSettings& settings)
+{
+	const uint32_t description[4] = { static_cast<uint32_t>(settings.filter), settings.srgb ? 1u : 0u, VIRTUAL_TILE_SIZE, VIRTUAL_TILE_BORDER };
+	uint64_t key = fnv1a(description, sizeof(description));
+	for (const auto& texture : textures) {
+		const uint32_t size[3] = { texture.width, texture.height, static_cast<uint32_t>(texture.format) };
+		key = fnv1a(size, sizeof(size), key);
+		key = fnv1a(texture.pixels(), texture.sizeInBytes(), key);
+	}
+
+	return key;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "helper.h"
+#include "mappedFile.h"
+#include "virtualTexture.h"
+
+/*
+ * Tiled texture cache - RGBA8 textures cut into the pages of VirtualTextureLayout, each page stored as a VIRTUAL_TILE_STRIDE^2 tile with its
+ * wrapped border, so that a page is read with a single copy. The mip levels are built with MipGenerator. Later runs memory map the file,
+ * tiles are only paged in from disk when they are read. The whole file is valid for one key, see computeKey(); any other format change
+ * must bump TILED_TEXTURE_CACHE_VERSION.
+ */
+
+#define TILED_TEXTURE_CACHE_MAGIC 0x58455456 // "VTEX"
+#define TILED_TEXTURE_CACHE_VERSION 1
+
+class TiledTextureCache
+{
+public:
+	TiledTextureCache(const std::string& cacheFile)
+	{
+		this->cacheFile = cacheFile;
+	}
+
+	// Returns false when the cache is missing or was built for another key. Fills the page table with the layouts of the textures.
+	bool load(uint64_t key, PageTable& pageTable);
+
+	// Writes the tiles of the textures, which must be RGBA8
+	void save(uint64_t key, const std::vector<Image2d>& textures, const MipSettings& settings = MipSettings()) const;
+
+	// VIRTUAL_TILE_STRIDE^2 RGBA8 texels, valid while the cache is loaded
+	const uint8_t* getTile(uint32_t pageId) const
+	{
+		CHECK_DBG_ONLY(pageId < tileCount, "TiledTextureCache: Page out of range.");
+		return file.data() + tileOffset + static_cast<size_t>(pageId) * tileBytes();
+	}
+
+	static size_t tileBytes()
+	{
+		return static_cast<size_t>(VIRTUAL_TILE_STRIDE) * VIRTUAL_TILE_STRIDE * 4;
+	}
+
+	// Hash over the texels and sizes of the textures and the mip settings
+	static uint64_t computeKey(const std::vector<Image2d>& textures, const MipSettings& settings = MipSettings());
+
+private:
+	std::string cacheFile;
+	MappedFile file;
+	uint64_t tileOffset = 0;
+	uint32_t tileCount = 0;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+#include <glm/glm.hpp>
+
+/*
+ * TLAS update policy - Decides per frame how a top level acceleration structure follows its instances. Nothing is built when no transform
+ * changed, a refit updates the bounds of the existing hierarchy in place when only transforms changed. A refit keeps the tree of the last
+ * full build, which gets worse the further the instances moved away from where they were, so a full rebuild is done when the instances
+ * moved by more than maxDisplacement of their size on average since the last build, or after maxRefits refits in a row.
+ * Pure host code, the decisions are counted in getStats().
+ */
+
+struct TlasUpdateSettings
+{
+	bool refit = true; // false rebuilds on every change, for a structure created without allowUpdate
+	float maxDisplacement = 0.5f; // sum of center distances over sum of radii since the last build
+	uint32_t maxRefits = 240;
+};
+
+struct TlasUpdateStats
+{
+	uint64_t rebuilds = 0;
+	uint64_t refits = 0;
+	uint64_t skips = 0;
+};
+
+class TlasUpdatePolicy
+{
+public:
+	enum Decision
+	{
+		SKIP,
+		REFIT,
+		REBUILD
+	};
+
+	TlasUpdatePolicy(const TlasUpdateSettings& settings = TlasUpdateSettings()) : settings(settings) {}
+
+	// spheres are the world space bounding spheres of the instances in TLAS order, changed tells whether a transform changed since the last
+	// call. The first call and a change of the instance count always rebuild.
+	Decision update(bool changed, const std::vector<glm::vec4>& spheres)
+	{
+		Decision decision;
+		if (!built || spheres.size() != buildSpheres.size())
+			decision = REBUILD;
+		else if (!changed)
+			decision = SKIP;
+		else if (!settings.refit || refitsSinceBuild >= settings.maxRefits || displacement(spheres) > settings.maxDisplacement)
+			decision = REBUILD;
+		else
+			decision = REFIT;
+
+		if (decision == REBUILD) {
+			buildSpheres = spheres;
+			refitsSinceBuild = 0;
+			built = true;
+			stats.rebuilds++;
+		}
+		else if (decision == REFIT) {
+			refitsSinceBuild++;
+			stats.refits++;
+		}
+		else {
+			stats.skips++;
+		}
+
+		return decision;
+	}
+
+	// The next update() rebuilds, e.g. after the structure was recreated
+	void invalidate()
+	{
+		built = false;
+	}
+
+	// Movement of the instances since the last full build relative to their size, 0 right after a build
+	float displacement(const std::vector<glm::vec4>& spheres) const
+	{
+		float distance = 0.0f;
+		float radius = 0.0f;
+		for (size_t i = 0; i < spheres.size() && i < buildSpheres.size(); i++) {
+			distance += glm::length(glm::vec3(spheres[i]) - glm::vec3(buildSpheres[i]));
+			radius += buildSpheres[i].w;
+		}
+
+		return radius > 0.0f ? distance / radius : (distance > 0.0f ? settings.maxDisplacement + 1.0f : 0.0f);
+	}
+
+	const TlasUpdateStats& getStats() const
+	{
+		return stats;
+	}
+
+	const TlasUpdateSettings& getSettings() const
+	{
+		return settings;
+	}
+
+	void setSettings(const TlasUpdateSettings& settings)
+	{
+		this->settings = settings;
+	}
+
+	// Drives the policy through scripted instance movements and throws when a decision or a count differs from the expected one
+	static void selfTest()
+	{
+		auto expect = [](bool condition, const std::string& message) {
+			if (!condition)
+				throw std::runtime_error("TlasUpdatePolicy: " + message);
+		};
+
+		// Two unit spheres, displacement is the summed center distance over 2
+		TlasUpdatePolicy policy;
+		std::vector<glm::vec4> spheres(2, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+		expect(policy.update(false, spheres) == REBUILD, "First update does not rebuild.");
+		expect(policy.update(false, spheres) == SKIP, "Unchanged transforms are not skipped.");
+		spheres[0].x = 0.5f;
+		expect(policy.update(true, spheres) == REFIT, "Small movement is not refitted.");
+		spheres[0].x = 0.9f;
+		expect(policy.update(true, spheres) == REFIT, "Displacement 0.45 is not refitted.");
+		spheres[0].x = 1.1f;
+		expect(policy.update(true, spheres) == REBUILD, "Displacement since the last build above maxDisplacement does not rebuild.");
+		expect(policy.displacement(spheres) == 0.0f, "Displacement is not reset by a rebuild.");
+		spheres[1].y = 0.2f;
+		expect(policy.update(true, spheres) == REFIT, "Movement after a rebuild is not measured from the rebuild.");
+		spheres.push_back(glm::vec4(5.0f, 0.0f, 0.0f, 1.0f));
+		expect(policy.update(false, spheres) == REBUILD, "Instance count change does not rebuild.");
+		policy.invalidate();
+		expect(policy.update(false, spheres) == REBUILD, "invalidate() does not rebuild.");
+
+		// Zero sized instances rebuild on any movement
+		std::vector<glm::vec4> points(1, glm::vec4(0.0f));
+		TlasUpdatePolicy pointPolicy;
+		pointPolicy.update(true, points);
+		points[0].z = 1e-3f;
+		expect(pointPolicy.update(true, points) == REBUILD, "Moved instance without size is refitted.");
+
+		// Slow drift: maxRefits refits, then a rebuild
+		TlasUpdateSettings settings;
+		settings.maxRefits = 3;
+		TlasUpdatePolicy driftPolicy(settings);
+		std::vector<glm::vec4> drift(1, glm::vec4(0.0f, 0.0f, 0.0f, 100.0f));
+		const Decision driftDecisions[8] = { REBUILD, REFIT, REFIT, REFIT, REBUILD, REFIT, REFIT, REFIT };
+		for (Decision expected : driftDecisions) {
+			drift[0].x += 0.01f;
+			expect(driftPolicy.update(true, drift) == expected, "Refits in a row are not limited to maxRefits.");
+		}
+
+		settings = TlasUpdateSettings();
+		settings.refit = false;
+		TlasUpdatePolicy noRefitPolicy(settings);
+		noRefitPolicy.update(true, drift);
+		drift[0].x += 0.01f;
+		expect(noRefitPolicy.update(true, drift) == REBUILD && noRefitPolicy.update(false, drift) == SKIP, "Structure without refits is refitted.");
+
+		// Animation: 64 instances, every other frame static, one instance orbiting and moving further out every frame
+		TlasUpdatePolicy animationPolicy;
+		std::vector<glm::vec4> scene(64);
+		for (size_t i = 0; i < scene.size(); i++)
+			scene[i] = glm::vec4(static_cast<float>(i % 8) * 4.0f, 0.0f, static_cast<float>(i / 8) * 4.0f, 1.0f);
+		TlasUpdateStats counted;
+		const uint32_t frameCount = 1000;
+		for (uint32_t frame = 0; frame < frameCount; frame++) {
+			const bool changed = frame % 2 == 1;
+			if (changed) {
+				const float angle = frame * 0.05f;
+				const float orbit = 1.0f + frame * 0.05f;
+				scene[0] = glm::vec4(orbit * std::cos(angle), 0.0f, orbit * std::sin(angle), 1.0f);
+			}
+
+			const Decision decision = animationPolicy.update(changed, scene);
+			expect(changed || frame == 0 || decision == SKIP, "Static frame is not skipped.");
+			counted.rebuilds += decision == REBUILD ? 1 : 0;
+			counted.refits += decision == REFIT ? 1 : 0;
+			counted.skips += decision == SKIP ? 1 : 0;
+		}
+
+		const TlasUpdateStats& stats = animationPolicy.getStats();
+		expect(stats.rebuilds == counted.rebuilds && stats.refits == counted.refits && stats.skips == counted.skips, "Stats differ from the decisions.");
+		expect(stats.skips == frameCount / 2 - 1 && stats.rebuilds > 1 && stats.refits > stats.rebuilds, "Animation is not mostly refitted.");
+
+		std::cout << "TLAS update policy - " << frameCount << " animated frames: " << stats.rebuilds << " rebuilds, " << stats.refits << " refits, "
+			<< stats.skips << " skips" << std::endl;
+	}
+
+private:
+	TlasUpdateSettings settings;
+	TlasUpdateStats stats;
+	std::vector<glm::vec4> buildSpheres; // at the last full build
+	uint32_t refitsSinceBuild = 0;
+	bool built = false;
+};
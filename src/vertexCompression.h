@@ -0,0 +1,311 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <iostream>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/hash.hpp>
+
+#include "helper.h"
+
+/*
+ * Packed vertex layout - 24 bytes instead of the 48 bytes of Vertex. The GLSL decoder lives in shaders/packedVertex.h.
+ * pos           : 3 x fp32, unchanged so that BLAS builds keep using VK_FORMAT_R32G32B32_SFLOAT at offset 0
+ * normal        : octahedral encoding, 2 x snorm16. Max angular error is below 2e-4 rad.
+ * texCoord      : 2 x fp16, round to nearest even. Relative error is at most 2^-11 (|uv| < 65504).
+ * colorMaterial : index into the color palette (low 16 bit) | material index (high 16 bit). Colors are stored exactly.
+ */
+struct PackedVertex
+{
+	glm::vec3 pos;
+	uint32_t normal;
+	uint32_t texCoord;
+	uint32_t colorMaterial;
+};
+
+static_assert(sizeof(PackedVertex) == 24, "PackedVertex: Layout must match shaders/packedVertex.h");
+
+namespace VertexCompression
+{
+	inline uint16_t floatToHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+
+		uint32_t sign = (bits >> 16) & 0x8000;
+		int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffff;
+
+		// Inf and NaN
+		if (((bits >> 23) & 0xff) == 0xff)
+			return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+
+		// Overflow
+		if (exponent >= 31)
+			return static_cast<uint16_t>(sign | 0x7c00);
+
+		// Denormals and underflow
+		if (exponent <= 0) {
+			if (exponent < -10)
+				return static_cast<uint16_t>(sign);
+
+			mantissa |= 0x800000;
+			uint32_t shift = static_cast<uint32_t>(14 - exponent);
+			uint32_t half = mantissa >> shift;
+			uint32_t remainder = mantissa & ((1u << shift) - 1);
+			uint32_t midpoint = 1u << (shift - 1);
+			if (remainder > midpoint || (remainder == midpoint && (half & 1)))
+				half++;
+
+			return static_cast<uint16_t>(sign | half);
+		}
+
+		uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+		uint32_t remainder = mantissa & 0x1fff;
+		// A carry into the exponent is correct, it rounds up to the next power of two (or to infinity)
+		if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+			half++;
+
+		return static_cast<uint16_t>(sign | half);
+	}
+
+	inline float halfToFloat(uint16_t value)
+	{
+		uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+		uint32_t exponent = (value >> 10) & 0x1f;
+		uint32_t mantissa = value & 0x3ff;
+
+		uint32_t bits;
+		if (exponent == 0x1f)
+			bits = sign | 0x7f800000 | (mantissa << 13);
+		else if (exponent != 0)
+			bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+		else if (mantissa == 0)
+			bits = sign;
+		else {
+			// Normalize the denormal
+			exponent = 127 - 15 + 1;
+			while ((mantissa & 0x400) == 0) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	// Same bit layout as GLSL packHalf2x16/unpackHalf2x16
+	inline uint32_t packHalf2x16(const glm::vec2& v)
+	{
+		return static_cast<uint32_t>(floatToHalf(v.x)) | (static_cast<uint32_t>(floatToHalf(v.y)) << 16);
+	}
+
+	inline glm::vec2 unpackHalf2x16(uint32_t packed)
+	{
+		return glm::vec2(halfToFloat(static_cast<uint16_t>(packed & 0xffff)), halfToFloat(static_cast<uint16_t>(packed >> 16)));
+	}
+
+	// Same bit layout as GLSL packSnorm2x16/unpackSnorm2x16
+	inline uint32_t packSnorm2x16(const glm::vec2& v)
+	{
+		int32_t x = static_cast<int32_t>(std::round(glm::clamp(v.x, -1.0f, 1.0f) * 32767.0f));
+		int32_t y = static_cast<int32_t>(std::round(glm::clamp(v.y, -1.0f, 1.0f) * 32767.0f));
+
+		return (static_cast<uint32_t>(x) & 0xffff) | ((static_cast<uint32_t>(y) & 0xffff) << 16);
+	}
+
+	inline glm::vec2 unpackSnorm2x16(uint32_t packed)
+	{
+		int16_t x = static_cast<int16_t>(packed & 0xffff);
+		int16_t y = static_cast<int16_t>(packed >> 16);
+
+		return glm::clamp(glm::vec2(x, y) / 32767.0f, -1.0f, 1.0f);
+	}
+
+	inline glm::vec3 octDecode(const glm::vec2& e)
+	{
+		glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+		float t = glm::max(-n.z, 0.0f);
+		n.x += n.x >= 0.0f ? -t : t;
+		n.y += n.y >= 0.0f ? -t : t;
+
+		return glm::normalize(n);
+	}
+
+	// Octahedral encoding quantized to snorm16. The four candidates around the projected point are tried and the one decoding closest to n is kept.
+	inline uint32_t encodeNormal(const glm::vec3& normal)
+	{
+		float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+		if (length == 0.0f)
+			return packSnorm2x16(glm::vec2(0.0f));
+
+		glm::vec3 n = normal / length;
+		glm::vec2 e(n.x, n.y);
+		if (n.z < 0.0f)
+			e = glm::vec2((1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+
+		glm::vec3 target = glm::normalize(normal);
+		glm::vec2 base = glm::floor(glm::clamp(e, -1.0f, 1.0f) * 32767.0f);
+		uint32_t best = 0;
+		float bestDot = -2.0f;
+		for (uint32_t i = 0; i < 4; i++) {
+			glm::vec2 candidate = glm::clamp((base + glm::vec2(i & 1, i >> 1)) / 32767.0f, -1.0f, 1.0f);
+			uint32_t packed = packSnorm2x16(candidate);
+			float d = glm::dot(octDecode(unpackSnorm2x16(packed)), target);
+			if (d > bestDot) {
+				bestDot = d;
+				best = packed;
+			}
+		}
+
+		return best;
+	}
+
+	inline glm::vec3 decodeNormal(uint32_t packed)
+	{
+		return octDecode(unpackSnorm2x16(packed));
+	}
+}
+
+// Encodes vertices and collects the distinct vertex colors into a palette. VertexType is Vertex of model.hpp.
+class VertexPacker
+{
+public:
+	template<typename VertexType>
+	PackedVertex encode(const VertexType& vertex)
+	{
+		CHECK(vertex.materialIndex <= 0xffff, "VertexPacker: Material index does not fit into 16 bits.");
+
+		PackedVertex packed;
+		packed.pos = vertex.pos;
+		packed.normal = VertexCompression::encodeNormal(vertex.normal);
+		packed.texCoord = VertexCompression::packHalf2x16(vertex.texCoord);
+		packed.colorMaterial = addColor(vertex.color) | (vertex.materialIndex << 16);
+
+		return packed;
+	}
+
+	template<typename VertexType>
+	std::vector<PackedVertex> encode(const std::vector<VertexType>& vertices)
+	{
+		std::vector<PackedVertex> packed;
+		packed.reserve(vertices.size());
+		for (const auto& vertex : vertices)
+			packed.push_back(encode(vertex));
+
+		return packed;
+	}
+
+	template<typename VertexType>
+	static VertexType decode(const PackedVertex& packed, const std::vector<glm::vec4>& palette)
+	{
+		VertexType vertex;
+		vertex.pos = packed.pos;
+		vertex.color = glm::vec3(palette[packed.colorMaterial & 0xffff]);
+		vertex.normal = VertexCompression::decodeNormal(packed.normal);
+		vertex.texCoord = VertexCompression::unpackHalf2x16(packed.texCoord);
+		vertex.materialIndex = packed.colorMaterial >> 16;
+
+		return vertex;
+	}
+
+	// Encodes random vertices and checks the decoded ones against the error bounds at the top of this file
+	static void selfTest()
+	{
+		struct TestVertex
+		{
+			glm::vec3 pos;
+			glm::vec3 color;
+			glm::vec3 normal;
+			glm::vec2 texCoord;
+			uint32_t materialIndex;
+		};
+
+		std::mt19937 rng(6);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		std::uniform_real_distribution<float> uv(-64.0f, 64.0f);
+		std::uniform_int_distribution<uint32_t> colorIdx(0, 255);
+
+		std::vector<TestVertex> vertices(100000);
+		for (size_t i = 0; i < vertices.size(); i++) {
+			TestVertex& vertex = vertices[i];
+			vertex.pos = glm::vec3(unit(rng), unit(rng), unit(rng)) * 1000.0f;
+			vertex.color = glm::vec3(static_cast<float>(colorIdx(rng)) / 255.0f, 0.5f, 1.0f);
+			// The octahedron edges and corners are the hardest cases for the encoding
+			if (i < 6)
+				vertex.normal = glm::vec3(i % 3 == 0, i % 3 == 1, i % 3 == 2) * (i < 3 ? 1.0f : -1.0f);
+			else if (i < 64)
+				vertex.normal = glm::vec3(unit(rng), unit(rng), 0.0f);
+			else
+				vertex.normal = glm::vec3(unit(rng), unit(rng), unit(rng));
+			if (glm::dot(vertex.normal, vertex.normal) < 1e-6f)
+				vertex.normal = glm::vec3(0.0f, 0.0f, 1.0f);
+			vertex.texCoord = glm::vec2(uv(rng), uv(rng));
+			vertex.materialIndex = static_cast<uint32_t>(i) & 0xffff;
+		}
+
+		VertexPacker packer;
+		std::vector<PackedVertex> packed = packer.encode(vertices);
+		CHECK(packer.getPalette().size() == 256, "VertexPacker: Palette does not hold the distinct colors.");
+
+		float maxAngle = 0.0f;
+		float maxTexCoordError = 0.0f;
+		for (size_t i = 0; i < vertices.size(); i++) {
+			const TestVertex& vertex = vertices[i];
+			TestVertex decoded = decode<TestVertex>(packed[i], packer.getPalette());
+
+			CHECK(decoded.pos == vertex.pos, "VertexPacker: Position is not exact.");
+			CHECK(decoded.color == vertex.color, "VertexPacker: Color is not exact.");
+			CHECK(decoded.materialIndex == vertex.materialIndex, "VertexPacker: Material index is not exact.");
+
+			// atan2 instead of acos, which loses ~3e-4 rad to the float rounding of the dot product close to 1
+			glm::vec3 n = glm::normalize(vertex.normal);
+			maxAngle = glm::max(maxAngle, std::atan2(glm::length(glm::cross(decoded.normal, n)), glm::dot(decoded.normal, n)));
+
+			for (int c = 0; c < 2; c++) {
+				float scale = glm::max(std::abs(vertex.texCoord[c]), 6.103515625e-5f); // absolute error below the smallest normal half
+				maxTexCoordError = glm::max(maxTexCoordError, std::abs(decoded.texCoord[c] - vertex.texCoord[c]) / scale);
+			}
+		}
+
+		CHECK(maxAngle < 2e-4f, "VertexPacker: Normal error above 2e-4 rad.");
+		CHECK(maxTexCoordError <= 1.0f / 2048.0f, "VertexPacker: Texture coordinate error above 2^-11.");
+
+		std::cout << "Vertex packing - " << vertices.size() << " vertices, " << sizeof(PackedVertex) << " bytes each" << std::endl;
+		std::cout << "\tNormal    : max error " << maxAngle << " rad" << std::endl;
+		std::cout << "\tTexCoord  : max relative error " << maxTexCoordError << std::endl;
+		std::cout << "\tPos, color and material exact, " << packer.getPalette().size() << " palette entries" << std::endl;
+	}
+
+	// vec4 per color for std430 layout, w is unused
+	const std::vector<glm::vec4>& getPalette() const
+	{
+		return palette;
+	}
+
+private:
+	std::vector<glm::vec4> palette;
+	std::unordered_map<glm::vec3, uint32_t> paletteIndices;
+
+	uint32_t addColor(const glm::vec3& color)
+	{
+		auto it = paletteIndices.find(color);
+		if (it != paletteIndices.end())
+			return it->second;
+
+		CHECK(palette.size() <= 0xffff, "VertexPacker: Color palette exceeds 65536 entries.");
+
+		uint32_t idx = static_cast<uint32_t>(palette.size());
+		paletteIndices[color] = idx;
+		palette.push_back(glm::vec4(color, 1.0f));
+
+		return idx;
+	}
+};
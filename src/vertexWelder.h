@@ -0,0 +1,286 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cmath>
+
+#include "model.hpp"
+#include "threadPool.h"
+
+/*
+ * Vertex welder - Turns a list of triangle corners into an indexed mesh by merging corners with identical attributes (position, color, normal,
+ * texture coordinate and material index). The unique vertices are emitted in the order of their first occurrence, which is the same order
+ * the loaders produced with std::unordered_map.
+ * Lookups go through an open addressing hash table with linear probing. Each slot packs the 32 bit hash and the entry index in 64 bits, so
+ * that a probe sequence mostly touches a single cache line and the full key is compared only when the hashes match. Finding and inserting a
+ * vertex is a single probe sequence.
+ * With a non-zero epsilon every attribute is snapped to a grid of that size before hashing, corners falling into the same cell are merged into
+ * the first one. The material index is always compared exactly. This is a grid snap and not a weld by distance - two values on either side
+ * of a cell boundary stay apart however close they are, and two values almost epsilon apart within a cell are merged. Probing the neighbour
+ * cells instead would take up to 3^11 lookups per corner over the 11 float attributes. Cells are 64 bit integers, so that a fine grid over a
+ * large model does not overflow. Infinite and NaN attributes, and the few cells beyond +-2^62, keep their float bits as key.
+ * Large meshes are welded on the thread pool - corners are partitioned by hash, each partition is deduplicated independently and the
+ * final compaction runs in corner order, hence the result is identical to the serial path.
+ */
+class VertexWelder
+{
+public:
+	// Meshes with at least this many corners are welded in parallel
+	static const size_t PARALLEL_THRESHOLD = 1 << 18;
+
+	// epsilon is the grid cell size of the attribute snapping, 0 merges equal attributes only
+	VertexWelder(float epsilon = 0.0f)
+	{
+		CHECK(epsilon >= 0.0f, "VertexWelder: Weld epsilon must not be negative.");
+		this->epsilon = epsilon;
+		invEpsilon = epsilon > 0.0f ? 1.0 / epsilon : 0.0;
+	}
+
+	void weld(const std::vector<Vertex>& corners, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, bool allowParallel = true) const
+	{
+		CHECK(corners.size() < 0xffffffff, "VertexWelder: Too many vertices for 32 bit indices.");
+
+		vertices.clear();
+		indices.resize(corners.size());
+
+		const bool parallel = allowParallel && corners.size() >= PARALLEL_THRESHOLD && ThreadPool::getInstance().size() > 1 && !ThreadPool::isWorkerThread();
+		if (epsilon > 0.0f) {
+			if (parallel)
+				weldParallel<CellKey>(corners, vertices, indices);
+			else
+				weldSerial<CellKey>(corners, vertices, indices);
+		}
+		else {
+			if (parallel)
+				weldParallel<BitsKey>(corners, vertices, indices);
+			else
+				weldSerial<BitsKey>(corners, vertices, indices);
+		}
+	}
+
+private:
+	float epsilon;
+	double invEpsilon;
+
+	// pos, color, normal, texCoord and materialIndex as raw bits or grid cells
+	template<typename Word>
+	struct WeldKey
+	{
+		Word words[12];
+
+		bool operator==(const WeldKey& other) const
+		{
+			return memcmp(words, other.words, sizeof(words)) == 0;
+		}
+	};
+
+	using BitsKey = WeldKey<uint32_t>;
+	using CellKey = WeldKey<uint64_t>;
+
+	template<typename Key>
+	class Table
+	{
+	public:
+		Table(size_t expectedEntries)
+		{
+			size_t capacity = 16;
+			while (capacity < expectedEntries * 2)
+				capacity <<= 1;
+
+			slots.resize(capacity, 0);
+			mask = capacity - 1;
+			keys.reserve(expectedEntries);
+			values.reserve(expectedEntries);
+		}
+
+		// Returns the value stored for key, inserts value when key is new
+		uint32_t findOrInsert(const Key& key, uint32_t hash, uint32_t value)
+		{
+			for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+				uint64_t entry = slots[slot];
+				if (entry == 0) {
+					slots[slot] = (static_cast<uint64_t>(hash) << 32) | (keys.size() + 1);
+					keys.push_back(key);
+					values.push_back(value);
+					if (keys.size() * 2 > slots.size())
+						grow();
+					return value;
+				}
+
+				uint32_t entryIdx = static_cast<uint32_t>(entry) - 1;
+				if (static_cast<uint32_t>(entry >> 32) == hash && keys[entryIdx] == key)
+					return values[entryIdx];
+			}
+		}
+
+	private:
+		std::vector<uint64_t> slots; // hash (32 bit) | entry index + 1 (32 bit), 0 marks an empty slot
+		std::vector<Key> keys;
+		std::vector<uint32_t> values;
+		size_t mask;
+
+		void grow()
+		{
+			std::vector<uint64_t> oldSlots(slots.size() * 2, 0);
+			oldSlots.swap(slots);
+			mask = slots.size() - 1;
+
+			for (uint64_t entry : oldSlots) {
+				if (entry == 0)
+					continue;
+
+				size_t slot = static_cast<uint32_t>(entry >> 32) & mask;
+				while (slots[slot] != 0)
+					slot = (slot + 1) & mask;
+				slots[slot] = entry;
+			}
+		}
+	};
+
+	static void getAttributes(const Vertex& vertex, float attributes[11])
+	{
+		const float values[11] = { vertex.pos.x, vertex.pos.y, vertex.pos.z, vertex.color.x, vertex.color.y, vertex.color.z,
+			vertex.normal.x, vertex.normal.y, vertex.normal.z, vertex.texCoord.x, vertex.texCoord.y };
+		memcpy(attributes, values, sizeof(values));
+	}
+
+	void makeKey(const Vertex& vertex, BitsKey& key) const
+	{
+		float attributes[11];
+		getAttributes(vertex, attributes);
+		for (uint32_t i = 0; i < 11; i++) {
+			// -0 and +0 compare equal, give them the same bits
+			float value = attributes[i] == 0.0f ? 0.0f : attributes[i];
+			memcpy(&key.words[i], &value, sizeof(value));
+		}
+		key.words[11] = vertex.materialIndex;
+	}
+
+	void makeKey(const Vertex& vertex, CellKey& key) const
+	{
+		// Cells within +-2^62 are stored as two's complement, i.e. their top two bits are equal. The float bits of the other values get the top
+		// bits 01, so that they never equal a cell.
+		const double cellLimit = 4611686018427387904.0;
+		float attributes[11];
+		getAttributes(vertex, attributes);
+		for (uint32_t i = 0; i < 11; i++) {
+			// Grid cell, not a distance test, see the comment at the top
+			const double cell = std::floor(static_cast<double>(attributes[i]) * invEpsilon);
+			if (std::isfinite(cell) && cell >= -cellLimit && cell < cellLimit) {
+				key.words[i] = static_cast<uint64_t>(static_cast<int64_t>(cell));
+			}
+			else {
+				uint32_t bits;
+				memcpy(&bits, &attributes[i], sizeof(bits));
+				key.words[i] = 0x4000000000000000ull | bits;
+			}
+		}
+		key.words[11] = vertex.materialIndex;
+	}
+
+	template<typename Key>
+	static uint32_t hashKey(const Key& key)
+	{
+		uint64_t hash = 0x9e3779b97f4a7c15ull;
+		for (uint64_t word : key.words) {
+			hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+			hash ^= hash >> 32;
+		}
+
+		return static_cast<uint32_t>(hash);
+	}
+
+	template<typename Key>
+	void weldSerial(const std::vector<Vertex>& corners, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) const
+	{
+		// Closed meshes typically have ~1/6 as many vertices as corners
+		Table<Key> table(corners.size() / 4);
+
+		for (size_t i = 0; i < corners.size(); i++) {
+			Key key;
+			makeKey(corners[i], key);
+			uint32_t newIndex = static_cast<uint32_t>(vertices.size());
+			indices[i] = table.findOrInsert(key, hashKey(key), newIndex);
+			if (indices[i] == newIndex)
+				vertices.push_back(corners[i]);
+		}
+	}
+
+	template<typename Key>
+	void weldParallel(const std::vector<Vertex>& corners, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) const
+	{
+		ThreadPool& pool = ThreadPool::getInstance();
+		const size_t cornerCount = corners.size();
+
+		std::vector<Key> keys(cornerCount);
+		std::vector<uint32_t> hashes(cornerCount);
+		pool.parallelFor(cornerCount, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				makeKey(corners[i], keys[i]);
+				hashes[i] = hashKey(keys[i]);
+			}
+		}, 4096);
+
+		// Partition on the high hash bits, the tables index with the low bits
+		uint32_t partitionBits = 2;
+		while ((1u << partitionBits) < 4 * pool.size() && partitionBits < 8)
+			partitionBits++;
+		const size_t partitionCount = size_t(1) << partitionBits;
+		auto partitionOf = [&hashes, partitionBits](size_t i) { return hashes[i] >> (32 - partitionBits); };
+
+		// Stable scatter of corner indices into partitions, each partition lists its corners in increasing order
+		const size_t chunkCount = pool.size();
+		const size_t chunkSize = (cornerCount + chunkCount - 1) / chunkCount;
+		std::vector<size_t> offsets(chunkCount * partitionCount, 0);
+		pool.parallelFor(chunkCount, [&](size_t begin, size_t end)
+		{
+			for (size_t chunk = begin; chunk < end; chunk++)
+				for (size_t i = chunk * chunkSize; i < std::min(cornerCount, (chunk + 1) * chunkSize); i++)
+					offsets[chunk * partitionCount + partitionOf(i)]++;
+		});
+
+		std::vector<size_t> partitionStart(partitionCount + 1, 0);
+		size_t sum = 0;
+		for (size_t partition = 0; partition < partitionCount; partition++) {
+			partitionStart[partition] = sum;
+			for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+				size_t count = offsets[chunk * partitionCount + partition];
+				offsets[chunk * partitionCount + partition] = sum;
+				sum += count;
+			}
+		}
+		partitionStart[partitionCount] = sum;
+
+		std::vector<uint32_t> order(cornerCount);
+		pool.parallelFor(chunkCount, [&](size_t begin, size_t end)
+		{
+			for (size_t chunk = begin; chunk < end; chunk++)
+				for (size_t i = chunk * chunkSize; i < std::min(cornerCount, (chunk + 1) * chunkSize); i++)
+					order[offsets[chunk * partitionCount + partitionOf(i)]++] = static_cast<uint32_t>(i);
+		});
+
+		// For every corner find the first corner with the same key
+		std::vector<uint32_t> firstOccurrence(cornerCount);
+		pool.parallelFor(partitionCount, [&](size_t begin, size_t end)
+		{
+			for (size_t partition = begin; partition < end; partition++) {
+				Table<Key> table((partitionStart[partition + 1] - partitionStart[partition]) / 4);
+				for (size_t j = partitionStart[partition]; j < partitionStart[partition + 1]; j++) {
+					uint32_t i = order[j];
+					firstOccurrence[i] = table.findOrInsert(keys[i], hashes[i], i);
+				}
+			}
+		});
+
+		// Compact in corner order, the first occurrence of a vertex always precedes its duplicates
+		for (size_t i = 0; i < cornerCount; i++) {
+			if (firstOccurrence[i] == i) {
+				indices[i] = static_cast<uint32_t>(vertices.size());
+				vertices.push_back(corners[i]);
+			}
+			else
+				indices[i] = indices[firstOccurrence[i]];
+		}
+	}
+};
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+#include "helper.h"
+
+/*
+ * Virtual texturing, CPU side - Textures are split into pages of VIRTUAL_TILE_SIZE^2 texels per mip level. Only the pages the renderer asks for
+ * are resident in a physical tile atlas of fixed size, the indirection table maps every page to its atlas slot or to the slot of its finest
+ * resident ancestor. The coarsest level of each texture is a single page that stays resident, so every lookup resolves.
+ * Nothing here depends on Vulkan: the residency and eviction logic can be driven by a simulated request stream. Tiles are read from a
+ * TiledTextureCache and streamed by VirtualTextureStreamer.
+ */
+
+#define VIRTUAL_TILE_SIZE 128
+#define VIRTUAL_TILE_BORDER 4 // texels on each side, wrapped from the neighbour pages, for filtering across page borders
+#define VIRTUAL_TILE_STRIDE (VIRTUAL_TILE_SIZE + 2 * VIRTUAL_TILE_BORDER)
+
+struct VirtualPage
+{
+	uint32_t texture;
+	uint32_t level;
+	uint32_t x;
+	uint32_t y;
+};
+
+// Page grid of one texture. Levels stop at the first one that fits into a single page, coarser levels are not virtualized.
+struct VirtualTextureLayout
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t levelCount = 0;
+	std::vector<uint32_t> levelOffsets; // first page of each level, levelCount + 1 entries
+
+	VirtualTextureLayout() {}
+
+	VirtualTextureLayout(uint32_t width, uint32_t height)
+	{
+		CHECK(width > 0 && height > 0, "VirtualTextureLayout: Texture size is zero.");
+		this->width = width;
+		this->height = height;
+
+		levelOffsets.push_back(0);
+		for (uint32_t level = 0; ; level++) {
+			levelCount++;
+			levelOffsets.push_back(levelOffsets.back() + pagesX(level) * pagesY(level));
+			if (pagesX(level) == 1 && pagesY(level) == 1)
+				break;
+		}
+	}
+
+	uint32_t levelWidth(uint32_t level) const
+	{
+		return std::max(width >> level, 1u);
+	}
+
+	uint32_t levelHeight(uint32_t level) const
+	{
+		return std::max(height >> level, 1u);
+	}
+
+	uint32_t pagesX(uint32_t level) const
+	{
+		return (levelWidth(level) + VIRTUAL_TILE_SIZE - 1) / VIRTUAL_TILE_SIZE;
+	}
+
+	uint32_t pagesY(uint32_t level) const
+	{
+		return (levelHeight(level) + VIRTUAL_TILE_SIZE - 1) / VIRTUAL_TILE_SIZE;
+	}
+
+	uint32_t pageCount() const
+	{
+		return levelOffsets.back();
+	}
+
+	// Index of the page within the texture, levels in order, pages row by row
+	uint32_t pageIndex(uint32_t level, uint32_t x, uint32_t y) const
+	{
+		return levelOffsets[level] + y * pagesX(level) + x;
+	}
+};
+
+/*
+ * Page table - Layouts of all virtual textures and the atlas slot of each resident page. Pages have a global id, the pages of texture t
+ * start at the id of its first page.
+ */
+class PageTable
+{
+public:
+	static constexpr uint32_t NO_PAGE = 0xffffffff;
+	static constexpr uint32_t NOT_RESIDENT = 0xffffffff;
+
+	// Returns the texture index
+	uint32_t addTexture(uint32_t width, uint32_t height)
+	{
+		layouts.emplace_back(width, height);
+		firstPages.push_back(static_cast<uint32_t>(slots.size()));
+		slots.resize(slots.size() + layouts.back().pageCount(), NOT_RESIDENT);
+
+		return static_cast<uint32_t>(layouts.size() - 1);
+	}
+
+	uint32_t textureCount() const
+	{
+		return static_cast<uint32_t>(layouts.size());
+	}
+
+	uint32_t pageCount() const
+	{
+		return static_cast<uint32_t>(slots.size());
+	}
+
+	const VirtualTextureLayout& getLayout(uint32_t texture) const
+	{
+		return layouts[texture];
+	}
+
+	uint32_t pageId(const VirtualPage& page) const
+	{
+		CHECK_DBG_ONLY(page.texture < layouts.size() && page.level < layouts[page.texture].levelCount, "PageTable: Page out of range.");
+		return firstPages[page.texture] + layouts[page.texture].pageIndex(page.level, page.x, page.y);
+	}
+
+	VirtualPage getPage(uint32_t pageId) const
+	{
+		const uint32_t texture = static_cast<uint32_t>(std::upper_bound(firstPages.begin(), firstPages.end(), pageId) - firstPages.begin()) - 1;
+		const VirtualTextureLayout& layout = layouts[texture];
+		const uint32_t index = pageId - firstPages[texture];
+		const uint32_t level = static_cast<uint32_t>(std::upper_bound(layout.levelOffsets.begin(), layout.levelOffsets.end(), index) - layout.levelOffsets.begin()) - 1;
+		const uint32_t inLevel = index - layout.levelOffsets[level];
+
+		return { texture, level, inLevel % layout.pagesX(level), inLevel / layout.pagesX(level) };
+	}
+
+	// The single page of the coarsest level
+	uint32_t rootPage(uint32_t texture) const
+	{
+		return firstPages[texture] + layouts[texture].pageCount() - 1;
+	}
+
+	// Page of the next coarser level that covers the page, NO_PAGE for the root
+	uint32_t parentPage(uint32_t pageId) const
+	{
+		VirtualPage page = getPage(pageId);
+		if (page.level + 1 >= layouts[page.texture].levelCount)
+			return NO_PAGE;
+
+		return this->pageId({ page.texture, page.level + 1, page.x / 2, page.y / 2 });
+	}
+
+	void map(uint32_t pageId, uint32_t slot)
+	{
+		slots[pageId] = slot;
+	}
+
+	void unmap(uint32_t pageId)
+	{
+		slots[pageId] = NOT_RESIDENT;
+	}
+
+	uint32_t getSlot(uint32_t pageId) const
+	{
+		return slots[pageId];
+	}
+
+	// One entry per page id: slot | level << 24 of the page or of its finest resident ancestor, NOT_RESIDENT when there is none.
+	// Levels are resolved coarse to fine, so each page only looks at its parent.
+	void buildIndirection(std::vector<uint32_t>& indirection) const
+	{
+		indirection.assign(slots.size(), NOT_RESIDENT);
+		for (uint32_t texture = 0; texture < layouts.size(); texture++) {
+			const VirtualTextureLayout& layout = layouts[texture];
+			for (uint32_t level = layout.levelCount; level-- > 0;)
+				for (uint32_t y = 0; y < layout.pagesY(level); y++)
+					for (uint32_t x = 0; x < layout.pagesX(level); x++) {
+						const uint32_t id = firstPages[texture] + layout.pageIndex(level, x, y);
+						if (slots[id] != NOT_RESIDENT)
+							indirection[id] = slots[id] | level << 24;
+						else if (level + 1 < layout.levelCount)
+							indirection[id] = indirection[firstPages[texture] + layout.pageIndex(level + 1, x / 2, y / 2)];
+					}
+		}
+	}
+
+private:
+	std::vector<VirtualTextureLayout> layouts;
+	std::vector<uint32_t> firstPages;
+	std::vector<uint32_t> slots; // by page id
+};
+
+struct ResidencyStats
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t rejected = 0; // insertions without a slot, every resident page was used in the same frame
+};
+
+/*
+ * Tile residency cache - Assigns the slots of the physical atlas to pages, least recently used pages are evicted first. Pages used in the
+ * current frame are never evicted, hence a frame that needs more pages than there are slots gets rejections instead of thrashing.
+ * Pinned pages, e.g. the roots of the page table, are never evicted.
+ */
+class TileResidencyCache
+{
+public:
+	static constexpr uint32_t NO_SLOT = 0xffffffff;
+
+	TileResidencyCache(uint32_t slotCount = 0)
+	{
+		reset(slotCount);
+	}
+
+	static uint32_t slotsForBudget(uint64_t budgetBytes, uint64_t tileBytes)
+	{
+		return static_cast<uint32_t>(std::min<uint64_t>(budgetBytes / tileBytes, 0xffffffffu));
+	}
+
+	void reset(uint32_t slotCount)
+	{
+		entries.clear();
+		lru.clear();
+		freeSlots.clear();
+		for (uint32_t slot = slotCount; slot-- > 0;)
+			freeSlots.push_back(slot);
+		this->slotCount = slotCount;
+		frame = 0;
+		stats = ResidencyStats();
+	}
+
+	void beginFrame()
+	{
+		frame++;
+	}
+
+	// Marks the page as used in this frame, false when it is not resident
+	bool touch(uint32_t key)
+	{
+		auto entry = entries.find(key);
+		if (entry == entries.end()) {
+			stats.misses++;
+			return false;
+		}
+
+		stats.hits++;
+		entry->second.lastFrame = frame;
+		if (!entry->second.pinned)
+			lru.splice(lru.end(), lru, entry->second.lruPosition);
+
+		return true;
+	}
+
+	bool contains(uint32_t key) const
+	{
+		return entries.count(key) > 0;
+	}
+
+	// Slot for a page that is not resident, a free one or the one of the least recently used page, which is returned in evictedKey.
+	// Returns NO_SLOT when every slot is pinned or in use this frame.
+	uint32_t insert(uint32_t key, bool pinned, uint32_t& evictedKey)
+	{
+		CHECK_DBG_ONLY(!contains(key), "TileResidencyCache: Page is already resident.");
+		evictedKey = NO_SLOT;
+
+		uint32_t slot;
+		if (!freeSlots.empty()) {
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else {
+			if (lru.empty() || entries[lru.front()].lastFrame == frame) {
+				stats.rejected++;
+				return NO_SLOT;
+			}
+
+			evictedKey = lru.front();
+			slot = entries[evictedKey].slot;
+			entries.erase(evictedKey);
+			lru.pop_front();
+			stats.evictions++;
+		}
+
+		Entry entry;
+		entry.slot = slot;
+		entry.lastFrame = frame;
+		entry.pinned = pinned;
+		if (!pinned)
+			entry.lruPosition = lru.insert(lru.end(), key);
+		entries[key] = entry;
+
+		return slot;
+	}
+
+	uint32_t residentCount() const
+	{
+		return static_cast<uint32_t>(entries.size());
+	}
+
+	uint32_t getSlotCount() const
+	{
+		return slotCount;
+	}
+
+	const ResidencyStats& getStats() const
+	{
+		return stats;
+	}
+
+private:
+	struct Entry
+	{
+		uint32_t slot;
+		uint64_t lastFrame;
+		bool pinned;
+		std::list<uint32_t>::iterator lruPosition;
+	};
+
+	std::unordered_map<uint32_t, Entry> entries;
+	std::list<uint32_t> lru; // least recently used first, pinned pages are not listed
+	std::vector<uint32_t> freeSlots;
+	uint32_t slotCount = 0;
+	uint64_t frame = 0;
+	ResidencyStats stats;
+};
+
+/*
+ * Feedback - The renderer writes the page it wants per pixel of a low resolution buffer, texture (12 bit) << 20 | level (4 bit) << 16 |
+ * page y (8 bit) << 8 | page x (8 bit), or FEEDBACK_NONE. collect() turns one frame of feedback into the list of pages to make resident.
+ */
+class VirtualTextureFeedback
+{
+public:
+	static constexpr uint32_t FEEDBACK_NONE = 0xffffffff;
+
+	static uint32_t encode(const VirtualPage& page)
+	{
+		return page.texture << 20 | page.level << 16 | page.y << 8 | page.x;
+	}
+
+	static VirtualPage decode(uint32_t value)
+	{
+		return { value >> 20, (value >> 16) & 0xf, value & 0xff, (value >> 8) & 0xff };
+	}
+
+	// Unique page ids of the requests and of their ancestors, coarse levels first and, within a level, the most requested first. Requests
+	// out of range, e.g. from stale feedback, are clamped to the texture.
+	static std::vector<uint32_t> collect(const uint32_t* feedback, size_t count, const PageTable& pageTable)
+	{
+		std::unordered_map<uint32_t, uint32_t> requestCounts;
+		for (size_t i = 0; i < count; i++) {
+			if (feedback[i] == FEEDBACK_NONE)
+				continue;
+
+			VirtualPage page = decode(feedback[i]);
+			if (page.texture >= pageTable.textureCount())
+				continue;
+
+			const VirtualTextureLayout& layout = pageTable.getLayout(page.texture);
+			page.level = std::min(page.level, layout.levelCount - 1);
+			page.x = std::min(page.x, layout.pagesX(page.level) - 1);
+			page.y = std::min(page.y, layout.pagesY(page.level) - 1);
+			requestCounts[pageTable.pageId(page)]++;
+		}
+
+		// Ancestors inherit the requests of their children, levels are processed fine to coarse so that the counts are complete when passed on
+		uint32_t levelCount = 0;
+		for (uint32_t texture = 0; texture < pageTable.textureCount(); texture++)
+			levelCount = std::max(levelCount, pageTable.getLayout(texture).levelCount);
+
+		std::vector<std::vector<uint32_t>> levelPages(levelCount);
+		for (const auto& request : requestCounts)
+			levelPages[pageTable.getPage(request.first).level].push_back(request.first);
+
+		for (size_t level = 0; level < levelPages.size(); level++)
+			for (uint32_t page : levelPages[level]) {
+				const uint32_t parent = pageTable.parentPage(page);
+				if (parent == PageTable::NO_PAGE)
+					continue;
+
+				const uint32_t childCount = requestCounts[page];
+				auto inserted = requestCounts.insert({ parent, 0 });
+				inserted.first->second += childCount;
+				if (inserted.second)
+					levelPages[level + 1].push_back(parent);
+			}
+
+		std::vector<uint32_t> pages;
+		pages.reserve(requestCounts.size());
+		for (size_t level = levelPages.size(); level-- > 0;) {
+			std::sort(levelPages[level].begin(), levelPages[level].end(), [&requestCounts](uint32_t a, uint32_t b) {
+				const uint32_t countA = requestCounts.at(a);
+				const uint32_t countB = requestCounts.at(b);
+				return countA != countB ? countA > countB : a < b;
+			});
+			pages.insert(pages.end(), levelPages[level].begin(), levelPages[level].end());
+		}
+
+		return pages;
+	}
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <vector>
+#include <future>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <filesystem>
+#include <iostream>
+
+#include "virtualTexture.h"
+#include "tiledTextureCache.h"
+#include "threadPool.h"
+
+// Tile to copy into the physical atlas, the texels stay valid until the next VirtualTextureStreamer::update()
+struct TileUpload
+{
+	uint32_t slot;
+	const uint8_t* texels; // VIRTUAL_TILE_STRIDE^2 RGBA8
+};
+
+/*
+ * Virtual texture streamer - Keeps the pages requested by the feedback of the renderer resident within a fixed memory budget. Each update()
+ * touches the requested pages that are resident, keeps loading up to maxLoadsInFlight missing ones from the TiledTextureCache on the
+ * ThreadPool, coarse levels first, and maps the loads that have finished. Slots are only taken when a tile arrives, so a page stays visible
+ * until its replacement is ready. The roots of all textures are loaded when the streamer is created and stay resident.
+ * The caller copies the returned TileUploads into slot (slot % getSlotsPerRow(), slot / getSlotsPerRow()) of an atlas of VIRTUAL_TILE_STRIDE
+ * sized tiles and uploads getIndirection() when it changed.
+ */
+class VirtualTextureStreamer
+{
+public:
+	VirtualTextureStreamer(const TiledTextureCache& cache, const PageTable& pageTable, uint64_t budgetBytes, uint32_t maxLoadsInFlight = 32) :
+		cache(cache), pageTable(pageTable), maxLoadsInFlight(maxLoadsInFlight)
+	{
+		const uint32_t slotCount = TileResidencyCache::slotsForBudget(budgetBytes, TiledTextureCache::tileBytes());
+		CHECK(slotCount > pageTable.textureCount(), "VirtualTextureStreamer: Memory budget is too small for the roots of the textures.");
+		residency.reset(slotCount);
+		slotsPerRow = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(slotCount))));
+
+		for (uint32_t texture = 0; texture < pageTable.textureCount(); texture++) {
+			const uint32_t root = pageTable.rootPage(texture);
+			uint32_t evicted;
+			const uint32_t slot = residency.insert(root, true, evicted);
+			this->pageTable.map(root, slot);
+			pendingUploads.push_back({ slot, cache.getTile(root) });
+		}
+		indirectionDirty = true;
+	}
+
+	// Waits for the loads in flight, they reference the cache
+	~VirtualTextureStreamer()
+	{
+		for (auto& load : loads)
+			load.second.wait();
+	}
+
+	// feedback holds count values of VirtualTextureFeedback. Returns the tiles that became resident.
+	std::vector<TileUpload> update(const uint32_t* feedback, size_t count)
+	{
+		residency.beginFrame();
+		frameTiles.clear();
+		std::vector<TileUpload> uploads;
+		uploads.swap(pendingUploads);
+
+		const std::vector<uint32_t> requests = VirtualTextureFeedback::collect(feedback, count, pageTable);
+		for (uint32_t page : requests)
+			if (!residency.touch(page) && loads.size() < maxLoadsInFlight && loads.count(page) == 0)
+				loads[page] = ThreadPool::getInstance().enqueue([this, page]() {
+					const uint8_t* tile = cache.getTile(page);
+					return std::vector<uint8_t>(tile, tile + TiledTextureCache::tileBytes());
+				});
+
+		for (auto load = loads.begin(); load != loads.end();) {
+			if (load->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				++load;
+				continue;
+			}
+
+			uint32_t evicted;
+			const uint32_t slot = residency.insert(load->first, false, evicted);
+			if (slot != TileResidencyCache::NO_SLOT) {
+				if (evicted != TileResidencyCache::NO_SLOT)
+					pageTable.unmap(evicted);
+				pageTable.map(load->first, slot);
+				frameTiles.push_back(load->second.get());
+				uploads.push_back({ slot, frameTiles.back().data() });
+				indirectionDirty = true;
+			}
+			load = loads.erase(load);
+		}
+
+		return uploads;
+	}
+
+	// See PageTable::buildIndirection(), rebuilt when pages were mapped since the last call. dirty tells whether it changed.
+	const std::vector<uint32_t>& getIndirection(bool& dirty)
+	{
+		dirty = indirectionDirty;
+		if (indirectionDirty)
+			pageTable.buildIndirection(indirection);
+		indirectionDirty = false;
+
+		return indirection;
+	}
+
+	uint32_t getSlotsPerRow() const
+	{
+		return slotsPerRow;
+	}
+
+	uint32_t getLoadsInFlight() const
+	{
+		return static_cast<uint32_t>(loads.size());
+	}
+
+	const TileResidencyCache& getResidency() const
+	{
+		return residency;
+	}
+
+	const PageTable& getPageTable() const
+	{
+		return pageTable;
+	}
+
+	// Drives the residency and eviction logic with a simulated request stream, no GPU needed. Writes a tile cache of four test textures to
+	// cacheFile and removes it afterwards. Throws on the first failure:
+	// - Page ids round trip through PageTable::getPage(), level 0 tiles hold their page with the wrapped border.
+	// - TileResidencyCache evicts the least recently used page, and neither pages used in the current frame nor pinned pages.
+	// - While a camera pans over two textures, every page resolves in each frame's indirection, uploads hold the tile of the page mapped to
+	//   their slot and residency stays within the budget. Once the loads settle, every requested page is resident.
+	static void selfTest(const std::string& cacheFile)
+	{
+		const uint32_t sizes[4][2] = { { 1024, 1024 }, { 2048, 512 }, { 300, 200 }, { 64, 64 } };
+		std::vector<Image2d> textures;
+		for (const auto& size : sizes) {
+			std::vector<uint8_t> texels(static_cast<size_t>(size[0]) * size[1] * 4);
+			for (size_t i = 0; i < texels.size(); i++)
+				texels[i] = static_cast<uint8_t>(i * 7 / 3 + textures.size());
+			textures.emplace_back(size[0], size[1], VK_FORMAT_R8G8B8A8_UNORM, texels.data());
+		}
+
+		PageTable pageTable;
+		{
+			TiledTextureCache cache(cacheFile);
+			const uint64_t key = TiledTextureCache::computeKey(textures);
+			cache.save(key, textures);
+			CHECK(cache.load(key, pageTable), "VirtualTextureStreamer: Test tile cache can not be loaded.");
+			CHECK(pageTable.textureCount() == 4, "VirtualTextureStreamer: Wrong texture count in the test tile cache.");
+
+			for (uint32_t id = 0; id < pageTable.pageCount(); id++)
+				CHECK(pageTable.pageId(pageTable.getPage(id)) == id, "PageTable: Page id does not round trip.");
+
+			// Texel (tx, ty) of a tile is texel (x * size + tx - border, y * size + ty - border) of level 0, wrapped
+			for (uint32_t texture = 0; texture < 4; texture++) {
+				const VirtualTextureLayout& layout = pageTable.getLayout(texture);
+				const uint8_t* texels = static_cast<const uint8_t*>(textures[texture].pixels());
+				for (uint32_t y = 0; y < layout.pagesY(0); y++)
+					for (uint32_t x = 0; x < layout.pagesX(0); x++) {
+						const uint8_t* tile = cache.getTile(pageTable.pageId({ texture, 0, x, y }));
+						for (uint32_t ty = 0; ty < VIRTUAL_TILE_STRIDE; ty += VIRTUAL_TILE_STRIDE / 8 - 1)
+							for (uint32_t tx = 0; tx < VIRTUAL_TILE_STRIDE; tx += VIRTUAL_TILE_STRIDE / 8 - 1) {
+								const uint32_t srcX = (x * VIRTUAL_TILE_SIZE + tx + layout.width - VIRTUAL_TILE_BORDER) % layout.width;
+								const uint32_t srcY = (y * VIRTUAL_TILE_SIZE + ty + layout.height - VIRTUAL_TILE_BORDER) % layout.height;
+								CHECK(memcmp(tile + (static_cast<size_t>(ty) * VIRTUAL_TILE_STRIDE + tx) * 4, texels + (static_cast<size_t>(srcY) * layout.width + srcX) * 4, 4) == 0,
+									"TiledTextureCache: Tile texel differs from the texture.");
+							}
+					}
+			}
+
+			TileResidencyCache lru(3);
+			uint32_t evicted;
+			lru.beginFrame();
+			lru.insert(100, true, evicted);
+			lru.insert(1, false, evicted);
+			lru.insert(2, false, evicted);
+			lru.beginFrame();
+			lru.touch(1);
+			lru.beginFrame();
+			const uint32_t slot = lru.insert(3, false, evicted);
+			CHECK(evicted == 2 && slot != TileResidencyCache::NO_SLOT, "TileResidencyCache: Least recently used page is not evicted first.");
+			lru.touch(1);
+			CHECK(lru.insert(4, false, evicted) == TileResidencyCache::NO_SLOT && lru.contains(100) && lru.getStats().rejected == 1,
+				"TileResidencyCache: Page of the current frame or pinned page evicted.");
+
+			const uint32_t budgetTiles = 40;
+			VirtualTextureStreamer streamer(cache, pageTable, budgetTiles * TiledTextureCache::tileBytes(), 8);
+			std::mt19937 rng(17);
+			std::vector<uint32_t> feedback(64 * 36);
+			size_t uploadCount = 0;
+			auto runFrame = [&](uint32_t column, bool random) {
+				for (size_t i = 0; i < feedback.size(); i++) {
+					const uint32_t request = random ? rng() : static_cast<uint32_t>(i);
+					if (random && request % 4 == 0) {
+						feedback[i] = VirtualTextureFeedback::FEEDBACK_NONE;
+						continue;
+					}
+					const uint32_t level = (request >> 2) % 3 == 0 ? 1 : 0;
+					const uint32_t x = (column + ((request >> 5) & 1)) % 8;
+					feedback[i] = VirtualTextureFeedback::encode({ (request >> 4) & 1, level, x >> level, ((request >> 6) & 1) >> level });
+				}
+
+				const std::vector<TileUpload> uploads = streamer.update(feedback.data(), feedback.size());
+				uploadCount += uploads.size();
+				const PageTable& mapped = streamer.getPageTable();
+				for (const auto& upload : uploads) {
+					uint32_t page = 0;
+					while (page < mapped.pageCount() && mapped.getSlot(page) != upload.slot)
+						page++;
+					CHECK(page < mapped.pageCount() && memcmp(upload.texels, cache.getTile(page), TiledTextureCache::tileBytes()) == 0,
+						"VirtualTextureStreamer: Upload does not hold the tile of the page mapped to its slot.");
+				}
+
+				bool dirty;
+				for (uint32_t entry : streamer.getIndirection(dirty))
+					CHECK(entry != PageTable::NOT_RESIDENT, "VirtualTextureStreamer: Page does not resolve.");
+				CHECK(streamer.getResidency().residentCount() <= budgetTiles, "VirtualTextureStreamer: Residency exceeds the budget.");
+			};
+
+			for (uint32_t frame = 0; frame < 200; frame++) {
+				runFrame((frame / 20) % 8, true);
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+
+			// Same requests every frame until they are all resident
+			auto allResident = [&]() {
+				for (uint32_t value : feedback)
+					if (streamer.getPageTable().getSlot(pageTable.pageId(VirtualTextureFeedback::decode(value))) == PageTable::NOT_RESIDENT)
+						return false;
+				return true;
+			};
+			for (uint32_t frame = 0; frame < 1000; frame++) {
+				runFrame(3, false);
+				if (streamer.getLoadsInFlight() == 0 && allResident())
+					break;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			CHECK(allResident(), "VirtualTextureStreamer: Requested pages are not resident after the loads settled.");
+
+			const ResidencyStats& stats = streamer.getResidency().getStats();
+			std::cout << "Virtual texturing - " << pageTable.pageCount() << " pages of " << pageTable.textureCount() << " textures, "
+				<< budgetTiles << " atlas slots" << std::endl;
+			std::cout << "\t" << uploadCount << " uploads, " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions
+				<< " evictions, " << stats.rejected << " rejected" << std::endl;
+		}
+
+		std::error_code error;
+		std::filesystem::remove(cacheFile, error);
+	}
+
+private:
+	const TiledTextureCache& cache;
+	PageTable pageTable;
+	TileResidencyCache residency;
+	uint32_t maxLoadsInFlight;
+	uint32_t slotsPerRow = 0;
+	std::unordered_map<uint32_t, std::future<std::vector<uint8_t>>> loads; // by page id
+	std::vector<TileUpload> pendingUploads; // roots, returned by the first update()
+	std::list<std::vector<uint8_t>> frameTiles; // texels of the uploads of the last update()
+	std::vector<uint32_t> indirection;
+	bool indirectionDirty = false;
+};